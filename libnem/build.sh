@@ -3,6 +3,9 @@
 cd `dirname $0`
 
 CC=clang50
+if [ "`uname`" = "Linux" ] ; then
+	CC=clang
+fi
 SOURCE_FILES=src/*.c
 OBJ_FILES=
 OBJ_MAIN=
@@ -20,9 +23,16 @@ LIBS="
 	-lyaml
 	-licuuc
 	-lcxxrt
+	-lpthread
 	../../libtoml2/bin/libtoml2.a
 "
 
+# NB: On Linux backtrace(3) lives in libc and the BSD bits (sys/tree.h,
+# strlcpy) come from libbsd.
+if [ "`uname`" = "Linux" ] ; then
+	LIBS="`echo "$LIBS" | grep -v -e -lexecinfo -e -lcxxrt` -lbsd"
+fi
+
 BUILD_FLAGS="
 	-g
 	-Wall -Werror -Wno-unused-function
@@ -37,6 +47,10 @@ BUILD_FLAGS="
 	-Iinc
 "
 
+if [ "`uname`" = "Linux" ] ; then
+	BUILD_FLAGS="$BUILD_FLAGS -D_GNU_SOURCE"
+fi
+
 mkdir -p bin
 mkdir -p obj
 
@@ -17,7 +17,8 @@ typedef struct {
 	// the app from initializing. This is done before the app starts
 	// running, so any network requests that need to be made won't happen
 	// until this returns. If setup returns NEM_err_none, teardown is
-	// guarenteed to be called.
+	// guarenteed to be called. Components that only have per-loop state can
+	// leave this NULL.
 	NEM_err_t(*setup)(NEM_app_t *, int argc, char *argv[]);
 
 	// try_shutdown is called repeatedly until it returns true or a timer
@@ -27,6 +28,14 @@ typedef struct {
 	// teardown signals that application termination is immenient and that
 	// the component should release any resources it's using.
 	void(*teardown)(NEM_app_t *);
+
+	// setup_loop is called once for each event loop the app runs, on that
+	// loop's thread, after every component's setup has succeeded. This is
+	// where loop-local things (listeners and the connections they accept)
+	// should be created. Errors here are fatal. teardown_loop is called on
+	// the same thread once the loop has stopped. Both are optional.
+	NEM_err_t(*setup_loop)(NEM_app_t *, NEM_kq_t *kq);
+	void(*teardown_loop)(NEM_app_t *, NEM_kq_t *kq);
 }
 NEM_app_comp_t;
 
@@ -36,14 +45,33 @@ typedef struct {
 }
 NEM_app_compentry_t;
 
+// NEM_app_worker_t is an additional event loop running on its own thread.
+// The main loop stops it with NEM_kq_post.
+typedef struct {
+	NEM_app_t   *app;
+	NEM_kq_t     kq;
+	size_t       idx;
+	pthread_t    thread;
+}
+NEM_app_worker_t;
+
 // NEM_app_t is a container for lifecycle components and a NEM_kq_t. The goal
 // is to provide a centralized place for initialization and so forth.
+//
+// By default everything runs on kq. With NEM_app_set_workers the app also
+// runs a number of worker loops, each on its own thread pinned to a core.
+// Component setup/teardown and shutdown always happen on kq; loop-local
+// objects (NEM_fd_t, NEM_chan_t, NEM_txnmgr_t, ...) must only be touched
+// from the loop that created them.
 struct NEM_app_t {
 	NEM_kq_t             kq;
 	bool                 running;
+	uint64_t             shutdown_at;
 	int                  comps_running;
 	size_t               comps_len;
 	NEM_app_compentry_t *comps;
+	size_t               workers_len;
+	NEM_app_worker_t    *workers;
 	void                *data;
 };
 
@@ -59,6 +87,13 @@ void NEM_app_add_comps(
 	size_t                num_comps
 );
 
+// NEM_app_set_workers configures the app to run n worker loops in addition
+// to the main one. Each component's setup_loop is run on every loop, so
+// e.g. a listener created there with NEM_list_init_tcp_shared gets one
+// socket per loop and the kernel spreads connections across them. It can
+// only be called before NEM_app_main.
+void NEM_app_set_workers(NEM_app_t *this, size_t n);
+
 // NEM_app_main runs the application components as configured.
 NEM_err_t NEM_app_main(NEM_app_t *this, int argc, char *argv[]);
 
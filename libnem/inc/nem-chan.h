@@ -9,6 +9,18 @@ typedef enum {
 }
 NEM_chan_state_t;
 
+// NEM_CHAN_WRITE_IOV and NEM_CHAN_WRITE_BUDGET bound how much of its send
+// queue a NEM_chan_t gathers into a single write: iovecs (each message takes
+// up to three) and bytes.
+#define NEM_CHAN_WRITE_IOV 48
+static const size_t NEM_CHAN_WRITE_BUDGET = 64 * 1024;
+
+// NEM_CHAN_OOL_THRESHOLD is the default NEM_chan_set_ool_threshold, and
+// NEM_CHAN_OOL_OFF turns sending bodies out-of-line off again (which is
+// how channels start out).
+static const size_t NEM_CHAN_OOL_THRESHOLD = 64 * 1024;
+static const size_t NEM_CHAN_OOL_OFF = SIZE_MAX;
+
 // NEM_chan_t implements the NEM framing protocol on top of a NEM_stream_t
 // and provides a message-based interface. This lets the application work in
 // terms of messages across a bidirectional channel rather than mucking with
@@ -27,6 +39,33 @@ typedef struct {
 	NEM_err_t        err;
 	NEM_chan_state_t rstate;
 	NEM_chan_state_t wstate;
+
+	// NB: Every read/write on the stream resumes into the same place, so
+	// the continuations are embedded rather than allocated per-step.
+	NEM_stream_cont_t rcont;
+	NEM_stream_cont_t wcont;
+
+	// NB: Reads can complete before NEM_stream_read_cont returns when the
+	// data's already there. rbusy is set while the read loop is running
+	// and ragain is how a read that completes inside it asks for another
+	// go around, so a backlog of messages doesn't recurse once per message.
+	bool rbusy;
+	bool ragain;
+
+	// NB: The first wbatch messages of wqueue are being written out of
+	// wiov. wstate is NEM_CHAN_STATE_BODY while they are,
+	// NEM_CHAN_STATE_FD while their completions run, and
+	// NEM_CHAN_STATE_DISPATCH when the writer is idle.
+	struct iovec wiov[NEM_CHAN_WRITE_IOV];
+	size_t       wbatch;
+
+	// NB: Bodies of at least ool_min bytes are sent out-of-line; it's
+	// NEM_CHAN_OOL_OFF if none are. wool is the descriptor holding the
+	// body of the last message in the batch if it's being sent that way
+	// (-1 otherwise), and wpmsg the fixed header sent in place of its own.
+	size_t     ool_min;
+	int        wool;
+	NEM_pmsg_t wpmsg;
 }
 NEM_chan_t;
 
@@ -62,6 +101,17 @@ void NEM_chan_send(NEM_chan_t *this, NEM_msg_t *msg, NEM_thunk1_t *cb);
 // returns, but may be kept around by NULL'ing the msg field of the ca.
 void NEM_chan_on_msg(NEM_chan_t *this, NEM_thunk_t *cb);
 
+// NEM_chan_set_ool_threshold makes the channel send bodies of at least min
+// bytes (zero picks NEM_CHAN_OOL_THRESHOLD, and NEM_CHAN_OOL_OFF none of
+// them) out-of-line: the body is copied into a sealed memfd which is passed
+// alongside the message, and the receiving channel maps it back in
+// (read-only) in place of reading it off the stream. Messages that already
+// carry a descriptor are always sent inline. This only makes sense for unix
+// sockets (which can pass fds) to a process that's trusted with a shared
+// mapping. Bodies over NEM_PMSG_BODYMAX can't be sent any other way;
+// NEM_chan_send fails them if the channel won't send them out-of-line.
+void NEM_chan_set_ool_threshold(NEM_chan_t *this, size_t min);
+
 // NEM_chan_on_close sets a singular callback to invoke when the stream is
 // closed. If the stream is already closed, this is invoked immediately.
 void NEM_chan_on_close(NEM_chan_t *this, NEM_thunk1_t *cb);
@@ -10,14 +10,15 @@ NEM_child_state_t;
 // The child should allocate a NEM_app_t and initialize it with NEM_app_init.
 // It receives a file descriptor on NEM_APP_FILENO which is used for
 // communication with the parent process (which is always going to be
-// nem-rootd).
+// nem-rootd). Messages go through a NEM_shmring_t rather than the socket
+// itself where the child supports it.
 typedef struct {
 	int               kq;
 	int               exe_fd;
 	int               exitcode;
 	pid_t             pid;
 	NEM_child_state_t state;
-	NEM_fd_t          fd;
+	NEM_shmring_t     ring;
 	NEM_txnmgr_t      txnmgr;
 	NEM_thunk_t      *on_kevent;
 	NEM_thunk1_t     *on_close;
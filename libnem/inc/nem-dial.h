@@ -1,22 +1,72 @@
 #pragma once
 
+// NEM_DIAL_TIMEOUT_MS is how long a dial gets (name resolution included)
+// unless it's given a timeout of its own.
+static const int NEM_DIAL_TIMEOUT_MS = 10 * 1000;
+
+// NEM_DIAL_STAGGER_MS is how long a TCP dial waits on one address before
+// also trying the next, in the style of Happy Eyeballs (RFC 8305).
+static const int NEM_DIAL_STAGGER_MS = 250;
+
+// NEM_DIAL_ADDRS_MAX caps the number of resolved addresses a TCP dial
+// tries.
+#define NEM_DIAL_ADDRS_MAX 8
+
+// NEM_dial_opts_t tunes a dial. Zero values pick the defaults.
+typedef struct {
+	// timeout_ms bounds the whole dial; once it passes, the dial fails
+	// with ETIMEDOUT.
+	int timeout_ms;
+
+	// stagger_ms is how long to wait on an address before starting on the
+	// next one alongside it. Whichever connects first wins.
+	int stagger_ms;
+
+	// pool is where host names are resolved, since getaddrinfo(3) blocks.
+	// Without one, only numeric addresses can be dialed.
+	NEM_pool_t *pool;
+}
+NEM_dial_opts_t;
+
 // NEM_dial_unix connects to a listening unix socket. If there's an error
 // it's passed to the provided thunk (which is always called). The thunk is
 // passed a NEM_dial_ca.
-void NEM_dial_unix(int kq, const char *path, NEM_thunk1_t *on_stream);
+void NEM_dial_unix(NEM_kq_t *kq, const char *path, NEM_thunk1_t *on_stream);
 
-// NEM_dial_tcp connects to the specified TCP address. If there's an error
-// it's passed to the provided thunk (always called too). The thunk is passed
-// a NEM_dial_ca.
+// NEM_dial_tcp connects to the specified TCP address, which must be a
+// numeric IPv4 or IPv6 address. If there's an error it's passed to the
+// provided thunk (always called too). The thunk is passed a NEM_dial_ca.
 void NEM_dial_tcp(
-	int           kq,
+	NEM_kq_t     *kq,
 	int           port,
 	const char   *addr,
 	NEM_thunk1_t *on_stream
 );
 
+// NEM_dial_tcp_host is NEM_dial_tcp for a host name, which is resolved on
+// opts->pool. Each address it resolves to is tried in turn (alternating
+// between IPv6 and IPv4), with a new attempt started every stagger_ms until
+// one of them connects. opts can be NULL.
+//
+// A dial that's still resolving its host name when kq is freed is leaked,
+// since its completion from the pool is discarded (see NEM_pool_submit).
+void NEM_dial_tcp_host(
+	NEM_kq_t              *kq,
+	int                    port,
+	const char            *host,
+	const NEM_dial_opts_t *opts,
+	NEM_thunk1_t          *on_stream
+);
+
+// NEM_dial_ca is passed to the thunk once the dial is done. Even a failed
+// dial fills in its timings: resolve_ns is how long name resolution took
+// (zero if there wasn't any), and connect_ns how long it took from then on
+// to connect (or give up). attempts is the number of connections started.
 typedef struct {
 	NEM_err_t    err;
 	NEM_stream_t stream;
+	uint64_t     resolve_ns;
+	uint64_t     connect_ns;
+	size_t       attempts;
 }
 NEM_dial_ca;
@@ -1,22 +1,75 @@
 #pragma once
 
+// NEM_fd_mode_t selects how a NEM_fd_t does I/O. NEM_FD_READY waits for the
+// kq to report the fd as readable/writable and then makes the syscall.
+// NEM_FD_URING (Linux only) submits reads and writes to an io_uring shared
+// by everything on the kq and is woken up with their results instead. It
+// falls back to NEM_FD_READY where io_uring isn't available.
+//
+// NB: A NEM_FD_URING fd only notices the remote hanging up when it's got a
+// read or write in flight.
+typedef enum {
+	NEM_FD_READY = 0,
+	NEM_FD_URING = 1,
+}
+NEM_fd_mode_t;
+
 typedef struct {
+	int           kq;
+	NEM_fd_mode_t mode;
 	int           fd_in;
 	int           fd_out;
 	NEM_thunk_t  *on_kevent;
 	NEM_thunk1_t *on_close;
 
-	size_t        wcap;
-	char         *wbuf;
-	size_t        wavail;
-	NEM_thunk1_t *on_write;
+	// NB: on_read/on_write point at the continuation of the pending read
+	// or write. rthunk/wthunk are what they point at when the operation
+	// was started with a thunk (see NEM_stream_cont_bind). Writes are
+	// always vectored: wiov is what's left of the caller's iovecs (or wone
+	// for a plain write) and wcap the total bytes remaining.
+	size_t             wcap;
+	struct iovec      *wiov;
+	size_t             wiovcnt;
+	struct iovec       wone;
+	size_t             wavail;
+
+	// NB: wfile is the file a pending sendfile is copying out of (-1 if
+	// there isn't one), and woff how far into it it's got. wnonblock is
+	// set once fd_out has been made non-blocking for sendfile.
+	int                wfile;
+	off_t              woff;
+	bool               wnonblock;
+	NEM_stream_cont_t *on_write;
+	NEM_stream_cont_t  wthunk;
+
+	size_t             rcap;
+	char              *rbuf;
+	size_t             ravail;
+	NEM_stream_cont_t *on_read;
+	NEM_stream_cont_t  rthunk;
 
-	size_t        rcap;
-	char         *rbuf;
-	size_t        ravail;
-	NEM_thunk1_t *on_read;
+	// NB: ibuf is the optional read buffer (see NEM_fd_set_read_buffer).
+	// ibuf[ibuf_at, ibuf_at + ibuf_len) has been read from fd_in but not
+	// handed to a reader yet. ifds are descriptors that arrived along with
+	// those bytes and are waiting for NEM_fd_read_fd(s).
+	char   *ibuf;
+	size_t  ibuf_cap;
+	size_t  ibuf_at;
+	size_t  ibuf_len;
+	int    *ifds;
+	size_t  ifds_len;
 
 	bool running;
+	bool wsock;
+	bool rsock;
+
+	// NB: Only used in NEM_FD_URING mode. rop/wop are the handles of the
+	// in-flight read and write (zero if there isn't one). wmsg is the
+	// msghdr of an in-flight vectored send.
+	struct NEM_uring_t *ring;
+	uint64_t            rop;
+	uint64_t            wop;
+	struct msghdr       wmsg;
 }
 NEM_fd_t;
 
@@ -28,6 +81,18 @@ extern const NEM_stream_vt NEM_fd_stream_vt;
 NEM_err_t NEM_fd_init(NEM_fd_t *this, int kq, int fd);
 NEM_err_t NEM_fd_init2(NEM_fd_t *this, int kq, int fd_in, int fd_out);
 
+// NEM_fd_init_mode is NEM_fd_init2 with an explicit I/O mode. The others use
+// the default mode, which is NEM_FD_READY unless changed with
+// NEM_fd_set_default_mode (which should be done before any fds are created).
+NEM_err_t NEM_fd_init_mode(
+	NEM_fd_t      *this,
+	int            kq,
+	int            fd_in,
+	int            fd_out,
+	NEM_fd_mode_t  mode
+);
+void NEM_fd_set_default_mode(NEM_fd_mode_t mode);
+
 // NEM_fd_init_pipe initializes a pair of NEM_fd_t's linked together with
 // an everyday pipe.
 NEM_err_t NEM_fd_init_pipe(NEM_fd_t *this, NEM_fd_t *that, int kq);
@@ -42,11 +107,81 @@ void NEM_fd_free(NEM_fd_t *this);
 
 NEM_stream_t NEM_fd_as_stream(NEM_fd_t *this);
 
+// NEM_FD_IOV_MAX caps the number of iovecs passed to a single writev.
+static const size_t NEM_FD_IOV_MAX = 1024;
+
+// NEM_FD_FDS_MAX is the most descriptors NEM_fd_write_fds can send at once
+// (Linux's SCM_MAX_FD).
+#define NEM_FD_FDS_MAX 253
+
+// NEM_FD_READ_BUFFER is the read buffer size NEM_fd_set_read_buffer uses if
+// it isn't given one.
+static const size_t NEM_FD_READ_BUFFER = 16 * 1024;
+
+// NEM_fd_set_read_buffer gives the fd a read buffer of cap bytes. Reads
+// smaller than the buffer then pull in as much as is available with a
+// single syscall, and later reads are satisfied from what's left over
+// (larger reads still go straight into the caller's buffer). Descriptors
+// sent with NEM_fd_write_fd are still delivered by NEM_fd_read_fd. It must
+// be done before the first read, and is a no-op outside NEM_FD_READY mode.
+NEM_err_t NEM_fd_set_read_buffer(NEM_fd_t *this, size_t cap);
+
+// NEM_fd_peek points out at whatever's sitting in the read buffer and
+// returns how many bytes there are, without consuming them. It returns zero
+// if the fd isn't buffered.
+size_t NEM_fd_peek(NEM_fd_t *this, const void **out);
+
 NEM_err_t NEM_fd_read(NEM_fd_t *this, void *buf, size_t len, NEM_thunk1_t *cb);
 NEM_err_t NEM_fd_write(NEM_fd_t *this, void *buf, size_t len, NEM_thunk1_t *cb);
 
+// NEM_fd_read_cont and NEM_fd_write_cont are the continuation-based versions
+// of NEM_fd_read/NEM_fd_write; see NEM_stream_read_cont.
+NEM_err_t NEM_fd_read_cont(
+	NEM_fd_t          *this,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+);
+NEM_err_t NEM_fd_write_cont(
+	NEM_fd_t          *this,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+);
+
+// NEM_fd_writev_cont writes several buffers with as few syscalls as it can;
+// see NEM_stream_writev_cont.
+NEM_err_t NEM_fd_writev_cont(
+	NEM_fd_t          *this,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+);
+
+// NEM_fd_sendfile_cont has the kernel copy from a file to the fd (with
+// sendfile(2)); see NEM_stream_sendfile_cont. Where that's not possible --
+// in NEM_FD_URING mode, or to anything but a socket outside Linux -- it
+// falls back to NEM_stream_sendfile_copy. The first direct sendfile sets
+// O_NONBLOCK on the fd (and on anything sharing its file description), and
+// leaves it set.
+NEM_err_t NEM_fd_sendfile_cont(
+	NEM_fd_t          *this,
+	int                fd,
+	off_t              off,
+	size_t             len,
+	NEM_stream_cont_t *cont
+);
+
 void NEM_fd_close(NEM_fd_t *this);
 void NEM_fd_on_close(NEM_fd_t *this, NEM_thunk1_t *cb);
 
 NEM_err_t NEM_fd_read_fd(NEM_fd_t *this, int *fdout);
 NEM_err_t NEM_fd_write_fd(NEM_fd_t *this, int fd);
+
+// NEM_fd_write_fds sends up to NEM_FD_FDS_MAX descriptors with a single
+// sendmsg. The byte sent alongside them is the count (rather than the 'F'
+// NEM_fd_write_fd sends), which NEM_fd_read_fds checks against what
+// arrived. *len is the capacity of fds going in and the number of
+// descriptors read coming out.
+NEM_err_t NEM_fd_read_fds(NEM_fd_t *this, int *fds, size_t *len);
+NEM_err_t NEM_fd_write_fds(NEM_fd_t *this, const int *fds, size_t len);
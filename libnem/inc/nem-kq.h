@@ -5,15 +5,92 @@
 // (use NEM_kq_init_root to avoid this behavior).
 static const int NEM_KQ_PARENT_FILENO = 4;
 
-// NEM_timer1_t is an internal struct for timer recordkeeping.
-typedef struct NEM_timer1_t {
-	SPLAY_ENTRY(NEM_timer1_t) link;
-	struct timeval invoke_at;
-	NEM_thunk1_t *thunk;
+// NEM_KQ_NSEC_PER_MSEC converts between the nanoseconds returned by
+// NEM_kq_now and the milliseconds most APIs take.
+static const uint64_t NEM_KQ_NSEC_PER_MSEC = 1000 * 1000;
+
+// NEM_timer1_t is an intrusive timer node. It's embedded in whatever needs
+// a timeout and scheduled on a NEM_kq_t's timing wheel with
+// NEM_kq_timer1_set. at is in nanoseconds on the kq's clock (see
+// NEM_kq_now). When the deadline passes the node is unlinked and fn is
+// invoked with it, so fn is free to re-set or free the containing struct.
+// A node is scheduled iff link.next is non-NULL.
+typedef struct NEM_timer1_t NEM_timer1_t;
+typedef void (*NEM_timer1_fn)(NEM_timer1_t *timer);
+
+// NEM_timer1_link_t links timer nodes into a wheel slot. Each slot is a
+// circular list with a sentinel link, so nodes can be removed in O(1).
+typedef struct NEM_timer1_link_t {
+	struct NEM_timer1_link_t *next;
+	struct NEM_timer1_link_t *prev;
+}
+NEM_timer1_link_t;
+
+struct NEM_timer1_t {
+	NEM_timer1_link_t link;
+	uint64_t          at;
+	NEM_timer1_fn     fn;
+};
+
+// NB: The wheel has NEM_KQ_WHEEL_LEVELS levels of NEM_KQ_WHEEL_SLOTS slots
+// each, with a 1ms tick at the bottom. Each level covers SLOTS times the
+// span of the one below it, so six levels reach a bit over two years;
+// anything further out is parked at the top and re-filed as it cascades.
+#define NEM_KQ_WHEEL_BITS   6
+#define NEM_KQ_WHEEL_SLOTS  (1 << NEM_KQ_WHEEL_BITS)
+#define NEM_KQ_WHEEL_LEVELS 6
+
+// NEM_KQ_STATS_FILTERS is the number of kevent filters that events are
+// counted for (indexed by -filter). NEM_KQ_STATS_BUCKETS is the number of
+// buckets in the iteration latency histogram.
+#define NEM_KQ_STATS_FILTERS 16
+#define NEM_KQ_STATS_BUCKETS 32
+
+// NEM_kq_stats_fn_t aggregates the time spent in a single callback
+// function, keyed by the function pointer of the thunk that was invoked.
+typedef struct {
+	void     *fn;
+	uint64_t  calls;
+	uint64_t  total_ns;
+	uint64_t  max_ns;
+}
+NEM_kq_stats_fn_t;
+
+// NEM_kq_stats_t is the instrumentation gathered by NEM_kq_run while stats
+// are enabled (see NEM_kq_set_stats).
+typedef struct {
+	// iterations is the number of times the loop woke up. defers is the
+	// number of NEM_kq_defer callbacks run, and slow is the number of
+	// callbacks that went over the slow threshold.
+	uint64_t iterations;
+	uint64_t defers;
+	uint64_t slow;
+
+	// events counts dispatched events per filter; events[-EVFILT_READ] is
+	// the number of read events, and so on.
+	uint64_t events[NEM_KQ_STATS_FILTERS];
+
+	// latency is a log2 histogram of the time spent processing each
+	// iteration of the loop (everything but the wait). Bucket i counts
+	// iterations that took less than 2^i microseconds but not less than
+	// 2^(i-1); the last bucket holds everything longer.
+	uint64_t latency[NEM_KQ_STATS_BUCKETS];
+
+	// NB: While running, fns is an open-addressed hash table of fns_cap
+	// entries. Snapshots compact it to fns_len entries, sorted by total
+	// time spent (descending).
+	NEM_kq_stats_fn_t *fns;
+	size_t             fns_len;
+	size_t             fns_cap;
 }
-NEM_timer1_t;
+NEM_kq_stats_t;
 
-typedef SPLAY_HEAD(NEM_timer1_tree_t, NEM_timer1_t) NEM_timer1_tree_t;
+// NEM_kq_post_t is a node in a kq's cross-thread mailbox. See NEM_kq_post.
+typedef struct NEM_kq_post_t {
+	struct NEM_kq_post_t *next;
+	NEM_thunk1_t         *thunk;
+}
+NEM_kq_post_t;
 
 // NEM_kq_t provides a wrapper around a kq and does initialization for
 // parent-child message passing. It also provides the basic runloop.
@@ -21,10 +98,53 @@ typedef struct {
 	int  kq;
 	bool running;
 
+	// NB: now is the kq's clock in nanoseconds, sampled from clock once
+	// per iteration of NEM_kq_run.
+	clockid_t clock;
+	uint64_t  now;
+
 	NEM_chan_t *chan;
 
+	// NB: wheel_now is the last (millisecond) tick that's been processed. wheel_bits
+	// tracks which slots of each level are non-empty. The kernel timer is
+	// only re-armed when the wheel's next tick differs from timer_at.
 	NEM_thunk_t      *on_timer;
-	NEM_timer1_tree_t timers;
+	NEM_timer1_link_t wheel[NEM_KQ_WHEEL_LEVELS][NEM_KQ_WHEEL_SLOTS];
+	uint64_t          wheel_bits[NEM_KQ_WHEEL_LEVELS];
+	uint64_t          wheel_now;
+	size_t            wheel_len;
+	uint64_t          timer_at;
+	bool              timer_armed;
+
+	// NB: defers is a ring buffer of thunks queued by NEM_kq_defer. It's
+	// drained at the top of each iteration of NEM_kq_run.
+	NEM_thunk1_t **defers;
+	size_t         defers_cap;
+	size_t         defers_at;
+	size_t         defers_len;
+
+	// NB: posts is a lock-free stack of thunks pushed by NEM_kq_post from
+	// other threads. post_wake is set once the EVFILT_USER event has been
+	// triggered, so a burst of posts only wakes the loop once.
+	NEM_thunk_t             *on_post;
+	_Atomic(NEM_kq_post_t*)  posts;
+	atomic_bool              post_wake;
+
+	// NB: stats is only allocated while instrumentation is enabled, so
+	// it costs a single branch per callback otherwise.
+	NEM_kq_stats_t *stats;
+	uint64_t        slow_ns;
+
+	// NB: changes are flushed with the next wait in NEM_kq_run. evs holds
+	// the batch of events harvested by a single wait.
+	struct kevent *changes;
+	size_t         changes_len;
+	size_t         changes_cap;
+
+	struct kevent *evs;
+	size_t         evs_cap;
+	size_t         evs_len;
+	size_t         evs_at;
 }
 NEM_kq_t;
 
@@ -35,28 +155,115 @@ NEM_err_t NEM_kq_init_root(NEM_kq_t *this);
 
 // NEM_kq_free frees the resources used by kq. Notably, this kills the
 // underlying kq but does not actually notify any waiting fds that the kq
-// died. Everything else needs to be freed manually.
+// died. Everything else needs to be freed manually. Timer nodes that are
+// still scheduled are unscheduled but otherwise left alone.
 void NEM_kq_free(NEM_kq_t *this);
 
-// NEM_kq_after schedules a callback to run at a time in the future. defer is
-// shorthand for "after 0 ms", which triggers on the next iteration of the
-// event loop.
+// NEM_kq_after schedules a callback to run at a time in the future.
 void NEM_kq_after(NEM_kq_t *this, uint64_t ms, NEM_thunk1_t *cb);
+
+// NEM_kq_defer queues a callback to run on the next iteration of the event
+// loop. Deferred callbacks run in the order they were queued, before the
+// loop polls for events; callbacks deferred while the queue is being drained
+// wait for the following iteration, so they can't starve I/O.
 void NEM_kq_defer(NEM_kq_t *this, NEM_thunk1_t *cb);
 
+// NEM_kq_post queues a callback to run on the kq's own thread. Unlike
+// everything else here it's safe to call from any thread (the kq must
+// outlive the call). Callbacks posted from the same thread run in the order
+// they were posted; callbacks still queued when the kq is freed are
+// discarded.
+void NEM_kq_post(NEM_kq_t *this, NEM_thunk1_t *cb);
+
 // NEM_kq_run runs the eventloop and does not return until NEM_kq_stop is
 // called or the heatdeath of the universe.
 NEM_err_t NEM_kq_run(NEM_kq_t *this);
 
-// NEM_kq_stop signals NEM_kq_run to stop running.
+// NEM_kq_set_batch sets the maximum number of events harvested per wakeup
+// of the eventloop. It can't be called while the kq is running.
+void NEM_kq_set_batch(NEM_kq_t *this, size_t nevents);
+
+// NEM_kq_change queues a kevent change to be submitted along with the next
+// wait of the eventloop rather than making a syscall immediately. Errors
+// (other than EV_DELETE'ing something that isn't there) are logged. An
+// EV_DELETE supersedes any queued changes for the same ident/filter.
+void NEM_kq_change(NEM_kq_t *this, const struct kevent *kev);
+
+// NEM_kq_forget drops any events for udata that have already been harvested
+// by the eventloop running on this thread but not dispatched yet. This must
+// be called before freeing a thunk that's registered as kevent udata, since
+// an earlier event in the same batch might be what's freeing it.
+void NEM_kq_forget(void *udata);
+
+// NEM_kq_running returns the kq whose eventloop is running on this thread,
+// or NULL outside of NEM_kq_run.
+NEM_kq_t *NEM_kq_running(void);
+
+// NEM_kq_stop signals NEM_kq_run to stop running. Callbacks deferred before
+// the stop still run first.
 void NEM_kq_stop(NEM_kq_t *this);
 
-// NEM_timer_t is a struct for cancellable/recurring timers. These are
-// built on NEM_timer1_t (which are for NEM_kq_defer/after) and are a bit
-// more heavyweight since bad design.
+// NEM_kq_set_stats enables or disables the runloop instrumentation.
+// Enabling it resets any existing stats. While enabled, NEM_kq_run counts
+// events and times every callback it dispatches, which costs a couple of
+// clock reads per callback.
+void NEM_kq_set_stats(NEM_kq_t *this, bool enabled);
+
+// NEM_kq_set_slow sets the threshold in milliseconds over which a single
+// callback is logged to stderr (along with its symbolized function) while
+// stats are enabled. Zero disables the logging.
+void NEM_kq_set_slow(NEM_kq_t *this, uint64_t ms);
+
+// NEM_kq_stats_snapshot copies the current stats into out and returns true,
+// or returns false if stats aren't enabled. out must be freed with
+// NEM_kq_stats_free.
+bool NEM_kq_stats_snapshot(const NEM_kq_t *this, NEM_kq_stats_t *out);
+void NEM_kq_stats_free(NEM_kq_stats_t *stats);
+
+// NEM_kq_filter_name returns a static string naming a kevent filter.
+const char *NEM_kq_filter_name(int filter);
+
+// NEM_kq_fn_name returns a heap-allocated string describing a callback
+// function pointer (as recorded in NEM_kq_stats_fn_t). This uses the same
+// symbolization as panic backtraces, so it's only as good as the symbols
+// the binary was linked with.
+char *NEM_kq_fn_name(void *fn);
+
+// NEM_kq_now returns the kq's notion of the current time, in nanoseconds on
+// a monotonic clock. It's sampled once per iteration of the eventloop, so
+// it doesn't advance while callbacks are running; everything dispatched in
+// the same iteration sees the same time.
+static inline uint64_t
+NEM_kq_now(const NEM_kq_t *this)
+{
+	return this->now;
+}
+
+// NEM_kq_set_coarse switches the kq between the precise monotonic clock
+// (the default) and the platform's coarse monotonic clock, which is cheaper
+// to sample but only has a resolution of a few milliseconds. NEM_kq_now
+// never goes backwards across a switch.
+void NEM_kq_set_coarse(NEM_kq_t *this, bool coarse);
+
+// NEM_timer1_init initializes an unscheduled timer node.
+void NEM_timer1_init(NEM_timer1_t *this, NEM_timer1_fn fn);
+
+// NEM_timer1_active returns true if the timer node is scheduled.
+bool NEM_timer1_active(const NEM_timer1_t *this);
+
+// NEM_kq_timer1_set schedules the timer node to fire at the absolute time
+// at (relative to NEM_kq_now), rescheduling it if it's already set.
+// NEM_kq_timer1_cancel unschedules it; cancelling an unscheduled node is a
+// no-op. Both are O(1) and don't make any syscalls.
+void NEM_kq_timer1_set(NEM_kq_t *this, NEM_timer1_t *timer, uint64_t at);
+void NEM_kq_timer1_cancel(NEM_kq_t *this, NEM_timer1_t *timer);
+
+// NEM_timer_t is a struct for cancellable/recurring timers. It wraps a
+// NEM_timer1_t with a thunk that's invoked with the NEM_timer_t each time
+// it fires.
 typedef struct {
+	NEM_timer1_t  base;
 	NEM_kq_t     *kq;
-	NEM_timer1_t *active;
 	NEM_thunk_t  *thunk;
 }
 NEM_timer_t;
@@ -68,8 +275,9 @@ void NEM_timer_init(NEM_timer_t *this, NEM_kq_t *kq, NEM_thunk_t *thunk);
 
 // NEM_timer_set updates the next firing time of the timer. If the timer is
 // already set to fire, the time is adjusted. If it isn't, it's scheduled.
+// NEM_timer_set_abs takes an absolute time relative to NEM_kq_now.
 void NEM_timer_set(NEM_timer_t *this, uint64_t ms_after);
-void NEM_timer_set_abs(NEM_timer_t *this, struct timeval t);
+void NEM_timer_set_abs(NEM_timer_t *this, uint64_t at);
 
 // NEM_timer_cancel cancels the next execution of the timer. If the timer
 // isn't set, this is a no-op.
@@ -78,4 +286,3 @@ void NEM_timer_cancel(NEM_timer_t *this);
 // NEM_timer_free frees the underlying timer. This must be called before
 // NEM_kq_free.
 void NEM_timer_free(NEM_timer_t *this);
-
@@ -1,12 +1,54 @@
 #pragma once
 
+// NEM_LIST_BACKLOG is the listen(2) backlog listeners start out with. The
+// kernel caps it at its own limit (kern.ipc.soacceptqueue on FreeBSD,
+// net.core.somaxconn on Linux).
+static const int NEM_LIST_BACKLOG = 1024;
+
+// NEM_LIST_ACCEPT_MAX is the most connections a listener accepts each time
+// it's woken up, so that a flood of them can't starve everything else on
+// the kq.
+static const size_t NEM_LIST_ACCEPT_MAX = 64;
+
+// NEM_LIST_PAUSE_MS is how long a listener stops watching its socket when
+// it can't accept anything (out of descriptors with none in reserve, or out
+// of memory) before it tries again.
+static const uint64_t NEM_LIST_PAUSE_MS = 50;
+
+// NEM_list_stats_t counts what a listener has been up to since it was
+// created.
+typedef struct {
+	// accepted is the number of connections handed to the thunk, and
+	// wakeups the number of times the listener was woken up to accept
+	// them.
+	uint64_t accepted;
+	uint64_t wakeups;
+
+	// overflows is the number of wakeups that found the accept queue at
+	// (or past) the backlog, meaning the kernel may have turned clients
+	// away. saturated is the number that stopped at NEM_LIST_ACCEPT_MAX
+	// with connections possibly still waiting.
+	uint64_t overflows;
+	uint64_t saturated;
+
+	// shed is the number of connections accepted and immediately closed
+	// because the process was out of descriptors. paused is the number of
+	// times the listener backed off for NEM_LIST_PAUSE_MS because it
+	// couldn't accept or shed anything.
+	uint64_t shed;
+	uint64_t paused;
+}
+NEM_list_stats_t;
+
 // NEM_list_vt is the virtual table for a listening socket. The listener
 // is initialized with a NEM_thunk_t that is passed a NEM_list_ca for each
-// connecting stream. NEM_list_vt has a single method -- close -- that closes
-// the underlying connection and prevents further incoming connections. The
-// listener is never closed prematurely.
+// connecting stream. close closes the underlying connection and prevents
+// further incoming connections. The listener is never closed prematurely.
+// set_backlog and stats are optional.
 typedef struct {
 	void (*close)(void *vthis);
+	NEM_err_t (*set_backlog)(void *vthis, int backlog);
+	void (*stats)(void *vthis, NEM_list_stats_t *out);
 }
 NEM_list_vt;
 
@@ -20,6 +62,13 @@ NEM_list_t;
 // NEM_list_init_unix initializes a unix domain socket listening on the
 // given port. The socket is removed when the listener is closed. The thunk
 // is passed a NEM_list_ca for each connecting stream.
+//
+// Each time the listener is woken up it accepts connections until there
+// are none left (or it reaches NEM_LIST_ACCEPT_MAX). If the process runs
+// out of descriptors, it keeps one in reserve to accept and close the
+// connections it can't take rather than leaving them in the queue. If even
+// that doesn't work, it pauses for NEM_LIST_PAUSE_MS rather than being
+// woken up over and over.
 NEM_err_t NEM_list_init_unix(
 	NEM_list_t  *this,
 	int          kq,
@@ -36,6 +85,18 @@ NEM_err_t NEM_list_init_tcp(
 	NEM_thunk_t *on_stream
 );
 
+// NEM_list_init_tcp_shared is NEM_list_init_tcp but the port can be shared
+// with other shared listeners (SO_REUSEPORT). The kernel spreads incoming
+// connections across them, so each event loop in a NEM_app_t with workers
+// can have its own listener on the same port.
+NEM_err_t NEM_list_init_tcp_shared(
+	NEM_list_t  *this,
+	int          kq,
+	int          port,
+	const char  *addr,
+	NEM_thunk_t *on_stream
+);
+
 typedef struct {
 	NEM_err_t    err;
 	NEM_list_t   list;
@@ -52,3 +113,25 @@ NEM_list_close(NEM_list_t this)
 {
 	this.vt->close(this.this);
 }
+
+// NEM_list_set_backlog changes the listen(2) backlog of the listener.
+static inline NEM_err_t
+NEM_list_set_backlog(NEM_list_t this, int backlog)
+{
+	if (NULL == this.vt->set_backlog) {
+		return NEM_err_static("NEM_list_set_backlog: not supported");
+	}
+
+	return this.vt->set_backlog(this.this, backlog);
+}
+
+// NEM_list_stats copies the listener's counters into out. They're all zero
+// if the listener doesn't keep any.
+static inline void
+NEM_list_stats(NEM_list_t this, NEM_list_stats_t *out)
+{
+	bzero(out, sizeof(*out));
+	if (NULL != this.vt->stats) {
+		this.vt->stats(this.this, out);
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+// NEM_LOOPBACK_RING is the default size of the ring buffer on each end of a
+// loopback pair.
+static const size_t NEM_LOOPBACK_RING = 64 * 1024;
+
+typedef struct NEM_loopback_fds_t NEM_loopback_fds_t;
+
+// NEM_loopback_t is one end of an in-process NEM_stream_t. Bytes written to
+// one end are copied into a ring buffer owned by the other (or straight into
+// a pending read, if there is one) without going near the kernel, so two
+// components in the same process can talk over a NEM_chan_t at memcpy
+// speed. Both ends run on the same NEM_kq_t; waking the other end up is
+// done with NEM_kq_defer. Closing either end shuts the other one down once
+// it's read whatever was left for it.
+typedef struct NEM_loopback_t {
+	NEM_kq_t              *kq;
+	struct NEM_loopback_t *peer;
+	NEM_thunk1_t          *on_close;
+	bool                   running;
+
+	// NB: ring[ring_at, ring_at + ring_len) (modulo ring_cap) has been
+	// written by the peer but not read yet. fds is a FIFO of descriptor
+	// batches the peer has sent.
+	char               *ring;
+	size_t              ring_cap;
+	size_t              ring_at;
+	size_t              ring_len;
+	NEM_loopback_fds_t *fds;
+	NEM_loopback_fds_t *fds_last;
+
+	// NB: The pending read/write, same as NEM_fd_t's.
+	char              *rbuf;
+	size_t             rcap;
+	NEM_stream_cont_t *on_read;
+	NEM_stream_cont_t  rthunk;
+
+	struct iovec      *wiov;
+	size_t             wiovcnt;
+	struct iovec       wone;
+	size_t             wcap;
+	NEM_stream_cont_t *on_write;
+	NEM_stream_cont_t  wthunk;
+
+	// NB: wake is the callback queued with NEM_kq_defer to pick up after
+	// the peer (NULL if there isn't one). It's disarmed rather than freed
+	// if this end shuts down first. gone is set by the shutdown if it
+	// happens while the wakeup is running.
+	NEM_thunk1_t *wake;
+	bool         *gone;
+}
+NEM_loopback_t;
+
+extern const NEM_stream_vt NEM_loopback_stream_vt;
+
+// NEM_loopback_init links two NEM_loopback_t's together on kq, each with a
+// ring buffer of cap bytes (zero picks NEM_LOOPBACK_RING). Both must be
+// freed before the kq is.
+void NEM_loopback_init(
+	NEM_loopback_t *this,
+	NEM_loopback_t *that,
+	NEM_kq_t       *kq,
+	size_t          cap
+);
+
+// NEM_loopback_free closes the loopback if it's not already been closed.
+void NEM_loopback_free(NEM_loopback_t *this);
+
+NEM_stream_t NEM_loopback_as_stream(NEM_loopback_t *this);
+
+void NEM_loopback_close(NEM_loopback_t *this);
+void NEM_loopback_on_close(NEM_loopback_t *this, NEM_thunk1_t *cb);
+
+// NEM_loopback_write_fds hands the peer duplicates of the descriptors (so,
+// as with NEM_fd_write_fds, the caller keeps its own) in a batch that
+// NEM_loopback_read_fds picks up whole. Batches are queued in order, but
+// aren't tied to a position in the byte stream: a descriptor is available
+// to the peer as soon as it's written.
+NEM_err_t NEM_loopback_read_fds(NEM_loopback_t *this, int *fds, size_t *len);
+NEM_err_t NEM_loopback_write_fds(
+	NEM_loopback_t *this,
+	const int      *fds,
+	size_t          len
+);
@@ -24,6 +24,9 @@ static const uint32_t NEM_PMSG_MAGIC   = 0x6e656d21;
 static const uint8_t  NEM_PMSG_VERSION = 1;
 
 static const size_t NEM_PMSG_HDRMAX = 64000;
+// NB: NEM_PMSG_BODYMAX only applies to bodies sent inline. Out-of-line
+// bodies (NEM_PMSGFLAG_OOL) are only limited by the width of body_len and
+// the size of the descriptor they arrive in.
 static const size_t NEM_PMSG_BODYMAX = 1048576; // 2**20 bytes.
 
 static const uint8_t
@@ -31,7 +34,9 @@ static const uint8_t
 	NEM_PMSGFLAG_CONTINUE = 1 << 1, // Additional messages continue the body.
 	NEM_PMSGFLAG_CANCEL   = 1 << 2, // Cancel future replies to this seq.
 	NEM_PMSGFLAG_FD       = 1 << 3, // File descriptor follows fixed header.
-	NEM_PMSGFLAG_ROUTE    = 1 << 4; // Message should be forwarded.
+	NEM_PMSGFLAG_ROUTE    = 1 << 4, // Message should be forwarded.
+	NEM_PMSGFLAG_OOL      = 1 << 5, // Body is in the fd rather than inline.
+	NEM_PMSGFLAG_FDS      = 1 << 6; // Counted batch of fds follows instead.
 
 // NEM_pmsg_validate returns an error if the packed message doesn't look
 // valid (e.g. if any of the fields are set in an invalid manner). 
@@ -46,6 +51,8 @@ typedef struct {
 	void *body;   // Body buffer. Appended if NEM_MSGFLAG_BODY_INLINE.
 	int   fd;     // Attached fd if NEM_MSGFLAG_HAS_FD.
 	int   flags;  // NEM_MSGFLAG_*s OR'd.
+	int  *fds;    // Attached fds if NEM_MSGFLAG_HAS_FDS.
+	size_t fds_len; // Number of fds.
 
 	// NB: packed+appended can be sent as a single blob.
 	#pragma pack(push, 0)
@@ -69,7 +76,9 @@ NEM_msglist_t;
 static const uint8_t
 	NEM_MSGFLAG_HEADER_INLINE = 1 << 0, // header is inlined.
 	NEM_MSGFLAG_BODY_INLINE   = 1 << 1, // body is inlined.
-	NEM_MSGFLAG_HAS_FD        = 1 << 2; // fd is set.
+	NEM_MSGFLAG_HAS_FD        = 1 << 2, // fd is set.
+	NEM_MSGFLAG_BODY_MAPPED   = 1 << 3, // body is mmap'd (read-only).
+	NEM_MSGFLAG_HAS_FDS       = 1 << 4; // fds is set.
 
 // NEM_msg_new allocates a new NEM_msg_t. If header_len/body_len are
 // provided, the header/body fields are pre-allocated with a single
@@ -86,6 +95,12 @@ void NEM_msg_free(NEM_msg_t *this);
 // NEM_msg_set_fd attaches a file descriptor to the message.
 NEM_err_t NEM_msg_set_fd(NEM_msg_t *this, int fd);
 
+// NEM_msg_set_fds attaches up to NEM_FD_FDS_MAX file descriptors to the
+// message, which are sent together. The array is copied; like
+// NEM_msg_set_fd the descriptors themselves aren't owned by the message.
+// A message can have either a single fd or a set, not both.
+NEM_err_t NEM_msg_set_fds(NEM_msg_t *this, const int *fds, size_t len);
+
 // NEM_msg_set_header_raw attaches a header buffer to the message. The buffer
 // becomes owned by the message and will be freed with NEM_msg_free (or
 // when a different buffer is attached).
@@ -103,5 +118,17 @@ NEM_err_t NEM_msg_set_header(NEM_msg_t *this, NEM_msghdr_t *hdr);
 NEM_msghdr_t *NEM_msg_header(const NEM_msg_t *this);
 
 // NEM_msg_set_body does the same thing as NEM_msg_set_header, but with
-// a different field.
+// a different field. The body can be bigger than NEM_PMSG_BODYMAX, but
+// then it can only be sent over a channel that sends it out-of-line.
 NEM_err_t NEM_msg_set_body(NEM_msg_t *this, void *body, size_t len);
+
+// NEM_msg_seal_body copies the message's body into a new anonymous shared
+// memory object and returns its descriptor in out. On Linux it's a memfd
+// sealed against any further changes. The message itself is left alone.
+NEM_err_t NEM_msg_seal_body(const NEM_msg_t *this, int *out);
+
+// NEM_msg_map_body replaces the message's body with a read-only mapping of
+// packed.body_len bytes of fd (as made by NEM_msg_seal_body), and clears
+// NEM_PMSGFLAG_OOL/NEM_PMSGFLAG_FD. The fd is consumed either way. The
+// mapping is undone by NEM_msg_free or NEM_msg_set_body.
+NEM_err_t NEM_msg_map_body(NEM_msg_t *this, int fd);
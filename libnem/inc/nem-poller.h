@@ -0,0 +1,143 @@
+#pragma once
+
+// The poller is the readiness-notification interface underneath NEM_kq_t.
+// Its shape is kevent(2): on FreeBSD it _is_ kevent(2), and on Linux it's
+// emulated with epoll, timerfd, signalfd and pidfd so that everything built
+// on top (NEM_kq_t, NEM_fd_t, NEM_list_t, NEM_child_t, ...) can keep passing
+// struct kevents around without caring which kernel it's running on.
+//
+// Only the subset of kevent(2) that libnem and its consumers use is
+// emulated on Linux:
+//
+//   * EVFILT_READ/EVFILT_WRITE on sockets and pipes. EV_CLEAR maps to
+//     edge-triggered mode. data is the number of bytes available to read
+//     (FIONREAD) or an estimate of the free space in the send buffer, and
+//     EV_EOF is set when the peer hangs up. Changing one filter on an fd
+//     can re-report the other one if it's still ready, so consumers must
+//     tolerate spurious events.
+//   * EVFILT_TIMER (backed by a timerfd) with NOTE_{,M,U,N}SECONDS units.
+//     data is the number of expirations since the last delivery.
+//   * EVFILT_SIGNAL (backed by a signalfd). The signal is blocked for the
+//     calling thread so that it's delivered even if it's SIG_IGN'd, which
+//     matches kqueue.
+//   * EVFILT_PROC with NOTE_EXIT (backed by a pidfd). data is the exit
+//     status of the process. The process is not reaped.
+//   * EVFILT_USER (backed by an eventfd). NOTE_TRIGGER fires the event;
+//     triggers are always coalesced as if EV_CLEAR were set, and the
+//     NOTE_FF* flag operations aren't supported.
+//
+// As with kevent(2), a poller can be used from multiple threads at once,
+// e.g. to trigger an EVFILT_USER event for a loop running elsewhere.
+//
+// Pollers should be released with NEM_poller_close rather than close(2)
+// so that the fds backing timers/signals/processes are released as well.
+//
+// Unlike kqueue, epoll keeps reporting an fd after it's been closed if
+// another process still holds a reference to it (e.g. across fork), so
+// fds that might be shared should be EV_DELETE'd before closing them.
+
+#if defined(__linux__)
+
+struct kevent {
+	uintptr_t      ident;
+	short          filter;
+	unsigned short flags;
+	unsigned int   fflags;
+	intptr_t       data;
+	void          *udata;
+};
+
+#define EV_SET(kevp, a, b, c, d, e, f) do { \
+	struct kevent *NEM_EV_kevp = (kevp); \
+	NEM_EV_kevp->ident = (a); \
+	NEM_EV_kevp->filter = (b); \
+	NEM_EV_kevp->flags = (c); \
+	NEM_EV_kevp->fflags = (d); \
+	NEM_EV_kevp->data = (e); \
+	NEM_EV_kevp->udata = (f); \
+} while (0)
+
+#define EVFILT_READ   (-1)
+#define EVFILT_WRITE  (-2)
+#define EVFILT_AIO    (-3)
+#define EVFILT_VNODE  (-4)
+#define EVFILT_PROC   (-5)
+#define EVFILT_SIGNAL (-6)
+#define EVFILT_TIMER  (-7)
+#define EVFILT_USER   (-11)
+
+#define EV_ADD     0x0001
+#define EV_DELETE  0x0002
+#define EV_ENABLE  0x0004
+#define EV_DISABLE 0x0008
+#define EV_ONESHOT 0x0010
+#define EV_CLEAR   0x0020
+#define EV_ERROR   0x4000
+#define EV_EOF     0x8000
+
+#define NOTE_SECONDS  0x00000001
+#define NOTE_MSECONDS 0x00000002
+#define NOTE_USECONDS 0x00000004
+#define NOTE_NSECONDS 0x00000008
+#define NOTE_TRIGGER  0x01000000
+#define NOTE_EXIT     0x80000000
+
+int NEM_poller_open(void);
+int NEM_poller_close(int kq);
+int NEM_poller_kevent(
+	int                   kq,
+	const struct kevent  *changes,
+	int                   nchanges,
+	struct kevent        *events,
+	int                   nevents,
+	const struct timespec *timeout
+);
+
+// NB: Alias the BSD names so existing kevent(2) consumers compile as-is.
+static inline int
+kqueue(void)
+{
+	return NEM_poller_open();
+}
+
+static inline int
+kevent(
+	int                   kq,
+	const struct kevent  *changes,
+	int                   nchanges,
+	struct kevent        *events,
+	int                   nevents,
+	const struct timespec *timeout
+) {
+	return NEM_poller_kevent(kq, changes, nchanges, events, nevents, timeout);
+}
+
+#else
+
+#include <sys/event.h>
+
+static inline int
+NEM_poller_open(void)
+{
+	return kqueue();
+}
+
+static inline int
+NEM_poller_close(int kq)
+{
+	return close(kq);
+}
+
+static inline int
+NEM_poller_kevent(
+	int                   kq,
+	const struct kevent  *changes,
+	int                   nchanges,
+	struct kevent        *events,
+	int                   nevents,
+	const struct timespec *timeout
+) {
+	return kevent(kq, changes, nchanges, events, nevents, timeout);
+}
+
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+
+// NEM_POOL_STATS_BUCKETS is the number of buckets in each of the pool's
+// latency histograms.
+#define NEM_POOL_STATS_BUCKETS 32
+
+// NEM_pool_fn does the actual work of a task on one of the pool's threads.
+// It's handed the task's completion thunk, so inputs and results can be
+// passed through the thunk's inline data (see NEM_thunk1_inlineptr); it
+// must not touch anything else owned by the submitting loop. Whatever it
+// returns is passed on to the completion.
+typedef NEM_err_t (*NEM_pool_fn)(NEM_thunk1_t *done);
+
+// NEM_pool_ca is the callback argument passed to a task's completion.
+typedef struct {
+	NEM_err_t err;
+	uint64_t  id;
+
+	// cancelled is set if NEM_pool_cancel got to the task before it
+	// completed. err is set as well in that case, and the task's work may
+	// or may not have run.
+	bool cancelled;
+}
+NEM_pool_ca;
+
+// NEM_pool_stats_t is a snapshot of a pool's queue and timings.
+typedef struct {
+	// queued is the number of tasks waiting for a thread, and queued_max
+	// the most there have ever been. running is the number of tasks being
+	// worked on.
+	size_t queued;
+	size_t queued_max;
+	size_t running;
+
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t cancelled;
+	uint64_t rejected;
+
+	// wait_* is how long tasks sat in the queue and run_* is how long their
+	// work took: totals, worst cases, and log2 histograms in microseconds
+	// bucketed the same way as NEM_kq_stats_t's latency.
+	uint64_t wait_ns;
+	uint64_t wait_max_ns;
+	uint64_t run_ns;
+	uint64_t run_max_ns;
+	uint64_t wait[NEM_POOL_STATS_BUCKETS];
+	uint64_t run[NEM_POOL_STATS_BUCKETS];
+}
+NEM_pool_stats_t;
+
+typedef struct NEM_pool_task_t NEM_pool_task_t;
+
+// NEM_pool_t is a fixed set of threads for work that would otherwise block
+// an eventloop: hashing files, synchronous database queries, public-key
+// math and the like. Tasks are submitted from a loop along with a completion
+// thunk, run on one of the pool's threads, and their completion is posted
+// back to the submitting NEM_kq_t with NEM_kq_post. Everything here is
+// safe to call from any thread.
+typedef struct {
+	pthread_mutex_t mtx;
+	pthread_cond_t  cond;
+	pthread_t      *threads;
+	size_t          threads_len;
+	bool            stopping;
+
+	// NB: queue is a FIFO of tasks waiting for a thread, bounded by
+	// queue_cap. Tasks move to running while their work is being done, so
+	// NEM_pool_cancel can find them either way.
+	NEM_pool_task_t *queue;
+	NEM_pool_task_t *queue_tail;
+	size_t           queue_cap;
+	NEM_pool_task_t *running;
+	uint64_t         next_id;
+
+	NEM_pool_stats_t stats;
+}
+NEM_pool_t;
+
+// NEM_pool_init starts a pool with the given number of threads. At most
+// queue_cap tasks can be waiting for a thread at once; zero picks a default.
+NEM_err_t NEM_pool_init(NEM_pool_t *this, size_t threads, size_t queue_cap);
+
+// NEM_pool_free waits for running tasks to finish and stops the pool's
+// threads. Tasks that are still queued are completed as cancelled without
+// running. Those completions are posted like any other, so the kqs they're
+// posted to must still be around, and have to run again to deliver them.
+void NEM_pool_free(NEM_pool_t *this);
+
+// NEM_pool_submit queues fn to run on the pool and returns an id for the
+// task. done is invoked on kq's thread with a NEM_pool_ca once the task
+// completes, is cancelled, or is rejected because the queue is full. It's
+// invoked at most once: if kq is freed before the completion gets to run,
+// NEM_kq_free discards done without invoking it, and anything only done
+// would have cleaned up is leaked. To be sure every done runs, free the
+// pool first and then run kq until the completions have all arrived.
+uint64_t NEM_pool_submit(
+	NEM_pool_t   *this,
+	NEM_pool_fn   fn,
+	NEM_thunk1_t *done,
+	NEM_kq_t     *kq
+);
+
+// NEM_pool_cancel cancels a task. A queued task is dropped without running;
+// a running task is left to finish, but can check NEM_pool_cancelled and
+// bail early. Either way the completion is told the task was cancelled.
+// Returns false if the task has already completed (its completion may not
+// have run yet).
+bool NEM_pool_cancel(NEM_pool_t *this, uint64_t id);
+
+// NEM_pool_cancelled returns true if the task running on the calling thread
+// has been cancelled. It's meant for long-running NEM_pool_fn's to poll.
+bool NEM_pool_cancelled();
+
+// NEM_pool_get_stats copies the pool's current stats into out.
+void NEM_pool_get_stats(NEM_pool_t *this, NEM_pool_stats_t *out);
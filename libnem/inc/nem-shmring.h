@@ -0,0 +1,96 @@
+#pragma once
+
+// NEM_SHMRING_CAP is the size of each direction's ring. It must be a power
+// of two.
+static const size_t NEM_SHMRING_CAP = 128 * 1024;
+
+typedef struct NEM_shmring_hdr_t NEM_shmring_hdr_t;
+
+typedef enum {
+	NEM_SHMRING_NEGOTIATING,
+	NEM_SHMRING_SOCKET,
+	NEM_SHMRING_RING,
+}
+NEM_shmring_mode_t;
+
+// NEM_shmring_t is the stream between a parent process and a NEM_child_t.
+// Bytes go through a pair of single-producer/single-consumer rings in a
+// shared memory region rather than the unix socket, and a side only gets
+// woken up (through a doorbell descriptor) if it's gone idle waiting on the
+// other. Descriptors still go over the socket, and closing the socket is
+// how either side finds out the other has gone away.
+//
+// The parent offers the region over the socket before the child is even
+// started, and the child says whether it took it up. If either side can't
+// set the region up, everything goes over the socket instead, as if it were
+// a plain NEM_fd_t.
+typedef struct {
+	NEM_fd_t           sock;
+	NEM_shmring_mode_t mode;
+	bool               running;
+	NEM_thunk1_t      *on_close;
+
+	// NB: region is the shared mapping, holding the rings' headers and
+	// data. in is the ring the peer writes to and out the one this side
+	// does; rpos/wpos are this side's own positions in them. bell is the
+	// descriptor the peer rings to wake this side up, and peer_bell the
+	// other way around (they're the same eventfd on Linux).
+	void              *region;
+	size_t             region_len;
+	size_t             cap;
+	NEM_shmring_hdr_t *in;
+	NEM_shmring_hdr_t *out;
+	char              *in_data;
+	char              *out_data;
+	uint64_t           rpos;
+	uint64_t           wpos;
+	int                bell;
+	int                peer_bell;
+	NEM_thunk_t       *on_bell;
+
+	// NB: The pending read and write. In socket mode they're forwarded to
+	// sock through rfwd/wfwd, so the continuations still see this stream.
+	char              *rbuf;
+	size_t             rcap;
+	NEM_stream_cont_t *on_read;
+	NEM_stream_cont_t  rthunk;
+	NEM_stream_cont_t  rfwd;
+
+	struct iovec      *wiov;
+	size_t             wiovcnt;
+	struct iovec       wone;
+	size_t             wcap;
+	NEM_stream_cont_t *on_write;
+	NEM_stream_cont_t  wthunk;
+	NEM_stream_cont_t  wfwd;
+
+	// NB: The parent reads the child's answer to its offer into ack.
+	char              ack;
+	NEM_stream_cont_t ack_cont;
+
+	// NB: gone is set by the shutdown if it happens while pending
+	// operations are being resumed, since any of them can free this.
+	bool *gone;
+}
+NEM_shmring_t;
+
+extern const NEM_stream_vt NEM_shmring_stream_vt;
+
+// NEM_shmring_init_parent sets up the parent's end on the socket fd (which
+// is consumed) and sends the offer. The child end of the socket should be
+// handed to the child afterwards. Reads and writes wait until the child
+// answers.
+NEM_err_t NEM_shmring_init_parent(NEM_shmring_t *this, int kq, int fd);
+
+// NEM_shmring_init_child sets up the child's end on the socket fd (which is
+// consumed). The parent's offer has to be sitting in the socket already;
+// if there isn't one the stream just uses the socket.
+NEM_err_t NEM_shmring_init_child(NEM_shmring_t *this, int kq, int fd);
+
+// NEM_shmring_free closes the stream if it's not already closed.
+void NEM_shmring_free(NEM_shmring_t *this);
+
+NEM_stream_t NEM_shmring_as_stream(NEM_shmring_t *this);
+
+void NEM_shmring_close(NEM_shmring_t *this);
+void NEM_shmring_on_close(NEM_shmring_t *this, NEM_thunk1_t *cb);
@@ -1,10 +1,40 @@
 #pragma once
 
+typedef struct NEM_stream_cont_t NEM_stream_cont_t;
+
 typedef struct {
 	NEM_err_t (*read)(void *vthis, void *buf, size_t len, NEM_thunk1_t *cb);
 	NEM_err_t (*write)(void *vthis, void *buf, size_t len, NEM_thunk1_t *cb);
+	NEM_err_t (*read_cont)(
+		void              *vthis,
+		void              *buf,
+		size_t             len,
+		NEM_stream_cont_t *cont
+	);
+	NEM_err_t (*write_cont)(
+		void              *vthis,
+		void              *buf,
+		size_t             len,
+		NEM_stream_cont_t *cont
+	);
+	NEM_err_t (*writev_cont)(
+		void              *vthis,
+		struct iovec      *iov,
+		size_t             iovcnt,
+		NEM_stream_cont_t *cont
+	);
+	NEM_err_t (*sendfile_cont)(
+		void              *vthis,
+		int                fd,
+		off_t              off,
+		size_t             len,
+		NEM_stream_cont_t *cont
+	);
+	size_t    (*peek)(void *vthis, const void **out);
 	NEM_err_t (*read_fd)(void *vthis, int *fdout);
 	NEM_err_t (*write_fd)(void *vthis, int fd);
+	NEM_err_t (*read_fds)(void *vthis, int *fds, size_t *len);
+	NEM_err_t (*write_fds)(void *vthis, const int *fds, size_t len);
 	NEM_err_t (*close)(void *vthis);
 	NEM_err_t (*on_close)(void *vthis, NEM_thunk1_t *cb);
 }
@@ -22,6 +52,45 @@ typedef struct {
 }
 NEM_stream_ca;
 
+typedef void (*NEM_stream_cont_fn)(NEM_stream_cont_t *cont, NEM_stream_ca *ca);
+
+// NEM_stream_cont_t is a continuation for a stream read or write that's
+// owned by the caller rather than allocated per-operation. Things that
+// always resume into the same function (e.g. NEM_chan_t's state machine)
+// embed one per direction and pass it to NEM_stream_read_cont/write_cont
+// each time, so steady-state I/O doesn't allocate. The stream only holds a
+// pointer to it while the operation is pending, and never frees it.
+struct NEM_stream_cont_t {
+	NEM_stream_cont_fn  fn;
+	void               *ctx;
+};
+
+static inline void
+NEM_stream_cont_init(NEM_stream_cont_t *this, NEM_stream_cont_fn fn, void *ctx)
+{
+	this->fn = fn;
+	this->ctx = ctx;
+}
+
+// NEM_stream_cont_invoke is NEM_thunk1_invoke for continuations: the slot
+// is cleared before the continuation runs, so it's free to queue up the
+// next operation.
+static inline void
+NEM_stream_cont_invoke(NEM_stream_cont_t **slot, NEM_stream_ca *ca)
+{
+	NEM_stream_cont_t *cont = *slot;
+	*slot = NULL;
+	cont->fn(cont, ca);
+}
+
+// NEM_stream_cont_bind points a continuation at a thunk, so that invoking
+// the continuation invokes (and frees) the thunk. This is how stream
+// implementations provide the thunk-based read/write on top of their
+// continuation-based ones. NEM_stream_cont_unbind discards the thunk if the
+// continuation was never invoked.
+void NEM_stream_cont_bind(NEM_stream_cont_t *this, NEM_thunk1_t *thunk);
+void NEM_stream_cont_unbind(NEM_stream_cont_t *this);
+
 //
 // Inline dispatch
 //
@@ -44,6 +113,90 @@ NEM_stream_write(NEM_stream_t this, void *buf, size_t len, NEM_thunk1_t *cb)
 	return this.vt->write(this.this, buf, len, cb);
 }
 
+// NEM_stream_read_cont and NEM_stream_write_cont are NEM_stream_read and
+// NEM_stream_write with a caller-owned continuation in place of the thunk.
+// cont must stay valid until it's invoked; if an error is returned it
+// isn't invoked at all.
+static inline NEM_err_t
+NEM_stream_read_cont(
+	NEM_stream_t       this,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	return this.vt->read_cont(this.this, buf, len, cont);
+}
+
+static inline NEM_err_t
+NEM_stream_write_cont(
+	NEM_stream_t       this,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	return this.vt->write_cont(this.this, buf, len, cont);
+}
+
+// NEM_stream_writev_cont writes the buffers described by iov, in order, as
+// if they were one. The iovec array (but not the memory it points at) may
+// be modified as the write progresses, and it must stay valid until cont is
+// invoked. Streams that don't implement writev_cont get a write_cont per
+// buffer instead.
+NEM_err_t NEM_stream_writev_cont(
+	NEM_stream_t       this,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+);
+
+// NEM_stream_sendfile_cont writes len bytes of the file fd, starting at off,
+// to the stream. It's a write as far as interleaving goes. Streams that can
+// have the kernel do the copy (NEM_fd_t, via sendfile(2)) implement
+// sendfile_cont; everything else goes through NEM_stream_sendfile_copy.
+// fd isn't closed, and its file offset isn't used or changed. The transfer
+// fails if the file turns out to be shorter than off + len.
+NEM_err_t NEM_stream_sendfile_cont(
+	NEM_stream_t       this,
+	int                fd,
+	off_t              off,
+	size_t             len,
+	NEM_stream_cont_t *cont
+);
+
+// NEM_stream_sendfile is NEM_stream_sendfile_cont with a thunk, with the
+// same semantics as NEM_stream_write.
+NEM_err_t NEM_stream_sendfile(
+	NEM_stream_t  this,
+	int           fd,
+	off_t         off,
+	size_t        len,
+	NEM_thunk1_t *cb
+);
+
+// NEM_stream_sendfile_copy is the fallback for NEM_stream_sendfile_cont: it
+// preads the file a chunk at a time and writes each chunk to the stream.
+NEM_err_t NEM_stream_sendfile_copy(
+	NEM_stream_t       this,
+	int                fd,
+	off_t              off,
+	size_t             len,
+	NEM_stream_cont_t *cont
+);
+
+// NEM_stream_peek points out at data the stream has already buffered and
+// returns how much there is, without consuming it. Streams that don't
+// buffer reads (or don't implement peek) always return zero.
+static inline size_t
+NEM_stream_peek(NEM_stream_t this, const void **out)
+{
+	if (NULL == this.vt->peek) {
+		*out = NULL;
+		return 0;
+	}
+
+	return this.vt->peek(this.this, out);
+}
+
 static inline NEM_err_t
 NEM_stream_read_fd(NEM_stream_t this, int *fdout)
 {
@@ -56,6 +209,29 @@ NEM_stream_write_fd(NEM_stream_t this, int fd)
 	return this.vt->write_fd(this.this, fd);
 }
 
+// NEM_stream_read_fds and NEM_stream_write_fds pass a batch of descriptors
+// in one go (see NEM_fd_write_fds). Streams that can't pass descriptors
+// return an error.
+static inline NEM_err_t
+NEM_stream_read_fds(NEM_stream_t this, int *fds, size_t *len)
+{
+	if (NULL == this.vt->read_fds) {
+		return NEM_err_static("NEM_stream_read_fds: not supported");
+	}
+
+	return this.vt->read_fds(this.this, fds, len);
+}
+
+static inline NEM_err_t
+NEM_stream_write_fds(NEM_stream_t this, const int *fds, size_t len)
+{
+	if (NULL == this.vt->write_fds) {
+		return NEM_err_static("NEM_stream_write_fds: not supported");
+	}
+
+	return this.vt->write_fds(this.this, fds, len);
+}
+
 static inline NEM_err_t
 NEM_stream_close(NEM_stream_t this)
 {
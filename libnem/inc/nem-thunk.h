@@ -6,6 +6,12 @@
  *
  */
 
+// NEM_THUNK_CLASSES is the number of size classes thunks are allocated
+// from. Each thread keeps a free list per class, so allocating a thunk with
+// a small amount of inline data usually doesn't hit malloc at all. Larger
+// thunks fall through to malloc/free.
+#define NEM_THUNK_CLASSES 6
+
 typedef struct NEM_thunk1_t NEM_thunk1_t;
 typedef struct NEM_thunk_t NEM_thunk_t;
 typedef void(*NEM_thunk1_fn)(NEM_thunk1_t*, void*);
@@ -100,6 +106,11 @@ NEM_thunk_inlineptr(NEM_thunk_t *this)
 	return (void*) &this->data[0];
 }
 
+// NEM_thunk1_release returns a thunk's memory to the allocator. It's what
+// NEM_thunk1_invoke uses after calling the thunk; use NEM_thunk1_discard
+// instead.
+void NEM_thunk1_release(NEM_thunk1_t *this);
+
 // NEM_thunk1_invoke invokes the wrapped function and immediately discards
 // (i.e., free's) the provided NEM_thunk1_t.
 #define NEM_thunk1_invoke(vthis, vdata) {\
@@ -108,7 +119,7 @@ NEM_thunk_inlineptr(NEM_thunk_t *this)
 	NEM_thunk1_t *NEM_THUNK_copy = *NEM_THUNK_this; \
 	*NEM_THUNK_this = NULL; \
 	NEM_THUNK_copy->fn(NEM_THUNK_copy, NEM_THUNK_data); \
-	free(NEM_THUNK_copy); \
+	NEM_thunk1_release(NEM_THUNK_copy); \
 }
 
 #define NEM_thunk_invoke(vthis, vdata) {\
@@ -120,3 +131,16 @@ NEM_thunk_inlineptr(NEM_thunk_t *this)
 // NEM_thunk1_discard free's the NEM_thunk1_t without invocation.
 void NEM_thunk1_discard(NEM_thunk1_t **this);
 void NEM_thunk_free(NEM_thunk_t *this);
+
+// NEM_thunk_set_debug enables (or disables) allocator debugging for thunks
+// allocated from here on: freed thunks are poisoned, and live ones are
+// counted (see NEM_thunk_live). Double frees are always caught.
+void NEM_thunk_set_debug(bool enabled);
+
+// NEM_thunk_live returns the number of thunks allocated with debugging
+// enabled that haven't been freed yet, across all threads.
+size_t NEM_thunk_live();
+
+// NEM_thunk_cache_flush returns the calling thread's cached thunk memory
+// to malloc. Threads flush their caches automatically when they exit.
+void NEM_thunk_cache_flush();
@@ -13,14 +13,42 @@ NEM_txntype_t;
 // around a set of messages -- either incoming or outgoing. Transactions
 // are hierarchical -- they can be bound to a parent transaction -- so that
 // cancelling the parent transaction propagates down to all children.
+//
+// Cancellation goes over the wire too. Cancelling an outgoing transaction
+// (explicitly, by timeout, or through its parent) sends the remote a
+// NEM_PMSGFLAG_CANCEL frame for its seq, which cancels the matching
+// incoming transaction there, along with everything it started in turn. An
+// incoming transaction that times out sends the same frame back as a reply.
+// An outgoing transaction's thunk is invoked with done and an error set
+// when it's cancelled. Incoming transactions have no thunk, so nothing tells
+// the handler: it should poll NEM_txnin_cancelled as it goes, and must still
+// finish with NEM_txnin_reply (or NEM_txnin_reply_err). The reply is dropped
+// rather than sent, but it's what frees the transaction; without it the
+// transaction sticks around until the connection closes.
+//
+// Deadlines go over the wire as well. Each outgoing request carries the
+// time it has left in a NEM_msghdr_time_t, and the incoming transaction on
+// the other end times out when that runs out. Requests that arrive with no
+// time left are answered with a "deadline exceeded" error without ever
+// reaching a handler.
 struct NEM_txn_t {
-	SPLAY_ENTRY(NEM_txn_t) link;
+	// NB: timeout is scheduled on the txnmgr's kq while the transaction
+	// has a deadline. It must remain the first member.
+	NEM_timer1_t   timeout;
 
 	uint64_t       seq;
-	struct timeval timeout;
 	NEM_txntype_t  type;
 	bool           cancelled;
 
+	// NB: slot is where the transaction sits in its manager's NEM_txntab_t,
+	// so removing it doesn't need a lookup.
+	size_t         slot;
+
+	// NB: children are the outgoing transactions started on behalf of
+	// this one (see NEM_txnmgr_req), and parent the reverse. A child that
+	// finishes first unlinks itself; a parent that finishes first just
+	// orphans its children.
+	NEM_txn_t    *parent;
 	size_t        children_len;
 	NEM_txn_t   **children;
 	NEM_txnmgr_t *mgr;
@@ -34,18 +62,20 @@ struct NEM_txn_t {
 // NEM_txnin_t is a specialization of NEM_txn_t that represents an incoming
 // request.
 typedef struct NEM_txnin_t {
-	NEM_txn_t                base;
-	SPLAY_ENTRY(NEM_txnin_t) link;
-	uint16_t                 service_id;
-	uint16_t                 command_id;
+	NEM_txn_t base;
+	uint16_t  service_id;
+	uint16_t  command_id;
 }
 NEM_txnin_t;
 
 // NEM_txnout_t is a specialization of NEM_txn_t that represents an outgoing
 // request.
 typedef struct NEM_txnout_t {
-	NEM_txn_t                 base;
-	SPLAY_ENTRY(NEM_txnout_t) link;
+	NEM_txn_t base;
+
+	// NB: sent is set once a message has gone out for the transaction,
+	// since there's no point telling the remote to cancel before then.
+	bool      sent;
 }
 NEM_txnout_t;
 
@@ -57,8 +87,9 @@ void *NEM_txn_data(NEM_txn_t *this);
 void NEM_txn_set_data(NEM_txn_t *this, void *data);
 
 // NEM_txnout_cancel aborts the entire transaction, removing it and every
-// child transaction from their respective managers. This invalidates the
-// transaction object. This invokes the callback before freeing the transaction.
+// child transaction from their respective managers and telling the remotes.
+// This invalidates the transaction object. This invokes the callback before
+// freeing the transaction.
 void NEM_txnout_cancel(NEM_txnout_t *this);
 void NEM_txnout_cancel_err(NEM_txnout_t *this, NEM_err_t err);
 
@@ -69,7 +100,7 @@ void NEM_txnout_cancel_err(NEM_txnout_t *this, NEM_err_t err);
 // absolute timeout value.
 // 
 // Setting -1 milliseconds makes the timeout infinite. There is an automatic
-// default timeout set.
+// default timeout set, for children of a parent without a deadline too.
 void NEM_txnout_set_timeout(NEM_txnout_t *this, int milliseconds);
 
 // NEM_txnout_req finializes the outgoing transaction and sends the 
@@ -92,24 +123,36 @@ void NEM_txnin_reply_err(NEM_txnin_t *this, NEM_err_t err);
 // transaction object.
 void NEM_txnin_reply_continue(NEM_txnin_t *this, NEM_msg_t *msg);
 
-// NEM_txn*_tree_t is a tree of transactions, ordered by seqid.
-typedef SPLAY_HEAD(NEM_txnin_tree_t, NEM_txnin_t) NEM_txnin_tree_t;
-typedef SPLAY_HEAD(NEM_txnout_tree_t, NEM_txnout_t) NEM_txnout_tree_t;
-typedef SPLAY_HEAD(NEM_txn_tree_t, NEM_txn_t) NEM_txn_tree_t;
+// NEM_txntab_t is an open-addressed hash table of transactions keyed by
+// seq, with linear probing. Lookups, inserts and removals are all O(1) and
+// lookups don't write anything, unlike the splay trees this replaced. cap
+// is a power of two (or zero before the first insert).
+//
+// NB: While the table is being walked (walking is non-zero) removals just
+// clear their slot so nothing moves under the walk, and stale is set so
+// the table is rehashed once the walk is over.
+typedef struct {
+	NEM_txn_t **slots;
+	size_t      cap;
+	size_t      len;
+	int         walking;
+	bool        stale;
+}
+NEM_txntab_t;
 
 // NEM_txnmgr_t wraps a NEM_chan_t and provides a transactional interface
 // over it. It handles assignment of sequence ids and can delegate request
-// dispatching.
+// dispatching. txns_out.len is the number of outgoing transactions in
+// flight, which is how NEM_txnpool_t judges how busy a connection is.
 struct NEM_txnmgr_t {
-	NEM_chan_t        chan;
-	NEM_timer_t       timer;
-	NEM_txnin_tree_t  txns_in;
-	NEM_txnout_tree_t txns_out;
-	NEM_txn_tree_t    timeouts;
-	NEM_thunk1_t     *on_close;
-	NEM_svcmux_t     *mux;
-	uint64_t          seq;
-	NEM_err_t         err;
+	NEM_chan_t    chan;
+	NEM_kq_t     *kq;
+	NEM_txntab_t  txns_in;
+	NEM_txntab_t  txns_out;
+	NEM_thunk1_t *on_close;
+	NEM_svcmux_t *mux;
+	uint64_t      seq;
+	NEM_err_t     err;
 };
 
 // NEM_txnmgr_init initializes the txnmgr with the specified stream. The
@@ -184,6 +227,22 @@ NEM_txnout_data(NEM_txnout_t *this)
 	return NEM_txn_data(&this->base);
 }
 
+// NEM_txnin_cancelled returns true once the transaction's been cancelled,
+// whether by the remote, a timeout, or the connection going away. Anything
+// sent on it from then on is dropped, but the final reply is still needed
+// to free it.
+static inline bool
+NEM_txnin_cancelled(const NEM_txnin_t *this)
+{
+	return this->base.cancelled;
+}
+
+static inline bool
+NEM_txnout_cancelled(const NEM_txnout_t *this)
+{
+	return this->base.cancelled;
+}
+
 static inline void
 NEM_txnin_set_data(NEM_txnin_t *this, void *data)
 {
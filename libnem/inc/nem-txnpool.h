@@ -0,0 +1,123 @@
+#pragma once
+
+// NEM_TXNPOOL_BACKOFF_MIN_MS and NEM_TXNPOOL_BACKOFF_MAX_MS bound how long
+// a pool waits before redialing a member whose connection failed. The wait
+// doubles with each consecutive failure.
+static const int NEM_TXNPOOL_BACKOFF_MIN_MS = 100;
+static const int NEM_TXNPOOL_BACKOFF_MAX_MS = 30 * 1000;
+
+typedef struct NEM_txnpool_t NEM_txnpool_t;
+typedef struct NEM_txnpool_member_t NEM_txnpool_member_t;
+
+typedef enum {
+	// NEM_TXNPOOL_LEAST_LOADED sends each request to the connected member
+	// with the fewest outgoing transactions in flight.
+	NEM_TXNPOOL_LEAST_LOADED,
+
+	// NEM_TXNPOOL_P2C picks two connected members at random and sends the
+	// request to whichever of them has fewer in flight ("power of two
+	// choices"). It spreads load nearly as well as NEM_TXNPOOL_LEAST_LOADED
+	// without every request landing on the same momentarily-idle member.
+	NEM_TXNPOOL_P2C,
+}
+NEM_txnpool_policy_t;
+
+// NEM_txnpool_opts_t configures a NEM_txnpool_t. Zero values pick the
+// defaults.
+typedef struct {
+	// endpoints is the number of endpoints in the set, and conns the number
+	// of connections kept open to each of them (at least one).
+	size_t endpoints;
+	size_t conns;
+
+	NEM_txnpool_policy_t policy;
+
+	int backoff_min_ms;
+	int backoff_max_ms;
+
+	// mux handles requests the endpoints send back over the pool's
+	// connections. Without one they're all answered with "no handler".
+	NEM_svcmux_t *mux;
+}
+NEM_txnpool_opts_t;
+
+// NEM_txnpool_dial_ca is passed to a pool's dial thunk each time a member
+// needs a connection. The thunk must eventually invoke on_stream with a
+// NEM_dial_ca, so it can be handed straight to NEM_dial_unix and friends.
+typedef struct {
+	NEM_txnpool_t *pool;
+	size_t         endpoint;
+	NEM_thunk1_t  *on_stream;
+}
+NEM_txnpool_dial_ca;
+
+// NEM_txnpool_t spreads outgoing requests over a set of NEM_txnmgr_t's
+// connected to replicas of the same service, so that one busy connection
+// doesn't hold up everything queued behind it. Each endpoint gets conns
+// members; all of them are dialed as soon as the pool is set up, and a
+// member whose connection fails (or never comes up) is redialed after an
+// exponential backoff. Requests only ever go to connected members.
+struct NEM_txnpool_t {
+	NEM_kq_t              *kq;
+	NEM_thunk_t           *dial;
+	NEM_txnpool_policy_t   policy;
+	NEM_svcmux_t          *mux;
+	NEM_svcmux_t           mux_empty;
+	NEM_txnpool_member_t **members;
+	size_t                 members_len;
+	int                    backoff_min_ms;
+	int                    backoff_max_ms;
+	uint64_t               rand;
+	size_t                 next;
+	NEM_thunk1_t          *on_ready;
+	bool                   freeing;
+
+	// NB: up is the number of members currently connected. dials counts
+	// every connection attempt and failures the attempts that failed plus
+	// the connections that dropped afterwards.
+	size_t                 up;
+	uint64_t               dials;
+	uint64_t               failures;
+};
+
+// NEM_txnpool_init sets up the pool and starts dialing every member. The
+// pool owns dial, which is invoked with a NEM_txnpool_dial_ca.
+void NEM_txnpool_init(
+	NEM_txnpool_t            *this,
+	NEM_kq_t                 *kq,
+	const NEM_txnpool_opts_t *opts,
+	NEM_thunk_t              *dial
+);
+
+// NEM_txnpool_free closes every member's connection, cancelling whatever's
+// still in flight on them. Dials that haven't finished yet are left to
+// discard their streams when they do. Requests made from the cancelled
+// transactions' callbacks fail immediately as if no connections were up.
+void NEM_txnpool_free(NEM_txnpool_t *this);
+
+// NEM_txnpool_on_ready invokes the thunk once at least one member is
+// connected (right away if one already is). It's passed a NEM_txn_ca with
+// only mgr set.
+void NEM_txnpool_on_ready(NEM_txnpool_t *this, NEM_thunk1_t *thunk);
+
+// NEM_txnpool_pick returns the connected member the next request should go
+// to, or NULL if none are connected.
+NEM_txnmgr_t* NEM_txnpool_pick(NEM_txnpool_t *this);
+
+// NEM_txnpool_req is NEM_txnmgr_req against the member picked by
+// NEM_txnpool_pick. If no member is connected the thunk is invoked (and
+// freed) straight away with done and an error set, and NULL is returned.
+NEM_txnout_t* NEM_txnpool_req(
+	NEM_txnpool_t *this,
+	NEM_txnin_t   *parent,
+	NEM_thunk_t   *thunk
+);
+
+// NEM_txnpool_req1 is NEM_txnmgr_req1 against the member picked by
+// NEM_txnpool_pick. The message is freed if no member is connected.
+void NEM_txnpool_req1(
+	NEM_txnpool_t *this,
+	NEM_txnin_t   *parent,
+	NEM_msg_t     *msg,
+	NEM_thunk_t   *thunk
+);
@@ -0,0 +1,80 @@
+#pragma once
+
+#if defined(__linux__)
+
+// NEM_uring_t is an io_uring shared by every NEM_fd_t on a single kq. It's
+// created the first time one of them submits I/O, and freed by NEM_kq_free.
+// The kq watches the ring's fd, so completions are harvested in batches as
+// part of the normal eventloop; anything submitted by the completion
+// callbacks is flushed to the kernel with a single io_uring_enter(2) once
+// the batch is done.
+typedef struct NEM_uring_t NEM_uring_t;
+
+// NEM_uring_fn is invoked with the result of a completed operation: the
+// number of bytes transferred or a negative errno.
+typedef void (*NEM_uring_fn)(void *arg, int res);
+
+// NEM_uring_supported returns true if the running kernel supports
+// everything NEM_uring_t needs. The result is cached.
+bool NEM_uring_supported();
+
+// NEM_uring_get returns the ring for kq, creating it if needed.
+NEM_err_t NEM_uring_get(int kq, NEM_uring_t **out);
+
+// NEM_uring_release frees the ring for kq, if there is one. Outstanding
+// operations are dropped without invoking their callbacks.
+void NEM_uring_release(int kq);
+
+// NEM_uring_read and NEM_uring_write submit an operation on fd and set out
+// to a handle that can be passed to NEM_uring_cancel. Small reads go through
+// one of the ring's registered buffers and are copied into buf when they
+// complete. Writes to sockets are sent with MSG_NOSIGNAL. If the kernel is
+// too backed up on completions to take the operation, an error is returned
+// and fn is never invoked.
+NEM_err_t NEM_uring_read(
+	NEM_uring_t *this,
+	int          fd,
+	void        *buf,
+	size_t       len,
+	NEM_uring_fn fn,
+	void        *arg,
+	uint64_t    *out
+);
+NEM_err_t NEM_uring_write(
+	NEM_uring_t *this,
+	int          fd,
+	const void  *buf,
+	size_t       len,
+	bool         sock,
+	NEM_uring_fn fn,
+	void        *arg,
+	uint64_t    *out
+);
+
+// NEM_uring_writev and NEM_uring_sendmsg are NEM_uring_write for a list of
+// buffers, to a file or a socket respectively. The iovec array (and msghdr)
+// must stay valid until the operation completes or is cancelled.
+NEM_err_t NEM_uring_writev(
+	NEM_uring_t        *this,
+	int                 fd,
+	const struct iovec *iov,
+	size_t              iovcnt,
+	NEM_uring_fn        fn,
+	void               *arg,
+	uint64_t           *out
+);
+NEM_err_t NEM_uring_sendmsg(
+	NEM_uring_t         *this,
+	int                  fd,
+	const struct msghdr *msg,
+	NEM_uring_fn         fn,
+	void                *arg,
+	uint64_t            *out
+);
+
+// NEM_uring_cancel synchronously cancels an operation. Its callback is
+// never invoked, and once this returns the kernel is done with its buffer.
+// Cancelling an operation that's already completed is a no-op.
+void NEM_uring_cancel(NEM_uring_t *this, uint64_t op);
+
+#endif
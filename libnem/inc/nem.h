@@ -1,11 +1,10 @@
 #pragma once
 #include <sys/types.h>
-#include <sys/event.h>
-#include <sys/tree.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,6 +13,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
@@ -21,11 +21,26 @@
 #include <errno.h>
 #include <libgen.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__linux__)
+#include <bsd/sys/tree.h>
+#include <bsd/string.h>
+#else
+#include <sys/tree.h>
+#endif
+
+#if !defined(MAP_NOCORE)
+#define MAP_NOCORE 0
+#endif
 
 #define NEM_ARRSIZE(x) (sizeof(x)/sizeof((x)[0]))
 #define NEM_MSIZE(t, f) (sizeof(((t*)0)->f))
 #define NEM_ALIGN _Alignas(void*)
 
+#include "nem-poller.h"
 #include "nem-error.h"
 #include "nem-thunk.h"
 #include "nem-semver.h"
@@ -33,15 +48,20 @@
 #include "nem-rootcert.h"
 #include "nem-marshal.h"
 #include "nem-stream.h"
+#include "nem-uring.h"
 #include "nem-fd.h"
 #include "nem-file.h"
 #include "nem-list.h"
-#include "nem-dial.h"
 #include "nem-msghdr.h"
 #include "nem-msg.h"
 #include "nem-chan.h"
 #include "nem-kq.h"
+#include "nem-loopback.h"
+#include "nem-shmring.h"
+#include "nem-pool.h"
+#include "nem-dial.h"
 #include "nem-svcmux.h"
 #include "nem-txnmgr.h"
+#include "nem-txnpool.h"
 #include "nem-child.h"
 #include "nem-app.h"
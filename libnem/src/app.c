@@ -1,5 +1,13 @@
 #include "nem.h"
 
+#if defined(__FreeBSD__)
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#endif
+
+static const uint64_t NEM_APP_SHUTDOWN_POLL_MS = 100;
+static const uint64_t NEM_APP_SHUTDOWN_TIMEOUT_MS = 5 * 1000;
+
 void
 NEM_app_init(NEM_app_t *this)
 {
@@ -43,6 +51,132 @@ void NEM_app_add_comps(
 	}
 }
 
+void
+NEM_app_set_workers(NEM_app_t *this, size_t n)
+{
+	if (this->kq.running || 0 != this->workers_len) {
+		NEM_panicf("NEM_app_set_workers: already configured");
+	}
+
+	this->workers_len = n;
+	this->workers = (0 == n) ? NULL : NEM_malloc(sizeof(NEM_app_worker_t) * n);
+	for (size_t i = 0; i < n; i += 1) {
+		this->workers[i].app = this;
+		this->workers[i].idx = i;
+	}
+}
+
+static void
+NEM_app_setup_loop(NEM_app_t *this, NEM_kq_t *kq)
+{
+	for (size_t i = 0; i < this->comps_len; i += 1) {
+		const NEM_app_comp_t *comp = this->comps[i].comp;
+		if (NULL == comp->setup_loop) {
+			continue;
+		}
+
+		NEM_err_t err = comp->setup_loop(this, kq);
+		if (!NEM_err_ok(err)) {
+			NEM_panicf(
+				"NEM_app_main: %s: setup_loop: %s",
+				comp->name,
+				NEM_err_string(err)
+			);
+		}
+	}
+}
+
+static void
+NEM_app_teardown_loop(NEM_app_t *this, NEM_kq_t *kq)
+{
+	for (size_t i = this->comps_len; i > 0; i -= 1) {
+		const NEM_app_comp_t *comp = this->comps[i - 1].comp;
+		if (NULL != comp->teardown_loop) {
+			comp->teardown_loop(this, kq);
+		}
+	}
+}
+
+static void
+NEM_app_worker_pin(NEM_app_worker_t *this)
+{
+	// NB: Pinning is best-effort; the worker still runs if it fails.
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (0 >= ncpu) {
+		return;
+	}
+
+	int cpu = this->idx % ncpu;
+	int ec = 0;
+
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	ec = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(__FreeBSD__)
+	cpuset_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	ec = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+
+	if (0 != ec) {
+		fprintf(
+			stderr,
+			"NEM_app: worker %zu: can't pin to cpu %d: %s\n",
+			this->idx,
+			cpu,
+			strerror(ec)
+		);
+	}
+}
+
+static void
+NEM_app_worker_on_stop(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_app_worker_t *this = NEM_thunk1_ptr(thunk);
+	NEM_kq_stop(&this->kq);
+}
+
+static void*
+NEM_app_worker_run(void *varg)
+{
+	NEM_app_worker_t *this = varg;
+	NEM_app_worker_pin(this);
+
+	NEM_app_setup_loop(this->app, &this->kq);
+	NEM_panic_if_err(NEM_kq_run(&this->kq));
+	NEM_app_teardown_loop(this->app, &this->kq);
+
+	return NULL;
+}
+
+static void
+NEM_app_worker_start(NEM_app_worker_t *this)
+{
+	NEM_panic_if_err(NEM_kq_init_root(&this->kq));
+
+	int ec = pthread_create(&this->thread, NULL, &NEM_app_worker_run, this);
+	if (0 != ec) {
+		NEM_panicf("NEM_app_main: pthread_create: %s", strerror(ec));
+	}
+}
+
+static void
+NEM_app_worker_stop(NEM_app_worker_t *this)
+{
+	// NB: NEM_kq_stop isn't thread-safe, so have the worker stop itself.
+	NEM_kq_post(&this->kq, NEM_thunk1_new_ptr(&NEM_app_worker_on_stop, this));
+
+	int ec = pthread_join(this->thread, NULL);
+	if (0 != ec) {
+		NEM_panicf("NEM_app_main: pthread_join: %s", strerror(ec));
+	}
+
+	NEM_kq_free(&this->kq);
+}
+
 NEM_err_t
 NEM_app_main(NEM_app_t *this, int argc, char *argv[])
 {
@@ -50,7 +184,9 @@ NEM_app_main(NEM_app_t *this, int argc, char *argv[])
 	size_t i = 0;
 
 	for (size_t i = 0; i < this->comps_len; i += 1) {
-		err = this->comps[i].comp->setup(this, argc, argv);
+		if (NULL != this->comps[i].comp->setup) {
+			err = this->comps[i].comp->setup(this, argc, argv);
+		}
 		if (!NEM_err_ok(err)) {
 			// XXX: Reallllly want some logging bits here.
 			break;
@@ -71,8 +207,24 @@ NEM_app_main(NEM_app_t *this, int argc, char *argv[])
 	}
 
 	this->running = true;
+	NEM_app_setup_loop(this, &this->kq);
+	for (size_t i = 0; i < this->workers_len; i += 1) {
+		NEM_app_worker_start(&this->workers[i]);
+	}
+
 	NEM_panic_if_err(NEM_kq_run(&this->kq));
 
+	// NB: The workers are stopped once the main loop is done shutting
+	// down, but before any component is torn down.
+	for (size_t i = 0; i < this->workers_len; i += 1) {
+		NEM_app_worker_stop(&this->workers[i]);
+	}
+	free(this->workers);
+	this->workers = NULL;
+	this->workers_len = 0;
+
+	NEM_app_teardown_loop(this, &this->kq);
+
 	for (size_t i = this->comps_len; i > 0; i -= 1) {
 		if (NULL != this->comps[i - 1].comp->teardown) {
 			this->comps[i - 1].comp->teardown(this);
@@ -110,8 +262,10 @@ NEM_app_shutdown_step(NEM_thunk1_t *thunk, void *varg)
 			this->comps_running -= 1;
 		}
 	}
-	if (0 != this->comps_running) {
-		NEM_kq_after(&this->kq, 100, NEM_thunk1_new_ptr(
+	// NB: Components that haven't finished by the deadline get torn down
+	// regardless.
+	if (0 != this->comps_running && NEM_kq_now(&this->kq) < this->shutdown_at) {
+		NEM_kq_after(&this->kq, NEM_APP_SHUTDOWN_POLL_MS, NEM_thunk1_new_ptr(
 			&NEM_app_shutdown_step,
 			this
 		));
@@ -121,13 +275,6 @@ NEM_app_shutdown_step(NEM_thunk1_t *thunk, void *varg)
 	}
 }
 
-static void
-NEM_app_shutdown_now(NEM_thunk1_t *thunk, void *varg)
-{
-	NEM_app_t *this = NEM_thunk1_ptr(thunk);
-	NEM_kq_stop(&this->kq);
-}
-
 void
 NEM_app_shutdown(NEM_app_t *this)
 {
@@ -136,17 +283,10 @@ NEM_app_shutdown(NEM_app_t *this)
 	}
 
 	this->running = false;
+	this->shutdown_at = NEM_kq_now(&this->kq)
+		+ NEM_APP_SHUTDOWN_TIMEOUT_MS * NEM_KQ_NSEC_PER_MSEC;
 
 	// XXX: This is kinda gross.
 	NEM_thunk1_t *dummy = NEM_thunk1_new_ptr(&NEM_app_shutdown_step, this);
 	NEM_thunk1_invoke(&dummy, NULL);
-
-	NEM_kq_after(
-		&this->kq,
-		5000,
-		NEM_thunk1_new_ptr(
-			&NEM_app_shutdown_now,
-			this
-		)
-	);
 }
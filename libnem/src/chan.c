@@ -13,6 +13,11 @@ NEM_chan_shutdown(NEM_chan_t *this, NEM_err_t err)
 	this->err = err;
 	NEM_stream_close(this->stream);
 
+	if (-1 != this->wool) {
+		close(this->wool);
+		this->wool = -1;
+	}
+
 	while (NULL != this->wqueue) {
 		NEM_chan_ca ca = {
 			.err  = err,
@@ -68,10 +73,9 @@ NEM_chan_state_string(NEM_chan_state_t st)
 static void NEM_chan_read(NEM_chan_t *this);
 
 static void
-NEM_chan_on_read(NEM_thunk1_t *thunk, void *varg)
+NEM_chan_on_read(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
 {
-	NEM_stream_ca *ca = varg;
-	NEM_chan_t *this = NEM_thunk1_ptr(thunk);
+	NEM_chan_t *this = cont->ctx;
 
 	if (!NEM_err_ok(ca->err)) {
 		NEM_chan_shutdown(this, ca->err);
@@ -108,22 +112,62 @@ NEM_chan_dispatch(NEM_chan_t *this)
 	return NEM_chan_read(this);
 }
 
+// NB: NEM_chan_read_frame starts reading a frame once its fixed header is in
+// this->pmsg. If the stream still has the fixed header buffered (see
+// NEM_stream_peek) it's read again along with the rest of the frame, straight
+// into the message.
 static void
-NEM_chan_read(NEM_chan_t *this)
+NEM_chan_read_frame(NEM_chan_t *this, bool whole)
+{
+	NEM_err_t err = NEM_pmsg_validate(&this->pmsg);
+	if (!NEM_err_ok(err)) {
+		return NEM_chan_shutdown(this, err);
+	}
+
+	// NB: An out-of-line body arrives with the fd; only the header is on
+	// the stream.
+	size_t body_len = (this->pmsg.flags & NEM_PMSGFLAG_OOL)
+		? 0
+		: this->pmsg.body_len;
+
+	this->rstate = NEM_CHAN_STATE_FD;
+	this->rmsg = NEM_msg_new(this->pmsg.header_len, body_len);
+
+	this->rmsg->packed = this->pmsg;
+	bzero(&this->pmsg, sizeof(this->pmsg));
+
+	size_t len = this->rmsg->packed.header_len + body_len;
+	void *buf = this->rmsg->appended;
+	if (whole) {
+		len += sizeof(this->rmsg->packed);
+		buf = &this->rmsg->packed;
+	}
+
+	err = NEM_stream_read_cont(this->stream, buf, len, &this->rcont);
+	if (!NEM_err_ok(err)) {
+		return NEM_chan_shutdown(this, err);
+	}
+}
+
+static void
+NEM_chan_read_step(NEM_chan_t *this)
 {
 	NEM_err_t err;
+	const void *peek;
 
 	switch (this->rstate) {
 		case NEM_CHAN_STATE_MAGIC:
+			if (NEM_stream_peek(this->stream, &peek) >= sizeof(this->pmsg)) {
+				memcpy(&this->pmsg, peek, sizeof(this->pmsg));
+				return NEM_chan_read_frame(this, true);
+			}
+
 			this->rstate = NEM_CHAN_STATE_BODY;
-			err = NEM_stream_read(
+			err = NEM_stream_read_cont(
 				this->stream,
 				&this->pmsg,
 				sizeof(this->pmsg),
-				NEM_thunk1_new_ptr(
-					&NEM_chan_on_read,
-					this
-				)
+				&this->rcont
 			);
 			if (!NEM_err_ok(err)) {
 				return NEM_chan_shutdown(this, err);
@@ -135,42 +179,33 @@ NEM_chan_read(NEM_chan_t *this)
 			NEM_panic("NEM_chan_read: invalid rstate");
 
 		case NEM_CHAN_STATE_BODY:
-			err = NEM_pmsg_validate(&this->pmsg);
-			if (!NEM_err_ok(err)) {
-				return NEM_chan_shutdown(this, err);
-			}
-
-			this->rstate = NEM_CHAN_STATE_FD;
-			this->rmsg = NEM_msg_new(
-				this->pmsg.header_len,
-				this->pmsg.body_len
-			);
-
-			this->rmsg->packed = this->pmsg;
-			bzero(&this->pmsg, sizeof(this->pmsg));
-
-			err = NEM_stream_read(
-				this->stream,
-				this->rmsg->appended,
-				this->rmsg->packed.header_len + this->rmsg->packed.body_len,
-				NEM_thunk1_new_ptr(
-					&NEM_chan_on_read,
-					this
-				)
-			);
-			if (!NEM_err_ok(err)) {
-				return NEM_chan_shutdown(this, err);
-			}
-			break;
+			return NEM_chan_read_frame(this, false);
 
 		case NEM_CHAN_STATE_FD:
-			if ((this->rmsg->packed.flags & NEM_PMSGFLAG_FD)) {
+			if ((this->rmsg->packed.flags & NEM_PMSGFLAG_FDS)) {
+				int fds[NEM_FD_FDS_MAX];
+				size_t len = NEM_ARRSIZE(fds);
+				err = NEM_stream_read_fds(this->stream, fds, &len);
+				if (!NEM_err_ok(err)) {
+					return NEM_chan_shutdown(this, err);
+				}
+				err = NEM_msg_set_fds(this->rmsg, fds, len);
+				if (!NEM_err_ok(err)) {
+					for (size_t i = 0; i < len; i += 1) {
+						close(fds[i]);
+					}
+					return NEM_chan_shutdown(this, err);
+				}
+			}
+			else if ((this->rmsg->packed.flags & NEM_PMSGFLAG_FD)) {
 				int fd;
 				err = NEM_stream_read_fd(this->stream, &fd);
 				if (!NEM_err_ok(err)) {
 					return NEM_chan_shutdown(this, err);
 				}
-				err = NEM_msg_set_fd(this->rmsg, fd);
+				err = (this->rmsg->packed.flags & NEM_PMSGFLAG_OOL)
+					? NEM_msg_map_body(this->rmsg, fd)
+					: NEM_msg_set_fd(this->rmsg, fd);
 				if (!NEM_err_ok(err)) {
 					return NEM_chan_shutdown(this, err);
 				}
@@ -183,134 +218,230 @@ NEM_chan_read(NEM_chan_t *this)
 	}
 }
 
+static void
+NEM_chan_read(NEM_chan_t *this)
+{
+	if (this->rbusy) {
+		this->ragain = true;
+		return;
+	}
+
+	this->rbusy = true;
+	do {
+		this->ragain = false;
+		NEM_chan_read_step(this);
+	}
+	while (this->ragain && NEM_err_ok(this->err));
+	this->rbusy = false;
+}
+
 static void NEM_chan_write(NEM_chan_t *this);
 
 static void
-NEM_chan_on_write(NEM_thunk1_t *thunk, void *varg)
+NEM_chan_on_write(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
 {
-	NEM_stream_ca *ca = varg;
-	NEM_chan_t *this = NEM_thunk1_ptr(thunk);
+	NEM_chan_t *this = cont->ctx;
 
 	if (!NEM_err_ok(ca->err)) {
 		NEM_chan_shutdown(this, ca->err);
 		return;
 	}
 
-	NEM_chan_write(this);
+	NEM_msglist_t *last = this->wqueue;
+	for (size_t i = 1; i < this->wbatch; i += 1) {
+		last = last->next;
+	}
+
+	// NB: Only the last message of a batch can have a descriptor, and it
+	// follows the rest of its message. NEM_stream_write_fd is synchronous,
+	// so once it's done the whole batch is on the wire.
+	if (-1 != this->wool) {
+		NEM_err_t err = NEM_stream_write_fd(this->stream, this->wool);
+		close(this->wool);
+		this->wool = -1;
+		if (!NEM_err_ok(err)) {
+			return NEM_chan_shutdown(this, err);
+		}
+	}
+	else if ((last->msg->flags & NEM_MSGFLAG_HAS_FD)) {
+		NEM_err_t err = NEM_stream_write_fd(this->stream, last->msg->fd);
+		if (!NEM_err_ok(err)) {
+			return NEM_chan_shutdown(this, err);
+		}
+	}
+	else if ((last->msg->flags & NEM_MSGFLAG_HAS_FDS)) {
+		NEM_err_t err = NEM_stream_write_fds(
+			this->stream,
+			last->msg->fds,
+			last->msg->fds_len
+		);
+		if (!NEM_err_ok(err)) {
+			return NEM_chan_shutdown(this, err);
+		}
+	}
+
+	// NB: Unhook the batch before running any completions, which are free
+	// to send more messages (those just get queued until this batch has
+	// been dealt with) or close the channel.
+	NEM_msglist_t *batch = this->wqueue;
+	this->wqueue = last->next;
+	if (NULL == this->wqueue) {
+		this->wlast = NULL;
+	}
+	last->next = NULL;
+	this->wbatch = 0;
+	this->wstate = NEM_CHAN_STATE_FD;
+
+	while (NULL != batch) {
+		NEM_msglist_t *next = batch->next;
+		NEM_chan_ca ca = {
+			.err  = NEM_err_none,
+			.chan = this,
+			.msg  = batch->msg,
+		};
+		if (NULL != batch->thunk) {
+			NEM_thunk1_invoke(&batch->thunk, &ca);
+		}
+		// NB: Let the thunk take ownership of the message.
+		NEM_msg_free(ca.msg);
+
+		free(batch);
+		batch = next;
+	}
+
+	this->wstate = NEM_CHAN_STATE_DISPATCH;
+	if (NEM_err_ok(this->err) && NULL != this->wqueue) {
+		NEM_chan_write(this);
+	}
+}
+
+// NB: NEM_chan_frame points iov at the pieces of msg's frame and returns how
+// many iovecs that took (at most three).
+static size_t
+NEM_chan_frame(NEM_msg_t *msg, struct iovec *iov)
+{
+	size_t cnt = 1;
+	size_t len = sizeof(msg->packed);
+	bool hdr_done = false;
+	bool body_done = false;
+
+	if ((msg->flags & NEM_MSGFLAG_HEADER_INLINE)) {
+		len += msg->packed.header_len;
+		hdr_done = true;
+
+		if ((msg->flags & NEM_MSGFLAG_BODY_INLINE)) {
+			len += msg->packed.body_len;
+			body_done = true;
+		}
+	}
+
+	iov[0].iov_base = &msg->packed;
+	iov[0].iov_len = len;
+
+	if (!hdr_done && 0 < msg->packed.header_len) {
+		iov[cnt].iov_base = msg->header;
+		iov[cnt].iov_len = msg->packed.header_len;
+		cnt += 1;
+	}
+	if (!body_done && 0 < msg->packed.body_len) {
+		iov[cnt].iov_base = msg->body;
+		iov[cnt].iov_len = msg->packed.body_len;
+		cnt += 1;
+	}
+
+	return cnt;
 }
 
-static void
-NEM_chan_write(NEM_chan_t *this)
+// NB: NEM_chan_frame_ool is NEM_chan_frame for a message whose body is
+// going out-of-line. The fixed header is sent from a copy with the flags
+// fixed up, so the message itself isn't touched.
+static size_t
+NEM_chan_frame_ool(NEM_chan_t *this, NEM_msg_t *msg, struct iovec *iov)
 {
-	size_t len;
-	NEM_err_t err;
-	NEM_msg_t *msg = this->wqueue->msg;
+	size_t cnt = 1;
 
-	switch (this->wstate) {
-		case NEM_CHAN_STATE_MAGIC:
-			this->wstate = NEM_CHAN_STATE_HEADERS;
-			len = sizeof(msg->packed);
-			if ((msg->flags & NEM_MSGFLAG_HEADER_INLINE)) {
-				len += msg->packed.header_len;
-				this->wstate = NEM_CHAN_STATE_BODY;
-
-				if ((msg->flags & NEM_MSGFLAG_BODY_INLINE)) {
-					len += msg->packed.body_len;
-					this->wstate = NEM_CHAN_STATE_FD;
-				}
-			}
+	this->wpmsg = msg->packed;
+	this->wpmsg.flags |= NEM_PMSGFLAG_FD | NEM_PMSGFLAG_OOL;
+	iov[0].iov_base = &this->wpmsg;
+	iov[0].iov_len = sizeof(this->wpmsg);
 
-			err = NEM_stream_write(
-				this->stream,
-				&msg->packed,
-				len,
-				NEM_thunk1_new_ptr(
-					&NEM_chan_on_write,
-					this
-				)
-			);
-			if (!NEM_err_ok(err)) {
-				return NEM_chan_shutdown(this, err);
-			}
-			return;
+	if (0 < msg->packed.header_len) {
+		iov[cnt].iov_base = msg->header;
+		iov[cnt].iov_len = msg->packed.header_len;
+		cnt += 1;
+	}
 
-		case NEM_CHAN_STATE_HEADERS:
-			this->wstate = NEM_CHAN_STATE_BODY;
-			len = msg->packed.header_len;
-			if (0 < len) {
-				err = NEM_stream_write(
-					this->stream,
-					msg->header,
-					len,
-					NEM_thunk1_new_ptr(
-						&NEM_chan_on_write,
-						this
-					)
-				);
-				if (!NEM_err_ok(err)) {
-					return NEM_chan_shutdown(this, err);
-				}
-				return;
+	return cnt;
+}
+
+// NB: NEM_chan_ool returns whether msg's body should go out-of-line.
+static bool
+NEM_chan_ool(const NEM_chan_t *this, const NEM_msg_t *msg)
+{
+	bool has_fd = (msg->flags & (NEM_MSGFLAG_HAS_FD | NEM_MSGFLAG_HAS_FDS));
+	return !has_fd && msg->packed.body_len >= this->ool_min;
+}
+
+// NB: NEM_chan_write gathers as much of the queue as fits in wiov and the
+// byte budget into one vectored write. The first message always goes,
+// however big it is.
+static void
+NEM_chan_write(NEM_chan_t *this)
+{
+	size_t iovcnt = 0;
+	size_t bytes = 0;
+	this->wbatch = 0;
+
+	for (NEM_msglist_t *it = this->wqueue; NULL != it; it = it->next) {
+		NEM_msg_t *msg = it->msg;
+		bool has_fd = (msg->flags & (NEM_MSGFLAG_HAS_FD | NEM_MSGFLAG_HAS_FDS));
+		bool ool = NEM_chan_ool(this, msg);
+		size_t len = sizeof(msg->packed)
+			+ msg->packed.header_len
+			+ (ool ? 0 : msg->packed.body_len);
+
+		if (0 < this->wbatch) {
+			if (iovcnt + 3 > NEM_CHAN_WRITE_IOV) {
+				break;
 			}
-			// Fallthrough
-		
-		case NEM_CHAN_STATE_BODY:
-			this->wstate = NEM_CHAN_STATE_FD;
-			len = msg->packed.body_len;
-			if (0 < len) {
-				err = NEM_stream_write(
-					this->stream,
-					msg->body,
-					len,
-					NEM_thunk1_new_ptr(
-						&NEM_chan_on_write,
-						this
-					)
-				);
-				if (!NEM_err_ok(err)) {
-					return NEM_chan_shutdown(this, err);
-				}
-				return;
+			if (bytes + len > NEM_CHAN_WRITE_BUDGET) {
+				break;
 			}
-			// Fallthrough
+		}
 
-		case NEM_CHAN_STATE_FD: {
-			this->wstate = NEM_CHAN_STATE_DISPATCH;
-			if ((msg->flags & NEM_MSGFLAG_HAS_FD)) {
-				err = NEM_stream_write_fd(this->stream, msg->fd);
-				if (!NEM_err_ok(err)) {
-					return NEM_chan_shutdown(this, err);
-				}
+		// NB: If the body can't be moved out-of-line for whatever reason
+		// it just goes inline, unless it's too big to.
+		if (ool) {
+			NEM_err_t err = NEM_msg_seal_body(msg, &this->wool);
+			if (NEM_err_ok(err)) {
+				iovcnt += NEM_chan_frame_ool(this, msg, &this->wiov[iovcnt]);
+				bytes += len;
+				this->wbatch += 1;
+				break;
 			}
-
-			// Pop off the just-written message. NEM_stream_write_fd is 
-			// synchronous, so this should be fine.
-			NEM_msglist_t *next = this->wqueue->next;
-			NEM_chan_ca ca = {
-				.err  = NEM_err_none,
-				.chan = this,
-				.msg  = this->wqueue->msg,
-			};
-			if (NULL != this->wqueue->thunk) {
-				NEM_thunk1_invoke(&this->wqueue->thunk, &ca);
+			if (msg->packed.body_len > NEM_PMSG_BODYMAX) {
+				return NEM_chan_shutdown(this, err);
 			}
-			// NB: Let the thunk take ownership of the message.
-			NEM_msg_free(ca.msg);
+		}
 
-			free(this->wqueue);
-			this->wqueue = next;
-			if (NULL == next) {
-				this->wlast = NULL;
-			}
-			
-			// Fallthrough
+		iovcnt += NEM_chan_frame(msg, &this->wiov[iovcnt]);
+		bytes += len;
+		this->wbatch += 1;
+
+		if (has_fd) {
+			break;
 		}
+	}
 
-		case NEM_CHAN_STATE_DISPATCH:
-			if (NULL != this->wqueue) {
-				this->wstate = NEM_CHAN_STATE_MAGIC;
-				return NEM_chan_write(this);
-			}
+	this->wstate = NEM_CHAN_STATE_BODY;
+	NEM_err_t err = NEM_stream_writev_cont(
+		this->stream,
+		this->wiov,
+		iovcnt,
+		&this->wcont
+	);
+	if (!NEM_err_ok(err)) {
+		return NEM_chan_shutdown(this, err);
 	}
 }
 
@@ -322,6 +453,10 @@ NEM_chan_init(NEM_chan_t *this, NEM_stream_t stream)
 	this->rstate = NEM_CHAN_STATE_MAGIC;
 	this->wstate = NEM_CHAN_STATE_DISPATCH;
 	this->err = NEM_err_none;
+	this->wool = -1;
+	this->ool_min = NEM_CHAN_OOL_OFF;
+	NEM_stream_cont_init(&this->rcont, &NEM_chan_on_read, this);
+	NEM_stream_cont_init(&this->wcont, &NEM_chan_on_write, this);
 
 	NEM_chan_read(this);
 }
@@ -343,9 +478,18 @@ NEM_chan_free(NEM_chan_t *this)
 void
 NEM_chan_send(NEM_chan_t *this, NEM_msg_t *msg, NEM_thunk1_t *cb)
 {
-	if (!NEM_err_ok(this->err)) {
+	NEM_err_t err = this->err;
+	if (
+		NEM_err_ok(err)
+		&& msg->packed.body_len > NEM_PMSG_BODYMAX
+		&& !NEM_chan_ool(this, msg)
+	) {
+		err = NEM_err_static("NEM_chan_send: body too long to send inline");
+	}
+
+	if (!NEM_err_ok(err)) {
 		NEM_chan_ca ca = {
-			.err  = this->err,
+			.err  = err,
 			.chan = this,
 			.msg  = msg,
 		};
@@ -361,16 +505,17 @@ NEM_chan_send(NEM_chan_t *this, NEM_msg_t *msg, NEM_thunk1_t *cb)
 	list->thunk = cb;
 
 	if (NULL == this->wqueue) {
-		if (NEM_CHAN_STATE_DISPATCH != this->wstate) {
-			NEM_panic("NEM_chan_send: state machine corrupt");
-		}
 		this->wqueue = list;
-		this->wlast = list;
-		NEM_chan_write(this);
 	}
 	else {
 		this->wlast->next = list;
-		this->wlast = list;
+	}
+	this->wlast = list;
+
+	// NB: Anything queued while a write is in flight (or its completions
+	// are running) goes out in the next batch.
+	if (NEM_CHAN_STATE_DISPATCH == this->wstate) {
+		NEM_chan_write(this);
 	}
 }
 
@@ -390,6 +535,12 @@ NEM_chan_on_msg(NEM_chan_t *this, NEM_thunk_t *cb)
 	NEM_chan_dispatch(this);
 }
 
+void
+NEM_chan_set_ool_threshold(NEM_chan_t *this, size_t min)
+{
+	this->ool_min = (0 == min) ? NEM_CHAN_OOL_THRESHOLD : min;
+}
+
 void
 NEM_chan_on_close(NEM_chan_t *this, NEM_thunk1_t *cb)
 {
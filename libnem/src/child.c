@@ -1,5 +1,11 @@
 #include "nem.h"
 
+#if defined(__linux__)
+// NB: fexecve works off an O_PATH fd on Linux, which is the closest thing
+// it has to O_EXEC.
+#define O_EXEC O_PATH
+#endif
+
 static void
 NEM_child_on_kevent(NEM_thunk_t *thunk, void *varg)
 {
@@ -12,7 +18,7 @@ NEM_child_on_kevent(NEM_thunk_t *thunk, void *varg)
 
 	this->state = CHILD_STOPPED;
 
-#if __FreeBSD__ >= 11
+#if defined(__linux__) || __FreeBSD__ >= 11
 	this->exitcode = kev->data;
 #else
 	// NB: https://svnweb.freebsd.org/base?view=revision&revision=285670
@@ -50,10 +56,20 @@ NEM_child_init(
 	}
 
 	this->state = CHILD_RUNNING;
-	NEM_fd_t fd_out;
 
-	NEM_err_t err = NEM_fd_init_unix(&this->fd, &fd_out, kq->kq);
+	int fds[2];
+	if (0 != socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+		NEM_err_t err = NEM_err_errno();
+		close(this->exe_fd);
+		this->exe_fd = 0;
+		return err;
+	}
+
+	// NB: The offer is made before the fork so it's already waiting on the
+	// socket when the child gets to NEM_kq_init.
+	NEM_err_t err = NEM_shmring_init_parent(&this->ring, kq->kq, fds[0]);
 	if (!NEM_err_ok(err)) {
+		close(fds[1]);
 		close(this->exe_fd);
 		this->exe_fd = 0;
 		return err;
@@ -69,7 +85,7 @@ NEM_child_init(
 		if (STDIN_FILENO != dup2(devnull, STDIN_FILENO)) {
 			NEM_panicf_errno("NEM_child_init: dup2");
 		}
-		if (NEM_KQ_PARENT_FILENO != dup2(fd_out.fd_in, NEM_KQ_PARENT_FILENO)) {
+		if (NEM_KQ_PARENT_FILENO != dup2(fds[1], NEM_KQ_PARENT_FILENO)) {
 			NEM_panicf_errno("NEM_child_init: dup2");
 		}
 		// NB: Inherit stdout/stderr for now. The caller can explicitly 
@@ -90,7 +106,7 @@ NEM_child_init(
 		fexecve(this->exe_fd, ca.args, ca.env);
 		NEM_panicf_errno("NEM_child_init: execve");
 	}
-	NEM_fd_free(&fd_out);
+	close(fds[1]);
 	if (NULL != preexec) {
 		NEM_thunk1_discard(&preexec);
 	}
@@ -109,7 +125,8 @@ NEM_child_init(
 	}
 
 	this->kq = kq->kq;
-	NEM_txnmgr_init(&this->txnmgr, NEM_fd_as_stream(&this->fd), kq);
+	NEM_txnmgr_init(&this->txnmgr, NEM_shmring_as_stream(&this->ring), kq);
+	NEM_chan_set_ool_threshold(&this->txnmgr.chan, 0);
 	NEM_txnmgr_on_close(&this->txnmgr, NEM_thunk1_new_ptr(
 		&NEM_child_on_txnmgr_close,
 		this
@@ -155,10 +172,11 @@ NEM_child_free(NEM_child_t *this)
 
 	NEM_child_stop(this);
 
-	NEM_fd_free(&this->fd);
+	NEM_shmring_free(&this->ring);
 	NEM_txnmgr_free(&this->txnmgr);
 
 	if (NULL != this->on_kevent) {
+		NEM_kq_forget(this->on_kevent);
 		NEM_thunk_free(this->on_kevent);
 	}
 	if (NULL != this->on_close) {
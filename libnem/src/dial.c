@@ -1,4 +1,51 @@
 #include "nem.h"
+#include <netdb.h>
+
+// NB: How long to wait before trying a unix socket again when the
+// listener's queue is full (Linux fails the connect with EAGAIN rather than
+// making it wait).
+static const int NEM_DIAL_RETRY_MS = 10;
+
+typedef struct {
+	struct sockaddr_storage addr;
+	socklen_t               len;
+}
+NEM_dial_addr_t;
+
+// NB: NEM_dial_t is the state of a single dial. addrs[next] is the next
+// address to try, and socks are the connections in flight. timer goes off
+// at whichever comes first of the deadline and next_at, when the next
+// attempt is due. All of the times are on the kq's clock.
+//
+// While a name is being resolved the dial can't be freed, since the pool
+// still has to complete the task; if it finishes (i.e. times out) in the
+// meantime it's marked done and the completion frees it.
+typedef struct {
+	NEM_timer1_t    timer;
+	NEM_kq_t       *kq;
+	NEM_thunk1_t   *on_stream;
+	NEM_thunk_t    *on_kevent;
+	int             stagger_ms;
+
+	uint64_t        begun_at;
+	uint64_t        resolved_at;
+	uint64_t        deadline;
+	uint64_t        next_at;
+
+	NEM_dial_addr_t addrs[NEM_DIAL_ADDRS_MAX];
+	size_t          addrs_len;
+	size_t          next;
+	int             socks[NEM_DIAL_ADDRS_MAX];
+	size_t          socks_len;
+	size_t          attempts;
+	NEM_err_t       err;
+
+	NEM_pool_t     *pool;
+	uint64_t        task;
+	bool            resolving;
+	bool            done;
+}
+NEM_dial_t;
 
 static void
 NEM_dial_fd_free(NEM_thunk1_t *thunk, void *varg)
@@ -8,155 +55,512 @@ NEM_dial_fd_free(NEM_thunk1_t *thunk, void *varg)
 	free(fd);
 }
 
-void
-NEM_dial_unix(int kq, const char *path, NEM_thunk1_t *on_stream)
+static void
+NEM_dial_arm(NEM_dial_t *this)
 {
-	NEM_err_t err = NEM_err_none;
-	NEM_dial_ca ca = {};
-	int fd = 0;
+	uint64_t at = this->deadline;
+	if (this->next < this->addrs_len && this->next_at < at) {
+		at = this->next_at;
+	}
+
+	NEM_kq_timer1_set(this->kq, &this->timer, at);
+}
 
-	fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if (-1 == fd) {
-		err = NEM_err_errno();
-		goto done;
+static void
+NEM_dial_drop_sock(NEM_dial_t *this, size_t i)
+{
+	int fd = this->socks[i];
+
+	// NB: Explicitly deregister for the epoll emulation's sake (see
+	// NEM_fd_shutdown).
+	struct kevent ev;
+	EV_SET(&ev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	kevent(this->kq->kq, &ev, 1, NULL, 0, NULL);
+	close(fd);
+
+	this->socks_len -= 1;
+	this->socks[i] = this->socks[this->socks_len];
+}
+
+// NB: NEM_dial_finish hands fd (or err, if fd is -1) to the caller and
+// tears the dial down.
+static void
+NEM_dial_finish(NEM_dial_t *this, NEM_err_t err, int fd)
+{
+	uint64_t now = NEM_kq_now(this->kq);
+
+	NEM_kq_timer1_cancel(this->kq, &this->timer);
+	while (0 < this->socks_len) {
+		NEM_dial_drop_sock(this, 0);
 	}
+	NEM_kq_forget(this->on_kevent);
+	NEM_thunk_free(this->on_kevent);
+	this->on_kevent = NULL;
 
-	struct sockaddr_un addr = {};
-	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
-	addr.sun_family = AF_LOCAL;
-	addr.sun_len = SUN_LEN(&addr);
+	NEM_dial_ca ca = {
+		.err      = err,
+		.attempts = this->attempts,
+	};
+	if (0 != this->resolved_at) {
+		ca.resolve_ns = this->resolved_at - this->begun_at;
+		ca.connect_ns = now - this->resolved_at;
+	}
+	else {
+		ca.resolve_ns = 0;
+		ca.connect_ns = now - this->begun_at;
+	}
 
-	if (-1 == connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
-		err = NEM_err_errno();
-		goto done;
+	if (-1 != fd) {
+		NEM_fd_t *nfd = NEM_malloc(sizeof(NEM_fd_t));
+		ca.err = NEM_fd_init(nfd, this->kq->kq, fd);
+		if (NEM_err_ok(ca.err)) {
+			NEM_fd_on_close(nfd, NEM_thunk1_new_ptr(&NEM_dial_fd_free, nfd));
+			ca.stream = NEM_fd_as_stream(nfd);
+		}
+		else {
+			free(nfd);
+		}
 	}
 
-	NEM_fd_t *nfd = NEM_malloc(sizeof(NEM_fd_t));
-	err = NEM_fd_init(nfd, kq, fd);
-	if (!NEM_err_ok(err)) {
-		free(nfd);
-		goto done;
+	NEM_thunk1_invoke(&this->on_stream, &ca);
+
+	if (this->resolving) {
+		this->done = true;
+	}
+	else {
+		free(this);
 	}
+}
 
-	NEM_fd_on_close(nfd, NEM_thunk1_new_ptr(&NEM_dial_fd_free, nfd));
-	ca.stream = NEM_fd_as_stream(nfd);
+// NB: NEM_dial_start starts connecting to the next address, skipping any
+// that fail straight away. It finishes the dial if there's nothing left to
+// try and nothing in flight; otherwise the timer's rearmed.
+static void
+NEM_dial_start(NEM_dial_t *this)
+{
+	uint64_t now = NEM_kq_now(this->kq);
 
-done:
-	if (!NEM_err_ok(err)) {
-		if (fd > 0) {
+	while (this->next < this->addrs_len) {
+		NEM_dial_addr_t *addr = &this->addrs[this->next];
+		int fd = socket(
+			addr->addr.ss_family,
+			SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			0
+		);
+		if (-1 == fd) {
+			this->err = NEM_err_errno();
+			this->next += 1;
+			continue;
+		}
+
+		if (-1 == connect(fd, (struct sockaddr*) &addr->addr, addr->len)) {
+			if (EAGAIN == errno && AF_LOCAL == addr->addr.ss_family) {
+				close(fd);
+				this->err = NEM_err_errno();
+				this->next_at = now
+					+ NEM_DIAL_RETRY_MS * NEM_KQ_NSEC_PER_MSEC;
+				break;
+			}
+			if (EINPROGRESS != errno) {
+				this->err = NEM_err_errno();
+				this->attempts += 1;
+				this->next += 1;
+				close(fd);
+				continue;
+			}
+		}
+
+		// NB: If the connect finished already the socket's writable
+		// straight away, so both cases go the same way.
+		struct kevent ev;
+		EV_SET(
+			&ev,
+			fd,
+			EVFILT_WRITE,
+			EV_ADD | EV_ONESHOT,
+			0,
+			0,
+			this->on_kevent
+		);
+		if (-1 == kevent(this->kq->kq, &ev, 1, NULL, 0, NULL)) {
+			this->err = NEM_err_errno();
+			this->next += 1;
 			close(fd);
+			continue;
 		}
+
+		this->socks[this->socks_len] = fd;
+		this->socks_len += 1;
+		this->attempts += 1;
+		this->next += 1;
+		this->next_at = now + this->stagger_ms * NEM_KQ_NSEC_PER_MSEC;
+		break;
 	}
 
-	ca.err = err;
-	NEM_thunk1_invoke(&on_stream, &ca);
+	if (0 == this->socks_len && this->next == this->addrs_len) {
+		NEM_dial_finish(this, this->err, -1);
+		return;
+	}
+
+	NEM_dial_arm(this);
 }
 
-typedef struct {
-	NEM_thunk1_t *on_stream;
-	int kq;
+static void
+NEM_dial_on_timer(NEM_timer1_t *timer)
+{
+	NEM_dial_t *this = (NEM_dial_t*) timer;
+
+	if (NEM_kq_now(this->kq) >= this->deadline) {
+		if (this->resolving) {
+			NEM_pool_cancel(this->pool, this->task);
+		}
+
+		errno = ETIMEDOUT;
+		NEM_dial_finish(this, NEM_err_errno(), -1);
+		return;
+	}
+	if (this->resolving) {
+		NEM_dial_arm(this);
+		return;
+	}
+
+	NEM_dial_start(this);
 }
-NEM_dial_tcp_baton_t;
 
 static void
-NEM_dial_tcp_cb(NEM_thunk_t *thunk, void *varg)
+NEM_dial_on_kevent(NEM_thunk_t *thunk, void *varg)
 {
+	NEM_dial_t *this = NEM_thunk_ptr(thunk);
 	struct kevent *kev = varg;
-	NEM_dial_tcp_baton_t *baton = NEM_thunk_inlineptr(thunk);
 
-	NEM_dial_ca ca = {};
-	NEM_fd_t *nfd = NULL;
+	size_t i = 0;
+	while (i < this->socks_len && (int) kev->ident != this->socks[i]) {
+		i += 1;
+	}
+	if (i == this->socks_len) {
+		// NB: A straggler from a connection that's already been dropped.
+		return;
+	}
+
+	int fd = this->socks[i];
+	int ec = 0;
+	socklen_t len = sizeof(ec);
+	if ((kev->flags & EV_ERROR)) {
+		ec = kev->data;
+	}
+	else if ((kev->flags & EV_EOF) && 0 != kev->fflags) {
+		// NB: kqueue hands over (and clears) the socket's error with EV_EOF.
+		ec = kev->fflags;
+	}
+	else if (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &ec, &len)) {
+		ec = errno;
+	}
 
-	if (EV_ERROR == (kev->flags & EV_ERROR)) {
-		ca.err.source = NEM_ERR_SOURCE_POSIX;
-		ca.err.code = kev->data;
-		goto done;
+	if (0 == ec) {
+		// NB: Take it out of socks so NEM_dial_finish doesn't close it.
+		this->socks_len -= 1;
+		this->socks[i] = this->socks[this->socks_len];
+		NEM_dial_finish(this, NEM_err_none, fd);
+		return;
 	}
 
-	nfd = NEM_malloc(sizeof(NEM_fd_t));
-	ca.err = NEM_fd_init(nfd, baton->kq, kev->ident);
-	if (!NEM_err_ok(ca.err)) {
-		goto done;
+	NEM_dial_drop_sock(this, i);
+	errno = ec;
+	this->err = NEM_err_errno();
+
+	// NB: No point waiting out the stagger once an attempt has failed.
+	this->next_at = NEM_kq_now(this->kq);
+	NEM_dial_start(this);
+}
+
+static NEM_dial_t*
+NEM_dial_new(
+	NEM_kq_t     *kq,
+	int           timeout_ms,
+	int           stagger_ms,
+	NEM_thunk1_t *on_stream
+) {
+	NEM_dial_t *this = NEM_malloc(sizeof(NEM_dial_t));
+	NEM_timer1_init(&this->timer, &NEM_dial_on_timer);
+	this->kq = kq;
+	this->on_stream = on_stream;
+	this->on_kevent = NEM_thunk_new_ptr(&NEM_dial_on_kevent, this);
+	this->stagger_ms = (0 < stagger_ms) ? stagger_ms : NEM_DIAL_STAGGER_MS;
+	this->err = NEM_err_static("NEM_dial: no addresses");
+
+	if (0 >= timeout_ms) {
+		timeout_ms = NEM_DIAL_TIMEOUT_MS;
 	}
+	this->begun_at = NEM_kq_now(kq);
+	this->deadline = this->begun_at + timeout_ms * NEM_KQ_NSEC_PER_MSEC;
 
-	NEM_fd_on_close(nfd, NEM_thunk1_new_ptr(&NEM_dial_fd_free, nfd));
-	ca.stream = NEM_fd_as_stream(nfd);
+	return this;
+}
 
-done:
-	if (!NEM_err_ok(ca.err)) {
-		if (NULL != nfd) {
-			free(nfd);
+static void
+NEM_dial_set_port(NEM_dial_addr_t *addr, int port)
+{
+	if (AF_INET == addr->addr.ss_family) {
+		((struct sockaddr_in*) &addr->addr)->sin_port = htons(port);
+	}
+	else if (AF_INET6 == addr->addr.ss_family) {
+		((struct sockaddr_in6*) &addr->addr)->sin6_port = htons(port);
+	}
+}
+
+// NB: NEM_dial_order interleaves the address families (RFC 8305 section
+// 4), starting with whichever getaddrinfo put first.
+static size_t
+NEM_dial_order(struct addrinfo *res, int port, NEM_dial_addr_t *out)
+{
+	struct addrinfo *fams[2][NEM_DIAL_ADDRS_MAX];
+	size_t fams_len[2] = { 0, 0 };
+	int first = (NULL != res) ? res->ai_family : AF_INET6;
+
+	for (struct addrinfo *ai = res; NULL != ai; ai = ai->ai_next) {
+		if (AF_INET != ai->ai_family && AF_INET6 != ai->ai_family) {
+			continue;
+		}
+		if (ai->ai_addrlen > sizeof(out[0].addr)) {
+			continue;
+		}
+
+		int f = (first == ai->ai_family) ? 0 : 1;
+		if (fams_len[f] < NEM_DIAL_ADDRS_MAX) {
+			fams[f][fams_len[f]] = ai;
+			fams_len[f] += 1;
+		}
+	}
+
+	size_t len = 0;
+	for (size_t i = 0; len < NEM_DIAL_ADDRS_MAX; i += 1) {
+		if (i >= fams_len[0] && i >= fams_len[1]) {
+			break;
+		}
+
+		for (int f = 0; f < 2 && len < NEM_DIAL_ADDRS_MAX; f += 1) {
+			if (i < fams_len[f]) {
+				struct addrinfo *ai = fams[f][i];
+				memcpy(&out[len].addr, ai->ai_addr, ai->ai_addrlen);
+				out[len].len = ai->ai_addrlen;
+				NEM_dial_set_port(&out[len], port);
+				len += 1;
+			}
 		}
 	}
 
-	NEM_thunk1_invoke(&baton->on_stream, &ca);
-	NEM_thunk_free(thunk);
+	return len;
+}
+
+// NB: NEM_dial_parse fills in addr if ip is a numeric IPv4 or IPv6 address.
+static bool
+NEM_dial_parse(const char *ip, int port, NEM_dial_addr_t *addr)
+{
+	bzero(addr, sizeof(*addr));
+
+	struct sockaddr_in *sin = (struct sockaddr_in*) &addr->addr;
+	if (1 == inet_pton(AF_INET, ip, &sin->sin_addr)) {
+#if !defined(__linux__)
+		sin->sin_len = sizeof(*sin);
+#endif
+		sin->sin_family = AF_INET;
+		addr->len = sizeof(*sin);
+		NEM_dial_set_port(addr, port);
+		return true;
+	}
+
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &addr->addr;
+	if (1 == inet_pton(AF_INET6, ip, &sin6->sin6_addr)) {
+#if !defined(__linux__)
+		sin6->sin6_len = sizeof(*sin6);
+#endif
+		sin6->sin6_family = AF_INET6;
+		addr->len = sizeof(*sin6);
+		NEM_dial_set_port(addr, port);
+		return true;
+	}
+
+	return false;
 }
 
 void
-NEM_dial_tcp(int kq, int port, const char *ip, NEM_thunk1_t *on_stream)
+NEM_dial_unix(NEM_kq_t *kq, const char *path, NEM_thunk1_t *on_stream)
 {
-	NEM_thunk_t *thunk = NULL;
-	NEM_err_t err = NEM_err_none;
-	NEM_dial_ca ca = {};
-	int fd = 0;
+	if (strlen(path) + 1 > NEM_MSIZE(struct sockaddr_un, sun_path)) {
+		NEM_dial_ca ca = {
+			.err = NEM_err_static("NEM_dial_unix: path too long"),
+		};
+		NEM_thunk1_invoke(&on_stream, &ca);
+		return;
+	}
+
+	NEM_dial_t *this = NEM_dial_new(kq, 0, 0, on_stream);
+
+	struct sockaddr_un *addr = (struct sockaddr_un*) &this->addrs[0].addr;
+	strlcpy(addr->sun_path, path, sizeof(addr->sun_path));
+	addr->sun_family = AF_LOCAL;
+#if !defined(__linux__)
+	addr->sun_len = SUN_LEN(addr);
+#endif
+	this->addrs[0].len = sizeof(*addr);
+	this->addrs_len = 1;
+
+	NEM_dial_start(this);
+}
 
-	fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
-	if (-1 == fd) {
-		err = NEM_err_errno();
-		goto done;
+void
+NEM_dial_tcp(
+	NEM_kq_t     *kq,
+	int           port,
+	const char   *ip,
+	NEM_thunk1_t *on_stream
+)
+{
+	NEM_dial_addr_t addr;
+	if (0 >= port || port >= UINT16_MAX) {
+		NEM_dial_ca ca = {
+			.err = NEM_err_static("NEM_dial_tcp: invalid port"),
+		};
+		NEM_thunk1_invoke(&on_stream, &ca);
+		return;
+	}
+	if (!NEM_dial_parse(ip, port, &addr)) {
+		NEM_dial_ca ca = {
+			.err = NEM_err_static("NEM_dial_tcp: invalid addr"),
+		};
+		NEM_thunk1_invoke(&on_stream, &ca);
+		return;
 	}
 
-	struct sockaddr_in addr = {};
-	addr.sin_len = sizeof(addr);
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
+	NEM_dial_t *this = NEM_dial_new(kq, 0, 0, on_stream);
+	this->addrs[0] = addr;
+	this->addrs_len = 1;
+	NEM_dial_start(this);
+}
 
-	int ec = inet_aton(ip, &addr.sin_addr);
-	if (0 == ec) {
-		err = NEM_err_static("NEM_dial_tcp: invalid addr");
-		goto done;
+// NB: NEM_dial_resolve_t is the inline data of the resolution task's
+// completion. The pool thread only touches host, port and addrs.
+typedef struct {
+	NEM_dial_t     *dial;
+	char            host[NI_MAXHOST];
+	int             port;
+	NEM_dial_addr_t addrs[NEM_DIAL_ADDRS_MAX];
+	size_t          addrs_len;
+}
+NEM_dial_resolve_t;
+
+static NEM_err_t
+NEM_dial_resolve_fn(NEM_thunk1_t *done)
+{
+	NEM_dial_resolve_t *res = NEM_thunk1_inlineptr(done);
+
+	struct addrinfo hints = {
+		.ai_family   = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags    = AI_ADDRCONFIG,
+	};
+	struct addrinfo *ais = NULL;
+
+	int ec = getaddrinfo(res->host, NULL, &hints, &ais);
+	if (EAI_SYSTEM == ec) {
+		return NEM_err_errno();
 	}
-	else if (-1 == ec) {
-		err = NEM_err_errno();
-		goto done;
+	if (0 != ec) {
+		// NB: gai_strerror's strings are static.
+		return NEM_err_static(gai_strerror(ec));
 	}
 
-	if (-1 == connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
-		if (EINPROGRESS != errno) {
-			err = NEM_err_errno();
-			goto done;
-		}
+	res->addrs_len = NEM_dial_order(ais, res->port, res->addrs);
+	freeaddrinfo(ais);
+	return NEM_err_none;
+}
+
+static void
+NEM_dial_on_resolve(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_dial_resolve_t *res = NEM_thunk1_inlineptr(thunk);
+	NEM_pool_ca *ca = varg;
+	NEM_dial_t *this = res->dial;
+
+	this->resolving = false;
+	if (this->done) {
+		free(this);
+		return;
 	}
 
-	thunk = NEM_thunk_new(
-		&NEM_dial_tcp_cb,
-		sizeof(NEM_dial_tcp_baton_t)
-	);
-	NEM_dial_tcp_baton_t *baton = NEM_thunk_inlineptr(thunk);
-	baton->on_stream = on_stream;
-	baton->kq = kq;
+	this->resolved_at = NEM_kq_now(this->kq);
+	if (!NEM_err_ok(ca->err)) {
+		NEM_dial_finish(this, ca->err, -1);
+		return;
+	}
 
-	struct kevent kev;
-	EV_SET(&kev, fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, thunk);
-	if (-1 == kevent(kq, &kev, 1, NULL, 0, NULL)) {
-		err = NEM_err_errno();
-		goto done;
+	memcpy(this->addrs, res->addrs, sizeof(res->addrs[0]) * res->addrs_len);
+	this->addrs_len = res->addrs_len;
+	NEM_dial_start(this);
+}
+
+void
+NEM_dial_tcp_host(
+	NEM_kq_t              *kq,
+	int                    port,
+	const char            *host,
+	const NEM_dial_opts_t *opts,
+	NEM_thunk1_t          *on_stream
+) {
+	NEM_dial_opts_t defaults = {0};
+	if (NULL == opts) {
+		opts = &defaults;
 	}
-	return;
 
-done:
+	NEM_err_t err = NEM_err_none;
+	if (0 >= port || port >= UINT16_MAX) {
+		err = NEM_err_static("NEM_dial_tcp_host: invalid port");
+	}
+	else if (strlen(host) >= NEM_MSIZE(NEM_dial_resolve_t, host)) {
+		err = NEM_err_static("NEM_dial_tcp_host: host too long");
+	}
 	if (!NEM_err_ok(err)) {
-		if (0 < fd) {
-			close(fd);
-		}
+		NEM_dial_ca ca = {
+			.err = err,
+		};
+		NEM_thunk1_invoke(&on_stream, &ca);
+		return;
+	}
 
-		if (NULL != thunk) {
-			NEM_thunk_free(thunk);
-		}
+	NEM_dial_t *this = NEM_dial_new(
+		kq,
+		opts->timeout_ms,
+		opts->stagger_ms,
+		on_stream
+	);
+
+	if (NEM_dial_parse(host, port, &this->addrs[0])) {
+		this->addrs_len = 1;
+		NEM_dial_start(this);
+		return;
+	}
+	if (NULL == opts->pool) {
+		NEM_dial_finish(
+			this,
+			NEM_err_static("NEM_dial_tcp_host: no pool to resolve with"),
+			-1
+		);
+		return;
 	}
 
-	ca.err = err;
-	NEM_thunk1_invoke(&on_stream, &ca);
-}
+	NEM_thunk1_t *done = NEM_thunk1_new(
+		&NEM_dial_on_resolve,
+		sizeof(NEM_dial_resolve_t)
+	);
+	NEM_dial_resolve_t *res = NEM_thunk1_inlineptr(done);
+	res->dial = this;
+	strlcpy(res->host, host, sizeof(res->host));
+	res->port = port;
+	res->addrs_len = 0;
 
+	// NB: The deadline covers resolution too.
+	this->pool = opts->pool;
+	this->resolving = true;
+	NEM_dial_arm(this);
+	this->task = NEM_pool_submit(opts->pool, &NEM_dial_resolve_fn, done, kq);
+}
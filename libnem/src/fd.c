@@ -1,5 +1,11 @@
 #include "nem.h"
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+static NEM_fd_mode_t NEM_fd_default_mode = NEM_FD_READY;
+
 static NEM_err_t
 NEM_fd_stream_read(void *vthis, void *buf, size_t len, NEM_thunk1_t *cb)
 {
@@ -14,6 +20,58 @@ NEM_fd_stream_write(void *vthis, void *buf, size_t len, NEM_thunk1_t *cb)
 	return NEM_fd_write(this, buf, len, cb);
 }
 
+static NEM_err_t
+NEM_fd_stream_read_cont(
+	void              *vthis,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	NEM_fd_t *this = vthis;
+	return NEM_fd_read_cont(this, buf, len, cont);
+}
+
+static NEM_err_t
+NEM_fd_stream_write_cont(
+	void              *vthis,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	NEM_fd_t *this = vthis;
+	return NEM_fd_write_cont(this, buf, len, cont);
+}
+
+static NEM_err_t
+NEM_fd_stream_writev_cont(
+	void              *vthis,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+) {
+	NEM_fd_t *this = vthis;
+	return NEM_fd_writev_cont(this, iov, iovcnt, cont);
+}
+
+static NEM_err_t
+NEM_fd_stream_sendfile_cont(
+	void              *vthis,
+	int                fd,
+	off_t              off,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	NEM_fd_t *this = vthis;
+	return NEM_fd_sendfile_cont(this, fd, off, len, cont);
+}
+
+static size_t
+NEM_fd_stream_peek(void *vthis, const void **out)
+{
+	NEM_fd_t *this = vthis;
+	return NEM_fd_peek(this, out);
+}
+
 static NEM_err_t
 NEM_fd_stream_read_fd(void *vthis, int *fdout)
 {
@@ -28,6 +86,20 @@ NEM_fd_stream_write_fd(void *vthis, int fd)
 	return NEM_fd_write_fd(this, fd);
 }
 
+static NEM_err_t
+NEM_fd_stream_read_fds(void *vthis, int *fds, size_t *len)
+{
+	NEM_fd_t *this = vthis;
+	return NEM_fd_read_fds(this, fds, len);
+}
+
+static NEM_err_t
+NEM_fd_stream_write_fds(void *vthis, const int *fds, size_t len)
+{
+	NEM_fd_t *this = vthis;
+	return NEM_fd_write_fds(this, fds, len);
+}
+
 static NEM_err_t
 NEM_fd_stream_close(void *vthis)
 {
@@ -52,6 +124,17 @@ NEM_close_fd_checked(int fd)
 	}
 }
 
+static void
+NEM_fd_close_ifds(NEM_fd_t *this)
+{
+	for (size_t i = 0; i < this->ifds_len; i += 1) {
+		close(this->ifds[i]);
+	}
+	free(this->ifds);
+	this->ifds = NULL;
+	this->ifds_len = 0;
+}
+
 static void
 NEM_fd_shutdown(NEM_fd_t *this)
 {
@@ -67,20 +150,51 @@ NEM_fd_shutdown(NEM_fd_t *this)
 		.stream = NEM_fd_as_stream(this),
 	};
 
+#if defined(__linux__)
+	// NB: The kernel must be done with the buffers before the callbacks
+	// hear about the shutdown.
+	if (0 != this->rop) {
+		NEM_uring_cancel(this->ring, this->rop);
+		this->rop = 0;
+	}
+	if (0 != this->wop) {
+		NEM_uring_cancel(this->ring, this->wop);
+		this->wop = 0;
+	}
+#endif
+
+	this->wfile = -1;
 	if (NULL != this->on_write) {
-		NEM_thunk1_invoke(&this->on_write, &ca);
+		NEM_stream_cont_invoke(&this->on_write, &ca);
 	}
 
 	if (NULL != this->on_read) {
-		NEM_thunk1_invoke(&this->on_read, &ca);
+		NEM_stream_cont_invoke(&this->on_read, &ca);
 	}
 
+	free(this->ibuf);
+	this->ibuf = NULL;
+	this->ibuf_len = 0;
+	NEM_fd_close_ifds(this);
+
 	// NB: Once we call this->on_close, we need to assume this is no
 	// longer valid memory. So copy all the stuff we care about into
 	// a separate bit.
 	int fd_in = this->fd_in;
 	int fd_out = this->fd_out;
 
+#if defined(__linux__)
+	// NB: epoll keeps reporting an fd after close(2) if another process
+	// (e.g. a forked child) still holds a reference to it, so explicitly
+	// deregister. kqueue handles this itself.
+	if (NEM_FD_READY == this->mode) {
+		struct kevent evs[2];
+		EV_SET(&evs[0], fd_in, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		EV_SET(&evs[1], fd_out, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(this->kq, evs, NEM_ARRSIZE(evs), NULL, 0, NULL);
+	}
+#endif
+
 	if (NULL != this->on_close) {
 		NEM_thunk1_invoke(&this->on_close, &ca);
 	}
@@ -93,6 +207,118 @@ NEM_fd_shutdown(NEM_fd_t *this)
 	}
 }
 
+static ssize_t
+NEM_fd_fill(NEM_fd_t *this)
+{
+	// NB: Only called with an empty buffer.
+	this->ibuf_at = 0;
+
+	if (!this->rsock) {
+		ssize_t got = read(this->fd_in, this->ibuf, this->ibuf_cap);
+		this->ibuf_len = (0 < got) ? got : 0;
+		return got;
+	}
+
+	// NB: Descriptors sent with NEM_fd_write_fd(s) ride along with their
+	// tag byte, which may get pulled into the buffer here rather than read
+	// by NEM_fd_read_fd(s). Keep hold of them until that's called. The
+	// kernel ends a read at a send carrying descriptors, but Linux returns
+	// whatever was sent before it in the same read, so the tag is the last
+	// byte buffered rather than the first. NEM_fd_recv_fds only finds it
+	// because the protocol has the reader consume everything sent before
+	// the tag (e.g. the message the fds belong to) before asking for them.
+	char cbuf[CMSG_SPACE(sizeof(int) * NEM_FD_FDS_MAX)];
+	struct iovec iov = {
+		.iov_base = this->ibuf,
+		.iov_len  = this->ibuf_cap,
+	};
+	struct msghdr msg = {
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+
+	ssize_t got = recvmsg(this->fd_in, &msg, MSG_CMSG_CLOEXEC);
+	if (0 >= got) {
+		this->ibuf_len = 0;
+		return got;
+	}
+	this->ibuf_len = got;
+
+	for (
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		NULL != cmsg;
+		cmsg = CMSG_NXTHDR(&msg, cmsg)
+	) {
+		if (SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type) {
+			continue;
+		}
+
+		// NB: The remote sent more descriptors before the last ones were
+		// read (or their tag was read past); that's a protocol violation.
+		// Close the older ones rather than leaking them.
+		NEM_fd_close_ifds(this);
+
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		this->ifds = NEM_malloc(sizeof(int) * n);
+		this->ifds_len = n;
+		memcpy(this->ifds, CMSG_DATA(cmsg), sizeof(int) * n);
+	}
+
+	return got;
+}
+
+static void
+NEM_fd_on_read_buffered(NEM_fd_t *this)
+{
+	for (;;) {
+		size_t n = this->ibuf_len > this->rcap ? this->rcap : this->ibuf_len;
+		memcpy(this->rbuf, this->ibuf + this->ibuf_at, n);
+		this->rbuf += n;
+		this->rcap -= n;
+		this->ibuf_at += n;
+		this->ibuf_len -= n;
+
+		if (0 == this->rcap) {
+			NEM_stream_ca ca = {
+				.err    = NEM_err_none,
+				.stream = NEM_fd_as_stream(this),
+			};
+			NEM_stream_cont_invoke(&this->on_read, &ca);
+			return;
+		}
+		if (0 == this->ravail) {
+			return;
+		}
+
+		// NB: The buffer's empty at this point. Reads that wouldn't fit in
+		// it anyway skip the extra copy.
+		ssize_t got = (this->rcap >= this->ibuf_cap)
+			? read(this->fd_in, this->rbuf, this->rcap)
+			: NEM_fd_fill(this);
+		if (-1 == got) {
+			if (EAGAIN == errno || EINTR == errno) {
+				this->ravail = 0;
+				return;
+			}
+			NEM_fd_shutdown(this);
+			return;
+		}
+		if (0 == got) {
+			// NB: EOF; the kevent's EV_EOF takes care of shutting down.
+			this->ravail = 0;
+			return;
+		}
+
+		if (this->rcap >= this->ibuf_cap) {
+			this->rbuf += got;
+			this->rcap -= got;
+		}
+		this->ravail = ((size_t) got > this->ravail) ? 0 : this->ravail - got;
+	}
+}
+
 static void
 NEM_fd_on_read(NEM_fd_t *this, size_t avail)
 {
@@ -106,7 +332,12 @@ NEM_fd_on_read(NEM_fd_t *this, size_t avail)
 			.err    = NEM_err_none,
 			.stream = NEM_fd_as_stream(this),
 		};
-		NEM_thunk1_invoke(&this->on_read, &ca);
+		NEM_stream_cont_invoke(&this->on_read, &ca);
+		return;
+	}
+
+	if (NULL != this->on_read && NULL != this->ibuf) {
+		NEM_fd_on_read_buffered(this);
 		return;
 	}
 
@@ -117,6 +348,11 @@ NEM_fd_on_read(NEM_fd_t *this, size_t avail)
 	size_t want = avail > this->rcap ? this->rcap : avail;
 	ssize_t got = read(this->fd_in, this->rbuf, want);
 	if (-1 == got) {
+		// NB: The poller's estimate can be stale; wait for the next event.
+		if (EAGAIN == errno || EINTR == errno) {
+			this->ravail = 0;
+			return;
+		}
 		NEM_fd_shutdown(this);
 		return;
 	}
@@ -131,10 +367,152 @@ NEM_fd_on_read(NEM_fd_t *this, size_t avail)
 			.stream = NEM_fd_as_stream(this),
 		};
 
-		NEM_thunk1_invoke(&this->on_read, &ca);
+		NEM_stream_cont_invoke(&this->on_read, &ca);
 	}
 }
 
+// NB: NEM_fd_wskip marks n bytes of the pending write as written.
+static void
+NEM_fd_wskip(NEM_fd_t *this, size_t n)
+{
+	this->wcap -= n;
+
+	while (0 < this->wiovcnt && n >= this->wiov->iov_len) {
+		n -= this->wiov->iov_len;
+		this->wiov += 1;
+		this->wiovcnt -= 1;
+	}
+	if (0 < n) {
+		this->wiov->iov_base = (char*) this->wiov->iov_base + n;
+		this->wiov->iov_len -= n;
+	}
+}
+
+// NB: NEM_fd_wiovcnt is how many of the pending iovecs to hand the kernel in
+// one go.
+static size_t
+NEM_fd_wiovcnt(NEM_fd_t *this)
+{
+	return this->wiovcnt > NEM_FD_IOV_MAX ? NEM_FD_IOV_MAX : this->wiovcnt;
+}
+
+static bool NEM_fd_sendfile_step(NEM_fd_t *this, size_t want);
+
+// NB: NEM_fd_sendfile_done finishes off a sendfile, successfully or not.
+// Failures that are about the file rather than the fd don't take the fd
+// down with them.
+static void
+NEM_fd_sendfile_done(NEM_fd_t *this, NEM_err_t err)
+{
+	this->wfile = -1;
+
+	NEM_stream_ca ca = {
+		.err    = err,
+		.stream = NEM_fd_as_stream(this),
+	};
+	NEM_stream_cont_invoke(&this->on_write, &ca);
+}
+
+static void
+NEM_fd_on_sendfile(NEM_fd_t *this)
+{
+	// NB: Unlike a short write, a short sendfile doesn't mean the fd is
+	// full -- it may have hit the end of the file -- so keep going until
+	// one or the other is sure.
+	while (0 < this->wavail) {
+		size_t want = this->wavail > this->wcap ? this->wcap : this->wavail;
+		if (!NEM_fd_sendfile_step(this, want)) {
+			return;
+		}
+	}
+}
+
+// NB: NEM_fd_sendfile_step returns true if the sendfile is still going.
+// Otherwise a continuation (or on_close) may have been invoked, which can
+// free the fd, so the caller mustn't touch it again.
+static bool
+NEM_fd_sendfile_step(NEM_fd_t *this, size_t want)
+{
+	ssize_t got = 0;
+	if (0 < want) {
+#if defined(__linux__)
+		got = sendfile(this->fd_out, this->wfile, &this->woff, want);
+#else
+		// NB: A non-blocking sendfile can send some and still fail with
+		// EAGAIN; what went out counts.
+		off_t sent = 0;
+		int rc = sendfile(
+			this->wfile,
+			this->fd_out,
+			this->woff,
+			want,
+			NULL,
+			&sent,
+			0
+		);
+		this->woff += sent;
+		got = (-1 == rc && 0 == sent) ? -1 : sent;
+#endif
+	}
+
+	if (-1 == got) {
+		if (EAGAIN == errno || EINTR == errno) {
+			this->wavail = 0;
+			return false;
+		}
+
+		// NB: Not every kind of file can be sent from. Copy the rest of it
+		// the slow way instead.
+		if (EINVAL == errno || ENOSYS == errno || EOPNOTSUPP == errno) {
+			NEM_stream_cont_t *cont = this->on_write;
+			int file = this->wfile;
+			this->on_write = NULL;
+			this->wfile = -1;
+
+			NEM_err_t err = NEM_stream_sendfile_copy(
+				NEM_fd_as_stream(this),
+				file,
+				this->woff,
+				this->wcap,
+				cont
+			);
+			if (!NEM_err_ok(err)) {
+				NEM_stream_ca ca = {
+					.err    = err,
+					.stream = NEM_fd_as_stream(this),
+				};
+				NEM_stream_cont_invoke(&cont, &ca);
+			}
+			return false;
+		}
+
+		if (EPIPE != errno && ECONNRESET != errno && ENOTCONN != errno) {
+			NEM_fd_sendfile_done(this, NEM_err_errno());
+			return false;
+		}
+
+		NEM_fd_shutdown(this);
+		return false;
+	}
+	if (0 == got && 0 < want) {
+		NEM_fd_sendfile_done(
+			this,
+			NEM_err_static("NEM_fd_sendfile: file is too short")
+		);
+		return false;
+	}
+
+	this->wcap -= got;
+	this->wavail -= got;
+
+	if (0 == this->wcap) {
+		NEM_fd_sendfile_done(this, NEM_err_none);
+		return false;
+	}
+
+	return true;
+}
+
 static void
 NEM_fd_on_write(NEM_fd_t *this, size_t avail)
 {
@@ -144,15 +522,49 @@ NEM_fd_on_write(NEM_fd_t *this, size_t avail)
 		return;
 	}
 
+	// NB: Only hand over as much as the poller says there's room for, which
+	// may mean shortening the last iovec for the duration of the call.
 	size_t want = avail > this->wcap ? this->wcap : avail;
-	ssize_t got = write(this->fd_out, this->wbuf, want);
+	if (-1 != this->wfile) {
+		return NEM_fd_on_sendfile(this);
+	}
+
+	size_t cnt = 0;
+	size_t sum = 0;
+	size_t max = NEM_fd_wiovcnt(this);
+	while (cnt < max && sum < want) {
+		sum += this->wiov[cnt].iov_len;
+		cnt += 1;
+	}
+
+	size_t trim = (sum > want) ? sum - want : 0;
+	ssize_t got = 0;
+	if (0 < cnt) {
+		this->wiov[cnt - 1].iov_len -= trim;
+		if (this->wsock) {
+			struct msghdr msg = {
+				.msg_iov    = this->wiov,
+				.msg_iovlen = cnt,
+			};
+			got = sendmsg(this->fd_out, &msg, MSG_DONTWAIT);
+		}
+		else {
+			got = writev(this->fd_out, this->wiov, cnt);
+		}
+		this->wiov[cnt - 1].iov_len += trim;
+	}
 	if (-1 == got) {
+		// NB: The poller's estimate of free space can be stale (on Linux it
+		// is only ever an estimate); wait for the next event.
+		if (EAGAIN == errno || EINTR == errno) {
+			this->wavail = 0;
+			return;
+		}
 		NEM_fd_shutdown(this);
 		return;
 	}
 
-	this->wbuf += got;
-	this->wcap -= got;
+	NEM_fd_wskip(this, got);
 	this->wavail -= got;
 
 	if (0 == this->wcap) {
@@ -161,10 +573,149 @@ NEM_fd_on_write(NEM_fd_t *this, size_t avail)
 			.stream = NEM_fd_as_stream(this),
 		};
 
-		NEM_thunk1_invoke(&this->on_write, &ca);
+		NEM_stream_cont_invoke(&this->on_write, &ca);
 	}
 }
 
+#if defined(__linux__)
+static void NEM_fd_uring_on_read(void *varg, int res);
+static void NEM_fd_uring_on_write(void *varg, int res);
+
+static NEM_err_t
+NEM_fd_uring_ring(NEM_fd_t *this)
+{
+	if (NULL != this->ring) {
+		return NEM_err_none;
+	}
+
+	return NEM_uring_get(this->kq, &this->ring);
+}
+
+static void
+NEM_fd_uring_read(NEM_fd_t *this)
+{
+	if (0 == this->rcap) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_none,
+			.stream = NEM_fd_as_stream(this),
+		};
+		NEM_stream_cont_invoke(&this->on_read, &ca);
+		return;
+	}
+
+	NEM_err_t err = NEM_uring_read(
+		this->ring,
+		this->fd_in,
+		this->rbuf,
+		this->rcap,
+		&NEM_fd_uring_on_read,
+		this,
+		&this->rop
+	);
+	if (!NEM_err_ok(err)) {
+		// NB: The ring couldn't take the read; treat it like an I/O error.
+		NEM_fd_shutdown(this);
+	}
+}
+
+static void
+NEM_fd_uring_on_read(void *varg, int res)
+{
+	NEM_fd_t *this = varg;
+	this->rop = 0;
+
+	if (-EAGAIN == res || -EINTR == res) {
+		NEM_fd_uring_read(this);
+		return;
+	}
+	if (0 >= res) {
+		// NB: Zero is EOF.
+		NEM_fd_shutdown(this);
+		return;
+	}
+
+	this->rbuf += res;
+	this->rcap -= res;
+	NEM_fd_uring_read(this);
+}
+
+static void
+NEM_fd_uring_write(NEM_fd_t *this)
+{
+	if (0 == this->wcap) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_none,
+			.stream = NEM_fd_as_stream(this),
+		};
+		NEM_stream_cont_invoke(&this->on_write, &ca);
+		return;
+	}
+
+	// NB: A single buffer goes out with a plain write/send, which doesn't
+	// need the iovec array kept alive.
+	NEM_err_t err = NEM_err_none;
+	if (1 == this->wiovcnt) {
+		err = NEM_uring_write(
+			this->ring,
+			this->fd_out,
+			this->wiov->iov_base,
+			this->wiov->iov_len,
+			this->wsock,
+			&NEM_fd_uring_on_write,
+			this,
+			&this->wop
+		);
+	}
+	else if (this->wsock) {
+		bzero(&this->wmsg, sizeof(this->wmsg));
+		this->wmsg.msg_iov = this->wiov;
+		this->wmsg.msg_iovlen = NEM_fd_wiovcnt(this);
+		err = NEM_uring_sendmsg(
+			this->ring,
+			this->fd_out,
+			&this->wmsg,
+			&NEM_fd_uring_on_write,
+			this,
+			&this->wop
+		);
+	}
+	else {
+		err = NEM_uring_writev(
+			this->ring,
+			this->fd_out,
+			this->wiov,
+			NEM_fd_wiovcnt(this),
+			&NEM_fd_uring_on_write,
+			this,
+			&this->wop
+		);
+	}
+
+	if (!NEM_err_ok(err)) {
+		NEM_fd_shutdown(this);
+	}
+}
+
+static void
+NEM_fd_uring_on_write(void *varg, int res)
+{
+	NEM_fd_t *this = varg;
+	this->wop = 0;
+
+	if (-EAGAIN == res || -EINTR == res) {
+		NEM_fd_uring_write(this);
+		return;
+	}
+	if (0 >= res) {
+		NEM_fd_shutdown(this);
+		return;
+	}
+
+	NEM_fd_wskip(this, res);
+	NEM_fd_uring_write(this);
+}
+#endif
+
 static void
 NEM_fd_on_kevent(NEM_thunk_t *thunk, void *varg)
 {
@@ -176,8 +727,9 @@ NEM_fd_on_kevent(NEM_thunk_t *thunk, void *varg)
 
 		// XXX: This might be a bit fucked; we want to ingest the remainder
 		// of the data on the read side before closing (so we don't close
-		// prematurely) but also want to eventually close.
-		if ((ev->flags & EV_EOF) && 0 == this->ravail) {
+		// prematurely) but also want to eventually close. Anything left in
+		// the read buffer counts as unread.
+		if ((ev->flags & EV_EOF) && 0 == this->ravail && 0 == this->ibuf_len) {
 			NEM_fd_shutdown(this);
 		}
 	}
@@ -204,9 +756,55 @@ NEM_fd_init(NEM_fd_t *this, int kq, int fd)
 NEM_err_t
 NEM_fd_init2(NEM_fd_t *this, int kq, int fd_in, int fd_out)
 {
+	return NEM_fd_init_mode(this, kq, fd_in, fd_out, NEM_fd_default_mode);
+}
+
+void
+NEM_fd_set_default_mode(NEM_fd_mode_t mode)
+{
+	NEM_fd_default_mode = mode;
+}
+
+NEM_err_t
+NEM_fd_init_mode(
+	NEM_fd_t      *this,
+	int            kq,
+	int            fd_in,
+	int            fd_out,
+	NEM_fd_mode_t  mode
+) {
 	bzero(this, sizeof(*this));
+	this->kq = kq;
 	this->fd_in = fd_in;
 	this->fd_out = fd_out;
+	this->wfile = -1;
+
+	struct stat st;
+	this->wsock = (0 == fstat(fd_out, &st)) && S_ISSOCK(st.st_mode);
+	this->rsock = (0 == fstat(fd_in, &st)) && S_ISSOCK(st.st_mode);
+
+#if defined(__linux__)
+	if (NEM_FD_URING == mode && NEM_uring_supported()) {
+		// NB: Nothing's registered with the kq in this mode (the ring is
+		// set up lazily by the first read/write) so check the fds here to
+		// fail the same way the kevent call below would.
+		if (
+			-1 == fcntl(kq, F_GETFD)
+			|| -1 == fcntl(fd_in, F_GETFD)
+			|| -1 == fcntl(fd_out, F_GETFD)
+		) {
+			NEM_err_t err = NEM_err_errno();
+			NEM_close_fd_checked(fd_in);
+			NEM_close_fd_checked(fd_out);
+			return err;
+		}
+
+		this->mode = NEM_FD_URING;
+		this->running = true;
+		return NEM_err_none;
+	}
+#endif
+
 	NEM_thunk_t *on_ev = NEM_thunk_new_ptr(&NEM_fd_on_kevent, this);
 
 	struct kevent evs[2];
@@ -228,6 +826,36 @@ NEM_fd_init2(NEM_fd_t *this, int kq, int fd_in, int fd_out)
 NEM_err_t
 NEM_fd_init_pipe(NEM_fd_t *this, NEM_fd_t *that, int kq)
 {
+#if defined(__linux__)
+	// NB: Linux pipes are unidirectional, so use a pair of them to get the
+	// same full-duplex behavior as a FreeBSD pipe.
+	int ab[2], ba[2];
+
+	if (0 != pipe2(ab, O_CLOEXEC)) {
+		return NEM_err_errno();
+	}
+	if (0 != pipe2(ba, O_CLOEXEC)) {
+		NEM_err_t err = NEM_err_errno();
+		close(ab[0]);
+		close(ab[1]);
+		return err;
+	}
+
+	NEM_err_t err = NEM_fd_init2(this, kq, ba[0], ab[1]);
+	if (!NEM_err_ok(err)) {
+		close(ab[0]);
+		close(ba[1]);
+		return err;
+	}
+
+	err = NEM_fd_init2(that, kq, ab[0], ba[1]);
+	if (!NEM_err_ok(err)) {
+		NEM_fd_free(this);
+		return err;
+	}
+
+	return NEM_err_none;
+#else
 	int fds[2];
 
 	if (0 != pipe2(fds, O_CLOEXEC)) {
@@ -248,144 +876,38 @@ NEM_fd_init_pipe(NEM_fd_t *this, NEM_fd_t *that, int kq)
 	}
 
 	return NEM_err_none;
+#endif
 }
 
 NEM_err_t
 NEM_fd_init_unix(NEM_fd_t *this, NEM_fd_t *that, int kq)
 {
-	// UNIX sockets require a path, so create an arbitrary but unique string.
-	// XXX: This should be moved to /tmp which is kind of a mess but whatever.
-	static int ctr = 0;
-	size_t path_len = NEM_MSIZE(struct sockaddr_un, sun_path);
-	char *path = alloca(path_len);
-	snprintf(path, path_len, "nem-%d-%d.sock", getpid(), ++ctr);
-
-	// Bind a socket to that path. The file exists after the call to bind(2).
-	int fd_list = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if (-1 == fd_list) {
-		goto cleanup_1;
-	}
-
-	struct sockaddr_un addr = {};
-	strlcpy(addr.sun_path, path, path_len);
-	addr.sun_family = AF_LOCAL;
-	addr.sun_len = SUN_LEN(&addr);
-
-	if (-1 == bind(fd_list, (struct sockaddr*) &addr, SUN_LEN(&addr))) {
-		goto cleanup_2;
-	}
-	if (-1 == listen(fd_list, 1)) {
-		goto cleanup_3;
-	}
-
-	// Create a second socket and connect it to the first one.
-	int fd_cli = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if (-1 == fd_cli) {
-		goto cleanup_3;
-	}
-
-	if (0 != connect(fd_cli, (struct sockaddr*) &addr, SUN_LEN(&addr))) {
-		goto cleanup_4;
-	}
-
-	// Then have the kernel send our credentials to the remote.
-	size_t clen = sizeof(struct cmsghdr) + sizeof(struct cmsgcred);
-	struct cmsghdr *cmsg = alloca(clen);
-	bzero(cmsg, clen);
-	cmsg->cmsg_len = clen;
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_CREDS;
-	struct cmsgcred *cred = (struct cmsgcred*) CMSG_DATA(cmsg);
-
-	struct msghdr msg = {
-		.msg_control    = cmsg,
-		.msg_controllen = clen,
-	};
-
-	if (-1 == sendmsg(fd_cli, &msg, 0)) {
-		goto cleanup_4;
-	}
-
-	int fd_srv;
-
-	do {
-		// Pull client sockets from the listening one until we get one that
-		// already has data pending (since we already sent it).
-		fd_srv = accept(fd_list, NULL, NULL);
-		if (-1 == fd_srv) {
-			goto cleanup_4;
-		}
-
-		bzero(cmsg, clen);
-
-		if (-1 == recvmsg(fd_srv, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) {
-			// EAGAIN is hit when fd_srv doesn't have any data pending.
-			// ECONNRESET is if fd_srv's remote disconnects between accept
-			// and recvmsg.
-			if (EAGAIN == errno || ECONNRESET == errno) {
-				close(fd_srv);
-				continue;
-			}
-
-			close(fd_srv);
-			goto cleanup_4;
-		}
-
-		// Then validate the incoming connection is from this process.
-		if (SCM_CREDS != cmsg->cmsg_type || cred->cmcred_pid != getpid()) {
-			close(fd_srv);
-			continue;
-		}
-
-		break;
-	}
-	while (true);
-
-	// Clean up the listening socket. Technically we can do this sooner.
-	if (0 != unlink(path)) {
-		goto cleanup_5;
-	}
-
-	if (0 != close(fd_list)) {
-		goto cleanup_5;
+	// NB: An anonymous socketpair can't be connected to by anyone else, so
+	// there's no need to bind a path and check who's on the other end.
+	int fds[2];
+	if (0 != socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+		return NEM_err_errno();
 	}
 
-	// Then hook up the NEM_fd_t's to fd_cli and fd_srv.
-	NEM_err_t err;
-	err = NEM_fd_init(this, kq, fd_srv);
+	NEM_err_t err = NEM_fd_init(this, kq, fds[0]);
 	if (!NEM_err_ok(err)) {
-		close(fd_srv);
-		close(fd_cli);
+		close(fds[1]);
 		return err;
 	}
 
-	err = NEM_fd_init(that, kq, fd_cli);
+	err = NEM_fd_init(that, kq, fds[1]);
 	if (!NEM_err_ok(err)) {
-		close(fd_cli);
 		NEM_fd_free(this);
 		return err;
 	}
 
 	return NEM_err_none;
-
-	{
-	// Ignore errors here, we've already broken something.
-	cleanup_5:
-		close(fd_srv);
-	cleanup_4:
-		close(fd_cli);
-	cleanup_3:
-		unlink(path);
-	cleanup_2:
-		close(fd_list);
-	cleanup_1:
-		return NEM_err_errno();
-	}
 }
 
 void
 NEM_fd_free(NEM_fd_t *this)
 {
+	NEM_kq_forget(this->on_kevent);
 	NEM_thunk_free(this->on_kevent);
 
 	// NB: NEM_fd_shutdown potentially frees 'this', do this last.
@@ -404,70 +926,273 @@ NEM_fd_as_stream(NEM_fd_t *this)
 }
 
 NEM_err_t
-NEM_fd_read(NEM_fd_t *this, void *buf, size_t len, NEM_thunk1_t *cb)
-{
+NEM_fd_read_cont(
+	NEM_fd_t          *this,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
 	if (!this->running) {
-		NEM_thunk1_discard(&cb);
 		return NEM_err_static("NEM_fd_read: already closed");
 	}
 	if (NULL != this->on_read) {
-		NEM_thunk1_discard(&cb);
 		return NEM_err_static("NEM_fd_read: interleaved reads");
 	}
 
 	this->rbuf = buf;
 	this->rcap = len;
-	this->on_read = cb;
+	this->on_read = cont;
+
+#if defined(__linux__)
+	if (NEM_FD_URING == this->mode) {
+		NEM_err_t err = NEM_fd_uring_ring(this);
+		if (!NEM_err_ok(err)) {
+			this->on_read = NULL;
+			return err;
+		}
+
+		NEM_fd_uring_read(this);
+		return NEM_err_none;
+	}
+#endif
 
 	NEM_fd_on_read(this, this->ravail);
 	return NEM_err_none;
 }
 
 NEM_err_t
-NEM_fd_write(NEM_fd_t *this, void *buf, size_t len, NEM_thunk1_t *cb)
-{
+NEM_fd_write_cont(
+	NEM_fd_t          *this,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	if (NULL != this->on_write) {
+		return NEM_err_static("NEM_fd_write: interleaved writes");
+	}
+
+	this->wone.iov_base = buf;
+	this->wone.iov_len = len;
+	return NEM_fd_writev_cont(this, &this->wone, 1, cont);
+}
+
+NEM_err_t
+NEM_fd_writev_cont(
+	NEM_fd_t          *this,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+) {
 	if (!this->running) {
-		NEM_thunk1_discard(&cb);
 		return NEM_err_static("NEM_fd_write: already closed");
 	}
 	if (NULL != this->on_write) {
-		NEM_thunk1_discard(&cb);
 		return NEM_err_static("NEM_fd_write: interleaved writes");
 	}
 
-	this->wbuf = buf;
+	this->wiov = iov;
+	this->wiovcnt = iovcnt;
+	this->wcap = 0;
+	for (size_t i = 0; i < iovcnt; i += 1) {
+		this->wcap += iov[i].iov_len;
+	}
+	this->on_write = cont;
+
+#if defined(__linux__)
+	if (NEM_FD_URING == this->mode) {
+		NEM_err_t err = NEM_fd_uring_ring(this);
+		if (!NEM_err_ok(err)) {
+			this->on_write = NULL;
+			return err;
+		}
+
+		NEM_fd_uring_write(this);
+		return NEM_err_none;
+	}
+#endif
+
+	NEM_fd_on_write(this, this->wavail);
+	return NEM_err_none;
+}
+
+NEM_err_t
+NEM_fd_sendfile_cont(
+	NEM_fd_t          *this,
+	int                fd,
+	off_t              off,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	if (!this->running) {
+		return NEM_err_static("NEM_fd_sendfile: already closed");
+	}
+	if (NULL != this->on_write) {
+		return NEM_err_static("NEM_fd_sendfile: interleaved writes");
+	}
+
+#if defined(__linux__)
+	bool direct = NEM_FD_URING != this->mode;
+#else
+	bool direct = this->wsock;
+#endif
+	if (!direct) {
+		return NEM_stream_sendfile_copy(
+			NEM_fd_as_stream(this),
+			fd,
+			off,
+			len,
+			cont
+		);
+	}
+
+	// NB: There's no MSG_DONTWAIT for sendfile, and the poller's idea of
+	// how much room there is doesn't account for how the kernel packs file
+	// pages into a pipe. Make sure it can't block. It's left that way for
+	// good, since everything else written to the fd waits on the poller
+	// anyway.
+	if (!this->wnonblock) {
+		int flags = fcntl(this->fd_out, F_GETFL);
+		if (
+			-1 == flags
+			|| -1 == fcntl(this->fd_out, F_SETFL, flags | O_NONBLOCK)
+		) {
+			return NEM_err_errno();
+		}
+		this->wnonblock = true;
+	}
+
+	this->wfile = fd;
+	this->woff = off;
 	this->wcap = len;
-	this->on_write = cb;
+	this->on_write = cont;
 
 	NEM_fd_on_write(this, this->wavail);
 	return NEM_err_none;
 }
 
 NEM_err_t
-NEM_fd_read_fd(NEM_fd_t *this, int *fdout)
+NEM_fd_read(NEM_fd_t *this, void *buf, size_t len, NEM_thunk1_t *cb)
 {
+	// NB: rthunk is in use while a read is pending, so don't touch it.
+	if (NULL != this->on_read) {
+		NEM_thunk1_discard(&cb);
+		return NEM_err_static("NEM_fd_read: interleaved reads");
+	}
+
+	NEM_stream_cont_bind(&this->rthunk, cb);
+	NEM_err_t err = NEM_fd_read_cont(this, buf, len, &this->rthunk);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_cont_unbind(&this->rthunk);
+	}
+
+	return err;
+}
+
+NEM_err_t
+NEM_fd_write(NEM_fd_t *this, void *buf, size_t len, NEM_thunk1_t *cb)
+{
+	if (NULL != this->on_write) {
+		NEM_thunk1_discard(&cb);
+		return NEM_err_static("NEM_fd_write: interleaved writes");
+	}
+
+	NEM_stream_cont_bind(&this->wthunk, cb);
+	NEM_err_t err = NEM_fd_write_cont(this, buf, len, &this->wthunk);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_cont_unbind(&this->wthunk);
+	}
+
+	return err;
+}
+
+NEM_err_t
+NEM_fd_set_read_buffer(NEM_fd_t *this, size_t cap)
+{
+	if (NEM_FD_READY != this->mode) {
+		// NB: io_uring reads already land in the caller's buffer.
+		return NEM_err_none;
+	}
+	if (NULL != this->on_read || NULL != this->ibuf) {
+		return NEM_err_static("NEM_fd_set_read_buffer: already reading");
+	}
+	if (!this->running) {
+		return NEM_err_static("NEM_fd_set_read_buffer: already closed");
+	}
+
+	this->ibuf_cap = (0 == cap) ? NEM_FD_READ_BUFFER : cap;
+	this->ibuf = NEM_malloc(this->ibuf_cap);
+	return NEM_err_none;
+}
+
+size_t
+NEM_fd_peek(NEM_fd_t *this, const void **out)
+{
+	if (NULL == this->ibuf) {
+		*out = NULL;
+		return 0;
+	}
+
+	*out = this->ibuf + this->ibuf_at;
+	return this->ibuf_len;
+}
+
+// NB: NEM_fd_recv_fds reads the tag byte sent by NEM_fd_send_fds and the
+// descriptors that came with it. Anything past cap is closed.
+static NEM_err_t
+NEM_fd_recv_fds(
+	NEM_fd_t      *this,
+	unsigned char *tag,
+	int           *fds,
+	size_t        *len,
+	size_t         cap
+) {
 	if (NULL != this->on_read) {
 		return NEM_err_static("NEM_fd_read_fd: interleaved with read");
 	}
 
-	size_t len = CMSG_SPACE(sizeof(*fdout));
-	char *buf = alloca(len);
+	*len = 0;
+
+	if (0 < this->ibuf_len) {
+		// NB: The tag (and the fds with it) already made it into the read
+		// buffer; see NEM_fd_fill.
+		*tag = (unsigned char) this->ibuf[this->ibuf_at];
+		this->ibuf_at += 1;
+		this->ibuf_len -= 1;
+
+		for (size_t i = 0; i < this->ifds_len; i += 1) {
+			if (i < cap) {
+				fds[i] = this->ifds[i];
+				*len += 1;
+			}
+			else {
+				close(this->ifds[i]);
+			}
+		}
+		free(this->ifds);
+		this->ifds = NULL;
+		this->ifds_len = 0;
+
+		return NEM_err_none;
+	}
+
+	size_t clen = CMSG_SPACE(sizeof(int) * cap);
+	char *buf = alloca(clen);
 
 	// NB: Doing stupid garbage here to support runtimes that support
 	// platforms that are garbage and can't read OOB data without ripping
 	// into the actual data stream. fml.
-	char discard = 0;
 	struct iovec iov = {
 		.iov_len  = 1,
-		.iov_base = &discard,
+		.iov_base = tag,
 	};
 	struct msghdr msg = {
 		.msg_control    = buf,
-		.msg_controllen = len,
+		.msg_controllen = clen,
 		.msg_iov        = &iov,
 		.msg_iovlen     = 1,
 	};
 
+	*tag = 0;
 	if (-1 == recvmsg(this->fd_in, &msg, MSG_CMSG_CLOEXEC)) {
 		return NEM_err_errno();
 	}
@@ -475,26 +1200,61 @@ NEM_fd_read_fd(NEM_fd_t *this, int *fdout)
 		this->ravail -= 1;
 	}
 
-	if ('F' != discard) {
-		return NEM_err_static("NEM_fd_read_fd: didn't get 'F'd");
+	for (
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		NULL != cmsg;
+		cmsg = CMSG_NXTHDR(&msg, cmsg)
+	) {
+		if (SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type) {
+			continue;
+		}
+
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < n; i += 1) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(fd));
+			if (*len < cap) {
+				fds[*len] = fd;
+				*len += 1;
+			}
+			else {
+				close(fd);
+			}
+		}
 	}
 
-	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-	if (NULL == cmsg) {
-		return NEM_err_static("NEM_fd_read_fd: CMSG_FIRSTHDR returned NULL");
+	// NB: The kernel closes whatever didn't fit.
+	if ((msg.msg_flags & MSG_CTRUNC)) {
+		for (size_t i = 0; i < *len; i += 1) {
+			close(fds[i]);
+		}
+		*len = 0;
+		return NEM_err_static("NEM_fd_read_fd: too many fds");
 	}
-	if (SOL_SOCKET != cmsg->cmsg_level) {
-		return NEM_err_static("NEM_fd_read_fd: cmsg_level");
+
+	return NEM_err_none;
+}
+
+NEM_err_t
+NEM_fd_read_fd(NEM_fd_t *this, int *fdout)
+{
+	unsigned char tag;
+	size_t len;
+	NEM_err_t err = NEM_fd_recv_fds(this, &tag, fdout, &len, 1);
+	if (!NEM_err_ok(err)) {
+		return err;
 	}
-	if (SCM_RIGHTS != cmsg->cmsg_type) {
-		return NEM_err_static("NEM_fd_read_fd: cmsg_type");
+
+	if ('F' != tag) {
+		if (1 == len) {
+			close(*fdout);
+		}
+		return NEM_err_static("NEM_fd_read_fd: didn't get 'F'd");
 	}
-	if (sizeof(*fdout) > cmsg->cmsg_len) {
-		return NEM_err_static("NEM_fd_read_fd: cmsg_len");
+	if (1 != len) {
+		return NEM_err_static("NEM_fd_read_fd: no fd with the 'F'");
 	}
 
-	memcpy(fdout, CMSG_DATA(cmsg), sizeof(*fdout));
-
 	// NB: Double-check that this is actually a file descriptor.
 	if (-1 == fcntl(*fdout, F_GETFD)) {
 		*fdout = 0;
@@ -505,27 +1265,49 @@ NEM_fd_read_fd(NEM_fd_t *this, int *fdout)
 }
 
 NEM_err_t
-NEM_fd_write_fd(NEM_fd_t *this, int fd)
+NEM_fd_read_fds(NEM_fd_t *this, int *fds, size_t *len)
+{
+	unsigned char tag;
+	size_t cap = *len > NEM_FD_FDS_MAX ? NEM_FD_FDS_MAX : *len;
+	NEM_err_t err = NEM_fd_recv_fds(this, &tag, fds, len, cap);
+	if (!NEM_err_ok(err)) {
+		return err;
+	}
+
+	if (tag != *len) {
+		for (size_t i = 0; i < *len; i += 1) {
+			close(fds[i]);
+		}
+		*len = 0;
+		return NEM_err_static("NEM_fd_read_fds: fd count mismatch");
+	}
+
+	return NEM_err_none;
+}
+
+// NB: NEM_fd_send_fds sends fds in a single SCM_RIGHTS cmsg along with a
+// one-byte tag.
+static NEM_err_t
+NEM_fd_send_fds(NEM_fd_t *this, unsigned char tag, const int *fds, size_t len)
 {
 	if (NULL != this->on_write) {
 		return NEM_err_static("NEM_fd_write_fd: interleaved with write");
 	}
 
-	size_t len = CMSG_SPACE(sizeof(fd));
-	char *buf = alloca(len);
-	bzero(buf, len);
+	size_t clen = CMSG_SPACE(sizeof(int) * len);
+	char *buf = alloca(clen);
+	bzero(buf, clen);
 
 	// NB: Go's fucking syscall.Recvmsg eats a goddamn byte from the not-OOB
 	// stream for some fucking reason. So put a fucking byte in there because
 	// holy shit what the flying fuck.
-	char discard = 'F';
 	struct iovec iov = {
 		.iov_len  = 1,
-		.iov_base = &discard,
+		.iov_base = &tag,
 	};
 	struct msghdr msg = {
 		.msg_control    = buf,
-		.msg_controllen = len,
+		.msg_controllen = clen,
 		.msg_iov        = &iov,
 		.msg_iovlen     = 1,
 	};
@@ -533,9 +1315,9 @@ NEM_fd_write_fd(NEM_fd_t *this, int fd)
 	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * len);
 
-	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * len);
 	msg.msg_controllen = cmsg->cmsg_len;
 
 	if (-1 == sendmsg(this->fd_out, &msg, 0)) {
@@ -545,6 +1327,22 @@ NEM_fd_write_fd(NEM_fd_t *this, int fd)
 	return NEM_err_none;
 }
 
+NEM_err_t
+NEM_fd_write_fd(NEM_fd_t *this, int fd)
+{
+	return NEM_fd_send_fds(this, 'F', &fd, 1);
+}
+
+NEM_err_t
+NEM_fd_write_fds(NEM_fd_t *this, const int *fds, size_t len)
+{
+	if (0 == len || NEM_FD_FDS_MAX < len) {
+		return NEM_err_static("NEM_fd_write_fds: invalid fd count");
+	}
+
+	return NEM_fd_send_fds(this, (unsigned char) len, fds, len);
+}
+
 void
 NEM_fd_close(NEM_fd_t *this)
 {
@@ -563,10 +1361,17 @@ NEM_fd_on_close(NEM_fd_t *this, NEM_thunk1_t *cb)
 }
 
 const NEM_stream_vt NEM_fd_stream_vt = {
-	.read     = &NEM_fd_stream_read,
-	.write    = &NEM_fd_stream_write,
-	.read_fd  = &NEM_fd_stream_read_fd,
-	.write_fd = &NEM_fd_stream_write_fd,
-	.close    = &NEM_fd_stream_close,
-	.on_close = &NEM_fd_stream_on_close,
+	.read          = &NEM_fd_stream_read,
+	.write         = &NEM_fd_stream_write,
+	.read_cont     = &NEM_fd_stream_read_cont,
+	.write_cont    = &NEM_fd_stream_write_cont,
+	.writev_cont   = &NEM_fd_stream_writev_cont,
+	.sendfile_cont = &NEM_fd_stream_sendfile_cont,
+	.peek          = &NEM_fd_stream_peek,
+	.read_fd       = &NEM_fd_stream_read_fd,
+	.write_fd      = &NEM_fd_stream_write_fd,
+	.read_fds      = &NEM_fd_stream_read_fds,
+	.write_fds     = &NEM_fd_stream_write_fds,
+	.close         = &NEM_fd_stream_close,
+	.on_close      = &NEM_fd_stream_on_close,
 };
@@ -1,74 +1,323 @@
 #include "nem.h"
 
-#include <sys/time.h>
 #include <errno.h>
 #include <strings.h>
 #include <string.h>
 #include <stdio.h>
+#include <execinfo.h>
 
-static inline int
-NEM_timer1_cmp(const void *vlhs, const void *vrhs)
+// NB: Default number of events harvested per wakeup of NEM_kq_run.
+static const size_t NEM_KQ_BATCH_DEFAULT = 64;
+
+// NB: The kq currently dispatching events on this thread, for
+// NEM_kq_forget. Callbacks always run on their kq's thread.
+static _Thread_local NEM_kq_t *NEM_kq_current = NULL;
+
+// NB: Placement is clamped to what the top level of the wheel can hold.
+static const uint64_t NEM_KQ_WHEEL_SPAN =
+	(1ULL << (NEM_KQ_WHEEL_BITS * NEM_KQ_WHEEL_LEVELS)) - 1;
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+static const clockid_t NEM_KQ_CLOCK_COARSE = CLOCK_MONOTONIC_COARSE;
+#elif defined(CLOCK_MONOTONIC_FAST)
+static const clockid_t NEM_KQ_CLOCK_COARSE = CLOCK_MONOTONIC_FAST;
+#else
+static const clockid_t NEM_KQ_CLOCK_COARSE = CLOCK_MONOTONIC;
+#endif
+
+static uint64_t
+NEM_kq_clock(const NEM_kq_t *this)
 {
-	const NEM_timer1_t *lhs = vlhs;
-	const NEM_timer1_t *rhs = vrhs;
+	struct timespec ts;
+	if (clock_gettime(this->clock, &ts)) {
+		NEM_panicf_errno("NEM_kq_run: clock_gettime");
+	}
 
-	if (lhs->invoke_at.tv_sec < rhs->invoke_at.tv_sec) {
-		return -1;
+	return (uint64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static void
+NEM_kq_sample_now(NEM_kq_t *this)
+{
+	// NB: The coarse clock lags the precise one by up to a tick, so after
+	// switching between them a fresh reading can be behind the cached one.
+	// Timers and deadlines are all computed off this, so hold it still
+	// rather than let it go backwards.
+	uint64_t now = NEM_kq_clock(this);
+	if (now > this->now) {
+		this->now = now;
 	}
-	else if (lhs->invoke_at.tv_sec > rhs->invoke_at.tv_sec) {
-		return 1;
+}
+
+void
+NEM_kq_set_coarse(NEM_kq_t *this, bool coarse)
+{
+	this->clock = coarse ? NEM_KQ_CLOCK_COARSE : CLOCK_MONOTONIC;
+	NEM_kq_sample_now(this);
+}
+
+void
+NEM_timer1_init(NEM_timer1_t *this, NEM_timer1_fn fn)
+{
+	bzero(this, sizeof(*this));
+	this->fn = fn;
+}
+
+bool
+NEM_timer1_active(const NEM_timer1_t *this)
+{
+	return NULL != this->link.next;
+}
+
+static inline size_t
+NEM_kq_wheel_slot(uint64_t tick, size_t level)
+{
+	return (tick >> (NEM_KQ_WHEEL_BITS * level)) & (NEM_KQ_WHEEL_SLOTS - 1);
+}
+
+static void
+NEM_kq_wheel_insert(NEM_kq_t *this, NEM_timer1_t *timer)
+{
+	// NB: Round up so a timer never fires before its deadline. Anything
+	// that's already due goes in the next tick; anything too far out is
+	// filed at the edge of the wheel and re-filed each time it cascades
+	// until it's in range.
+	uint64_t tick = (timer->at + NEM_KQ_NSEC_PER_MSEC - 1) / NEM_KQ_NSEC_PER_MSEC;
+	if (tick <= this->wheel_now) {
+		tick = this->wheel_now + 1;
 	}
-	else if (lhs->invoke_at.tv_usec < rhs->invoke_at.tv_usec) {
-		return -1;
+	else if (tick - this->wheel_now > NEM_KQ_WHEEL_SPAN) {
+		tick = this->wheel_now + NEM_KQ_WHEEL_SPAN;
 	}
-	else if (lhs->invoke_at.tv_usec > rhs->invoke_at.tv_usec) {
-		return 1;
+
+	// NB: A timer lives at the lowest level where its tick shares a block
+	// with the current one at the next level up, so slot indices never
+	// alias a block that has already been processed.
+	uint64_t delta = tick - this->wheel_now;
+	size_t level = 0;
+	while (
+		level + 1 < NEM_KQ_WHEEL_LEVELS
+		&& delta >= (1ULL << (NEM_KQ_WHEEL_BITS * (level + 1)))
+	) {
+		level += 1;
 	}
 
-	return 0;
+	size_t slot = NEM_kq_wheel_slot(tick, level);
+	NEM_timer1_link_t *head = &this->wheel[level][slot];
+
+	// NB: Append so that timers due on the same tick fire in order.
+	timer->link.next = head;
+	timer->link.prev = head->prev;
+	head->prev->next = &timer->link;
+	head->prev = &timer->link;
+
+	this->wheel_bits[level] |= 1ULL << slot;
+	this->wheel_len += 1;
 }
 
-static inline bool
-NEM_timer1_before(NEM_timer1_t *this, struct timeval t)
+static void
+NEM_kq_wheel_remove(NEM_kq_t *this, NEM_timer1_t *timer)
 {
-	if (this->invoke_at.tv_sec > t.tv_sec) {
-		return false;
+	NEM_timer1_link_t *next = timer->link.next;
+	NEM_timer1_link_t *prev = timer->link.prev;
+	prev->next = next;
+	next->prev = prev;
+	timer->link.next = NULL;
+	timer->link.prev = NULL;
+	this->wheel_len -= 1;
+
+	// NB: If the slot is now empty, next and prev are both the sentinel.
+	// Find which one it is so the occupancy bit can be cleared.
+	if (next == prev) {
+		uintptr_t ptr = (uintptr_t) next;
+		for (size_t level = 0; level < NEM_KQ_WHEEL_LEVELS; level += 1) {
+			uintptr_t base = (uintptr_t) &this->wheel[level][0];
+			uintptr_t end = (uintptr_t) &this->wheel[level][NEM_KQ_WHEEL_SLOTS];
+			if (ptr >= base && ptr < end) {
+				size_t slot = (ptr - base) / sizeof(NEM_timer1_link_t);
+				this->wheel_bits[level] &= ~(1ULL << slot);
+				break;
+			}
+		}
+	}
+}
+
+void
+NEM_kq_timer1_set(NEM_kq_t *this, NEM_timer1_t *timer, uint64_t at)
+{
+	if (NEM_timer1_active(timer)) {
+		NEM_kq_wheel_remove(this, timer);
 	}
-	else if (this->invoke_at.tv_sec < t.tv_sec) {
-		return true;
+
+	timer->at = at;
+	NEM_kq_wheel_insert(this, timer);
+}
+
+void
+NEM_kq_timer1_cancel(NEM_kq_t *this, NEM_timer1_t *timer)
+{
+	if (NEM_timer1_active(timer)) {
+		NEM_kq_wheel_remove(this, timer);
+	}
+}
+
+static void
+NEM_kq_wheel_cascade(NEM_kq_t *this, size_t level)
+{
+	size_t slot = NEM_kq_wheel_slot(this->wheel_now, level);
+	NEM_timer1_link_t *head = &this->wheel[level][slot];
+	if (head->next == head) {
+		return;
 	}
-	else {
-		return this->invoke_at.tv_usec <= t.tv_usec;
+
+	// NB: Detach the whole slot first, since re-filing can land timers
+	// back in it (if they're still too far out).
+	NEM_timer1_link_t *link = head->next;
+	head->prev->next = NULL;
+	head->next = head;
+	head->prev = head;
+	this->wheel_bits[level] &= ~(1ULL << slot);
+
+	while (NULL != link) {
+		NEM_timer1_t *timer = (NEM_timer1_t*) link;
+		link = link->next;
+		this->wheel_len -= 1;
+		NEM_kq_wheel_insert(this, timer);
 	}
 }
 
-// XXX: Use SPLAY_PROTOTYPE_STATIC/SPLAY_GENERATE_STATIC instead here.
-SPLAY_PROTOTYPE(NEM_timer1_tree_t, NEM_timer1_t, link, NEM_timer1_cmp);
-SPLAY_GENERATE(NEM_timer1_tree_t, NEM_timer1_t, link, NEM_timer1_cmp);
+static void
+NEM_kq_wheel_fire(NEM_kq_t *this)
+{
+	size_t slot = NEM_kq_wheel_slot(this->wheel_now, 0);
+	NEM_timer1_link_t *head = &this->wheel[0][slot];
+
+	// NB: Pop one at a time; callbacks can cancel other timers in this
+	// slot. Anything they schedule is at least a tick out, so this ends.
+	while (head->next != head) {
+		NEM_timer1_t *timer = (NEM_timer1_t*) head->next;
+		NEM_kq_wheel_remove(this, timer);
+		timer->fn(timer);
+	}
+}
 
-static NEM_err_t
-NEM_kq_timer1_schedule(NEM_kq_t *this, struct timeval now, NEM_timer1_t *next)
+static void
+NEM_kq_wheel_advance(NEM_kq_t *this, uint64_t to)
 {
-	struct kevent ev;
+	if (0 == this->wheel_len) {
+		this->wheel_now = to > this->wheel_now ? to : this->wheel_now;
+		return;
+	}
+
+	while (this->wheel_now < to) {
+		// NB: Skip ahead to the next tick that has something to do, which
+		// is either an occupied slot in the bottom level or the start of
+		// the next block (where the upper levels cascade).
+		uint64_t now = this->wheel_now;
+		size_t idx = NEM_kq_wheel_slot(now, 0);
+		uint64_t next = (now | (NEM_KQ_WHEEL_SLOTS - 1)) + 1;
+		uint64_t bits = (NEM_KQ_WHEEL_SLOTS - 1 == idx)
+			? 0
+			: this->wheel_bits[0] >> (idx + 1);
+		if (0 != bits) {
+			next = now + 1 + __builtin_ctzll(bits);
+		}
+		if (next > to) {
+			this->wheel_now = to;
+			break;
+		}
+
+		this->wheel_now = next;
+
+		if (0 == NEM_kq_wheel_slot(next, 0)) {
+			// NB: Cascade from the top down so that timers re-filed into a
+			// lower level's current slot get cascaded along with it.
+			size_t top = 1;
+			while (
+				top + 1 < NEM_KQ_WHEEL_LEVELS
+				&& 0 == NEM_kq_wheel_slot(next, top)
+			) {
+				top += 1;
+			}
+			for (size_t level = top; level > 0; level -= 1) {
+				NEM_kq_wheel_cascade(this, level);
+			}
+		}
+
+		NEM_kq_wheel_fire(this);
+
+		if (0 == this->wheel_len) {
+			this->wheel_now = to;
+			break;
+		}
+	}
+}
+
+static bool
+NEM_kq_wheel_next(NEM_kq_t *this, uint64_t *out)
+{
+	if (0 == this->wheel_len) {
+		return false;
+	}
+
+	// NB: For each level, find the first occupied slot after the current
+	// one (wrapping around). On the bottom level that's when the timers
+	// fire; on the others it's when they cascade down a level.
+	bool found = false;
+	uint64_t best = 0;
+
+	for (size_t level = 0; level < NEM_KQ_WHEEL_LEVELS; level += 1) {
+		uint64_t bits = this->wheel_bits[level];
+		if (0 == bits) {
+			continue;
+		}
+
+		size_t shift = NEM_KQ_WHEEL_BITS * level;
+		size_t rot = (NEM_kq_wheel_slot(this->wheel_now, level) + 1)
+			& (NEM_KQ_WHEEL_SLOTS - 1);
+		if (0 != rot) {
+			bits = (bits >> rot) | (bits << (NEM_KQ_WHEEL_SLOTS - rot));
+		}
+
+		uint64_t block = (this->wheel_now >> shift) + 1 + __builtin_ctzll(bits);
+		uint64_t tick = block << shift;
+		if (!found || tick < best) {
+			best = tick;
+			found = true;
+		}
+	}
+
+	*out = best;
+	return found;
+}
 
-	if (NULL == next) {
-		// Timers are configured as one-shot, so we don't have to bother
-		// clearing anything here. We just don't set another timer event.
-		return NEM_err_none;
+static void
+NEM_kq_wheel_arm(NEM_kq_t *this)
+{
+	uint64_t at = 0;
+	if (!NEM_kq_wheel_next(this, &at)) {
+		// NB: Leave any armed timer alone; it's cheaper to eat a spurious
+		// wakeup than to make the syscall to remove it.
+		return;
+	}
+	if (this->timer_armed && at == this->timer_at) {
+		return;
 	}
 
-	// Otherwise set the timer.
-	intptr_t after_ms = 0;
-	after_ms += 1000 * (next->invoke_at.tv_sec - now.tv_sec);
-	after_ms += (next->invoke_at.tv_usec - now.tv_usec) / 1000;
+	uint64_t now = this->now / NEM_KQ_NSEC_PER_MSEC;
+	intptr_t after_ms = (at > now) ? (intptr_t)(at - now) : 0;
+	struct kevent ev;
 
 	// NB: I'm not sure why this needs to be done. According to the
 	// documentation, EV_ADD with the same ident should _update_ the timer
 	// data field -- but this does not appear to be working for some
-	// godforsaken reason. Manually delete and re-add the timer. This returns
-	// ENOENT if the timer isn't currently configured to run, which is ignored.
-	EV_SET(&ev, this->kq, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
-	kevent(this->kq, &ev, 1, NULL, 0, NULL);
+	// godforsaken reason. Manually delete and re-add the timer. Skip the
+	// delete if the one-shot timer has already fired, since it'd only come
+	// back as ENOENT.
+	if (this->timer_armed) {
+		EV_SET(&ev, this->kq, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+		NEM_kq_change(this, &ev);
+	}
 
 	EV_SET(
 		&ev,
@@ -79,58 +328,256 @@ NEM_kq_timer1_schedule(NEM_kq_t *this, struct timeval now, NEM_timer1_t *next)
 		after_ms,
 		this->on_timer
 	);
-	if (0 != kevent(this->kq, &ev, 1, NULL, 0, NULL)) {
-		return NEM_err_errno();
+	NEM_kq_change(this, &ev);
+	this->timer_armed = true;
+	this->timer_at = at;
+}
+
+static void
+NEM_kq_on_timer(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_kq_t *this = NEM_thunk_ptr(thunk);
+	this->timer_armed = false;
+	NEM_kq_wheel_advance(this, this->now / NEM_KQ_NSEC_PER_MSEC);
+}
+
+// NB: NEM_kq_after_t is the heap-allocated node used for one-off timers.
+typedef struct {
+	NEM_timer1_t  base;
+	NEM_thunk1_t *thunk;
+}
+NEM_kq_after_t;
+
+static void
+NEM_kq_after_fire(NEM_timer1_t *timer)
+{
+	NEM_kq_after_t *after = (NEM_kq_after_t*) timer;
+	NEM_thunk1_invoke(&after->thunk, NULL);
+	free(after);
+}
+
+static void
+NEM_kq_after_discard(NEM_timer1_t *timer)
+{
+	NEM_kq_after_t *after = (NEM_kq_after_t*) timer;
+	NEM_thunk1_discard(&after->thunk);
+	free(after);
+}
+
+/*
+ * Runloop instrumentation
+ */
+
+static size_t
+NEM_kq_stats_hash(void *fn, size_t cap)
+{
+	// NB: Fibonacci hashing; function pointers are aligned so the low bits
+	// are mostly useless on their own.
+	uint64_t h = (uint64_t)(uintptr_t) fn * 0x9E3779B97F4A7C15ULL;
+	return (size_t)(h >> 32) & (cap - 1);
+}
+
+static void
+NEM_kq_stats_grow(NEM_kq_stats_t *this)
+{
+	size_t old_cap = this->fns_cap;
+	NEM_kq_stats_fn_t *old = this->fns;
+
+	this->fns_cap = (0 == old_cap) ? 64 : 2 * old_cap;
+	this->fns = NEM_malloc(sizeof(NEM_kq_stats_fn_t) * this->fns_cap);
+
+	for (size_t i = 0; i < old_cap; i += 1) {
+		if (NULL == old[i].fn) {
+			continue;
+		}
+
+		size_t idx = NEM_kq_stats_hash(old[i].fn, this->fns_cap);
+		while (NULL != this->fns[idx].fn) {
+			idx = (idx + 1) & (this->fns_cap - 1);
+		}
+		this->fns[idx] = old[i];
 	}
 
-	return NEM_err_none;
+	free(old);
 }
 
-static inline void
-NEM_kq_timer1_now(struct timeval *t)
+static size_t
+NEM_kq_stats_probe(NEM_kq_stats_t *this, void *fn)
 {
-	if (gettimeofday(t, NULL)) {
-		NEM_panicf("gettimeofday: %s", strerror(errno));
+	size_t idx = NEM_kq_stats_hash(fn, this->fns_cap);
+	while (NULL != this->fns[idx].fn && fn != this->fns[idx].fn) {
+		idx = (idx + 1) & (this->fns_cap - 1);
 	}
+
+	return idx;
 }
 
-static inline void
-NEM_kq_timer1_add_ms(struct timeval *t, int ms)
+static NEM_kq_stats_fn_t*
+NEM_kq_stats_find(NEM_kq_stats_t *this, void *fn)
 {
-	t->tv_sec += ms / 1000;
-	t->tv_usec += (ms % 1000) * 1000;
+	// NB: Almost every lookup is for a callback that's already been seen,
+	// so only think about growing once it's clear this one's new.
+	size_t idx = 0;
+	if (0 < this->fns_cap) {
+		idx = NEM_kq_stats_probe(this, fn);
+		if (NULL != this->fns[idx].fn) {
+			return &this->fns[idx];
+		}
+	}
 
-	// NB: Overflow these values for collation reasons.
-	t->tv_sec += t->tv_usec / (1000 * 1000);
-	t->tv_usec = t->tv_usec % (1000 * 1000);
+	if (2 * (this->fns_len + 1) > this->fns_cap) {
+		NEM_kq_stats_grow(this);
+		idx = NEM_kq_stats_probe(this, fn);
+	}
+
+	this->fns[idx].fn = fn;
+	this->fns_len += 1;
+	return &this->fns[idx];
 }
 
 static void
-NEM_kq_on_timer(NEM_thunk_t *thunk, void *varg)
+NEM_kq_stats_record(NEM_kq_t *this, void *fn, uint64_t start)
 {
-	NEM_kq_t *this = NEM_thunk_ptr(thunk);
-	struct timeval now;
-	NEM_kq_timer1_now(&now);
+	// NB: The callback may have turned stats off.
+	if (NULL == this->stats) {
+		return;
+	}
 
-	for (;;) {
-		NEM_timer1_t *timer = SPLAY_MIN(NEM_timer1_tree_t, &this->timers);
-		if (NULL == timer || !NEM_timer1_before(timer, now)) {
-			break;
+	uint64_t took = NEM_kq_clock(this) - start;
+	NEM_kq_stats_fn_t *entry = NEM_kq_stats_find(this->stats, fn);
+
+	entry->calls += 1;
+	entry->total_ns += took;
+	if (took > entry->max_ns) {
+		entry->max_ns = took;
+	}
+
+	if (0 != this->slow_ns && took >= this->slow_ns) {
+		this->stats->slow += 1;
+
+		char *name = NEM_kq_fn_name(fn);
+		fprintf(
+			stderr,
+			"NEM_kq_run: slow callback: %s took %llu us\n",
+			name,
+			(unsigned long long)(took / 1000)
+		);
+		free(name);
+	}
+}
+
+static void
+NEM_kq_stats_iteration(NEM_kq_t *this)
+{
+	// NB: this->now was sampled when the loop woke up, so this is the time
+	// spent dispatching everything since.
+	uint64_t took_us = (NEM_kq_clock(this) - this->now) / 1000;
+	size_t bucket = 0;
+	while (0 != took_us && bucket + 1 < NEM_KQ_STATS_BUCKETS) {
+		took_us >>= 1;
+		bucket += 1;
+	}
+
+	this->stats->iterations += 1;
+	this->stats->latency[bucket] += 1;
+}
+
+void
+NEM_kq_set_stats(NEM_kq_t *this, bool enabled)
+{
+	if (NULL != this->stats) {
+		NEM_kq_stats_free(this->stats);
+		free(this->stats);
+		this->stats = NULL;
+	}
+	if (enabled) {
+		this->stats = NEM_malloc(sizeof(NEM_kq_stats_t));
+	}
+}
+
+void
+NEM_kq_set_slow(NEM_kq_t *this, uint64_t ms)
+{
+	this->slow_ns = ms * NEM_KQ_NSEC_PER_MSEC;
+}
+
+static int
+NEM_kq_stats_fn_cmp(const void *va, const void *vb)
+{
+	const NEM_kq_stats_fn_t *a = va;
+	const NEM_kq_stats_fn_t *b = vb;
+	if (a->total_ns == b->total_ns) {
+		return 0;
+	}
+	return (a->total_ns > b->total_ns) ? -1 : 1;
+}
+
+bool
+NEM_kq_stats_snapshot(const NEM_kq_t *this, NEM_kq_stats_t *out)
+{
+	if (NULL == this->stats) {
+		return false;
+	}
+
+	*out = *this->stats;
+	out->fns = NULL;
+	out->fns_len = 0;
+	out->fns_cap = 0;
+
+	if (0 < this->stats->fns_len) {
+		out->fns = NEM_malloc(sizeof(NEM_kq_stats_fn_t) * this->stats->fns_len);
+		for (size_t i = 0; i < this->stats->fns_cap; i += 1) {
+			if (NULL != this->stats->fns[i].fn) {
+				out->fns[out->fns_len] = this->stats->fns[i];
+				out->fns_len += 1;
+			}
 		}
+		out->fns_cap = out->fns_len;
 
-		NEM_thunk1_invoke(&timer->thunk, NULL);
-		SPLAY_REMOVE(NEM_timer1_tree_t, &this->timers, timer);
-		free(timer);
+		qsort(
+			out->fns,
+			out->fns_len,
+			sizeof(NEM_kq_stats_fn_t),
+			&NEM_kq_stats_fn_cmp
+		);
 	}
 
-	NEM_err_t err = NEM_kq_timer1_schedule(
-		this,
-		now,
-		SPLAY_MIN(NEM_timer1_tree_t, &this->timers)
-	);
-	if (!NEM_err_ok(err)) {
-		NEM_panicf("NEM_kq_on_timer: %s", NEM_err_string(err));
+	return true;
+}
+
+void
+NEM_kq_stats_free(NEM_kq_stats_t *stats)
+{
+	free(stats->fns);
+	stats->fns = NULL;
+	stats->fns_len = 0;
+	stats->fns_cap = 0;
+}
+
+char*
+NEM_kq_fn_name(void *fn)
+{
+	char *name = NULL;
+	char **syms = backtrace_symbols(&fn, 1);
+	if (NULL != syms) {
+		name = strdup(syms[0]);
+		free(syms);
+	}
+	else if (-1 == asprintf(&name, "%p", fn)) {
+		name = NULL;
 	}
+
+	return NEM_panic_if_null(name);
+}
+
+static NEM_thunk1_t*
+NEM_kq_defer_pop(NEM_kq_t *this)
+{
+	NEM_thunk1_t *cb = this->defers[this->defers_at];
+	this->defers[this->defers_at] = NULL;
+	this->defers_at = (this->defers_at + 1) & (this->defers_cap - 1);
+	this->defers_len -= 1;
+	return cb;
 }
 
 static void
@@ -140,6 +587,43 @@ NEM_kq_on_stop(NEM_thunk1_t *thunk, void *varg)
 	this->running = false;
 }
 
+static NEM_kq_post_t*
+NEM_kq_take_posts(NEM_kq_t *this)
+{
+	// NB: The stack is LIFO; reverse it so posts run in the order they
+	// were pushed.
+	NEM_kq_post_t *post = atomic_exchange(&this->posts, NULL);
+	NEM_kq_post_t *fifo = NULL;
+
+	while (NULL != post) {
+		NEM_kq_post_t *next = post->next;
+		post->next = fifo;
+		fifo = post;
+		post = next;
+	}
+
+	return fifo;
+}
+
+static void
+NEM_kq_on_post(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_kq_t *this = NEM_thunk_ptr(thunk);
+
+	// NB: Clear the flag before taking the stack: anything pushed after
+	// this point triggers a fresh wakeup, and anything pushed before it is
+	// picked up below.
+	atomic_store(&this->post_wake, false);
+	NEM_kq_post_t *post = NEM_kq_take_posts(this);
+
+	while (NULL != post) {
+		NEM_kq_post_t *next = post->next;
+		NEM_thunk1_invoke(&post->thunk, NULL);
+		free(post);
+		post = next;
+	}
+}
+
 static NEM_err_t
 NEM_kq_init_internal(NEM_kq_t *this)
 {
@@ -150,16 +634,44 @@ NEM_kq_init_internal(NEM_kq_t *this)
 	}
 
 	this->on_timer = NEM_thunk_new_ptr(&NEM_kq_on_timer, this);
-	SPLAY_INIT(&this->timers);
+	for (size_t i = 0; i < NEM_KQ_WHEEL_LEVELS; i += 1) {
+		for (size_t j = 0; j < NEM_KQ_WHEEL_SLOTS; j += 1) {
+			NEM_timer1_link_t *head = &this->wheel[i][j];
+			head->next = head;
+			head->prev = head;
+		}
+	}
+	this->clock = CLOCK_MONOTONIC;
+	NEM_kq_sample_now(this);
+	this->wheel_now = this->now / NEM_KQ_NSEC_PER_MSEC;
+
+	this->evs_cap = NEM_KQ_BATCH_DEFAULT;
+	this->evs = NEM_malloc(sizeof(struct kevent) * this->evs_cap);
+
+	// NB: The mailbox's event is registered immediately rather than via
+	// the changelist, since it can be triggered before the loop runs.
+	struct kevent ev;
+	this->on_post = NEM_thunk_new_ptr(&NEM_kq_on_post, this);
+	atomic_init(&this->posts, NULL);
+	atomic_init(&this->post_wake, false);
+	EV_SET(&ev, this->kq, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, this->on_post);
+	if (-1 == kevent(this->kq, &ev, 1, NULL, 0, NULL)) {
+		NEM_err_t err = NEM_err_errno();
+		NEM_thunk_free(this->on_timer);
+		NEM_thunk_free(this->on_post);
+		free(this->evs);
+		NEM_poller_close(this->kq);
+		return err;
+	}
+
 	return NEM_err_none;
 }
 
 static void
-NEM_kq_free_fd(NEM_thunk1_t *thunk, void *varg)
+NEM_kq_free_ring(NEM_thunk1_t *thunk, void *varg)
 {
-	NEM_fd_t *fd = NEM_thunk1_ptr(thunk);
-	NEM_fd_free(fd);
-	free(fd);
+	NEM_shmring_t *ring = NEM_thunk1_ptr(thunk);
+	free(ring);
 }
 
 NEM_err_t
@@ -178,20 +690,21 @@ NEM_kq_init(NEM_kq_t *this)
 		return err;
 	}
 
-	NEM_fd_t *fd = NEM_malloc(sizeof(NEM_fd_t));
-	err = NEM_fd_init(fd, this->kq, NEM_KQ_PARENT_FILENO);
+	NEM_shmring_t *ring = NEM_malloc(sizeof(NEM_shmring_t));
+	err = NEM_shmring_init_child(ring, this->kq, NEM_KQ_PARENT_FILENO);
 	if (!NEM_err_ok(err)) {
-		free(fd);
+		free(ring);
 		return err;
 	}
 
-	NEM_fd_on_close(fd, NEM_thunk1_new_ptr(
-		&NEM_kq_free_fd,
-		fd
+	NEM_shmring_on_close(ring, NEM_thunk1_new_ptr(
+		&NEM_kq_free_ring,
+		ring
 	));
 
 	this->chan = NEM_malloc(sizeof(NEM_chan_t));
-	NEM_chan_init(this->chan, NEM_fd_as_stream(fd));
+	NEM_chan_init(this->chan, NEM_shmring_as_stream(ring));
+	NEM_chan_set_ool_threshold(this->chan, 0);
 	return NEM_err_none;
 }
 
@@ -213,136 +726,173 @@ NEM_kq_free(NEM_kq_t *this)
 		free(this->chan);
 	}
 
-	NEM_timer1_t *timer = NULL;
-	while (NULL != (timer = SPLAY_MIN(NEM_timer1_tree_t, &this->timers))) {
-		SPLAY_REMOVE(NEM_timer1_tree_t, &this->timers, timer);
-		NEM_thunk1_discard(&timer->thunk);
-		free(timer);
+	// NB: The nodes left from NEM_kq_after are owned by the kq and freed
+	// here. Anything else is embedded in a struct someone else owns (a
+	// NEM_timer_t, a transaction's timeout, ...), so it's only unlinked;
+	// the owner can still cancel it afterwards.
+	for (size_t i = 0; i < NEM_KQ_WHEEL_LEVELS; i += 1) {
+		for (size_t j = 0; j < NEM_KQ_WHEEL_SLOTS; j += 1) {
+			NEM_timer1_link_t *head = &this->wheel[i][j];
+			while (head->next != head) {
+				NEM_timer1_t *timer = (NEM_timer1_t*) head->next;
+				NEM_kq_wheel_remove(this, timer);
+				if (&NEM_kq_after_fire == timer->fn) {
+					NEM_kq_after_discard(timer);
+				}
+			}
+		}
+	}
+
+	while (0 < this->defers_len) {
+		NEM_thunk1_t *cb = NEM_kq_defer_pop(this);
+		NEM_thunk1_discard(&cb);
 	}
 
+	NEM_kq_post_t *post = NEM_kq_take_posts(this);
+	while (NULL != post) {
+		NEM_kq_post_t *next = post->next;
+		NEM_thunk1_discard(&post->thunk);
+		free(post);
+		post = next;
+	}
+
+	NEM_kq_set_stats(this, false);
 	NEM_thunk_free(this->on_timer);
-	if (0 != close(this->kq)) {
+	NEM_thunk_free(this->on_post);
+	free(this->defers);
+	free(this->changes);
+	free(this->evs);
+
+#if defined(__linux__)
+	NEM_uring_release(this->kq);
+#endif
+
+	if (0 != NEM_poller_close(this->kq)) {
 		NEM_panicf_errno("NEM_kq_free: close(kq): %s");
 	}
 
 	this->kq = 0;
 }
 
-static void
-NEM_kq_insert_timer(NEM_kq_t *this, NEM_timer1_t *timer, struct timeval now)
+void
+NEM_kq_after(NEM_kq_t *this, uint64_t ms, NEM_thunk1_t *cb)
 {
-	SPLAY_INSERT(NEM_timer1_tree_t, &this->timers, timer);
+	NEM_kq_after_t *after = NEM_malloc(sizeof(NEM_kq_after_t));
+	NEM_timer1_init(&after->base, &NEM_kq_after_fire);
+	after->thunk = cb;
+	NEM_kq_timer1_set(
+		this,
+		&after->base,
+		this->now + ms * NEM_KQ_NSEC_PER_MSEC
+	);
+}
 
-	// If the inserted timer should occur before the currently scheduled
-	// interruption, update the thingy to fire sooner.
-	NEM_timer1_t *next_timer = SPLAY_MIN(NEM_timer1_tree_t, &this->timers);
-	if (timer == next_timer) {
-		NEM_err_t err = NEM_kq_timer1_schedule(this, now, next_timer);
-		if (!NEM_err_ok(err)) {
-			NEM_panicf("NEM_kq_insert_timer: %s", NEM_err_string(err));
+void
+NEM_kq_defer(NEM_kq_t *this, NEM_thunk1_t *cb)
+{
+	if (this->defers_len == this->defers_cap) {
+		// NB: Grow by unrolling the ring into a fresh buffer. The capacity
+		// stays a power of two so indices can be masked.
+		size_t cap = (0 == this->defers_cap) ? 16 : 2 * this->defers_cap;
+		NEM_thunk1_t **defers = NEM_malloc(sizeof(NEM_thunk1_t*) * cap);
+		for (size_t i = 0; i < this->defers_len; i += 1) {
+			size_t idx = (this->defers_at + i) & (this->defers_cap - 1);
+			defers[i] = this->defers[idx];
 		}
+
+		free(this->defers);
+		this->defers = defers;
+		this->defers_cap = cap;
+		this->defers_at = 0;
 	}
+
+	size_t idx = (this->defers_at + this->defers_len) & (this->defers_cap - 1);
+	this->defers[idx] = cb;
+	this->defers_len += 1;
 }
 
-static NEM_timer1_t*
-NEM_kq_after_internal(NEM_kq_t *this, uint64_t ms, NEM_thunk1_t *cb)
+void
+NEM_kq_post(NEM_kq_t *this, NEM_thunk1_t *cb)
 {
-	struct timeval now;
-	NEM_kq_timer1_now(&now);
-
-	NEM_timer1_t *timer = NEM_malloc(sizeof(NEM_timer1_t));
-	timer->thunk = cb;
-	timer->invoke_at = now;
-	NEM_kq_timer1_add_ms(&timer->invoke_at, ms);
+	NEM_kq_post_t *post = NEM_malloc(sizeof(NEM_kq_post_t));
+	post->thunk = cb;
+	post->next = atomic_load(&this->posts);
+	while (!atomic_compare_exchange_weak(&this->posts, &post->next, post)) {
+		// NB: post->next was updated with the current head; retry.
+	}
 
-	NEM_kq_insert_timer(this, timer, now);
+	// NB: Only the first post since the loop last drained the mailbox
+	// needs to trigger the event.
+	if (atomic_exchange(&this->post_wake, true)) {
+		return;
+	}
 
-	return timer;
+	struct kevent ev;
+	EV_SET(&ev, this->kq, EVFILT_USER, 0, NOTE_TRIGGER, 0, this->on_post);
+	if (-1 == kevent(this->kq, &ev, 1, NULL, 0, NULL)) {
+		NEM_panicf_errno("NEM_kq_post: kevent");
+	}
 }
 
-void
-NEM_kq_after(NEM_kq_t *this, uint64_t ms, NEM_thunk1_t *cb)
+static void
+NEM_kq_run_defers(NEM_kq_t *this)
 {
-	NEM_kq_after_internal(this, ms, cb);
+	// NB: Only run what was queued coming in; anything deferred by these
+	// callbacks waits for the next iteration.
+	size_t len = this->defers_len;
+	for (size_t i = 0; i < len; i += 1) {
+		NEM_thunk1_t *cb = NEM_kq_defer_pop(this);
+		if (NULL == this->stats) {
+			NEM_thunk1_invoke(&cb, NULL);
+			continue;
+		}
+
+		// NB: Grab the fn first; the thunk is freed by the invoke.
+		void *fn = (void*) cb->fn;
+		uint64_t start = NEM_kq_clock(this);
+		NEM_thunk1_invoke(&cb, NULL);
+		NEM_kq_stats_record(this, fn, start);
+		if (NULL != this->stats) {
+			this->stats->defers += 1;
+		}
+	}
 }
 
-void
-NEM_kq_defer(NEM_kq_t *this, NEM_thunk1_t *cb)
+static void
+NEM_timer_on_timer(NEM_timer1_t *timer)
 {
-	NEM_kq_after(this, 0, cb);
+	NEM_timer_t *this = (NEM_timer_t*) timer;
+	NEM_thunk_invoke(this->thunk, this);
 }
 
 void
 NEM_timer_init(NEM_timer_t *this, NEM_kq_t *kq, NEM_thunk_t *thunk)
 {
 	bzero(this, sizeof(*this));
+	NEM_timer1_init(&this->base, &NEM_timer_on_timer);
 	this->kq = kq;
 	this->thunk = thunk;
 }
 
-static void
-NEM_timer_on_timer(NEM_thunk1_t *thunk, void *varg)
-{
-	NEM_timer_t *this = NEM_thunk1_ptr(thunk);
-	this->active = NULL;
-
-	NEM_thunk_invoke(this->thunk, this);
-}
-
 void
 NEM_timer_set(NEM_timer_t *this, uint64_t ms_after)
 {
-	if (NULL != this->active) {
-		// Sneakily adjust the underlying timer entry.
-		SPLAY_REMOVE(NEM_timer1_tree_t, &this->kq->timers, this->active);
-
-		struct timeval now;
-		NEM_kq_timer1_now(&now);
-		this->active->invoke_at = now;
-		NEM_kq_timer1_add_ms(&this->active->invoke_at, ms_after);
-
-		NEM_kq_insert_timer(this->kq, this->active, now);
-	}
-	else {
-		// Otherwise, need to create a new timer entry.
-		this->active = NEM_kq_after_internal(
-			this->kq,
-			ms_after,
-			NEM_thunk1_new_ptr(
-				&NEM_timer_on_timer,
-				this
-			)
-		);
-	}
+	NEM_timer_set_abs(
+		this,
+		NEM_kq_now(this->kq) + ms_after * NEM_KQ_NSEC_PER_MSEC
+	);
 }
 
 void
-NEM_timer_set_abs(NEM_timer_t *this, struct timeval tv)
+NEM_timer_set_abs(NEM_timer_t *this, uint64_t at)
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-
-	// XXX: This is super hacky should probably fix this.
-	if (NULL == this->active) {
-		NEM_timer_set(this, 10);
-	}
-
-	SPLAY_REMOVE(NEM_timer1_tree_t, &this->kq->timers, this->active);
-	this->active->invoke_at = tv;
-	NEM_kq_insert_timer(this->kq, this->active, now);
+	NEM_kq_timer1_set(this->kq, &this->base, at);
 }
 
 void
 NEM_timer_cancel(NEM_timer_t *this)
 {
-	if (NULL == this->active) {
-		return;
-	}
-
-	SPLAY_REMOVE(NEM_timer1_tree_t, &this->kq->timers, this->active);
-	NEM_thunk1_discard(&this->active->thunk);
-	free(this->active);
-	this->active = NULL;
+	NEM_kq_timer1_cancel(this->kq, &this->base);
 }
 
 void
@@ -352,8 +902,8 @@ NEM_timer_free(NEM_timer_t *this)
 	NEM_thunk_free(this->thunk);
 }
 
-static const char *
-evfilt_str(int ev)
+const char*
+NEM_kq_filter_name(int ev)
 {
 	struct {
 		int filt;
@@ -379,6 +929,121 @@ evfilt_str(int ev)
 	return "unknown";
 }
 
+void
+NEM_kq_set_batch(NEM_kq_t *this, size_t nevents)
+{
+	if (this->running) {
+		NEM_panic("NEM_kq_set_batch: kq is running");
+	}
+	if (0 == nevents) {
+		nevents = 1;
+	}
+
+	this->evs = NEM_panic_if_null(realloc(
+		this->evs,
+		sizeof(struct kevent) * nevents
+	));
+	this->evs_cap = nevents;
+}
+
+void
+NEM_kq_change(NEM_kq_t *this, const struct kevent *kev)
+{
+	if ((kev->flags & EV_DELETE)) {
+		size_t j = 0;
+		for (size_t i = 0; i < this->changes_len; i += 1) {
+			struct kevent *ch = &this->changes[i];
+			if (ch->ident == kev->ident && ch->filter == kev->filter) {
+				continue;
+			}
+			this->changes[j] = *ch;
+			j += 1;
+		}
+		this->changes_len = j;
+	}
+
+	if (this->changes_len == this->changes_cap) {
+		this->changes_cap = (0 == this->changes_cap) ? 8 : 2 * this->changes_cap;
+		this->changes = NEM_panic_if_null(realloc(
+			this->changes,
+			sizeof(struct kevent) * this->changes_cap
+		));
+	}
+
+	this->changes[this->changes_len] = *kev;
+	this->changes_len += 1;
+}
+
+void
+NEM_kq_forget(void *udata)
+{
+	NEM_kq_t *this = NEM_kq_current;
+	if (NULL == this || NULL == udata) {
+		return;
+	}
+
+	for (size_t i = this->evs_at + 1; i < this->evs_len; i += 1) {
+		struct kevent *ev = &this->evs[i];
+		if (ev->udata == udata) {
+			// NB: Zero filter marks the slot as dropped for NEM_kq_run.
+			ev->filter = 0;
+			ev->udata = NULL;
+		}
+	}
+}
+
+NEM_kq_t*
+NEM_kq_running(void)
+{
+	return NEM_kq_current;
+}
+
+static void
+NEM_kq_dispatch(NEM_kq_t *this, struct kevent *trig)
+{
+	if (0 == trig->filter) {
+		return;
+	}
+
+	if (EV_ERROR == (trig->flags & EV_ERROR)) {
+		// NB: Queued EV_DELETEs for things that already went away are
+		// expected (e.g. one-shot timers that already fired).
+		if (ENOENT == trig->data) {
+			return;
+		}
+
+		// XXX: The thunks should process these errors and we shouldn't
+		// be logging them.
+		fprintf(
+			stderr,
+			"NEM_kq_run: EV_ERROR: %s: %s\n",
+			NEM_kq_filter_name(trig->filter),
+			strerror(trig->data)
+		);
+		return;
+	}
+
+	NEM_thunk_t *thunk = trig->udata;
+	if (NULL == trig->udata) {
+		NEM_panicf("NEM_kq_run: NULL udata filter=%d", trig->filter);
+	}
+	if (NULL == this->stats) {
+		NEM_thunk_invoke(thunk, trig);
+		return;
+	}
+
+	// NB: The thunk might be freed by its own callback.
+	void *fn = (void*) thunk->fn;
+	int filter = trig->filter;
+	uint64_t start = NEM_kq_clock(this);
+	NEM_thunk_invoke(thunk, trig);
+
+	NEM_kq_stats_record(this, fn, start);
+	if (NULL != this->stats && 0 > filter && -filter < NEM_KQ_STATS_FILTERS) {
+		this->stats->events[-filter] += 1;
+	}
+}
+
 NEM_err_t
 NEM_kq_run(NEM_kq_t *this)
 {
@@ -386,35 +1051,62 @@ NEM_kq_run(NEM_kq_t *this)
 		NEM_panic("NEM_kq_run: kq not initialized");
 	}
 
+	NEM_kq_t *prev = NEM_kq_current;
+	NEM_kq_current = this;
 	this->running = true;
+	NEM_kq_sample_now(this);
 
 	while (this->running) {
-		struct kevent trig;
-		if (-1 == kevent(this->kq, NULL, 0, &trig, 1, NULL)) {
-			NEM_panic("NEM_kq_run: kevent");
+		NEM_kq_run_defers(this);
+		NEM_kq_wheel_arm(this);
+
+		if (NULL != this->stats) {
+			NEM_kq_stats_iteration(this);
 		}
 
-		if (EV_ERROR == (trig.flags & EV_ERROR)) {
-			// XXX: The thunks should process these errors and we shouldn't
-			// be logging them.
-			fprintf(stderr, "NEM_kq_run: EV_ERROR: %s", strerror(trig.data));
-			break;
+		// NB: If there's more deferred work queued up (or a deferred
+		// callback stopped the loop), just poll for events rather than
+		// waiting for them. Anything that's already ready still gets
+		// dispatched before NEM_kq_run returns.
+		struct timespec poll = {0};
+		bool nowait = !this->running || 0 < this->defers_len;
+
+		// NB: The changelist is applied before the wait even if it gets
+		// interrupted, so it's always consumed here.
+		int nev = kevent(
+			this->kq,
+			this->changes,
+			this->changes_len,
+			this->evs,
+			this->evs_cap,
+			nowait ? &poll : NULL
+		);
+		this->changes_len = 0;
+		NEM_kq_sample_now(this);
+
+		if (-1 == nev) {
+			if (EINTR == errno) {
+				continue;
+			}
+			NEM_panicf_errno("NEM_kq_run: kevent");
 		}
 
-		NEM_thunk_t *thunk = trig.udata;
-		if (NULL == trig.udata) {
-			NEM_panicf("NEM_kq_run: NULL udata filter=%d", trig.filter);
+		// NB: Always finish the batch, even if something in it stops the
+		// loop: the events are edge-triggered and would otherwise be lost.
+		this->evs_len = nev;
+		for (this->evs_at = 0; this->evs_at < this->evs_len; this->evs_at += 1) {
+			NEM_kq_dispatch(this, &this->evs[this->evs_at]);
 		}
-		NEM_thunk_invoke(thunk, &trig);
+		this->evs_len = 0;
+		this->evs_at = 0;
 	}
 
+	NEM_kq_current = prev;
 	return NEM_err_none;
 }
 
 void
 NEM_kq_stop(NEM_kq_t *this)
 {
-	// NB: Setting a timer procs the kqueue to deliver a message, breaking
-	// it out of the wait loop.
-	NEM_kq_after(this, 0, NEM_thunk1_new_ptr(&NEM_kq_on_stop, this));
+	NEM_kq_defer(this, NEM_thunk1_new_ptr(&NEM_kq_on_stop, this));
 }
@@ -1,10 +1,26 @@
 #include "nem.h"
 
+// NB: reserve is a descriptor held open so that there's one to give back
+// when the process runs out: closing it makes room to accept (and then
+// drop) a connection that would otherwise sit in the queue forever,
+// waking the loop up over and over. accept_flags are the flags the
+// accepted sockets get. gone is set if the listener is closed while it's
+// handing out connections.
+//
+// resume is scheduled on resume_kq while the listener is paused; see
+// NEM_list_base_pause.
 typedef struct {
-	int fd;
-	int kq;
-	NEM_thunk_t *on_kevent;
-	NEM_thunk_t *on_stream;
+	NEM_timer1_t     resume;
+	NEM_kq_t        *resume_kq;
+	int              fd;
+	int              kq;
+	int              backlog;
+	int              reserve;
+	int              accept_flags;
+	NEM_thunk_t     *on_kevent;
+	NEM_thunk_t     *on_stream;
+	NEM_list_stats_t stats;
+	bool            *gone;
 }
 NEM_list_base_t;
 
@@ -19,19 +35,53 @@ typedef struct {
 }
 NEM_list_tcp_t;
 
+static void
+NEM_list_base_close(NEM_list_base_t *this)
+{
+	if (NULL != this->gone) {
+		*this->gone = true;
+	}
+	if (NULL != this->resume_kq) {
+		NEM_kq_timer1_cancel(this->resume_kq, &this->resume);
+	}
+
+	if (0 != close(this->fd)) {
+		NEM_panicf_errno("NEM_list_base_close");
+	}
+	if (-1 != this->reserve) {
+		close(this->reserve);
+	}
+
+	NEM_kq_forget(this->on_kevent);
+	NEM_thunk_free(this->on_kevent);
+	NEM_thunk_free(this->on_stream);
+}
+
+static void
+NEM_list_base_close_reserve(NEM_list_base_t *this)
+{
+	if (-1 != this->reserve) {
+		close(this->reserve);
+		this->reserve = -1;
+	}
+}
+
+static void
+NEM_list_base_open_reserve(NEM_list_base_t *this)
+{
+	// NB: If this fails the listener does without, and tries again the
+	// next time it needs it.
+	this->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
 static void
 NEM_list_unix_close(void *vthis)
 {
 	NEM_list_unix_t *this = vthis;
-	if (0 != close(this->base.fd)) {
-		NEM_panicf_errno("NEM_list_unix_close");
-	}
+	NEM_list_base_close(&this->base);
 
 	unlink(this->path);
 	free(this->path);
-
-	NEM_thunk_free(this->base.on_kevent);
-	NEM_thunk_free(this->base.on_stream);
 	free(this);
 }
 
@@ -39,12 +89,7 @@ static void
 NEM_list_tcp_close(void *vthis)
 {
 	NEM_list_tcp_t *this = vthis;
-	if (0 != close(this->base.fd)) {
-		NEM_panicf_errno("NEM_list_tcp_close");
-	}
-
-	NEM_thunk_free(this->base.on_kevent);
-	NEM_thunk_free(this->base.on_stream);
+	NEM_list_base_close(&this->base);
 	free(this);
 }
 
@@ -57,16 +102,10 @@ NEM_list_base_free_fd(NEM_thunk1_t *thunk, void *varg)
 }
 
 static void
-NEM_list_base_on_kevent(NEM_thunk_t *thunk, void *varg)
+NEM_list_base_on_conn(NEM_list_t *list, int fd)
 {
-	NEM_list_t *list = NEM_thunk_inlineptr(thunk);
 	NEM_list_base_t *this = list->this;
 
-	int fd = accept(this->fd, NULL, NULL);
-	if (-1 == fd) {
-		NEM_panicf_errno("NEM_list_base_on_kevent: accept");
-	}
-
 	NEM_fd_t *nfd = NEM_malloc(sizeof(NEM_fd_t));
 	NEM_err_t err = NEM_fd_init(nfd, this->kq, fd);
 	if (!NEM_err_ok(err)) {
@@ -80,6 +119,8 @@ NEM_list_base_on_kevent(NEM_thunk_t *thunk, void *varg)
 		nfd
 	));
 
+	this->stats.accepted += 1;
+
 	NEM_list_ca ca = {
 		.err    = NEM_err_none,
 		.list   = *list,
@@ -88,12 +129,201 @@ NEM_list_base_on_kevent(NEM_thunk_t *thunk, void *varg)
 	NEM_thunk_invoke(this->on_stream, &ca);
 }
 
+// NB: NEM_list_accept_t is what came of a single accept: MORE if it's
+// worth trying again, DONE if the queue's empty, and STUCK if there are
+// connections waiting that can't be taken off the queue right now.
+typedef enum {
+	NEM_LIST_ACCEPT_MORE,
+	NEM_LIST_ACCEPT_DONE,
+	NEM_LIST_ACCEPT_STUCK,
+}
+NEM_list_accept_t;
+
+// NB: NEM_list_base_shed accepts a connection and immediately closes it,
+// using the reserve descriptor to do it.
+static NEM_list_accept_t
+NEM_list_base_shed(NEM_list_base_t *this)
+{
+	// NB: The reserve might not have come back the last time it was
+	// given up; there may be room for it now.
+	if (-1 == this->reserve) {
+		NEM_list_base_open_reserve(this);
+		if (-1 == this->reserve) {
+			return NEM_LIST_ACCEPT_STUCK;
+		}
+	}
+
+	NEM_list_base_close_reserve(this);
+	int fd = accept(this->fd, NULL, NULL);
+	int accept_errno = errno;
+	if (-1 != fd) {
+		close(fd);
+		this->stats.shed += 1;
+	}
+	NEM_list_base_open_reserve(this);
+
+	if (-1 != fd) {
+		return NEM_LIST_ACCEPT_MORE;
+	}
+	return (EAGAIN == accept_errno)
+		? NEM_LIST_ACCEPT_DONE
+		: NEM_LIST_ACCEPT_STUCK;
+}
+
+// NB: NEM_list_base_accept accepts (or sheds) a single connection.
+static NEM_list_accept_t
+NEM_list_base_accept(NEM_list_t *list)
+{
+	NEM_list_base_t *this = list->this;
+
+	int fd = accept4(this->fd, NULL, NULL, this->accept_flags);
+	if (-1 != fd) {
+		NEM_list_base_on_conn(list, fd);
+		return NEM_LIST_ACCEPT_MORE;
+	}
+
+	switch (errno) {
+		case EINTR:
+		case ECONNABORTED:
+		case EPROTO:
+			return NEM_LIST_ACCEPT_MORE;
+
+		case EMFILE:
+		case ENFILE:
+			return NEM_list_base_shed(this);
+
+		case EAGAIN:
+			return NEM_LIST_ACCEPT_DONE;
+
+		case ENOBUFS:
+		case ENOMEM:
+			return NEM_LIST_ACCEPT_STUCK;
+
+		default:
+			NEM_panicf_errno("NEM_list_base_accept: accept");
+	}
+}
+
+static void
+NEM_list_base_on_resume(NEM_timer1_t *timer)
+{
+	NEM_list_base_t *this = (NEM_list_base_t*) timer;
+
+	struct kevent ev;
+	EV_SET(&ev, this->fd, EVFILT_READ, EV_ENABLE, 0, 0, this->on_kevent);
+	if (-1 == kevent(this->kq, &ev, 1, NULL, 0, NULL)) {
+		NEM_panicf_errno("NEM_list_base_on_resume: kevent");
+	}
+}
+
+// NB: NEM_list_base_pause stops watching the listening socket for a bit.
+// It's level-triggered, so a connection that can't be taken off the queue
+// would otherwise wake the loop straight back up, forever. The wheel timer
+// is used to resume it since a kevent timer costs a descriptor on some
+// pollers, and there aren't any to spare.
+static void
+NEM_list_base_pause(NEM_list_base_t *this)
+{
+	NEM_kq_t *kq = NEM_kq_running();
+	if (NULL == kq) {
+		return;
+	}
+
+	struct kevent ev;
+	EV_SET(&ev, this->fd, EVFILT_READ, EV_DISABLE, 0, 0, this->on_kevent);
+	if (-1 == kevent(this->kq, &ev, 1, NULL, 0, NULL)) {
+		NEM_panicf_errno("NEM_list_base_pause: kevent");
+	}
+
+	this->resume_kq = kq;
+	NEM_kq_timer1_set(
+		kq,
+		&this->resume,
+		NEM_kq_now(kq) + NEM_LIST_PAUSE_MS * NEM_KQ_NSEC_PER_MSEC
+	);
+	this->stats.paused += 1;
+}
+
+static void
+NEM_list_base_on_kevent(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_list_t *list = NEM_thunk_inlineptr(thunk);
+	NEM_list_base_t *this = list->this;
+	struct kevent *ev = varg;
+
+	this->stats.wakeups += 1;
+	if (-1 == this->reserve) {
+		NEM_list_base_open_reserve(this);
+	}
+
+	// NB: data is the length of the accept queue (as near as the poller
+	// can tell).
+	if (ev->data >= this->backlog) {
+		this->stats.overflows += 1;
+	}
+
+	// NB: on_stream can close the listener, which frees list too.
+	bool gone = false;
+	this->gone = &gone;
+
+	// NB: The listener is level-triggered, so anything left in the queue
+	// after NEM_LIST_ACCEPT_MAX connections is picked up on the next trip
+	// around the loop, after everything else that's ready has had a go.
+	NEM_list_accept_t res = NEM_LIST_ACCEPT_MORE;
+	size_t i = 0;
+	while (i < NEM_LIST_ACCEPT_MAX && !gone) {
+		res = NEM_list_base_accept(list);
+		if (NEM_LIST_ACCEPT_MORE != res) {
+			break;
+		}
+		i += 1;
+	}
+
+	if (!gone) {
+		this->gone = NULL;
+		if (NEM_LIST_ACCEPT_MAX == i) {
+			this->stats.saturated += 1;
+		}
+		if (NEM_LIST_ACCEPT_STUCK == res) {
+			NEM_list_base_pause(this);
+		}
+	}
+}
+
+static NEM_err_t
+NEM_list_base_set_backlog(void *vthis, int backlog)
+{
+	NEM_list_base_t *this = vthis;
+
+	// NB: Calling listen again on a listening socket just changes the
+	// backlog.
+	if (-1 == listen(this->fd, backlog)) {
+		return NEM_err_errno();
+	}
+
+	this->backlog = backlog;
+	return NEM_err_none;
+}
+
+static void
+NEM_list_base_stats(void *vthis, NEM_list_stats_t *out)
+{
+	NEM_list_base_t *this = vthis;
+	*out = this->stats;
+}
+
+// NB: Both listeners start with a NEM_list_base_t, so the base methods work
+// on either.
 const NEM_list_vt NEM_list_unix_vt = {
-	.close = &NEM_list_unix_close,
+	.close       = &NEM_list_unix_close,
+	.set_backlog = &NEM_list_base_set_backlog,
+	.stats       = &NEM_list_base_stats,
 };
 
 const NEM_list_vt NEM_list_tcp_vt = {
-	.close = &NEM_list_tcp_close,
+	.close       = &NEM_list_tcp_close,
+	.set_backlog = &NEM_list_base_set_backlog,
+	.stats       = &NEM_list_base_stats,
 };
 
 NEM_err_t
@@ -112,7 +342,7 @@ NEM_list_init_unix(
 		goto done;
 	}
 
-	fd_list = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	fd_list = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
 	if (-1 == fd_list) {
 		err = NEM_err_errno();
 		goto done;
@@ -121,13 +351,15 @@ NEM_list_init_unix(
 	struct sockaddr_un addr = {};
 	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
 	addr.sun_family = AF_LOCAL;
+#if !defined(__linux__)
 	addr.sun_len = SUN_LEN(&addr);
+#endif
 
 	if (-1 == bind(fd_list, (struct sockaddr*) &addr, SUN_LEN(&addr))) {
 		err = NEM_err_errno();
 		goto done;
 	}
-	if (-1 == listen(fd_list, 1)) {
+	if (-1 == listen(fd_list, NEM_LIST_BACKLOG)) {
 		err = NEM_err_errno();
 		goto done;
 	}
@@ -145,12 +377,20 @@ NEM_list_init_unix(
 		goto done;
 	}
 
+	NEM_timer1_init(&uthis->base.resume, &NEM_list_base_on_resume);
 	uthis->base.kq = kq;
 	uthis->base.fd = fd_list;
+	uthis->base.backlog = NEM_LIST_BACKLOG;
 	uthis->base.on_kevent = thunk;
 	uthis->base.on_stream = on_stream;
 	uthis->path = strdup(path);
 
+	// NB: Connections over a unix socket stay blocking; NEM_fd_read_fd
+	// relies on recvmsg waiting for descriptors that lag behind the bytes
+	// announcing them.
+	uthis->base.accept_flags = SOCK_CLOEXEC;
+	NEM_list_base_open_reserve(&uthis->base);
+
 	this->this = uthis;
 	this->vt = &NEM_list_unix_vt;
 
@@ -172,19 +412,20 @@ done:
 	return err;
 }
 
-NEM_err_t
-NEM_list_init_tcp(
+static NEM_err_t
+NEM_list_init_tcp_internal(
 	NEM_list_t  *this,
 	int          kq,
 	int          port,
 	const char  *ip,
+	bool         shared,
 	NEM_thunk_t *on_stream
 ) {
 	NEM_err_t err = NEM_err_none;
 	int fd_list = 0;
 	NEM_thunk_t *thunk = NULL;
 
-	fd_list = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	fd_list = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
 	if (-1 == fd_list) {
 		err = NEM_err_errno();
 		goto done;
@@ -195,7 +436,9 @@ NEM_list_init_tcp(
 	}
 
 	struct sockaddr_in addr = {};
+#if !defined(__linux__)
 	addr.sin_len = sizeof(addr);
+#endif
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 
@@ -214,12 +457,42 @@ NEM_list_init_tcp(
 		}
 	}
 
+	// NB: Don't let connections left in TIME_WAIT by a previous listener
+	// keep the port tied up.
+	int reuse = 1;
+	if (-1 == setsockopt(
+		fd_list,
+		SOL_SOCKET,
+		SO_REUSEADDR,
+		&reuse,
+		sizeof(reuse)
+	)) {
+		err = NEM_err_errno();
+		goto done;
+	}
+
+	if (shared) {
+		// NB: FreeBSD's SO_REUSEPORT lets sockets share the port but hands
+		// every connection to the last one bound; SO_REUSEPORT_LB balances
+		// them, which is what Linux's SO_REUSEPORT does.
+#if defined(SO_REUSEPORT_LB)
+		int opt = SO_REUSEPORT_LB;
+#else
+		int opt = SO_REUSEPORT;
+#endif
+		int on = 1;
+		if (-1 == setsockopt(fd_list, SOL_SOCKET, opt, &on, sizeof(on))) {
+			err = NEM_err_errno();
+			goto done;
+		}
+	}
+
 	if (-1 == bind(fd_list, (struct sockaddr*) &addr, sizeof(addr))) {
 		err = NEM_err_errno();
 		goto done;
 	}
 
-	if (-1 == listen(fd_list, 1)) {
+	if (-1 == listen(fd_list, NEM_LIST_BACKLOG)) {
 		err = NEM_err_errno();
 		goto done;
 	}
@@ -237,10 +510,14 @@ NEM_list_init_tcp(
 		goto done;
 	}
 
+	NEM_timer1_init(&uthis->base.resume, &NEM_list_base_on_resume);
 	uthis->base.kq = kq;
 	uthis->base.fd = fd_list;
+	uthis->base.backlog = NEM_LIST_BACKLOG;
+	uthis->base.accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
 	uthis->base.on_kevent = thunk;
 	uthis->base.on_stream = on_stream;
+	NEM_list_base_open_reserve(&uthis->base);
 
 	this->this = uthis;
 	this->vt = &NEM_list_tcp_vt;
@@ -261,3 +538,25 @@ done:
 
 	return err;
 }
+
+NEM_err_t
+NEM_list_init_tcp(
+	NEM_list_t  *this,
+	int          kq,
+	int          port,
+	const char  *ip,
+	NEM_thunk_t *on_stream
+) {
+	return NEM_list_init_tcp_internal(this, kq, port, ip, false, on_stream);
+}
+
+NEM_err_t
+NEM_list_init_tcp_shared(
+	NEM_list_t  *this,
+	int          kq,
+	int          port,
+	const char  *ip,
+	NEM_thunk_t *on_stream
+) {
+	return NEM_list_init_tcp_internal(this, kq, port, ip, true, on_stream);
+}
@@ -0,0 +1,595 @@
+#include "nem.h"
+
+struct NEM_loopback_fds_t {
+	NEM_loopback_fds_t *next;
+	size_t              len;
+	int                 fds[];
+};
+
+static void NEM_loopback_on_wake(NEM_thunk1_t *thunk, void *varg);
+
+static void
+NEM_loopback_wake(NEM_loopback_t *this)
+{
+	if (NULL != this->wake) {
+		return;
+	}
+
+	this->wake = NEM_thunk1_new_ptr(&NEM_loopback_on_wake, this);
+	NEM_kq_defer(this->kq, this->wake);
+}
+
+static void
+NEM_loopback_drop_fds(NEM_loopback_t *this)
+{
+	while (NULL != this->fds) {
+		NEM_loopback_fds_t *batch = this->fds;
+		this->fds = batch->next;
+
+		for (size_t i = 0; i < batch->len; i += 1) {
+			close(batch->fds[i]);
+		}
+		free(batch);
+	}
+	this->fds_last = NULL;
+}
+
+static void
+NEM_loopback_shutdown(NEM_loopback_t *this)
+{
+	bool was_running = this->running;
+	this->running = false;
+
+	if (!was_running) {
+		return;
+	}
+
+	if (NULL != this->gone) {
+		*this->gone = true;
+		this->gone = NULL;
+	}
+	if (NULL != this->wake) {
+		// NB: The thunk's still sitting in the kq's defer queue, which will
+		// free it. Just make sure it doesn't come back here.
+		*(void**) NEM_thunk1_inlineptr(this->wake) = NULL;
+		this->wake = NULL;
+	}
+
+	// NB: The peer hears about it the same way it would an EOF: once it's
+	// run out of things to read.
+	if (NULL != this->peer) {
+		this->peer->peer = NULL;
+		NEM_loopback_wake(this->peer);
+		this->peer = NULL;
+	}
+
+	NEM_stream_ca ca = {
+		.err    = NEM_err_static("NEM_loopback_t: shutdown"),
+		.stream = NEM_loopback_as_stream(this),
+	};
+
+	if (NULL != this->on_write) {
+		NEM_stream_cont_invoke(&this->on_write, &ca);
+	}
+	if (NULL != this->on_read) {
+		NEM_stream_cont_invoke(&this->on_read, &ca);
+	}
+
+	free(this->ring);
+	this->ring = NULL;
+	this->ring_len = 0;
+	NEM_loopback_drop_fds(this);
+
+	// NB: Once on_close is invoked this may no longer be valid memory.
+	if (NULL != this->on_close) {
+		NEM_thunk1_invoke(&this->on_close, &ca);
+	}
+}
+
+// NB: NEM_loopback_put copies as much of buf as fits into this's ring.
+static size_t
+NEM_loopback_put(NEM_loopback_t *this, const char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len && this->ring_len < this->ring_cap) {
+		size_t tail = (this->ring_at + this->ring_len) % this->ring_cap;
+		size_t room = this->ring_cap - this->ring_len;
+		size_t span = this->ring_cap - tail;
+		if (span > room) {
+			span = room;
+		}
+		if (span > len - done) {
+			span = len - done;
+		}
+
+		memcpy(this->ring + tail, buf + done, span);
+		this->ring_len += span;
+		done += span;
+	}
+
+	return done;
+}
+
+static void
+NEM_loopback_wskip(NEM_loopback_t *this, size_t n)
+{
+	this->wcap -= n;
+	this->wiov->iov_base = (char*) this->wiov->iov_base + n;
+	this->wiov->iov_len -= n;
+}
+
+static void
+NEM_loopback_on_write(NEM_loopback_t *this)
+{
+	if (NULL == this->on_write) {
+		return;
+	}
+
+	NEM_loopback_t *peer = this->peer;
+	if (NULL == peer) {
+		NEM_loopback_shutdown(this);
+		return;
+	}
+
+	bool moved = false;
+	while (0 < this->wcap) {
+		if (0 == this->wiov->iov_len) {
+			this->wiov += 1;
+			this->wiovcnt -= 1;
+			continue;
+		}
+
+		const char *buf = this->wiov->iov_base;
+		size_t len = this->wiov->iov_len;
+		size_t n = 0;
+
+		// NB: If the peer's already waiting on a read there's no need to go
+		// through the ring (which has to be empty for the bytes to stay in
+		// order).
+		if (NULL != peer->on_read && 0 < peer->rcap && 0 == peer->ring_len) {
+			n = (len > peer->rcap) ? peer->rcap : len;
+			memcpy(peer->rbuf, buf, n);
+			peer->rbuf += n;
+			peer->rcap -= n;
+		}
+		else {
+			n = NEM_loopback_put(peer, buf, len);
+		}
+
+		if (0 == n) {
+			break;
+		}
+
+		NEM_loopback_wskip(this, n);
+		moved = true;
+	}
+
+	if (moved && NULL != peer->on_read) {
+		NEM_loopback_wake(peer);
+	}
+
+	if (0 == this->wcap) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_none,
+			.stream = NEM_loopback_as_stream(this),
+		};
+		NEM_stream_cont_invoke(&this->on_write, &ca);
+	}
+}
+
+static void
+NEM_loopback_on_read(NEM_loopback_t *this)
+{
+	if (NULL == this->on_read) {
+		return;
+	}
+
+	bool moved = false;
+	while (0 < this->rcap && 0 < this->ring_len) {
+		size_t span = this->ring_cap - this->ring_at;
+		if (span > this->ring_len) {
+			span = this->ring_len;
+		}
+		if (span > this->rcap) {
+			span = this->rcap;
+		}
+
+		memcpy(this->rbuf, this->ring + this->ring_at, span);
+		this->rbuf += span;
+		this->rcap -= span;
+		this->ring_at = (this->ring_at + span) % this->ring_cap;
+		this->ring_len -= span;
+		moved = true;
+	}
+
+	// NB: Keep what's buffered contiguous for as long as possible, since
+	// that's all NEM_stream_peek can see.
+	if (0 == this->ring_len) {
+		this->ring_at = 0;
+	}
+
+	if (moved && NULL != this->peer && NULL != this->peer->on_write) {
+		NEM_loopback_wake(this->peer);
+	}
+
+	if (0 == this->rcap) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_none,
+			.stream = NEM_loopback_as_stream(this),
+		};
+		NEM_stream_cont_invoke(&this->on_read, &ca);
+		return;
+	}
+
+	if (NULL == this->peer) {
+		NEM_loopback_shutdown(this);
+	}
+}
+
+static void
+NEM_loopback_on_wake(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_loopback_t *this = NEM_thunk1_ptr(thunk);
+	if (NULL == this) {
+		return;
+	}
+
+	this->wake = NULL;
+
+	// NB: Either continuation can close (and free) this, so keep track of
+	// whether it's still around between steps.
+	bool gone = false;
+	this->gone = &gone;
+
+	NEM_loopback_on_write(this);
+	if (!gone) {
+		NEM_loopback_on_read(this);
+	}
+	if (!gone && NULL == this->peer && 0 == this->ring_len) {
+		NEM_loopback_shutdown(this);
+	}
+	if (!gone) {
+		this->gone = NULL;
+	}
+}
+
+static NEM_err_t
+NEM_loopback_read_cont(
+	NEM_loopback_t    *this,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	if (!this->running) {
+		return NEM_err_static("NEM_loopback_read: already closed");
+	}
+	if (NULL != this->on_read) {
+		return NEM_err_static("NEM_loopback_read: interleaved reads");
+	}
+
+	this->rbuf = buf;
+	this->rcap = len;
+	this->on_read = cont;
+
+	NEM_loopback_on_read(this);
+	return NEM_err_none;
+}
+
+static NEM_err_t
+NEM_loopback_writev_cont(
+	NEM_loopback_t    *this,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+) {
+	if (!this->running) {
+		return NEM_err_static("NEM_loopback_write: already closed");
+	}
+	if (NULL != this->on_write) {
+		return NEM_err_static("NEM_loopback_write: interleaved writes");
+	}
+
+	this->wiov = iov;
+	this->wiovcnt = iovcnt;
+	this->wcap = 0;
+	for (size_t i = 0; i < iovcnt; i += 1) {
+		this->wcap += iov[i].iov_len;
+	}
+	this->on_write = cont;
+
+	NEM_loopback_on_write(this);
+	return NEM_err_none;
+}
+
+static NEM_err_t
+NEM_loopback_stream_read_cont(
+	void              *vthis,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	NEM_loopback_t *this = vthis;
+	return NEM_loopback_read_cont(this, buf, len, cont);
+}
+
+static NEM_err_t
+NEM_loopback_stream_write_cont(
+	void              *vthis,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	NEM_loopback_t *this = vthis;
+	if (NULL != this->on_write) {
+		return NEM_err_static("NEM_loopback_write: interleaved writes");
+	}
+
+	this->wone.iov_base = buf;
+	this->wone.iov_len = len;
+	return NEM_loopback_writev_cont(this, &this->wone, 1, cont);
+}
+
+static NEM_err_t
+NEM_loopback_stream_writev_cont(
+	void              *vthis,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+) {
+	NEM_loopback_t *this = vthis;
+	return NEM_loopback_writev_cont(this, iov, iovcnt, cont);
+}
+
+static NEM_err_t
+NEM_loopback_stream_read(void *vthis, void *buf, size_t len, NEM_thunk1_t *cb)
+{
+	NEM_loopback_t *this = vthis;
+
+	// NB: rthunk is in use while a read is pending, so don't touch it.
+	if (NULL != this->on_read) {
+		NEM_thunk1_discard(&cb);
+		return NEM_err_static("NEM_loopback_read: interleaved reads");
+	}
+
+	NEM_stream_cont_bind(&this->rthunk, cb);
+	NEM_err_t err = NEM_loopback_read_cont(this, buf, len, &this->rthunk);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_cont_unbind(&this->rthunk);
+	}
+
+	return err;
+}
+
+static NEM_err_t
+NEM_loopback_stream_write(void *vthis, void *buf, size_t len, NEM_thunk1_t *cb)
+{
+	NEM_loopback_t *this = vthis;
+
+	if (NULL != this->on_write) {
+		NEM_thunk1_discard(&cb);
+		return NEM_err_static("NEM_loopback_write: interleaved writes");
+	}
+
+	NEM_stream_cont_bind(&this->wthunk, cb);
+	NEM_err_t err = NEM_loopback_stream_write_cont(
+		this,
+		buf,
+		len,
+		&this->wthunk
+	);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_cont_unbind(&this->wthunk);
+	}
+
+	return err;
+}
+
+static size_t
+NEM_loopback_stream_peek(void *vthis, const void **out)
+{
+	NEM_loopback_t *this = vthis;
+	if (0 == this->ring_len) {
+		*out = NULL;
+		return 0;
+	}
+
+	size_t span = this->ring_cap - this->ring_at;
+	*out = this->ring + this->ring_at;
+	return (span > this->ring_len) ? this->ring_len : span;
+}
+
+static NEM_err_t
+NEM_loopback_stream_read_fd(void *vthis, int *fdout)
+{
+	NEM_loopback_t *this = vthis;
+	size_t len = 1;
+	return NEM_loopback_read_fds(this, fdout, &len);
+}
+
+static NEM_err_t
+NEM_loopback_stream_write_fd(void *vthis, int fd)
+{
+	NEM_loopback_t *this = vthis;
+	return NEM_loopback_write_fds(this, &fd, 1);
+}
+
+static NEM_err_t
+NEM_loopback_stream_read_fds(void *vthis, int *fds, size_t *len)
+{
+	NEM_loopback_t *this = vthis;
+	return NEM_loopback_read_fds(this, fds, len);
+}
+
+static NEM_err_t
+NEM_loopback_stream_write_fds(void *vthis, const int *fds, size_t len)
+{
+	NEM_loopback_t *this = vthis;
+	return NEM_loopback_write_fds(this, fds, len);
+}
+
+static NEM_err_t
+NEM_loopback_stream_close(void *vthis)
+{
+	NEM_loopback_t *this = vthis;
+	NEM_loopback_close(this);
+	return NEM_err_none;
+}
+
+static NEM_err_t
+NEM_loopback_stream_on_close(void *vthis, NEM_thunk1_t *cb)
+{
+	NEM_loopback_t *this = vthis;
+	NEM_loopback_on_close(this, cb);
+	return NEM_err_none;
+}
+
+void
+NEM_loopback_init(
+	NEM_loopback_t *this,
+	NEM_loopback_t *that,
+	NEM_kq_t       *kq,
+	size_t          cap
+) {
+	if (0 == cap) {
+		cap = NEM_LOOPBACK_RING;
+	}
+
+	bzero(this, sizeof(*this));
+	bzero(that, sizeof(*that));
+
+	this->kq = that->kq = kq;
+	this->running = that->running = true;
+	this->ring_cap = that->ring_cap = cap;
+	this->ring = NEM_malloc(cap);
+	that->ring = NEM_malloc(cap);
+	this->peer = that;
+	that->peer = this;
+}
+
+void
+NEM_loopback_free(NEM_loopback_t *this)
+{
+	NEM_loopback_shutdown(this);
+}
+
+NEM_stream_t
+NEM_loopback_as_stream(NEM_loopback_t *this)
+{
+	NEM_stream_t stream = {
+		.vt   = &NEM_loopback_stream_vt,
+		.this = this,
+	};
+
+	return stream;
+}
+
+void
+NEM_loopback_close(NEM_loopback_t *this)
+{
+	NEM_loopback_shutdown(this);
+}
+
+void
+NEM_loopback_on_close(NEM_loopback_t *this, NEM_thunk1_t *cb)
+{
+	if (NULL != this->on_close) {
+		NEM_thunk1_discard(&this->on_close);
+	}
+
+	if (!this->running) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_static("NEM_loopback_t: shutdown"),
+			.stream = NEM_loopback_as_stream(this),
+		};
+		NEM_thunk1_invoke(&cb, &ca);
+		return;
+	}
+
+	this->on_close = cb;
+}
+
+NEM_err_t
+NEM_loopback_read_fds(NEM_loopback_t *this, int *fds, size_t *len)
+{
+	if (!this->running) {
+		return NEM_err_static("NEM_loopback_read_fds: already closed");
+	}
+	if (NULL == this->fds) {
+		return NEM_err_static("NEM_loopback_read_fds: no descriptors pending");
+	}
+
+	NEM_loopback_fds_t *batch = this->fds;
+	this->fds = batch->next;
+	if (NULL == this->fds) {
+		this->fds_last = NULL;
+	}
+
+	size_t n = (batch->len > *len) ? *len : batch->len;
+	memcpy(fds, batch->fds, sizeof(int) * n);
+
+	// NB: Same as NEM_fd_read_fds, anything that doesn't fit is closed.
+	for (size_t i = n; i < batch->len; i += 1) {
+		close(batch->fds[i]);
+	}
+
+	*len = n;
+	free(batch);
+	return NEM_err_none;
+}
+
+NEM_err_t
+NEM_loopback_write_fds(NEM_loopback_t *this, const int *fds, size_t len)
+{
+	if (0 == len || NEM_FD_FDS_MAX < len) {
+		return NEM_err_static("NEM_loopback_write_fds: invalid fd count");
+	}
+	if (!this->running || NULL == this->peer) {
+		return NEM_err_static("NEM_loopback_write_fds: already closed");
+	}
+
+	NEM_loopback_fds_t *batch = NEM_malloc(
+		sizeof(NEM_loopback_fds_t) + sizeof(int) * len
+	);
+
+	for (size_t i = 0; i < len; i += 1) {
+		batch->fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+		if (-1 == batch->fds[i]) {
+			NEM_err_t err = NEM_err_errno();
+			for (size_t j = 0; j < i; j += 1) {
+				close(batch->fds[j]);
+			}
+			free(batch);
+			return err;
+		}
+	}
+
+	batch->next = NULL;
+	batch->len = len;
+
+	NEM_loopback_t *peer = this->peer;
+	if (NULL != peer->fds_last) {
+		peer->fds_last->next = batch;
+	}
+	else {
+		peer->fds = batch;
+	}
+	peer->fds_last = batch;
+
+	return NEM_err_none;
+}
+
+const NEM_stream_vt NEM_loopback_stream_vt = {
+	.read        = &NEM_loopback_stream_read,
+	.write       = &NEM_loopback_stream_write,
+	.read_cont   = &NEM_loopback_stream_read_cont,
+	.write_cont  = &NEM_loopback_stream_write_cont,
+	.writev_cont = &NEM_loopback_stream_writev_cont,
+	.peek        = &NEM_loopback_stream_peek,
+	.read_fd     = &NEM_loopback_stream_read_fd,
+	.write_fd    = &NEM_loopback_stream_write_fd,
+	.read_fds    = &NEM_loopback_stream_read_fds,
+	.write_fds   = &NEM_loopback_stream_write_fds,
+	.close       = &NEM_loopback_stream_close,
+	.on_close    = &NEM_loopback_stream_on_close,
+};
@@ -12,13 +12,40 @@ NEM_pmsg_validate(const NEM_pmsg_t *this)
 	if (NEM_PMSG_HDRMAX < this->header_len) {
 		return NEM_err_static("NEM_pmsg_validate: header length exceeds max");
 	}
-	if (NEM_PMSG_BODYMAX < this->body_len) {
+	// NB: An out-of-line body is checked against the size of its descriptor
+	// when it's mapped instead.
+	if (
+		!(this->flags & NEM_PMSGFLAG_OOL)
+		&& NEM_PMSG_BODYMAX < this->body_len
+	) {
 		return NEM_err_static("NEM_pmsg_validate: body length exceeds max");
 	}
+	if ((this->flags & NEM_PMSGFLAG_OOL) && !(this->flags & NEM_PMSGFLAG_FD)) {
+		return NEM_err_static("NEM_pmsg_validate: out-of-line body without fd");
+	}
+	if ((this->flags & NEM_PMSGFLAG_FDS) && (this->flags & NEM_PMSGFLAG_FD)) {
+		return NEM_err_static("NEM_pmsg_validate: both fd and fds");
+	}
 
 	return NEM_err_none;
 }
 
+// NB: NEM_msg_drop_body releases whatever the body is (if it's not part of
+// the message's own allocation) and clears NEM_MSGFLAG_BODY_MAPPED.
+static void
+NEM_msg_drop_body(NEM_msg_t *this)
+{
+	if ((this->flags & NEM_MSGFLAG_BODY_MAPPED)) {
+		if (NULL != this->body && 0 != munmap(this->body, this->packed.body_len)) {
+			NEM_panicf_errno("NEM_msg: munmap");
+		}
+		this->flags &= ~NEM_MSGFLAG_BODY_MAPPED;
+	}
+	else if (!(this->flags & NEM_MSGFLAG_BODY_INLINE)) {
+		free(this->body);
+	}
+}
+
 NEM_msg_t*
 NEM_msg_new(size_t header_len, size_t body_len)
 {
@@ -66,16 +93,15 @@ NEM_msg_free(NEM_msg_t *this)
 	if (!(this->flags & NEM_MSGFLAG_HEADER_INLINE)) {
 		free(this->header);
 	}
-	if (!(this->flags & NEM_MSGFLAG_BODY_INLINE)) {
-		free(this->body);
-	}
+	NEM_msg_drop_body(this);
+	free(this->fds);
 	free(this);
 }
 
 NEM_err_t
 NEM_msg_set_fd(NEM_msg_t *this, int fd)
 {
-	if (0 != this->fd) {
+	if (0 != this->fd || (this->flags & NEM_MSGFLAG_HAS_FDS)) {
 		return NEM_err_static("NEM_msg_set_fd: already set");
 	}
 
@@ -85,6 +111,24 @@ NEM_msg_set_fd(NEM_msg_t *this, int fd)
 	return NEM_err_none;
 }
 
+NEM_err_t
+NEM_msg_set_fds(NEM_msg_t *this, const int *fds, size_t len)
+{
+	if (0 != this->fd || (this->flags & NEM_MSGFLAG_HAS_FDS)) {
+		return NEM_err_static("NEM_msg_set_fds: already set");
+	}
+	if (0 == len || NEM_FD_FDS_MAX < len) {
+		return NEM_err_static("NEM_msg_set_fds: invalid fd count");
+	}
+
+	this->fds = NEM_malloc(sizeof(int) * len);
+	memcpy(this->fds, fds, sizeof(int) * len);
+	this->fds_len = len;
+	this->flags |= NEM_MSGFLAG_HAS_FDS;
+	this->packed.flags |= NEM_PMSGFLAG_FDS;
+	return NEM_err_none;
+}
+
 NEM_err_t
 NEM_msg_set_header_raw(NEM_msg_t *this, void *header, size_t len)
 {
@@ -139,16 +183,110 @@ NEM_msg_header(const NEM_msg_t *this)
 NEM_err_t
 NEM_msg_set_body(NEM_msg_t *this, void *body, size_t len)
 {
-	if (len > NEM_PMSG_BODYMAX) {
+	if (len > UINT32_MAX) {
 		return NEM_err_static("NEM_msg_set_body: too long");
 	}
 
-	if (!(this->flags & NEM_MSGFLAG_BODY_INLINE)) {
-		free(this->body);
-	}
+	NEM_msg_drop_body(this);
 
 	this->flags &= ~NEM_MSGFLAG_BODY_INLINE;
 	this->body = body;
 	this->packed.body_len = (uint32_t) len;
 	return NEM_err_none;
 }
+
+#if defined(__linux__)
+// NB: Everything but F_SEAL_FUTURE_WRITE, which would be redundant.
+static const int NEM_MSG_SEALS =
+	F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+#endif
+
+NEM_err_t
+NEM_msg_seal_body(const NEM_msg_t *this, int *out)
+{
+#if defined(__linux__)
+	int fd = memfd_create("NEM_msg", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	// XXX: FreeBSD 13's memfd_create supports seals; until then the
+	// receiver has to trust the sender not to modify the body after the
+	// fact.
+	int fd = shm_open(SHM_ANON, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+#endif
+	if (-1 == fd) {
+		return NEM_err_errno();
+	}
+
+	const char *buf = this->body;
+	size_t len = this->packed.body_len;
+	while (0 < len) {
+		ssize_t n = write(fd, buf, len);
+		if (-1 == n) {
+			if (EINTR == errno) {
+				continue;
+			}
+			NEM_err_t err = NEM_err_errno();
+			close(fd);
+			return err;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+#if defined(__linux__)
+	if (-1 == fcntl(fd, F_ADD_SEALS, NEM_MSG_SEALS)) {
+		NEM_err_t err = NEM_err_errno();
+		close(fd);
+		return err;
+	}
+#endif
+
+	*out = fd;
+	return NEM_err_none;
+}
+
+NEM_err_t
+NEM_msg_map_body(NEM_msg_t *this, int fd)
+{
+	size_t len = this->packed.body_len;
+	NEM_err_t err = NEM_err_none;
+	void *body = NULL;
+
+	struct stat sb;
+	if (0 != fstat(fd, &sb)) {
+		err = NEM_err_errno();
+		goto done;
+	}
+	if ((size_t) sb.st_size < len) {
+		err = NEM_err_static("NEM_msg_map_body: body is truncated");
+		goto done;
+	}
+
+#if defined(__linux__)
+	// NB: Without the seals the sender could still rewrite (or truncate,
+	// and SIGBUS us) the body out from under the receiver.
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (-1 == seals || NEM_MSG_SEALS != (seals & NEM_MSG_SEALS)) {
+		err = NEM_err_static("NEM_msg_map_body: body is not sealed");
+		goto done;
+	}
+#endif
+
+	if (0 < len) {
+		body = mmap(NULL, len, PROT_READ, MAP_SHARED | MAP_NOCORE, fd, 0);
+		if (MAP_FAILED == body) {
+			err = NEM_err_errno();
+			goto done;
+		}
+	}
+
+	NEM_msg_drop_body(this);
+	this->body = body;
+	this->flags &= ~NEM_MSGFLAG_BODY_INLINE;
+	this->flags |= NEM_MSGFLAG_BODY_MAPPED;
+	this->packed.flags &= ~(NEM_PMSGFLAG_OOL | NEM_PMSGFLAG_FD);
+
+done:
+	close(fd);
+	return err;
+}
@@ -0,0 +1,1051 @@
+#include "nem.h"
+
+#if defined(__linux__)
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/pidfd.h>
+#include <linux/sockios.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+#include <pthread.h>
+
+// NB: Upper bound on the number of epoll events harvested by a single
+// NEM_poller_kevent call. Each epoll event may expand into two kevents.
+static const int NEM_POLLER_MAXEVENTS = 256;
+
+// NB: Fallback write-space estimate for fds that are neither sockets nor
+// pipes (e.g. ttys).
+static const intptr_t NEM_POLLER_WSPACE_DEFAULT = 4096;
+
+typedef enum {
+	NEM_POLLER_KIND_OTHER,
+	NEM_POLLER_KIND_SOCKET,
+	NEM_POLLER_KIND_PIPE,
+}
+NEM_poller_kind_t;
+
+// NEM_poller_note_t is a registered (ident, filter) pair.
+typedef struct {
+	struct kevent kev;
+	bool          active;
+	bool          enabled;
+}
+NEM_poller_note_t;
+
+// NEM_poller_src_t is a single fd registered with epoll. EVFILT_READ and
+// EVFILT_WRITE share the src of the ident they watch (notes[0] and notes[1]
+// respectively). Every other filter owns a private fd (timerfd, signalfd,
+// pidfd) and only uses notes[0].
+typedef struct NEM_poller_src_t {
+	int                      fd;
+	bool                     owned;
+	bool                     registered;
+	NEM_poller_kind_t        kind;
+	intptr_t                 wsize;
+	NEM_poller_note_t        notes[2];
+	struct NEM_poller_src_t *next;
+}
+NEM_poller_src_t;
+
+// NB: Like kevent(2), NEM_poller_kevent can be called on the same poller
+// from multiple threads (e.g. to NOTE_TRIGGER an EVFILT_USER event), so the
+// bookkeeping is guarded by mtx. It's released while blocked in epoll_wait.
+typedef struct {
+	int                epfd;
+	pthread_mutex_t    mtx;
+	NEM_poller_src_t **srcs;
+	size_t             srcs_cap;
+	NEM_poller_src_t  *owned;
+
+	struct kevent *pending;
+	size_t         pending_len;
+	size_t         pending_cap;
+}
+NEM_poller_t;
+
+// NB: Pollers are looked up by their epoll fd since that's the only handle
+// kevent(2) consumers have. The table is two-level so that growing it never
+// moves a slot out from under a concurrent reader on another thread.
+#define NEM_POLLER_CHUNK 1024
+static NEM_poller_t **NEM_pollers[NEM_POLLER_CHUNK];
+static pthread_mutex_t NEM_pollers_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static NEM_poller_t**
+NEM_poller_slot(int kq, bool create)
+{
+	if (0 > kq || kq >= NEM_POLLER_CHUNK * NEM_POLLER_CHUNK) {
+		return NULL;
+	}
+
+	NEM_poller_t ***chunk = &NEM_pollers[kq / NEM_POLLER_CHUNK];
+	NEM_poller_t **slots = __atomic_load_n(chunk, __ATOMIC_ACQUIRE);
+
+	if (NULL == slots && create) {
+		pthread_mutex_lock(&NEM_pollers_mtx);
+		slots = __atomic_load_n(chunk, __ATOMIC_ACQUIRE);
+		if (NULL == slots) {
+			slots = NEM_malloc(sizeof(NEM_poller_t*) * NEM_POLLER_CHUNK);
+			__atomic_store_n(chunk, slots, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&NEM_pollers_mtx);
+	}
+	if (NULL == slots) {
+		return NULL;
+	}
+
+	return &slots[kq % NEM_POLLER_CHUNK];
+}
+
+static NEM_poller_t*
+NEM_poller_get(int kq)
+{
+	NEM_poller_t **slot = NEM_poller_slot(kq, false);
+	return (NULL == slot) ? NULL : *slot;
+}
+
+static void
+NEM_poller_free(NEM_poller_t *this, bool close_owned)
+{
+	NEM_poller_src_t *src = this->owned;
+	while (NULL != src) {
+		NEM_poller_src_t *next = src->next;
+		if (close_owned) {
+			close(src->fd);
+		}
+		this->srcs[src->fd] = NULL;
+		free(src);
+		src = next;
+	}
+
+	for (size_t i = 0; i < this->srcs_cap; i += 1) {
+		free(this->srcs[i]);
+	}
+
+	free(this->srcs);
+	free(this->pending);
+	pthread_mutex_destroy(&this->mtx);
+	free(this);
+}
+
+int
+NEM_poller_open(void)
+{
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == epfd) {
+		return -1;
+	}
+
+	NEM_poller_t **slot = NEM_poller_slot(epfd, true);
+	if (NULL == slot) {
+		close(epfd);
+		errno = EMFILE;
+		return -1;
+	}
+
+	// NB: A leftover poller means the previous owner of this fd closed it
+	// with close(2) instead of NEM_poller_close. Its owned fds may have been
+	// reused since, so don't close them.
+	if (NULL != *slot) {
+		NEM_poller_free(*slot, false);
+	}
+
+	NEM_poller_t *this = NEM_malloc(sizeof(NEM_poller_t));
+	this->epfd = epfd;
+	pthread_mutex_init(&this->mtx, NULL);
+	*slot = this;
+	return epfd;
+}
+
+int
+NEM_poller_close(int kq)
+{
+	NEM_poller_t **slot = NEM_poller_slot(kq, false);
+	if (NULL != slot && NULL != *slot) {
+		NEM_poller_free(*slot, true);
+		*slot = NULL;
+	}
+
+	return close(kq);
+}
+
+static int
+NEM_poller_reserve(NEM_poller_t *this, int fd)
+{
+	if ((size_t) fd < this->srcs_cap) {
+		return 0;
+	}
+
+	size_t cap = (0 == this->srcs_cap) ? 64 : this->srcs_cap;
+	while (cap <= (size_t) fd) {
+		cap *= 2;
+	}
+
+	NEM_poller_src_t **srcs = realloc(this->srcs, sizeof(*srcs) * cap);
+	if (NULL == srcs) {
+		return ENOMEM;
+	}
+
+	bzero(&srcs[this->srcs_cap], sizeof(*srcs) * (cap - this->srcs_cap));
+	this->srcs = srcs;
+	this->srcs_cap = cap;
+	return 0;
+}
+
+static void
+NEM_poller_push(NEM_poller_t *this, const struct kevent *kev)
+{
+	if (this->pending_len == this->pending_cap) {
+		this->pending_cap = (0 == this->pending_cap) ? 16 : 2 * this->pending_cap;
+		this->pending = NEM_panic_if_null(realloc(
+			this->pending,
+			sizeof(struct kevent) * this->pending_cap
+		));
+	}
+
+	this->pending[this->pending_len] = *kev;
+	this->pending_len += 1;
+}
+
+static void
+NEM_poller_purge(NEM_poller_t *this, uintptr_t ident, short filter)
+{
+	size_t j = 0;
+	for (size_t i = 0; i < this->pending_len; i += 1) {
+		struct kevent *kev = &this->pending[i];
+		if (kev->ident == ident && kev->filter == filter) {
+			continue;
+		}
+		this->pending[j] = *kev;
+		j += 1;
+	}
+	this->pending_len = j;
+}
+
+static void
+NEM_poller_emit(
+	NEM_poller_t        *this,
+	struct kevent       *events,
+	int                  nevents,
+	int                 *nout,
+	const struct kevent *kev
+) {
+	if (*nout < nevents) {
+		events[*nout] = *kev;
+		*nout += 1;
+	}
+	else {
+		NEM_poller_push(this, kev);
+	}
+}
+
+/*
+ * EVFILT_READ/EVFILT_WRITE
+ */
+
+static void
+NEM_poller_src_probe(NEM_poller_src_t *src)
+{
+	struct stat st;
+	src->kind = NEM_POLLER_KIND_OTHER;
+	src->wsize = NEM_POLLER_WSPACE_DEFAULT;
+
+	if (0 != fstat(src->fd, &st)) {
+		return;
+	}
+
+	if (S_ISSOCK(st.st_mode)) {
+		int size = 0;
+		socklen_t len = sizeof(size);
+		if (0 == getsockopt(src->fd, SOL_SOCKET, SO_SNDBUF, &size, &len)) {
+			src->kind = NEM_POLLER_KIND_SOCKET;
+			src->wsize = size;
+		}
+	}
+	else if (S_ISFIFO(st.st_mode)) {
+		int size = fcntl(src->fd, F_GETPIPE_SZ);
+		if (0 < size) {
+			src->kind = NEM_POLLER_KIND_PIPE;
+			src->wsize = size;
+		}
+	}
+}
+
+static intptr_t
+NEM_poller_src_ravail(NEM_poller_src_t *src)
+{
+	int avail = 0;
+	if (-1 == ioctl(src->fd, FIONREAD, &avail)) {
+		// NB: Listening sockets don't support FIONREAD. kqueue reports the
+		// length of the accept queue for them, which a TCP listener's
+		// tcpi_unacked is; otherwise all the consumers care about is that
+		// there's something to accept.
+		struct tcp_info info;
+		socklen_t len = sizeof(info);
+		if (
+			0 == getsockopt(src->fd, IPPROTO_TCP, TCP_INFO, &info, &len)
+			&& TCP_LISTEN == info.tcpi_state
+			&& 0 < info.tcpi_unacked
+		) {
+			return info.tcpi_unacked;
+		}
+		return 1;
+	}
+
+	return avail;
+}
+
+static intptr_t
+NEM_poller_src_wavail(NEM_poller_src_t *src)
+{
+	int used = 0;
+
+	switch (src->kind) {
+		case NEM_POLLER_KIND_SOCKET:
+			if (-1 == ioctl(src->fd, SIOCOUTQ, &used)) {
+				used = 0;
+			}
+			break;
+
+		case NEM_POLLER_KIND_PIPE:
+			if (-1 == ioctl(src->fd, FIONREAD, &used)) {
+				used = 0;
+			}
+			break;
+
+		case NEM_POLLER_KIND_OTHER:
+			return src->wsize;
+	}
+
+	return (src->wsize > used) ? src->wsize - used : 0;
+}
+
+static uint32_t
+NEM_poller_src_events(NEM_poller_src_t *src)
+{
+	uint32_t events = 0;
+	bool edge = true;
+
+	for (int i = 0; i < 2; i += 1) {
+		NEM_poller_note_t *note = &src->notes[i];
+		if (!note->active) {
+			continue;
+		}
+
+		if (note->enabled) {
+			events |= (0 == i) ? (EPOLLIN | EPOLLRDHUP) : EPOLLOUT;
+		}
+
+		// NB: epoll can't mix edge/level triggering on one fd, so only go
+		// edge-triggered if everything registered asked for EV_CLEAR.
+		if (!(note->kev.flags & EV_CLEAR)) {
+			edge = false;
+		}
+	}
+
+	if (edge) {
+		events |= EPOLLET;
+	}
+
+	return events;
+}
+
+static int
+NEM_poller_src_sync(NEM_poller_t *this, NEM_poller_src_t *src, int changed)
+{
+	if (!src->notes[0].active && !src->notes[1].active) {
+		if (src->registered) {
+			// NB: Errors are ignored; the fd may already have been closed,
+			// which removes it from the epoll set implicitly.
+			epoll_ctl(this->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+		}
+		this->srcs[src->fd] = NULL;
+		free(src);
+		return 0;
+	}
+
+	struct epoll_event ev = {
+		.events  = NEM_poller_src_events(src),
+		.data.fd = src->fd,
+	};
+
+	int op = (src->registered) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (0 == epoll_ctl(this->epfd, op, src->fd, &ev)) {
+		src->registered = true;
+		return 0;
+	}
+
+	if (EPOLL_CTL_MOD == op && ENOENT == errno) {
+		// NB: The fd was closed (which silently drops it from epoll) and
+		// the number has since been reused. Whatever else was registered
+		// against the old fd is stale; keep only the note being changed.
+		for (int i = 0; i < 2; i += 1) {
+			NEM_poller_note_t *note = &src->notes[i];
+			NEM_poller_purge(this, note->kev.ident, note->kev.filter);
+			if (i != changed) {
+				note->active = false;
+			}
+		}
+
+		src->registered = false;
+		NEM_poller_src_probe(src);
+		return NEM_poller_src_sync(this, src, changed);
+	}
+	if (EPOLL_CTL_ADD == op && EEXIST == errno) {
+		src->registered = true;
+		return NEM_poller_src_sync(this, src, changed);
+	}
+
+	return errno;
+}
+
+static void
+NEM_poller_src_drop(NEM_poller_t *this, NEM_poller_src_t *src)
+{
+	for (int i = 0; i < 2; i += 1) {
+		NEM_poller_note_t *note = &src->notes[i];
+		if (note->active) {
+			NEM_poller_purge(this, note->kev.ident, note->kev.filter);
+		}
+	}
+
+	this->srcs[src->fd] = NULL;
+	free(src);
+}
+
+static bool
+NEM_poller_src_alive(NEM_poller_t *this, NEM_poller_src_t *src)
+{
+	if (!src->registered) {
+		return false;
+	}
+
+	// NB: close(2) silently drops an fd from the epoll set. Re-issuing the
+	// current registration fails with EBADF if the fd is gone, or ENOENT if
+	// the number has been reused by something that isn't registered.
+	struct epoll_event ev = {
+		.events  = NEM_poller_src_events(src),
+		.data.fd = src->fd,
+	};
+	return 0 == epoll_ctl(this->epfd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+static int
+NEM_poller_take(NEM_poller_t *this, struct kevent *events, int nevents)
+{
+	// NB: kqueue discards queued knotes when their fd is closed. Anything
+	// that's been sitting in pending may have been closed (and its udata
+	// freed) by a callback since it was harvested, so check before handing
+	// READ/WRITE events back out.
+	size_t j = 0;
+	for (size_t i = 0; i < this->pending_len; i += 1) {
+		struct kevent *kev = &this->pending[i];
+		if (EVFILT_READ == kev->filter || EVFILT_WRITE == kev->filter) {
+			NEM_poller_src_t *src = (kev->ident < this->srcs_cap)
+				? this->srcs[kev->ident]
+				: NULL;
+			if (NULL == src || src->owned) {
+				continue;
+			}
+			if (!NEM_poller_src_alive(this, src)) {
+				NEM_poller_src_drop(this, src);
+				continue;
+			}
+		}
+		this->pending[j] = *kev;
+		j += 1;
+	}
+	this->pending_len = j;
+
+	size_t n = this->pending_len;
+	if (n > (size_t) nevents) {
+		n = (size_t) nevents;
+	}
+
+	memcpy(events, this->pending, sizeof(struct kevent) * n);
+	memmove(
+		this->pending,
+		&this->pending[n],
+		sizeof(struct kevent) * (this->pending_len - n)
+	);
+	this->pending_len -= n;
+	return (int) n;
+}
+
+static int
+NEM_poller_apply_fd(NEM_poller_t *this, const struct kevent *kev)
+{
+	if (kev->ident > INT_MAX) {
+		return EBADF;
+	}
+
+	int fd = (int) kev->ident;
+	int idx = (EVFILT_READ == kev->filter) ? 0 : 1;
+	NEM_poller_src_t *src = ((size_t) fd < this->srcs_cap)
+		? this->srcs[fd]
+		: NULL;
+
+	if (NULL != src && src->owned) {
+		// NB: Someone's watching one of our private fds. Don't.
+		return EINVAL;
+	}
+
+	if ((kev->flags & EV_DELETE)) {
+		if (NULL == src || !src->notes[idx].active) {
+			return ENOENT;
+		}
+
+		src->notes[idx].active = false;
+		NEM_poller_purge(this, kev->ident, kev->filter);
+		return NEM_poller_src_sync(this, src, idx);
+	}
+
+	if ((kev->flags & EV_ADD)) {
+		bool fresh = (NULL == src);
+		if (fresh) {
+			if (-1 == fcntl(fd, F_GETFD)) {
+				return errno;
+			}
+
+			int err = NEM_poller_reserve(this, fd);
+			if (0 != err) {
+				return err;
+			}
+
+			src = NEM_malloc(sizeof(NEM_poller_src_t));
+			src->fd = fd;
+			NEM_poller_src_probe(src);
+			this->srcs[fd] = src;
+		}
+
+		NEM_poller_note_t prev = src->notes[idx];
+		src->notes[idx].kev = *kev;
+		src->notes[idx].active = true;
+		src->notes[idx].enabled = !(kev->flags & EV_DISABLE);
+
+		int err = NEM_poller_src_sync(this, src, idx);
+		if (0 != err) {
+			if (fresh) {
+				this->srcs[fd] = NULL;
+				free(src);
+			}
+			else {
+				src->notes[idx] = prev;
+			}
+		}
+		return err;
+	}
+
+	if ((kev->flags & (EV_ENABLE | EV_DISABLE))) {
+		if (NULL == src || !src->notes[idx].active) {
+			return ENOENT;
+		}
+
+		src->notes[idx].enabled = !!(kev->flags & EV_ENABLE);
+		return NEM_poller_src_sync(this, src, idx);
+	}
+
+	return 0;
+}
+
+static void
+NEM_poller_collect_fd(
+	NEM_poller_t     *this,
+	NEM_poller_src_t *src,
+	uint32_t          revents,
+	struct kevent    *events,
+	int               nevents,
+	int              *nout
+) {
+	NEM_poller_note_t *rnote = &src->notes[0];
+	NEM_poller_note_t *wnote = &src->notes[1];
+	bool resync = false;
+
+	if (
+		rnote->active
+		&& rnote->enabled
+		&& (revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	) {
+		struct kevent kev = rnote->kev;
+		kev.data = NEM_poller_src_ravail(src);
+		if ((revents & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+			kev.flags |= EV_EOF;
+		}
+		if ((kev.flags & EV_ONESHOT)) {
+			rnote->active = false;
+			resync = true;
+		}
+		NEM_poller_emit(this, events, nevents, nout, &kev);
+	}
+
+	if (
+		wnote->active
+		&& wnote->enabled
+		&& (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+	) {
+		struct kevent kev = wnote->kev;
+		kev.data = NEM_poller_src_wavail(src);
+		if ((revents & (EPOLLHUP | EPOLLERR))) {
+			int soerr = 0;
+			socklen_t len = sizeof(soerr);
+			getsockopt(src->fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+			kev.flags |= EV_EOF;
+			kev.fflags = soerr;
+		}
+		if ((kev.flags & EV_ONESHOT)) {
+			wnote->active = false;
+			resync = true;
+		}
+		NEM_poller_emit(this, events, nevents, nout, &kev);
+	}
+
+	if (resync) {
+		NEM_poller_src_sync(this, src, -1);
+	}
+}
+
+/*
+ * EVFILT_TIMER/EVFILT_SIGNAL/EVFILT_PROC/EVFILT_USER
+ */
+
+static NEM_poller_src_t*
+NEM_poller_find_owned(NEM_poller_t *this, uintptr_t ident, short filter)
+{
+	for (NEM_poller_src_t *src = this->owned; NULL != src; src = src->next) {
+		const struct kevent *kev = &src->notes[0].kev;
+		if (kev->ident == ident && kev->filter == filter) {
+			return src;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+NEM_poller_remove_owned(NEM_poller_t *this, NEM_poller_src_t *src)
+{
+	NEM_poller_src_t **link = &this->owned;
+	while (*link != src) {
+		link = &(*link)->next;
+	}
+	*link = src->next;
+
+	NEM_poller_purge(this, src->notes[0].kev.ident, src->notes[0].kev.filter);
+	this->srcs[src->fd] = NULL;
+	close(src->fd);
+	free(src);
+}
+
+static int
+NEM_poller_timer_arm(NEM_poller_src_t *src, const struct kevent *kev)
+{
+	int64_t ns = kev->data;
+	if ((kev->fflags & NOTE_SECONDS)) {
+		ns *= 1000 * 1000 * 1000;
+	}
+	else if ((kev->fflags & NOTE_USECONDS)) {
+		ns *= 1000;
+	}
+	else if ((kev->fflags & NOTE_NSECONDS)) {
+		/* already ns */
+	}
+	else {
+		ns *= 1000 * 1000;
+	}
+
+	// NB: A zero it_value disarms a timerfd, but a zero kqueue timer
+	// means "as soon as possible".
+	if (0 >= ns) {
+		ns = 1;
+	}
+
+	struct timespec ts = {
+		.tv_sec  = ns / (1000 * 1000 * 1000),
+		.tv_nsec = ns % (1000 * 1000 * 1000),
+	};
+	struct itimerspec its = {
+		.it_value    = ts,
+		.it_interval = (kev->flags & EV_ONESHOT) ? (struct timespec){0} : ts,
+	};
+
+	if (0 != timerfd_settime(src->fd, 0, &its, NULL)) {
+		return errno;
+	}
+
+	return 0;
+}
+
+static int
+NEM_poller_owned_open(const struct kevent *kev)
+{
+	switch (kev->filter) {
+		case EVFILT_TIMER:
+			return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+		case EVFILT_SIGNAL: {
+			sigset_t set;
+			sigemptyset(&set);
+			if (0 != sigaddset(&set, (int) kev->ident)) {
+				return -1;
+			}
+
+			// NB: Blocked signals are queued even when they're ignored,
+			// which is what lets this see SIG_IGN'd signals like kqueue.
+			int ec = pthread_sigmask(SIG_BLOCK, &set, NULL);
+			if (0 != ec) {
+				errno = ec;
+				return -1;
+			}
+
+			return signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+		}
+
+		case EVFILT_PROC:
+			if (!(kev->fflags & NOTE_EXIT)) {
+				errno = EINVAL;
+				return -1;
+			}
+			return pidfd_open((pid_t) kev->ident, 0);
+
+		case EVFILT_USER:
+			return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+}
+
+static int
+NEM_poller_apply_owned(NEM_poller_t *this, const struct kevent *kev)
+{
+	NEM_poller_src_t *src = NEM_poller_find_owned(
+		this,
+		kev->ident,
+		kev->filter
+	);
+
+	if ((kev->flags & EV_DELETE)) {
+		if (NULL == src) {
+			return ENOENT;
+		}
+
+		NEM_poller_remove_owned(this, src);
+		return 0;
+	}
+
+	if ((kev->flags & EV_ADD)) {
+		if (NULL == src) {
+			int fd = NEM_poller_owned_open(kev);
+			if (-1 == fd) {
+				return errno;
+			}
+
+			int err = NEM_poller_reserve(this, fd);
+			if (0 != err) {
+				close(fd);
+				return err;
+			}
+
+			struct epoll_event ev = {
+				.events  = EPOLLIN,
+				.data.fd = fd,
+			};
+			if (0 != epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+				err = errno;
+				close(fd);
+				return err;
+			}
+
+			// NB: A fresh fd can only collide with a src whose fd was
+			// closed out from under it.
+			if (NULL != this->srcs[fd]) {
+				NEM_poller_src_drop(this, this->srcs[fd]);
+			}
+
+			src = NEM_malloc(sizeof(NEM_poller_src_t));
+			src->fd = fd;
+			src->owned = true;
+			src->registered = true;
+			src->next = this->owned;
+			this->owned = src;
+			this->srcs[fd] = src;
+		}
+
+		src->notes[0].kev = *kev;
+		src->notes[0].kev.fflags &= ~NOTE_TRIGGER;
+		src->notes[0].active = true;
+		src->notes[0].enabled = !(kev->flags & EV_DISABLE);
+
+		if (EVFILT_TIMER == kev->filter) {
+			int err = NEM_poller_timer_arm(src, kev);
+			if (0 != err) {
+				NEM_poller_remove_owned(this, src);
+				return err;
+			}
+		}
+	}
+	else if (NULL == src) {
+		return ENOENT;
+	}
+	else if ((kev->flags & (EV_ENABLE | EV_DISABLE))) {
+		src->notes[0].enabled = !!(kev->flags & EV_ENABLE);
+	}
+
+	if (EVFILT_USER == kev->filter && (kev->fflags & NOTE_TRIGGER)) {
+		uint64_t one = 1;
+		if (sizeof(one) != write(src->fd, &one, sizeof(one)) && EAGAIN != errno) {
+			return errno;
+		}
+	}
+
+	return 0;
+}
+
+static void
+NEM_poller_collect_owned(
+	NEM_poller_t     *this,
+	NEM_poller_src_t *src,
+	struct kevent    *events,
+	int               nevents,
+	int              *nout
+) {
+	NEM_poller_note_t *note = &src->notes[0];
+	struct kevent kev = note->kev;
+	bool remove = false;
+
+	switch (kev.filter) {
+		case EVFILT_TIMER: {
+			uint64_t expirations = 0;
+			ssize_t got = read(src->fd, &expirations, sizeof(expirations));
+			if (sizeof(expirations) != got) {
+				return;
+			}
+			kev.data = (intptr_t) expirations;
+			remove = (kev.flags & EV_ONESHOT);
+			break;
+		}
+
+		case EVFILT_SIGNAL: {
+			struct signalfd_siginfo info;
+			kev.data = 0;
+			while (sizeof(info) == read(src->fd, &info, sizeof(info))) {
+				kev.data += 1;
+			}
+			if (0 == kev.data) {
+				return;
+			}
+			remove = (kev.flags & EV_ONESHOT);
+			break;
+		}
+
+		case EVFILT_PROC: {
+			siginfo_t info = {0};
+			if (0 != waitid(P_PIDFD, src->fd, &info, WEXITED | WNOWAIT | WNOHANG)) {
+				// NB: Not our child, so we can't get the status.
+				info.si_status = 0;
+			}
+			else if (0 == info.si_pid) {
+				return;
+			}
+
+			kev.data = info.si_status;
+			kev.fflags = NOTE_EXIT;
+			kev.flags |= EV_EOF;
+			remove = true;
+			break;
+		}
+
+		case EVFILT_USER: {
+			// NB: Reading resets the eventfd, so user events always behave
+			// as if they were EV_CLEAR.
+			uint64_t triggers = 0;
+			ssize_t got = read(src->fd, &triggers, sizeof(triggers));
+			if (sizeof(triggers) != got) {
+				return;
+			}
+			kev.data = 0;
+			kev.fflags |= NOTE_TRIGGER;
+			remove = (kev.flags & EV_ONESHOT);
+			break;
+		}
+
+		default:
+			NEM_panicf("NEM_poller_collect_owned: unknown filter %d", kev.filter);
+	}
+
+	if (note->enabled) {
+		NEM_poller_emit(this, events, nevents, nout, &kev);
+	}
+	if (remove) {
+		NEM_poller_remove_owned(this, src);
+	}
+}
+
+/*
+ * Dispatch
+ */
+
+static int
+NEM_poller_apply(NEM_poller_t *this, const struct kevent *kev)
+{
+	switch (kev->filter) {
+		case EVFILT_READ:
+		case EVFILT_WRITE:
+			return NEM_poller_apply_fd(this, kev);
+
+		case EVFILT_TIMER:
+		case EVFILT_SIGNAL:
+		case EVFILT_PROC:
+		case EVFILT_USER:
+			return NEM_poller_apply_owned(this, kev);
+
+		default:
+			return EINVAL;
+	}
+}
+
+static int
+NEM_poller_timeout_ms(const struct timespec *timeout)
+{
+	if (NULL == timeout) {
+		return -1;
+	}
+
+	// NB: Round up so a sub-millisecond timeout doesn't turn into a
+	// busy-poll.
+	int64_t ms = (int64_t) timeout->tv_sec * 1000;
+	ms += (timeout->tv_nsec + 999999) / 1000000;
+	return (ms > INT_MAX) ? INT_MAX : (int) ms;
+}
+
+static int
+NEM_poller_kevent_locked(
+	NEM_poller_t         *this,
+	const struct kevent  *changes,
+	int                   nchanges,
+	struct kevent        *events,
+	int                   nevents,
+	const struct timespec *timeout
+) {
+	int nout = 0;
+
+	for (int i = 0; i < nchanges; i += 1) {
+		int err = NEM_poller_apply(this, &changes[i]);
+		if (0 == err) {
+			continue;
+		}
+
+		// NB: Mirror kevent(2): report errors in the eventlist if there's
+		// room for them, otherwise bail with errno.
+		if (nout < nevents) {
+			events[nout] = changes[i];
+			events[nout].flags = EV_ERROR;
+			events[nout].data = err;
+			nout += 1;
+			continue;
+		}
+
+		errno = err;
+		return -1;
+	}
+
+	if (0 < nout || 0 >= nevents) {
+		return nout;
+	}
+
+	if (0 < this->pending_len) {
+		return NEM_poller_take(this, events, nevents);
+	}
+
+	struct epoll_event evs[NEM_POLLER_MAXEVENTS];
+	int max = (nevents < NEM_POLLER_MAXEVENTS) ? nevents : NEM_POLLER_MAXEVENTS;
+	int ms = NEM_poller_timeout_ms(timeout);
+
+	// NB: epoll can wake up for things that don't turn into kevents (e.g.
+	// disabled filters or spurious pidfd wakeups). Only an explicit timeout
+	// is allowed to return nothing.
+	while (0 == nout) {
+		pthread_mutex_unlock(&this->mtx);
+		int n = epoll_wait(this->epfd, evs, max, ms);
+		int err = errno;
+		pthread_mutex_lock(&this->mtx);
+		errno = err;
+
+		if (-1 == n) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+
+		for (int i = 0; i < n; i += 1) {
+			int fd = evs[i].data.fd;
+			NEM_poller_src_t *src = ((size_t) fd < this->srcs_cap)
+				? this->srcs[fd]
+				: NULL;
+
+			// NB: Events for srcs removed earlier in this batch are dropped.
+			if (NULL == src) {
+				continue;
+			}
+
+			if (src->owned) {
+				NEM_poller_collect_owned(this, src, events, nevents, &nout);
+			}
+			else {
+				NEM_poller_collect_fd(
+					this,
+					src,
+					evs[i].events,
+					events,
+					nevents,
+					&nout
+				);
+			}
+		}
+
+		if (NULL != timeout) {
+			break;
+		}
+	}
+
+	return nout;
+}
+
+int
+NEM_poller_kevent(
+	int                   kq,
+	const struct kevent  *changes,
+	int                   nchanges,
+	struct kevent        *events,
+	int                   nevents,
+	const struct timespec *timeout
+) {
+	NEM_poller_t *this = NEM_poller_get(kq);
+	if (NULL == this) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&this->mtx);
+	int ret = NEM_poller_kevent_locked(
+		this,
+		changes,
+		nchanges,
+		events,
+		nevents,
+		timeout
+	);
+	int err = errno;
+	pthread_mutex_unlock(&this->mtx);
+
+	errno = err;
+	return ret;
+}
+
+#endif
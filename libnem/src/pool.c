@@ -0,0 +1,335 @@
+#include "nem.h"
+
+// NB: Default bound on the number of tasks waiting for a thread.
+static const size_t NEM_POOL_QUEUE_DEFAULT = 1024;
+
+struct NEM_pool_task_t {
+	NEM_pool_task_t *next;
+	NEM_pool_task_t *prev;
+	uint64_t         id;
+	NEM_pool_fn      fn;
+	NEM_thunk1_t    *done;
+	NEM_kq_t        *kq;
+	uint64_t         queued_at;
+	NEM_err_t        err;
+	atomic_bool      cancelled;
+};
+
+// NB: The task being worked on by this thread, for NEM_pool_cancelled.
+static _Thread_local NEM_pool_task_t *NEM_pool_current = NULL;
+
+static uint64_t
+NEM_pool_clock()
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		NEM_panicf_errno("NEM_pool: clock_gettime");
+	}
+
+	return (uint64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static void
+NEM_pool_record(uint64_t *hist, uint64_t *total, uint64_t *max, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	size_t bucket = 0;
+	while (0 != us && bucket + 1 < NEM_POOL_STATS_BUCKETS) {
+		us >>= 1;
+		bucket += 1;
+	}
+
+	hist[bucket] += 1;
+	*total += ns;
+	if (ns > *max) {
+		*max = ns;
+	}
+}
+
+static void
+NEM_pool_link(NEM_pool_task_t **head, NEM_pool_task_t *task)
+{
+	task->prev = NULL;
+	task->next = *head;
+	if (NULL != *head) {
+		(*head)->prev = task;
+	}
+	*head = task;
+}
+
+static void
+NEM_pool_unlink(NEM_pool_task_t **head, NEM_pool_task_t *task)
+{
+	if (NULL != task->prev) {
+		task->prev->next = task->next;
+	}
+	else {
+		*head = task->next;
+	}
+	if (NULL != task->next) {
+		task->next->prev = task->prev;
+	}
+	task->next = task->prev = NULL;
+}
+
+static void
+NEM_pool_enqueue(NEM_pool_t *this, NEM_pool_task_t *task)
+{
+	task->next = NULL;
+	task->prev = this->queue_tail;
+	if (NULL != this->queue_tail) {
+		this->queue_tail->next = task;
+	}
+	else {
+		this->queue = task;
+	}
+	this->queue_tail = task;
+}
+
+static void
+NEM_pool_dequeue(NEM_pool_t *this, NEM_pool_task_t *task)
+{
+	if (task == this->queue_tail) {
+		this->queue_tail = task->prev;
+	}
+	NEM_pool_unlink(&this->queue, task);
+}
+
+static void
+NEM_pool_on_done(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_pool_task_t *task = NEM_thunk1_ptr(thunk);
+
+	NEM_pool_ca ca = {
+		.err       = task->err,
+		.id        = task->id,
+		.cancelled = atomic_load(&task->cancelled),
+	};
+	if (ca.cancelled && NEM_err_ok(ca.err)) {
+		ca.err = NEM_err_static("NEM_pool: task cancelled");
+	}
+
+	NEM_thunk1_invoke(&task->done, &ca);
+	free(task);
+}
+
+static void
+NEM_pool_complete(NEM_pool_task_t *task)
+{
+	NEM_kq_post(task->kq, NEM_thunk1_new_ptr(&NEM_pool_on_done, task));
+}
+
+static void*
+NEM_pool_run(void *varg)
+{
+	NEM_pool_t *this = varg;
+
+	pthread_mutex_lock(&this->mtx);
+	for (;;) {
+		while (NULL == this->queue && !this->stopping) {
+			pthread_cond_wait(&this->cond, &this->mtx);
+		}
+		if (this->stopping) {
+			break;
+		}
+
+		NEM_pool_task_t *task = this->queue;
+		NEM_pool_dequeue(this, task);
+		NEM_pool_link(&this->running, task);
+		this->stats.queued -= 1;
+		this->stats.running += 1;
+
+		uint64_t started_at = NEM_pool_clock();
+		NEM_pool_record(
+			this->stats.wait,
+			&this->stats.wait_ns,
+			&this->stats.wait_max_ns,
+			started_at - task->queued_at
+		);
+		pthread_mutex_unlock(&this->mtx);
+
+		NEM_pool_current = task;
+		task->err = task->fn(task->done);
+		NEM_pool_current = NULL;
+
+		uint64_t finished_at = NEM_pool_clock();
+		pthread_mutex_lock(&this->mtx);
+		NEM_pool_unlink(&this->running, task);
+		this->stats.running -= 1;
+		this->stats.completed += 1;
+		NEM_pool_record(
+			this->stats.run,
+			&this->stats.run_ns,
+			&this->stats.run_max_ns,
+			finished_at - started_at
+		);
+
+		// NB: Once the task is off the running list NEM_pool_cancel can't
+		// find it, so the cancelled flag is final.
+		pthread_mutex_unlock(&this->mtx);
+		NEM_pool_complete(task);
+		pthread_mutex_lock(&this->mtx);
+	}
+	pthread_mutex_unlock(&this->mtx);
+
+	return NULL;
+}
+
+NEM_err_t
+NEM_pool_init(NEM_pool_t *this, size_t threads, size_t queue_cap)
+{
+	if (0 == threads) {
+		return NEM_err_static("NEM_pool_init: no threads");
+	}
+
+	bzero(this, sizeof(*this));
+	this->queue_cap = (0 == queue_cap) ? NEM_POOL_QUEUE_DEFAULT : queue_cap;
+	this->next_id = 1;
+
+	int ec = pthread_mutex_init(&this->mtx, NULL);
+	if (0 != ec) {
+		errno = ec;
+		return NEM_err_errno();
+	}
+	ec = pthread_cond_init(&this->cond, NULL);
+	if (0 != ec) {
+		pthread_mutex_destroy(&this->mtx);
+		errno = ec;
+		return NEM_err_errno();
+	}
+
+	this->threads = NEM_malloc(sizeof(pthread_t) * threads);
+	for (size_t i = 0; i < threads; i += 1) {
+		ec = pthread_create(&this->threads[i], NULL, &NEM_pool_run, this);
+		if (0 != ec) {
+			NEM_pool_free(this);
+			errno = ec;
+			return NEM_err_errno();
+		}
+
+		this->threads_len += 1;
+	}
+
+	return NEM_err_none;
+}
+
+void
+NEM_pool_free(NEM_pool_t *this)
+{
+	pthread_mutex_lock(&this->mtx);
+	this->stopping = true;
+	pthread_cond_broadcast(&this->cond);
+	pthread_mutex_unlock(&this->mtx);
+
+	for (size_t i = 0; i < this->threads_len; i += 1) {
+		int ec = pthread_join(this->threads[i], NULL);
+		if (0 != ec) {
+			NEM_panicf("NEM_pool_free: pthread_join: %s", strerror(ec));
+		}
+	}
+
+	// NB: The threads are gone, so nothing else is touching the queue.
+	while (NULL != this->queue) {
+		NEM_pool_task_t *task = this->queue;
+		NEM_pool_dequeue(this, task);
+		atomic_store(&task->cancelled, true);
+		this->stats.queued -= 1;
+		this->stats.cancelled += 1;
+		NEM_pool_complete(task);
+	}
+
+	free(this->threads);
+	pthread_cond_destroy(&this->cond);
+	pthread_mutex_destroy(&this->mtx);
+}
+
+uint64_t
+NEM_pool_submit(
+	NEM_pool_t   *this,
+	NEM_pool_fn   fn,
+	NEM_thunk1_t *done,
+	NEM_kq_t     *kq
+) {
+	NEM_pool_task_t *task = NEM_malloc(sizeof(NEM_pool_task_t));
+	task->fn = fn;
+	task->done = done;
+	task->kq = kq;
+	task->err = NEM_err_none;
+	atomic_init(&task->cancelled, false);
+
+	pthread_mutex_lock(&this->mtx);
+	task->id = this->next_id;
+	this->next_id += 1;
+	this->stats.submitted += 1;
+
+	if (this->stats.queued >= this->queue_cap) {
+		this->stats.rejected += 1;
+		pthread_mutex_unlock(&this->mtx);
+
+		// NB: Rejections still complete asynchronously, so callers only have
+		// one path to deal with.
+		task->err = NEM_err_static("NEM_pool_submit: queue full");
+		uint64_t id = task->id;
+		NEM_pool_complete(task);
+		return id;
+	}
+
+	task->queued_at = NEM_pool_clock();
+	NEM_pool_enqueue(this, task);
+	this->stats.queued += 1;
+	if (this->stats.queued > this->stats.queued_max) {
+		this->stats.queued_max = this->stats.queued;
+	}
+
+	uint64_t id = task->id;
+	pthread_cond_signal(&this->cond);
+	pthread_mutex_unlock(&this->mtx);
+
+	return id;
+}
+
+bool
+NEM_pool_cancel(NEM_pool_t *this, uint64_t id)
+{
+	pthread_mutex_lock(&this->mtx);
+
+	for (NEM_pool_task_t *task = this->queue; NULL != task; task = task->next) {
+		if (id == task->id) {
+			NEM_pool_dequeue(this, task);
+			atomic_store(&task->cancelled, true);
+			this->stats.queued -= 1;
+			this->stats.cancelled += 1;
+			pthread_mutex_unlock(&this->mtx);
+
+			NEM_pool_complete(task);
+			return true;
+		}
+	}
+
+	for (NEM_pool_task_t *task = this->running; NULL != task; task = task->next) {
+		if (id == task->id) {
+			atomic_store(&task->cancelled, true);
+			this->stats.cancelled += 1;
+			pthread_mutex_unlock(&this->mtx);
+			return true;
+		}
+	}
+
+	pthread_mutex_unlock(&this->mtx);
+	return false;
+}
+
+bool
+NEM_pool_cancelled()
+{
+	return NULL != NEM_pool_current
+		&& atomic_load(&NEM_pool_current->cancelled);
+}
+
+void
+NEM_pool_get_stats(NEM_pool_t *this, NEM_pool_stats_t *out)
+{
+	pthread_mutex_lock(&this->mtx);
+	*out = this->stats;
+	pthread_mutex_unlock(&this->mtx);
+}
@@ -0,0 +1,1045 @@
+#include "nem.h"
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+// NB: The parent's first byte on the socket is either an offer (sent with
+// NEM_fd_write_fds, so the tag is the descriptor count) or this, if it
+// couldn't set a region up. The child answers an offer with one of the
+// acks.
+static const unsigned char NEM_SHMRING_DECLINE = 0;
+static const char NEM_SHMRING_ACK_RING = 'R';
+static const char NEM_SHMRING_ACK_SOCKET = 'S';
+
+// NB: An offer is the region, the child's doorbell (read end) and the
+// parent's doorbell (write end).
+#define NEM_SHMRING_OFFER_FDS 3
+
+static const uint32_t NEM_SHMRING_MAGIC = 0x4e454d52;
+
+// NB: head is how far the consumer has got and tail how far the producer
+// has. sleeping is set by the consumer when it's waiting on the producer,
+// and starved the other way around; whoever clears one rings the other
+// side's doorbell. Each group sits on its own cache line.
+struct NEM_shmring_hdr_t {
+	_Atomic uint64_t head;
+	char             pad0[56];
+	_Atomic uint64_t tail;
+	char             pad1[56];
+	atomic_uint      sleeping;
+	atomic_uint      starved;
+	char             pad2[56];
+};
+
+// NB: rings[0] is parent-to-child and rings[1] child-to-parent. Their data
+// follows the struct, in the same order. hangup is set by whichever side
+// shuts down first, so the other's writes fail the way they would on a
+// socket rather than filling up a ring nobody's reading.
+typedef struct {
+	uint32_t          magic;
+	atomic_uint       hangup;
+	uint64_t          cap;
+	char              pad1[48];
+	NEM_shmring_hdr_t rings[2];
+}
+NEM_shmring_region_t;
+
+static void NEM_shmring_shutdown(NEM_shmring_t *this);
+
+static NEM_err_t
+NEM_shmring_bell_new(int *rd, int *wr)
+{
+#if defined(__linux__)
+	int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (-1 == fd) {
+		return NEM_err_errno();
+	}
+
+	*rd = fd;
+	*wr = fd;
+#else
+	int fds[2];
+	if (0 != pipe2(fds, O_CLOEXEC | O_NONBLOCK)) {
+		return NEM_err_errno();
+	}
+
+	*rd = fds[0];
+	*wr = fds[1];
+#endif
+	return NEM_err_none;
+}
+
+static void
+NEM_shmring_ring(int fd)
+{
+	// NB: If this fails the doorbell's already full of wakeups.
+#if defined(__linux__)
+	uint64_t one = 1;
+	(void) write(fd, &one, sizeof(one));
+#else
+	char one = 1;
+	(void) write(fd, &one, sizeof(one));
+#endif
+}
+
+static void
+NEM_shmring_drain(int fd)
+{
+	char buf[64];
+	while (0 < read(fd, buf, sizeof(buf))) {
+		// Nothing.
+	}
+}
+
+static void
+NEM_shmring_put(char *data, size_t cap, uint64_t pos, const char *buf, size_t len)
+{
+	size_t at = pos & (cap - 1);
+	size_t first = (cap - at > len) ? len : cap - at;
+	memcpy(data + at, buf, first);
+	memcpy(data, buf + first, len - first);
+}
+
+static void
+NEM_shmring_get(const char *data, size_t cap, uint64_t pos, char *buf, size_t len)
+{
+	size_t at = pos & (cap - 1);
+	size_t first = (cap - at > len) ? len : cap - at;
+	memcpy(buf, data + at, first);
+	memcpy(buf + first, data, len - first);
+}
+
+static void
+NEM_shmring_unmap(NEM_shmring_t *this)
+{
+	if (NULL != this->region && !this->running) {
+		NEM_shmring_region_t *region = this->region;
+		atomic_store(&region->hangup, 1);
+		NEM_shmring_ring(this->peer_bell);
+	}
+
+	if (NULL != this->on_bell) {
+		struct kevent ev;
+		EV_SET(&ev, this->bell, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		kevent(this->sock.kq, &ev, 1, NULL, 0, NULL);
+		NEM_kq_forget(this->on_bell);
+		NEM_thunk_free(this->on_bell);
+		this->on_bell = NULL;
+	}
+	if (NULL != this->region) {
+		munmap(this->region, this->region_len);
+		this->region = NULL;
+	}
+	if (-1 != this->bell) {
+		close(this->bell);
+	}
+	if (-1 != this->peer_bell && this->peer_bell != this->bell) {
+		close(this->peer_bell);
+	}
+	this->bell = -1;
+	this->peer_bell = -1;
+}
+
+// NB: NEM_shmring_attach points the ring pointers at the region. parent
+// picks which ring is which.
+static NEM_err_t
+NEM_shmring_attach(NEM_shmring_t *this, int fd, bool parent)
+{
+	struct stat st;
+	if (0 != fstat(fd, &st)) {
+		return NEM_err_errno();
+	}
+	if ((size_t) st.st_size < sizeof(NEM_shmring_region_t)) {
+		return NEM_err_static("NEM_shmring: region is too small");
+	}
+
+	void *mem = mmap(
+		NULL,
+		st.st_size,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_NOCORE,
+		fd,
+		0
+	);
+	if (MAP_FAILED == mem) {
+		return NEM_err_errno();
+	}
+
+	NEM_shmring_region_t *region = mem;
+	size_t cap = region->cap;
+	if (
+		NEM_SHMRING_MAGIC != region->magic
+		|| 0 == cap
+		|| 0 != (cap & (cap - 1))
+		|| (size_t) st.st_size != sizeof(*region) + 2 * cap
+	) {
+		munmap(mem, st.st_size);
+		return NEM_err_static("NEM_shmring: bad region");
+	}
+
+	this->region = mem;
+	this->region_len = st.st_size;
+	this->cap = cap;
+
+	char *data = (char*) (region + 1);
+	int in = parent ? 1 : 0;
+	this->in = &region->rings[in];
+	this->out = &region->rings[1 - in];
+	this->in_data = data + in * cap;
+	this->out_data = data + (1 - in) * cap;
+	this->rpos = atomic_load(&this->in->head);
+	this->wpos = atomic_load(&this->out->tail);
+
+	return NEM_err_none;
+}
+
+// NB: NEM_shmring_create sets up a region and the doorbells, and fills
+// offer with what the child needs.
+static NEM_err_t
+NEM_shmring_create(NEM_shmring_t *this, int offer[NEM_SHMRING_OFFER_FDS])
+{
+#if defined(__linux__)
+	int fd = memfd_create("NEM_shmring", MFD_CLOEXEC);
+#else
+	int fd = shm_open(SHM_ANON, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+#endif
+	if (-1 == fd) {
+		return NEM_err_errno();
+	}
+
+	NEM_err_t err = NEM_err_none;
+	size_t len = sizeof(NEM_shmring_region_t) + 2 * NEM_SHMRING_CAP;
+	if (0 != ftruncate(fd, len)) {
+		err = NEM_err_errno();
+		goto done;
+	}
+
+	NEM_shmring_region_t *region = mmap(
+		NULL,
+		sizeof(*region),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED,
+		fd,
+		0
+	);
+	if (MAP_FAILED == region) {
+		err = NEM_err_errno();
+		goto done;
+	}
+	region->magic = NEM_SHMRING_MAGIC;
+	region->cap = NEM_SHMRING_CAP;
+	munmap(region, sizeof(*region));
+
+	err = NEM_shmring_attach(this, fd, true);
+	if (!NEM_err_ok(err)) {
+		goto done;
+	}
+
+	int child_rd, parent_wr;
+	err = NEM_shmring_bell_new(&child_rd, &this->peer_bell);
+	if (!NEM_err_ok(err)) {
+		goto done;
+	}
+	err = NEM_shmring_bell_new(&this->bell, &parent_wr);
+	if (!NEM_err_ok(err)) {
+		if (child_rd != this->peer_bell) {
+			close(child_rd);
+		}
+		goto done;
+	}
+
+	offer[0] = fd;
+	offer[1] = child_rd;
+	offer[2] = parent_wr;
+	return NEM_err_none;
+
+done:
+	NEM_shmring_unmap(this);
+	close(fd);
+	return err;
+}
+
+static void
+NEM_shmring_on_write(NEM_shmring_t *this)
+{
+	if (NULL == this->on_write) {
+		return;
+	}
+
+	NEM_shmring_region_t *region = this->region;
+	if (atomic_load(&region->hangup)) {
+		NEM_shmring_shutdown(this);
+		return;
+	}
+
+	bool moved = false;
+	while (0 < this->wcap) {
+		if (0 == this->wiov->iov_len) {
+			this->wiov += 1;
+			this->wiovcnt -= 1;
+			continue;
+		}
+
+		uint64_t head = atomic_load_explicit(
+			&this->out->head,
+			memory_order_acquire
+		);
+		if (this->wpos - head > this->cap) {
+			NEM_shmring_shutdown(this);
+			return;
+		}
+
+		size_t room = this->cap - (this->wpos - head);
+		if (0 == room) {
+			// NB: Ask to be woken up, then check again in case the reader
+			// made room before it could have seen the flag.
+			atomic_store(&this->out->starved, 1);
+			if (this->wpos - atomic_load(&this->out->head) == this->cap) {
+				break;
+			}
+			atomic_store(&this->out->starved, 0);
+			continue;
+		}
+
+		size_t n = (room > this->wiov->iov_len) ? this->wiov->iov_len : room;
+		NEM_shmring_put(
+			this->out_data,
+			this->cap,
+			this->wpos,
+			this->wiov->iov_base,
+			n
+		);
+		this->wpos += n;
+		this->wcap -= n;
+		this->wiov->iov_base = (char*) this->wiov->iov_base + n;
+		this->wiov->iov_len -= n;
+		atomic_store_explicit(&this->out->tail, this->wpos, memory_order_release);
+		moved = true;
+	}
+
+	if (moved) {
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_exchange(&this->out->sleeping, 0)) {
+			NEM_shmring_ring(this->peer_bell);
+		}
+	}
+
+	if (0 == this->wcap) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_none,
+			.stream = NEM_shmring_as_stream(this),
+		};
+		NEM_stream_cont_invoke(&this->on_write, &ca);
+	}
+}
+
+static void
+NEM_shmring_on_read(NEM_shmring_t *this)
+{
+	if (NULL == this->on_read) {
+		return;
+	}
+
+	bool moved = false;
+	while (0 < this->rcap) {
+		uint64_t tail = atomic_load_explicit(
+			&this->in->tail,
+			memory_order_acquire
+		);
+		if (tail - this->rpos > this->cap) {
+			NEM_shmring_shutdown(this);
+			return;
+		}
+
+		size_t avail = tail - this->rpos;
+		if (0 == avail) {
+			atomic_store(&this->in->sleeping, 1);
+			if (atomic_load(&this->in->tail) == this->rpos) {
+				break;
+			}
+			atomic_store(&this->in->sleeping, 0);
+			continue;
+		}
+
+		size_t n = (avail > this->rcap) ? this->rcap : avail;
+		NEM_shmring_get(this->in_data, this->cap, this->rpos, this->rbuf, n);
+		this->rpos += n;
+		this->rbuf += n;
+		this->rcap -= n;
+		atomic_store_explicit(&this->in->head, this->rpos, memory_order_release);
+		moved = true;
+	}
+
+	if (moved) {
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_exchange(&this->in->starved, 0)) {
+			NEM_shmring_ring(this->peer_bell);
+		}
+	}
+
+	if (0 == this->rcap) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_none,
+			.stream = NEM_shmring_as_stream(this),
+		};
+		NEM_stream_cont_invoke(&this->on_read, &ca);
+	}
+}
+
+static void
+NEM_shmring_on_rfwd(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	NEM_shmring_t *this = cont->ctx;
+	ca->stream = NEM_shmring_as_stream(this);
+	NEM_stream_cont_invoke(&this->on_read, ca);
+}
+
+static void
+NEM_shmring_on_wfwd(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	NEM_shmring_t *this = cont->ctx;
+	ca->stream = NEM_shmring_as_stream(this);
+	NEM_stream_cont_invoke(&this->on_write, ca);
+}
+
+static void
+NEM_shmring_fwd_read(NEM_shmring_t *this)
+{
+	NEM_err_t err = NEM_fd_read_cont(
+		&this->sock,
+		this->rbuf,
+		this->rcap,
+		&this->rfwd
+	);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_ca ca = {
+			.err    = err,
+			.stream = NEM_shmring_as_stream(this),
+		};
+		NEM_stream_cont_invoke(&this->on_read, &ca);
+	}
+}
+
+static void
+NEM_shmring_fwd_write(NEM_shmring_t *this)
+{
+	NEM_err_t err = NEM_fd_writev_cont(
+		&this->sock,
+		this->wiov,
+		this->wiovcnt,
+		&this->wfwd
+	);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_ca ca = {
+			.err    = err,
+			.stream = NEM_shmring_as_stream(this),
+		};
+		NEM_stream_cont_invoke(&this->on_write, &ca);
+	}
+}
+
+// NB: NEM_shmring_resume picks up the pending write and read, either of
+// which may complete (and close this) straight away.
+static void
+NEM_shmring_resume(NEM_shmring_t *this)
+{
+	bool gone = false;
+	this->gone = &gone;
+
+	if (NEM_SHMRING_RING == this->mode) {
+		NEM_shmring_on_write(this);
+		if (!gone) {
+			NEM_shmring_on_read(this);
+		}
+	}
+	else if (NEM_SHMRING_SOCKET == this->mode) {
+		if (NULL != this->on_write) {
+			NEM_shmring_fwd_write(this);
+		}
+		if (!gone && NULL != this->on_read) {
+			NEM_shmring_fwd_read(this);
+		}
+	}
+
+	if (!gone) {
+		this->gone = NULL;
+	}
+}
+
+static void
+NEM_shmring_on_bell(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_shmring_t *this = NEM_thunk_ptr(thunk);
+	NEM_shmring_drain(this->bell);
+	NEM_shmring_resume(this);
+}
+
+static NEM_err_t
+NEM_shmring_start_ring(NEM_shmring_t *this)
+{
+	NEM_thunk_t *on_bell = NEM_thunk_new_ptr(&NEM_shmring_on_bell, this);
+
+	struct kevent ev;
+	EV_SET(&ev, this->bell, EVFILT_READ, EV_ADD|EV_CLEAR, 0, 0, on_bell);
+	if (-1 == kevent(this->sock.kq, &ev, 1, NULL, 0, NULL)) {
+		NEM_thunk_free(on_bell);
+		return NEM_err_errno();
+	}
+
+	this->on_bell = on_bell;
+	this->mode = NEM_SHMRING_RING;
+	return NEM_err_none;
+}
+
+static void
+NEM_shmring_on_ack(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	NEM_shmring_t *this = cont->ctx;
+	if (!NEM_err_ok(ca->err)) {
+		// NB: The socket's gone, which shuts this down too.
+		return;
+	}
+
+	if (NEM_SHMRING_ACK_RING == this->ack) {
+		if (!NEM_err_ok(NEM_shmring_start_ring(this))) {
+			NEM_shmring_shutdown(this);
+			return;
+		}
+	}
+	else if (NEM_SHMRING_ACK_SOCKET == this->ack) {
+		NEM_shmring_unmap(this);
+		this->mode = NEM_SHMRING_SOCKET;
+	}
+	else {
+		NEM_shmring_shutdown(this);
+		return;
+	}
+
+	NEM_shmring_resume(this);
+}
+
+static void
+NEM_shmring_on_sock_close(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_shmring_t *this = NEM_thunk1_ptr(thunk);
+
+	// NB: Let a pending read have whatever the peer left in the ring on
+	// its way out.
+	if (this->running && NEM_SHMRING_RING == this->mode) {
+		bool gone = false;
+		this->gone = &gone;
+		NEM_shmring_on_read(this);
+		if (gone) {
+			return;
+		}
+		this->gone = NULL;
+	}
+
+	NEM_shmring_shutdown(this);
+}
+
+static void
+NEM_shmring_shutdown(NEM_shmring_t *this)
+{
+	bool was_running = this->running;
+	this->running = false;
+
+	if (!was_running) {
+		return;
+	}
+
+	if (NULL != this->gone) {
+		*this->gone = true;
+		this->gone = NULL;
+	}
+
+	// NB: In socket mode this takes care of the pending read/write too.
+	NEM_fd_free(&this->sock);
+
+	NEM_stream_ca ca = {
+		.err    = NEM_err_static("NEM_shmring_t: shutdown"),
+		.stream = NEM_shmring_as_stream(this),
+	};
+
+	if (NULL != this->on_write) {
+		NEM_stream_cont_invoke(&this->on_write, &ca);
+	}
+	if (NULL != this->on_read) {
+		NEM_stream_cont_invoke(&this->on_read, &ca);
+	}
+
+	NEM_shmring_unmap(this);
+
+	// NB: Once on_close is invoked this may no longer be valid memory.
+	if (NULL != this->on_close) {
+		NEM_thunk1_invoke(&this->on_close, &ca);
+	}
+}
+
+static NEM_err_t
+NEM_shmring_init_common(NEM_shmring_t *this, int kq, int fd)
+{
+	bzero(this, sizeof(*this));
+	this->bell = -1;
+	this->peer_bell = -1;
+	NEM_stream_cont_init(&this->rfwd, &NEM_shmring_on_rfwd, this);
+	NEM_stream_cont_init(&this->wfwd, &NEM_shmring_on_wfwd, this);
+	NEM_stream_cont_init(&this->ack_cont, &NEM_shmring_on_ack, this);
+
+	// NB: The socket has to notice the peer hanging up without a read in
+	// flight, which rules out NEM_FD_URING.
+	NEM_err_t err = NEM_fd_init_mode(&this->sock, kq, fd, fd, NEM_FD_READY);
+	if (!NEM_err_ok(err)) {
+		return err;
+	}
+
+	this->running = true;
+	NEM_fd_on_close(&this->sock, NEM_thunk1_new_ptr(
+		&NEM_shmring_on_sock_close,
+		this
+	));
+	return NEM_fd_set_read_buffer(&this->sock, 0);
+}
+
+NEM_err_t
+NEM_shmring_init_parent(NEM_shmring_t *this, int kq, int fd)
+{
+	NEM_err_t err = NEM_shmring_init_common(this, kq, fd);
+	if (!NEM_err_ok(err)) {
+		NEM_shmring_free(this);
+		return err;
+	}
+
+	int offer[NEM_SHMRING_OFFER_FDS];
+	if (!NEM_err_ok(NEM_shmring_create(this, offer))) {
+		this->mode = NEM_SHMRING_SOCKET;
+		if (1 != write(this->sock.fd_out, &NEM_SHMRING_DECLINE, 1)) {
+			err = NEM_err_errno();
+			NEM_shmring_free(this);
+			return err;
+		}
+
+		return NEM_err_none;
+	}
+
+	err = NEM_fd_write_fds(&this->sock, offer, NEM_ARRSIZE(offer));
+
+	// NB: The child has its own copies now. On Linux the doorbells are
+	// eventfds this side keeps using.
+	close(offer[0]);
+	if (offer[1] != this->peer_bell) {
+		close(offer[1]);
+	}
+	if (offer[2] != this->bell) {
+		close(offer[2]);
+	}
+
+	if (!NEM_err_ok(err)) {
+		NEM_shmring_free(this);
+		return err;
+	}
+
+	this->mode = NEM_SHMRING_NEGOTIATING;
+	err = NEM_fd_read_cont(&this->sock, &this->ack, 1, &this->ack_cont);
+	if (!NEM_err_ok(err)) {
+		NEM_shmring_free(this);
+		return err;
+	}
+
+	return NEM_err_none;
+}
+
+// NB: NEM_shmring_recv_offer reads the parent's offer, if there is one,
+// without blocking. *len is zero if there was no offer.
+static NEM_err_t
+NEM_shmring_recv_offer(int fd, int fds[NEM_SHMRING_OFFER_FDS], size_t *len)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * NEM_SHMRING_OFFER_FDS)];
+	unsigned char tag = 0;
+	struct iovec iov = {
+		.iov_base = &tag,
+		.iov_len  = 1,
+	};
+	struct msghdr msg = {
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+
+	*len = 0;
+	ssize_t got = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (-1 == got) {
+		return (EAGAIN == errno) ? NEM_err_none : NEM_err_errno();
+	}
+	if (0 == got) {
+		return NEM_err_static("NEM_shmring: parent hung up");
+	}
+
+	for (
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		NULL != cmsg;
+		cmsg = CMSG_NXTHDR(&msg, cmsg)
+	) {
+		if (SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type) {
+			continue;
+		}
+
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < n; i += 1) {
+			int rfd;
+			memcpy(&rfd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(rfd));
+			if (*len < NEM_SHMRING_OFFER_FDS) {
+				fds[*len] = rfd;
+				*len += 1;
+			}
+			else {
+				close(rfd);
+			}
+		}
+	}
+
+	if (NEM_SHMRING_DECLINE == tag && 0 == *len) {
+		return NEM_err_none;
+	}
+	if (NEM_SHMRING_OFFER_FDS != tag || NEM_SHMRING_OFFER_FDS != *len) {
+		for (size_t i = 0; i < *len; i += 1) {
+			close(fds[i]);
+		}
+		*len = 0;
+		return NEM_err_static("NEM_shmring: garbled offer");
+	}
+
+	return NEM_err_none;
+}
+
+NEM_err_t
+NEM_shmring_init_child(NEM_shmring_t *this, int kq, int fd)
+{
+	int offer[NEM_SHMRING_OFFER_FDS];
+	size_t offer_len = 0;
+
+	NEM_err_t err = NEM_shmring_recv_offer(fd, offer, &offer_len);
+	if (!NEM_err_ok(err)) {
+		close(fd);
+		return err;
+	}
+
+	err = NEM_shmring_init_common(this, kq, fd);
+	if (!NEM_err_ok(err)) {
+		for (size_t i = 0; i < offer_len; i += 1) {
+			close(offer[i]);
+		}
+		NEM_shmring_free(this);
+		return err;
+	}
+
+	this->mode = NEM_SHMRING_SOCKET;
+	if (0 == offer_len) {
+		return NEM_err_none;
+	}
+
+	err = NEM_shmring_attach(this, offer[0], false);
+	close(offer[0]);
+	this->bell = offer[1];
+	this->peer_bell = offer[2];
+	if (NEM_err_ok(err)) {
+		err = NEM_shmring_start_ring(this);
+	}
+
+	// NB: Whatever went wrong, the parent can still fall back on the
+	// socket as long as it's told.
+	char ack = NEM_SHMRING_ACK_RING;
+	if (!NEM_err_ok(err)) {
+		NEM_shmring_unmap(this);
+		this->mode = NEM_SHMRING_SOCKET;
+		ack = NEM_SHMRING_ACK_SOCKET;
+	}
+
+	if (1 != write(this->sock.fd_out, &ack, 1)) {
+		err = NEM_err_errno();
+		NEM_shmring_free(this);
+		return err;
+	}
+
+	return NEM_err_none;
+}
+
+void
+NEM_shmring_free(NEM_shmring_t *this)
+{
+	NEM_shmring_shutdown(this);
+}
+
+NEM_stream_t
+NEM_shmring_as_stream(NEM_shmring_t *this)
+{
+	NEM_stream_t stream = {
+		.vt   = &NEM_shmring_stream_vt,
+		.this = this,
+	};
+
+	return stream;
+}
+
+void
+NEM_shmring_close(NEM_shmring_t *this)
+{
+	NEM_shmring_shutdown(this);
+}
+
+void
+NEM_shmring_on_close(NEM_shmring_t *this, NEM_thunk1_t *cb)
+{
+	if (NULL != this->on_close) {
+		NEM_thunk1_discard(&this->on_close);
+	}
+
+	this->on_close = cb;
+}
+
+static NEM_err_t
+NEM_shmring_read_cont(
+	NEM_shmring_t     *this,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	if (!this->running) {
+		return NEM_err_static("NEM_shmring_read: already closed");
+	}
+	if (NULL != this->on_read) {
+		return NEM_err_static("NEM_shmring_read: interleaved reads");
+	}
+
+	this->rbuf = buf;
+	this->rcap = len;
+	this->on_read = cont;
+
+	if (NEM_SHMRING_RING == this->mode) {
+		NEM_shmring_on_read(this);
+	}
+	else if (NEM_SHMRING_SOCKET == this->mode) {
+		NEM_err_t err = NEM_fd_read_cont(&this->sock, buf, len, &this->rfwd);
+		if (!NEM_err_ok(err)) {
+			this->on_read = NULL;
+			return err;
+		}
+	}
+
+	return NEM_err_none;
+}
+
+static NEM_err_t
+NEM_shmring_writev_cont(
+	NEM_shmring_t     *this,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+) {
+	if (!this->running) {
+		return NEM_err_static("NEM_shmring_write: already closed");
+	}
+	if (NULL != this->on_write) {
+		return NEM_err_static("NEM_shmring_write: interleaved writes");
+	}
+
+	this->wiov = iov;
+	this->wiovcnt = iovcnt;
+	this->wcap = 0;
+	for (size_t i = 0; i < iovcnt; i += 1) {
+		this->wcap += iov[i].iov_len;
+	}
+	this->on_write = cont;
+
+	if (NEM_SHMRING_RING == this->mode) {
+		NEM_shmring_on_write(this);
+	}
+	else if (NEM_SHMRING_SOCKET == this->mode) {
+		NEM_err_t err = NEM_fd_writev_cont(
+			&this->sock,
+			iov,
+			iovcnt,
+			&this->wfwd
+		);
+		if (!NEM_err_ok(err)) {
+			this->on_write = NULL;
+			return err;
+		}
+	}
+
+	return NEM_err_none;
+}
+
+static NEM_err_t
+NEM_shmring_stream_read_cont(
+	void              *vthis,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	NEM_shmring_t *this = vthis;
+	return NEM_shmring_read_cont(this, buf, len, cont);
+}
+
+static NEM_err_t
+NEM_shmring_stream_write_cont(
+	void              *vthis,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	NEM_shmring_t *this = vthis;
+	if (NULL != this->on_write) {
+		return NEM_err_static("NEM_shmring_write: interleaved writes");
+	}
+
+	this->wone.iov_base = buf;
+	this->wone.iov_len = len;
+	return NEM_shmring_writev_cont(this, &this->wone, 1, cont);
+}
+
+static NEM_err_t
+NEM_shmring_stream_writev_cont(
+	void              *vthis,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+) {
+	NEM_shmring_t *this = vthis;
+	return NEM_shmring_writev_cont(this, iov, iovcnt, cont);
+}
+
+static NEM_err_t
+NEM_shmring_stream_read(void *vthis, void *buf, size_t len, NEM_thunk1_t *cb)
+{
+	NEM_shmring_t *this = vthis;
+
+	// NB: rthunk is in use while a read is pending, so don't touch it.
+	if (NULL != this->on_read) {
+		NEM_thunk1_discard(&cb);
+		return NEM_err_static("NEM_shmring_read: interleaved reads");
+	}
+
+	NEM_stream_cont_bind(&this->rthunk, cb);
+	NEM_err_t err = NEM_shmring_read_cont(this, buf, len, &this->rthunk);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_cont_unbind(&this->rthunk);
+	}
+
+	return err;
+}
+
+static NEM_err_t
+NEM_shmring_stream_write(void *vthis, void *buf, size_t len, NEM_thunk1_t *cb)
+{
+	NEM_shmring_t *this = vthis;
+
+	if (NULL != this->on_write) {
+		NEM_thunk1_discard(&cb);
+		return NEM_err_static("NEM_shmring_write: interleaved writes");
+	}
+
+	NEM_stream_cont_bind(&this->wthunk, cb);
+	NEM_err_t err = NEM_shmring_stream_write_cont(
+		this,
+		buf,
+		len,
+		&this->wthunk
+	);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_cont_unbind(&this->wthunk);
+	}
+
+	return err;
+}
+
+static size_t
+NEM_shmring_stream_peek(void *vthis, const void **out)
+{
+	NEM_shmring_t *this = vthis;
+	*out = NULL;
+
+	if (NEM_SHMRING_SOCKET == this->mode) {
+		return NEM_fd_peek(&this->sock, out);
+	}
+	if (NEM_SHMRING_RING != this->mode || !this->running) {
+		return 0;
+	}
+
+	uint64_t avail = atomic_load_explicit(
+		&this->in->tail,
+		memory_order_acquire
+	) - this->rpos;
+	if (0 == avail || avail > this->cap) {
+		return 0;
+	}
+
+	size_t at = this->rpos & (this->cap - 1);
+	size_t span = this->cap - at;
+	*out = this->in_data + at;
+	return (span > avail) ? avail : span;
+}
+
+// NB: Descriptors always go over the socket. In ring mode they can show up
+// a moment after the bytes they were sent with; the socket's blocking, so
+// reading them waits that moment out.
+static NEM_err_t
+NEM_shmring_stream_read_fd(void *vthis, int *fdout)
+{
+	NEM_shmring_t *this = vthis;
+	return NEM_fd_read_fd(&this->sock, fdout);
+}
+
+static NEM_err_t
+NEM_shmring_stream_write_fd(void *vthis, int fd)
+{
+	NEM_shmring_t *this = vthis;
+	return NEM_fd_write_fd(&this->sock, fd);
+}
+
+static NEM_err_t
+NEM_shmring_stream_read_fds(void *vthis, int *fds, size_t *len)
+{
+	NEM_shmring_t *this = vthis;
+	return NEM_fd_read_fds(&this->sock, fds, len);
+}
+
+static NEM_err_t
+NEM_shmring_stream_write_fds(void *vthis, const int *fds, size_t len)
+{
+	NEM_shmring_t *this = vthis;
+	return NEM_fd_write_fds(&this->sock, fds, len);
+}
+
+static NEM_err_t
+NEM_shmring_stream_close(void *vthis)
+{
+	NEM_shmring_t *this = vthis;
+	NEM_shmring_close(this);
+	return NEM_err_none;
+}
+
+static NEM_err_t
+NEM_shmring_stream_on_close(void *vthis, NEM_thunk1_t *cb)
+{
+	NEM_shmring_t *this = vthis;
+	NEM_shmring_on_close(this, cb);
+	return NEM_err_none;
+}
+
+const NEM_stream_vt NEM_shmring_stream_vt = {
+	.read        = &NEM_shmring_stream_read,
+	.write       = &NEM_shmring_stream_write,
+	.read_cont   = &NEM_shmring_stream_read_cont,
+	.write_cont  = &NEM_shmring_stream_write_cont,
+	.writev_cont = &NEM_shmring_stream_writev_cont,
+	.peek        = &NEM_shmring_stream_peek,
+	.read_fd     = &NEM_shmring_stream_read_fd,
+	.write_fd    = &NEM_shmring_stream_write_fd,
+	.read_fds    = &NEM_shmring_stream_read_fds,
+	.write_fds   = &NEM_shmring_stream_write_fds,
+	.close       = &NEM_shmring_stream_close,
+	.on_close    = &NEM_shmring_stream_on_close,
+};
@@ -0,0 +1,282 @@
+#include "nem.h"
+
+static void
+NEM_stream_cont_on_thunk(NEM_stream_cont_t *this, NEM_stream_ca *ca)
+{
+	// NB: Take the thunk out first; it may well start another operation
+	// that rebinds this continuation.
+	NEM_thunk1_t *thunk = this->ctx;
+	this->ctx = NULL;
+	NEM_thunk1_invoke(&thunk, ca);
+}
+
+void
+NEM_stream_cont_bind(NEM_stream_cont_t *this, NEM_thunk1_t *thunk)
+{
+	this->fn = &NEM_stream_cont_on_thunk;
+	this->ctx = thunk;
+}
+
+void
+NEM_stream_cont_unbind(NEM_stream_cont_t *this)
+{
+	NEM_thunk1_t *thunk = this->ctx;
+	this->ctx = NULL;
+	NEM_thunk1_discard(&thunk);
+}
+
+// NB: NEM_stream_writev_t is the state of a NEM_stream_writev_cont on a
+// stream that only does one buffer at a time.
+typedef struct {
+	NEM_stream_cont_t  cont;
+	NEM_stream_cont_t *outer;
+	NEM_stream_t       stream;
+	struct iovec      *iov;
+	size_t             iovcnt;
+}
+NEM_stream_writev_t;
+
+static NEM_err_t
+NEM_stream_writev_next(NEM_stream_writev_t *this)
+{
+	while (0 < this->iovcnt && 0 == this->iov->iov_len) {
+		this->iov += 1;
+		this->iovcnt -= 1;
+	}
+
+	if (0 == this->iovcnt) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_none,
+			.stream = this->stream,
+		};
+		NEM_stream_cont_t *outer = this->outer;
+		free(this);
+		NEM_stream_cont_invoke(&outer, &ca);
+		return NEM_err_none;
+	}
+
+	struct iovec *iov = this->iov;
+	this->iov += 1;
+	this->iovcnt -= 1;
+
+	return NEM_stream_write_cont(
+		this->stream,
+		iov->iov_base,
+		iov->iov_len,
+		&this->cont
+	);
+}
+
+static void
+NEM_stream_writev_on_write(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	NEM_stream_writev_t *this = cont->ctx;
+	NEM_err_t err = ca->err;
+
+	if (NEM_err_ok(err)) {
+		err = NEM_stream_writev_next(this);
+	}
+	if (!NEM_err_ok(err)) {
+		NEM_stream_ca eca = {
+			.err    = err,
+			.stream = this->stream,
+		};
+		NEM_stream_cont_t *outer = this->outer;
+		free(this);
+		NEM_stream_cont_invoke(&outer, &eca);
+	}
+}
+
+NEM_err_t
+NEM_stream_writev_cont(
+	NEM_stream_t       this,
+	struct iovec      *iov,
+	size_t             iovcnt,
+	NEM_stream_cont_t *cont
+) {
+	if (NULL != this.vt->writev_cont) {
+		return this.vt->writev_cont(this.this, iov, iovcnt, cont);
+	}
+
+	// NB: Zero-length writes still go through the stream so that they
+	// complete asynchronously (and report a closed stream) like any other.
+	if (0 == iovcnt) {
+		return NEM_stream_write_cont(this, NULL, 0, cont);
+	}
+
+	NEM_stream_writev_t *state = NEM_malloc(sizeof(NEM_stream_writev_t));
+	NEM_stream_cont_init(&state->cont, &NEM_stream_writev_on_write, state);
+	state->outer = cont;
+	state->stream = this;
+	state->iov = iov;
+	state->iovcnt = iovcnt;
+
+	struct iovec *first = state->iov;
+	state->iov += 1;
+	state->iovcnt -= 1;
+
+	NEM_err_t err = NEM_stream_write_cont(
+		this,
+		first->iov_base,
+		first->iov_len,
+		&state->cont
+	);
+	if (!NEM_err_ok(err)) {
+		free(state);
+	}
+
+	return err;
+}
+
+// NB: Size of the buffer NEM_stream_sendfile_copy bounces the file through.
+static const size_t NEM_STREAM_SENDFILE_CHUNK = 64 * 1024;
+
+typedef struct {
+	NEM_stream_cont_t  cont;
+	NEM_stream_cont_t *outer;
+	NEM_stream_t       stream;
+	int                fd;
+	off_t              off;
+	size_t             len;
+	size_t             chunk;
+	char               buf[];
+}
+NEM_stream_sendfile_t;
+
+static NEM_err_t
+NEM_stream_sendfile_next(NEM_stream_sendfile_t *this)
+{
+	if (0 == this->len) {
+		NEM_stream_ca ca = {
+			.err    = NEM_err_none,
+			.stream = this->stream,
+		};
+		NEM_stream_cont_t *outer = this->outer;
+		free(this);
+		NEM_stream_cont_invoke(&outer, &ca);
+		return NEM_err_none;
+	}
+
+	size_t want = this->len > NEM_STREAM_SENDFILE_CHUNK
+		? NEM_STREAM_SENDFILE_CHUNK
+		: this->len;
+
+	ssize_t got;
+	do {
+		got = pread(this->fd, this->buf, want, this->off);
+	}
+	while (-1 == got && EINTR == errno);
+
+	if (-1 == got) {
+		return NEM_err_errno();
+	}
+	if (0 == got) {
+		return NEM_err_static("NEM_stream_sendfile: file is too short");
+	}
+
+	this->chunk = got;
+	return NEM_stream_write_cont(this->stream, this->buf, got, &this->cont);
+}
+
+static void
+NEM_stream_sendfile_on_write(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	NEM_stream_sendfile_t *this = cont->ctx;
+	NEM_err_t err = ca->err;
+
+	if (NEM_err_ok(err)) {
+		this->off += this->chunk;
+		this->len -= this->chunk;
+		err = NEM_stream_sendfile_next(this);
+	}
+	if (!NEM_err_ok(err)) {
+		NEM_stream_ca eca = {
+			.err    = err,
+			.stream = this->stream,
+		};
+		NEM_stream_cont_t *outer = this->outer;
+		free(this);
+		NEM_stream_cont_invoke(&outer, &eca);
+	}
+}
+
+NEM_err_t
+NEM_stream_sendfile_copy(
+	NEM_stream_t       this,
+	int                fd,
+	off_t              off,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	// NB: As with NEM_stream_writev_cont, an empty transfer still goes
+	// through the stream.
+	if (0 == len) {
+		return NEM_stream_write_cont(this, NULL, 0, cont);
+	}
+
+	size_t buf_len = len > NEM_STREAM_SENDFILE_CHUNK
+		? NEM_STREAM_SENDFILE_CHUNK
+		: len;
+	NEM_stream_sendfile_t *state = NEM_malloc(
+		sizeof(NEM_stream_sendfile_t) + buf_len
+	);
+	NEM_stream_cont_init(&state->cont, &NEM_stream_sendfile_on_write, state);
+	state->outer = cont;
+	state->stream = this;
+	state->fd = fd;
+	state->off = off;
+	state->len = len;
+
+	NEM_err_t err = NEM_stream_sendfile_next(state);
+	if (!NEM_err_ok(err)) {
+		free(state);
+	}
+
+	return err;
+}
+
+NEM_err_t
+NEM_stream_sendfile_cont(
+	NEM_stream_t       this,
+	int                fd,
+	off_t              off,
+	size_t             len,
+	NEM_stream_cont_t *cont
+) {
+	if (NULL != this.vt->sendfile_cont) {
+		return this.vt->sendfile_cont(this.this, fd, off, len, cont);
+	}
+
+	return NEM_stream_sendfile_copy(this, fd, off, len, cont);
+}
+
+static void
+NEM_stream_sendfile_on_thunk(NEM_stream_cont_t *this, NEM_stream_ca *ca)
+{
+	NEM_thunk1_t *thunk = this->ctx;
+	free(this);
+	NEM_thunk1_invoke(&thunk, ca);
+}
+
+NEM_err_t
+NEM_stream_sendfile(
+	NEM_stream_t  this,
+	int           fd,
+	off_t         off,
+	size_t        len,
+	NEM_thunk1_t *cb
+) {
+	// NB: There's no per-stream slot to bind the thunk to (as there is for
+	// reads and writes), so the continuation gets allocated. A transfer
+	// that's worth using this for dwarfs that.
+	NEM_stream_cont_t *cont = NEM_malloc(sizeof(NEM_stream_cont_t));
+	NEM_stream_cont_init(cont, &NEM_stream_sendfile_on_thunk, cb);
+
+	NEM_err_t err = NEM_stream_sendfile_cont(this, fd, off, len, cont);
+	if (!NEM_err_ok(err)) {
+		free(cont);
+		NEM_thunk1_discard(&cb);
+	}
+
+	return err;
+}
@@ -3,19 +3,194 @@
 
 #include "nem.h"
 
+// NB: Thunks are carved out of blocks with a small header in front that
+// records which size class the block belongs to. Freed blocks are kept on
+// per-thread free lists (one per class) rather than going back to malloc,
+// since almost every async step allocates a thunk and frees it right after.
+// Blocks are individually allocated, so a thunk created on one thread can
+// be freed on another (e.g. via NEM_kq_post); it just ends up in that
+// thread's cache.
+static const size_t NEM_thunk_classes[NEM_THUNK_CLASSES] = {
+	8, 16, 32, 64, 128, 256,
+};
+
+// NB: How many free blocks of each class a thread hangs on to.
+static const size_t NEM_THUNK_CACHE_MAX = 256;
+
+// NB: Blocks bigger than the largest class are plain malloc/free.
+static const uint32_t NEM_THUNK_CLASS_NONE = NEM_THUNK_CLASSES;
+
+static const uint32_t NEM_THUNK_LIVE = 0x4e454d54;
+static const uint32_t NEM_THUNK_DEAD = 0x64656164;
+static const uint32_t NEM_THUNK_LIVE_DEBUG = 0x4e454d44;
+
+static const int NEM_THUNK_POISON = 0xa5;
+
+// NB: len is the size of the data area the block was allocated with.
+typedef struct {
+	uint32_t cls;
+	uint32_t state;
+	uint64_t len;
+}
+NEM_thunk_hdr_t;
+
+_Static_assert(
+	sizeof(NEM_thunk_hdr_t) % _Alignof(max_align_t) == 0,
+	"NEM_thunk_hdr_t breaks thunk alignment"
+);
+
+// NB: A free block stores the link to the next one where the thunk's fn
+// would be.
+typedef struct NEM_thunk_free_t {
+	struct NEM_thunk_free_t *next;
+}
+NEM_thunk_free_t;
+
+typedef struct {
+	NEM_thunk_free_t *heads[NEM_THUNK_CLASSES];
+	size_t            lens[NEM_THUNK_CLASSES];
+}
+NEM_thunk_cache_t;
+
+static _Thread_local NEM_thunk_cache_t NEM_thunk_cache;
+static pthread_key_t NEM_thunk_cache_key;
+static pthread_once_t NEM_thunk_cache_once = PTHREAD_ONCE_INIT;
+static _Thread_local bool NEM_thunk_cache_keyed = false;
+
+static atomic_bool NEM_thunk_debug = false;
+static atomic_size_t NEM_thunk_live_count = 0;
+
+static void
+NEM_thunk_cache_drain(void *unused)
+{
+	for (size_t i = 0; i < NEM_THUNK_CLASSES; i += 1) {
+		while (NULL != NEM_thunk_cache.heads[i]) {
+			NEM_thunk_free_t *blk = NEM_thunk_cache.heads[i];
+			NEM_thunk_cache.heads[i] = blk->next;
+			free(((NEM_thunk_hdr_t*) blk) - 1);
+		}
+		NEM_thunk_cache.lens[i] = 0;
+	}
+}
+
+static void
+NEM_thunk_cache_key_init()
+{
+	if (0 != pthread_key_create(&NEM_thunk_cache_key, &NEM_thunk_cache_drain)) {
+		NEM_panic("NEM_thunk: pthread_key_create");
+	}
+}
+
+static void
+NEM_thunk_cache_attach()
+{
+	// NB: The key's value is never read; setting it just gets the
+	// destructor to run (and drain the cache) when the thread exits.
+	pthread_once(&NEM_thunk_cache_once, &NEM_thunk_cache_key_init);
+	pthread_setspecific(NEM_thunk_cache_key, &NEM_thunk_cache);
+	NEM_thunk_cache_keyed = true;
+}
+
+static uint32_t
+NEM_thunk_class(size_t sz)
+{
+	for (uint32_t i = 0; i < NEM_THUNK_CLASSES; i += 1) {
+		if (sz <= NEM_thunk_classes[i]) {
+			return i;
+		}
+	}
+
+	return NEM_THUNK_CLASS_NONE;
+}
+
+static void*
+NEM_thunk_alloc(size_t head, size_t sz)
+{
+	uint32_t cls = NEM_thunk_class(sz);
+	NEM_thunk_hdr_t *hdr = NULL;
+
+	if (NEM_THUNK_CLASS_NONE != cls && NULL != NEM_thunk_cache.heads[cls]) {
+		NEM_thunk_free_t *blk = NEM_thunk_cache.heads[cls];
+		NEM_thunk_cache.heads[cls] = blk->next;
+		NEM_thunk_cache.lens[cls] -= 1;
+		hdr = ((NEM_thunk_hdr_t*) blk) - 1;
+
+		// NB: Fresh blocks come from calloc, and callers are used to the
+		// inline data starting out zeroed.
+		bzero(blk, head + sz);
+	}
+	else {
+		size_t len = (NEM_THUNK_CLASS_NONE == cls)
+			? sz
+			: NEM_thunk_classes[cls];
+		hdr = NEM_malloc(sizeof(NEM_thunk_hdr_t) + head + len);
+		hdr->cls = cls;
+		hdr->len = len;
+	}
+
+	if (atomic_load_explicit(&NEM_thunk_debug, memory_order_relaxed)) {
+		hdr->state = NEM_THUNK_LIVE_DEBUG;
+		atomic_fetch_add(&NEM_thunk_live_count, 1);
+	}
+	else {
+		hdr->state = NEM_THUNK_LIVE;
+	}
+
+	return hdr + 1;
+}
+
+static void
+NEM_thunk_release(void *ptr)
+{
+	// NB: Like free(3), releasing NULL is fine; NEM_thunk_free is often
+	// handed whatever's in a struct field.
+	if (NULL == ptr) {
+		return;
+	}
+
+	NEM_thunk_hdr_t *hdr = ((NEM_thunk_hdr_t*) ptr) - 1;
+
+	if (NEM_THUNK_LIVE_DEBUG == hdr->state) {
+		atomic_fetch_sub(&NEM_thunk_live_count, 1);
+
+		// NB: Scribble over the whole block so anything still holding onto
+		// the thunk reads garbage rather than plausible-looking data.
+		memset(ptr, NEM_THUNK_POISON, sizeof(NEM_thunk1_t) + hdr->len);
+	}
+	else if (NEM_THUNK_LIVE != hdr->state) {
+		NEM_panicf("NEM_thunk: double free of %p", ptr);
+	}
+	hdr->state = NEM_THUNK_DEAD;
+
+	uint32_t cls = hdr->cls;
+	if (NEM_THUNK_CLASS_NONE == cls
+		|| NEM_thunk_cache.lens[cls] >= NEM_THUNK_CACHE_MAX
+	) {
+		free(hdr);
+		return;
+	}
+
+	if (!NEM_thunk_cache_keyed) {
+		NEM_thunk_cache_attach();
+	}
+
+	NEM_thunk_free_t *blk = ptr;
+	blk->next = NEM_thunk_cache.heads[cls];
+	NEM_thunk_cache.heads[cls] = blk;
+	NEM_thunk_cache.lens[cls] += 1;
+}
+
 NEM_thunk1_t*
 NEM_thunk1_new(NEM_thunk1_fn fn, size_t sz)
 {
-	size_t len = sizeof(NEM_thunk1_t) + sz;
-	NEM_thunk1_t *this = NEM_malloc(len);
+	NEM_thunk1_t *this = NEM_thunk_alloc(sizeof(NEM_thunk1_t), sz);
 	this->fn = fn;
 	return this;
 }
 NEM_thunk_t*
 NEM_thunk_new(NEM_thunk_fn fn, size_t sz)
 {
-	size_t len = sizeof(NEM_thunk_t) + sz;
-	NEM_thunk_t *this = NEM_malloc(len);
+	NEM_thunk_t *this = NEM_thunk_alloc(sizeof(NEM_thunk_t), sz);
 	this->fn = fn;
 	return this;
 }
@@ -46,6 +221,12 @@ NEM_thunk_ptr(NEM_thunk_t *this)
 	return *(void**) this->data;
 }
 
+void
+NEM_thunk1_release(NEM_thunk1_t *this)
+{
+	NEM_thunk_release(this);
+}
+
 void
 NEM_thunk1_discard(NEM_thunk1_t **this)
 {
@@ -53,12 +234,30 @@ NEM_thunk1_discard(NEM_thunk1_t **this)
 		return;
 	}
 
-	free(*this);
+	NEM_thunk_release(*this);
 	*this = NULL;
 }
 
 void
 NEM_thunk_free(NEM_thunk_t *this)
 {
-	free(this);
+	NEM_thunk_release(this);
+}
+
+void
+NEM_thunk_set_debug(bool enabled)
+{
+	atomic_store(&NEM_thunk_debug, enabled);
+}
+
+size_t
+NEM_thunk_live()
+{
+	return atomic_load(&NEM_thunk_live_count);
+}
+
+void
+NEM_thunk_cache_flush()
+{
+	NEM_thunk_cache_drain(NULL);
 }
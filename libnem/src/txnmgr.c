@@ -5,76 +5,173 @@ static const int NEM_TXN_DEFAULT_TIMEOUT_MS = 15 * 1000;
 static void NEM_txnmgr_remove_txn(NEM_txnmgr_t *this, NEM_txn_t *txn);
 static void NEM_txnmgr_add_txn(NEM_txnmgr_t *this, NEM_txn_t *txn);
 static void NEM_txnmgr_set_timeout(
-	NEM_txnmgr_t  *this,
-	NEM_txn_t     *txn,
-	struct timeval t
+	NEM_txnmgr_t *this,
+	NEM_txn_t    *txn,
+	uint64_t      at
 );
 
-static inline int NEM_txn_cmp(const void *lhs, const void *rhs);
-static inline int NEM_txn_cmp_timeout(const void *lhs, const void *rhs);
+// NB: NEM_TXNTAB_MIN is the smallest a NEM_txntab_t gets once it's had
+// anything in it. NEM_TXNTAB_NONE is the slot of a transaction that isn't
+// in a table.
+static const size_t NEM_TXNTAB_MIN = 16;
+#define NEM_TXNTAB_NONE SIZE_MAX
 
-SPLAY_PROTOTYPE(NEM_txnin_tree_t, NEM_txnin_t, link, NEM_txn_cmp);
-SPLAY_GENERATE(NEM_txnin_tree_t, NEM_txnin_t, link, NEM_txn_cmp);
-SPLAY_PROTOTYPE(NEM_txnout_tree_t, NEM_txnout_t, link, NEM_txn_cmp);
-SPLAY_GENERATE(NEM_txnout_tree_t, NEM_txnout_t, link, NEM_txn_cmp);
-SPLAY_PROTOTYPE(NEM_txn_tree_t, NEM_txn_t, link, NEM_txn_cmp_timeout);
-SPLAY_GENERATE(NEM_txn_tree_t, NEM_txn_t, link, NEM_txn_cmp_timeout);
+static inline size_t
+NEM_txntab_hash(uint64_t seq, size_t cap)
+{
+	// NB: Fibonacci hashing. Our own seqs are dense and would do fine
+	// masked off as-is, but incoming ones are whatever the remote sends.
+	uint64_t h = seq * 0x9E3779B97F4A7C15ULL;
+	return (size_t)(h >> 32) & (cap - 1);
+}
 
-static inline bool
-time_is_zero(struct timeval t)
+static void
+NEM_txntab_resize(NEM_txntab_t *this, size_t cap)
 {
-	return 0 == t.tv_sec && 0 == t.tv_usec;
+	NEM_txn_t **old = this->slots;
+	size_t old_cap = this->cap;
+
+	this->cap = cap;
+	this->slots = NEM_malloc(sizeof(NEM_txn_t*) * cap);
+	this->stale = false;
+
+	for (size_t i = 0; i < old_cap; i += 1) {
+		NEM_txn_t *txn = old[i];
+		if (NULL == txn) {
+			continue;
+		}
+
+		size_t idx = NEM_txntab_hash(txn->seq, cap);
+		while (NULL != this->slots[idx]) {
+			idx = (idx + 1) & (cap - 1);
+		}
+		this->slots[idx] = txn;
+		txn->slot = idx;
+	}
+
+	free(old);
+}
+
+static void
+NEM_txntab_free(NEM_txntab_t *this)
+{
+	free(this->slots);
+	bzero(this, sizeof(*this));
 }
 
-static inline bool
-time_is_less(struct timeval t1, struct timeval t2) {
-	if (t1.tv_sec < t2.tv_sec) {
-		return true;
+static NEM_txn_t*
+NEM_txntab_find(const NEM_txntab_t *this, uint64_t seq)
+{
+	if (0 == this->len) {
+		return NULL;
 	}
-	else if (t1.tv_sec == t2.tv_sec && t1.tv_usec < t2.tv_usec) {
-		return true;
+
+	size_t idx = NEM_txntab_hash(seq, this->cap);
+	while (NULL != this->slots[idx]) {
+		if (seq == this->slots[idx]->seq) {
+			return this->slots[idx];
+		}
+		idx = (idx + 1) & (this->cap - 1);
 	}
 
-	return false;
+	return NULL;
 }
 
-static inline int
-NEM_txn_cmp(const void *vlhs, const void *vrhs)
+static bool
+NEM_txntab_insert(NEM_txntab_t *this, NEM_txn_t *txn)
 {
-	const NEM_txn_t *lhs = vlhs;
-	const NEM_txn_t *rhs = vrhs;
+	txn->slot = NEM_TXNTAB_NONE;
+
+	if (0 < this->walking) {
+		NEM_panic("NEM_txntab_insert: cannot insert while walking");
+	}
 
-	if (lhs->seq < rhs->seq) {
-		return -1;
+	// NB: Grow at 3/4 full. Shrinking happens here rather than on removal
+	// so that a burst of completions doesn't rehash the table over and
+	// over on its way down.
+	if (0 == this->cap) {
+		NEM_txntab_resize(this, NEM_TXNTAB_MIN);
 	}
-	else if (lhs->seq > rhs->seq) {
-		return 1;
+	else if (4 * (this->len + 1) > 3 * this->cap) {
+		NEM_txntab_resize(this, 2 * this->cap);
 	}
-	else {
-		return 0;
+	else if (NEM_TXNTAB_MIN < this->cap && this->len < this->cap / 8) {
+		NEM_txntab_resize(this, this->cap / 2);
+	}
+
+	size_t idx = NEM_txntab_hash(txn->seq, this->cap);
+	while (NULL != this->slots[idx]) {
+		if (txn->seq == this->slots[idx]->seq) {
+			return false;
+		}
+		idx = (idx + 1) & (this->cap - 1);
 	}
+
+	this->slots[idx] = txn;
+	this->len += 1;
+	txn->slot = idx;
+	return true;
 }
 
-static inline int
-NEM_txn_cmp_timeout(const void *vlhs, const void *vrhs)
+static void
+NEM_txntab_remove(NEM_txntab_t *this, NEM_txn_t *txn)
 {
-	const NEM_txn_t *lhs = vlhs;
-	const NEM_txn_t *rhs = vrhs;
+	size_t hole = txn->slot;
+	if (hole >= this->cap || txn != this->slots[hole]) {
+		return;
+	}
+
+	this->slots[hole] = NULL;
+	this->len -= 1;
+	txn->slot = NEM_TXNTAB_NONE;
 
-	if (lhs->timeout.tv_sec < rhs->timeout.tv_sec) {
-		return -1;
+	if (0 < this->walking) {
+		this->stale = true;
+		return;
 	}
-	else if (lhs->timeout.tv_sec > rhs->timeout.tv_sec) {
-		return 1;
+
+	// NB: Backward-shift deletion rather than tombstones: pull each later
+	// entry of the run into the hole unless that would put it before its
+	// home slot. This keeps probe lengths from creeping up over time on a
+	// long-lived connection.
+	size_t mask = this->cap - 1;
+	size_t idx = hole;
+	for (;;) {
+		idx = (idx + 1) & mask;
+		NEM_txn_t *next = this->slots[idx];
+		if (NULL == next) {
+			break;
+		}
+
+		size_t home = NEM_txntab_hash(next->seq, this->cap);
+		if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+			this->slots[hole] = next;
+			this->slots[idx] = NULL;
+			next->slot = hole;
+			hole = idx;
+		}
 	}
-	else if (lhs->timeout.tv_usec < rhs->timeout.tv_usec) {
-		return -1;
+}
+
+// NB: NEM_txntab_walk calls fn on each transaction in the table. fn can
+// remove any transaction from the table (including ones the walk hasn't
+// reached yet, which it then won't) but can't add any.
+typedef void (*NEM_txntab_fn)(NEM_txnmgr_t *mgr, NEM_txn_t *txn);
+
+static void
+NEM_txntab_walk(NEM_txntab_t *this, NEM_txntab_fn fn, NEM_txnmgr_t *mgr)
+{
+	this->walking += 1;
+	for (size_t i = 0; i < this->cap; i += 1) {
+		if (NULL != this->slots[i]) {
+			fn(mgr, this->slots[i]);
+		}
 	}
-	else if (lhs->timeout.tv_usec > rhs->timeout.tv_usec) {
-		return 1;
+	this->walking -= 1;
+
+	if (0 == this->walking && this->stale) {
+		NEM_txntab_resize(this, this->cap);
 	}
-	
-	return 0;
 }
 
 static void
@@ -97,11 +194,29 @@ NEM_txn_add_child(NEM_txn_t *this, NEM_txn_t *child)
 	this->children[this->children_len - 1] = child;
 }
 
+static void
+NEM_txn_remove_child(NEM_txn_t *this, NEM_txn_t *child)
+{
+	for (size_t i = 0; i < this->children_len; i += 1) {
+		if (child == this->children[i]) {
+			this->children_len -= 1;
+			this->children[i] = this->children[this->children_len];
+			break;
+		}
+	}
+
+	child->parent = NULL;
+}
+
 static void
 NEM_txn_free(NEM_txn_t *this)
 {
 	for (size_t i = 0; i < this->children_len; i += 1) {
-		NEM_txn_free(this->children[i]);
+		this->children[i]->parent = NULL;
+	}
+	free(this->children);
+	if (NULL != this->parent) {
+		NEM_txn_remove_child(this->parent, this);
 	}
 
 	for (size_t i = 0; i < this->messages_len; i += 1) {
@@ -136,11 +251,30 @@ NEM_txn_set_data(NEM_txn_t *this, void *data)
 	this->data = data;
 }
 
+static void
+NEM_txn_send_cancel(NEM_txn_t *this)
+{
+	if (!NEM_err_ok(this->mgr->err)) {
+		return;
+	}
+	if (NEM_TXN_OUT == this->type && !((NEM_txnout_t*) this)->sent) {
+		return;
+	}
+
+	// NB: The remote knows which transaction this is by seq (and which
+	// way it goes by the reply flag), so the frame carries nothing else.
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	msg->packed.seq = this->seq;
+	msg->packed.flags = NEM_PMSGFLAG_CANCEL;
+	if (NEM_TXN_IN == this->type) {
+		msg->packed.flags |= NEM_PMSGFLAG_REPLY;
+	}
+	NEM_chan_send(&this->mgr->chan, msg, NULL);
+}
+
 static void
 NEM_txn_cancel_internal(NEM_txn_t *this, NEM_msg_t *msg, NEM_err_t err)
 {
-	// NB: NEM_txn_cancel_err and this both call NEM_txn_cancel_internal
-	// on all children.
 	if (this->cancelled) {
 		return;
 	}
@@ -152,15 +286,21 @@ NEM_txn_cancel_internal(NEM_txn_t *this, NEM_msg_t *msg, NEM_err_t err)
 	// operations against it.
 	this->cancelled = true;
 
-	for (size_t i = 0; i < this->children_len; i += 1) {
-		NEM_txn_cancel_internal(this->children[i], NULL, err);
+	// NB: msg is the remote's own CANCEL frame when it's the one doing the
+	// cancelling, so there's no need to tell it. If the connection's gone
+	// there's no one to tell.
+	if (NULL == msg) {
+		NEM_txn_send_cancel(this);
 	}
 
-	// XXX: If this is an outgoing transaction, we should tell the remote
-	// that we're not wanting anything else. If this is an incoming
-	// transaction that we're cancelling, we should probably tell the 
-	// remote (since NEM_txn_cancel is called on our side by timeout,
-	// shutdown, or application code).
+	// NB: Children are outgoing transactions, which are done once their
+	// thunk hears about it, so they're freed as they're cancelled. Freeing
+	// one unlinks it from children.
+	while (0 < this->children_len) {
+		NEM_txn_t *child = this->children[this->children_len - 1];
+		NEM_txn_cancel_internal(child, NULL, err);
+		NEM_txn_free(child);
+	}
 
 	NEM_txn_ca ca = {
 		.err    = err,
@@ -180,12 +320,6 @@ NEM_txnout_cancel_err(NEM_txnout_t *this, NEM_err_t err)
 {
 	// NB: This is an exported function, so explicitly free.
 	NEM_txn_cancel_internal(&this->base, NULL, err);
-
-	for (size_t i = 0; i < this->base.children_len; i += 1) {
-		// XXX: How does this work?
-		//NEM_txnout_cancel_err(this->base.children[i], err);
-	}
-
 	NEM_txn_free(&this->base);
 }
 
@@ -202,7 +336,7 @@ NEM_txn_set_timeout(NEM_txn_t *this, int ms)
 		return;
 	}
 
-	struct timeval new_time = {0};
+	uint64_t at = 0;
 	if (-1 == ms) {
 		/* zero */
 	}
@@ -210,16 +344,10 @@ NEM_txn_set_timeout(NEM_txn_t *this, int ms)
 		NEM_panic("NEM_txnout_set_timeout: invalid number of ms");
 	}
 	else {
-		gettimeofday(&new_time, NULL);
-		new_time.tv_sec += ms / 1000;
-		new_time.tv_usec += (ms % 1000) * 1000;
-
-		// NB: Handle overflow for canonicalized values.
-		new_time.tv_sec += new_time.tv_usec / (1000 * 1000);
-		new_time.tv_usec = new_time.tv_usec % (1000 * 1000);
+		at = NEM_kq_now(this->mgr->kq) + ms * NEM_KQ_NSEC_PER_MSEC;
 	}
 
-	NEM_txnmgr_set_timeout(this->mgr, this, new_time);
+	NEM_txnmgr_set_timeout(this->mgr, this, at);
 }
 
 static void
@@ -290,22 +418,34 @@ NEM_txnout_req(NEM_txnout_t *this, NEM_msg_t *msg)
 	bool done = 0 == (msg->packed.flags & NEM_PMSGFLAG_CONTINUE);
 	msg->packed.seq = this->base.seq;
 
-	if (!time_is_zero(this->base.timeout)) {
-		// Explicitly set timeout information.
-		struct timeval tv = {0};
-		gettimeofday(&tv, NULL);
+	if (this->base.cancelled) {
+		done = true;
+		NEM_msg_free(msg);
+		return;
+	}
 
-		int64_t remaining = 0;
-		remaining += (this->base.timeout.tv_sec - tv.tv_sec) * 1000;
-		remaining += (this->base.timeout.tv_usec - tv.tv_usec) / 1000;
-		if (0 > remaining) {
-			NEM_panic("already timed out"); // XXX: fix this.
+	if (NEM_timer1_active(&this->base.timeout)) {
+		// NB: Pass along whatever's left of the deadline so the remote
+		// doesn't keep working on this after we've given up on it. If
+		// there's under a millisecond left there's no point sending it at
+		// all; the timer is about to cancel the transaction anyway.
+		uint64_t now = NEM_kq_now(this->base.mgr->kq);
+		if (this->base.timeout.at <= now + NEM_KQ_NSEC_PER_MSEC) {
+			NEM_msg_free(msg);
+			return;
 		}
+	}
+
+	// NB: The remote only looks at the deadline on the message that starts
+	// the transaction, so the rest go out without reparsing their headers.
+	if (!this->sent && NEM_timer1_active(&this->base.timeout)) {
+		uint64_t now = NEM_kq_now(this->base.mgr->kq);
 
 		// XXX: Could use a helper or something to simplify this, but it'd
 		// have to be a macro or something which is kind of gross.
 		NEM_msghdr_time_t timehdr = {
-			.timeout_ms = remaining,
+			.timeout_ms =
+				(this->base.timeout.at - now) / NEM_KQ_NSEC_PER_MSEC,
 		};
 
 		NEM_msghdr_t *hdr = NEM_msg_header(msg);
@@ -318,13 +458,8 @@ NEM_txnout_req(NEM_txnout_t *this, NEM_msg_t *msg)
 		NEM_msghdr_free(hdr);
 	}
 
-	if (this->base.cancelled) {
-		done = true;
-		NEM_msg_free(msg);
-		return;
-	}
-
 	NEM_chan_send(&this->base.mgr->chan, msg, NULL);
+	this->sent = true;
 	// XXX: We'd want to maybe clear a timeout in that NULL callback.
 
 	if (done) {
@@ -339,6 +474,21 @@ NEM_txnout_req_continue(NEM_txnout_t *this, NEM_msg_t *msg)
 	NEM_txnout_req(this, msg);
 }
 
+static void
+NEM_txnmgr_cancel_txn(NEM_txnmgr_t *this, NEM_txn_t *txn)
+{
+	// NB: Once cancelled the timeouts are moot, so pull them off the wheel
+	// now rather than waiting for the transactions to be freed.
+	NEM_kq_timer1_cancel(this->kq, &txn->timeout);
+	NEM_txn_cancel_internal(txn, NULL, this->err);
+}
+
+static void
+NEM_txnmgr_free_txn(NEM_txnmgr_t *this, NEM_txn_t *txn)
+{
+	NEM_txn_free(txn);
+}
+
 static void
 NEM_txnmgr_shutdown(NEM_txnmgr_t *this, NEM_err_t err)
 {
@@ -348,26 +498,15 @@ NEM_txnmgr_shutdown(NEM_txnmgr_t *this, NEM_err_t err)
 
 	this->err = err;
 
-	NEM_txnin_t *txnin = NULL;
-	NEM_txnout_t *txnout = NULL;
-
 	// NB: shutdown happens when the underlying stream breaks. We can't
 	// really control when this happens, but there might be dangling refs
 	// to the bits and bobbles. Go through and cancel everything. This leaves
-	// the actual transactions intact (and in-tree) so they can be removed
+	// the actual transactions intact (and in-table) so they can be removed
 	// on free.
-	SPLAY_FOREACH(txnin, NEM_txnin_tree_t, &this->txns_in) {
-		NEM_txn_cancel_internal(&txnin->base, NULL, this->err);
-	}
-	SPLAY_FOREACH(txnout, NEM_txnout_tree_t, &this->txns_out) {
-		NEM_txn_cancel_internal(&txnout->base, NULL, this->err);
-	}
-	// NB: The timer tree is automatically cleared out when all the
-	// transactions are removed (since NEM_txn_free removes them from the
-	// timeout tree).
+	NEM_txntab_walk(&this->txns_in, &NEM_txnmgr_cancel_txn, this);
+	NEM_txntab_walk(&this->txns_out, &NEM_txnmgr_cancel_txn, this);
 
 	NEM_chan_free(&this->chan);
-	NEM_timer_free(&this->timer);
 
 	if (NULL != this->mux) {
 		NEM_svcmux_unref(this->mux);
@@ -388,16 +527,9 @@ NEM_txnmgr_on_reply(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 	// NB: This is called when we have an incoming message that's marked as
 	// a reply. There should be a matching txnout entry.
 	NEM_msg_t *msg = chan_ca->msg;
-	NEM_txnout_t dummy = {
-		.base = {
-			.seq = msg->packed.seq,
-		},
-	};
-
-	NEM_txnout_t *txnout = SPLAY_FIND(
-		NEM_txnout_tree_t,
+	NEM_txnout_t *txnout = (NEM_txnout_t*) NEM_txntab_find(
 		&this->txns_out,
-		&dummy
+		msg->packed.seq
 	);
 	if (NULL == txnout) {
 		// NB: No matching transaction. We can't reply to a reply, so it's
@@ -407,7 +539,7 @@ NEM_txnmgr_on_reply(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 		return;
 	}
 	else if (txnout->base.cancelled) {
-		// We cancelled on our side; maybe we should notify the remote?
+		// NB: We cancelled on our side, and the remote's been told.
 		return;
 	}
 	if (NULL == txnout->base.thunk) {
@@ -423,6 +555,7 @@ NEM_txnmgr_on_reply(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 	if ((msg->packed.flags & NEM_PMSGFLAG_CANCEL)) {
 		err = NEM_err_static("remote cancelled transaction");
 		NEM_txn_cancel_internal(&txnout->base, msg, err);
+		NEM_txn_free(&txnout->base);
 		return;
 	}
 
@@ -456,6 +589,22 @@ NEM_txnmgr_on_reply(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 	}
 }
 
+static void
+NEM_txnmgr_reply_err(NEM_txnmgr_t *this, NEM_msg_t *msg, const char *reason)
+{
+	// XXX: This shouldn't be using a generic error.
+	NEM_msghdr_err_t err = {
+		.code   = 1,
+		.reason = reason,
+	};
+	NEM_msghdr_t hdr = {
+		.err = &err,
+	};
+	NEM_msg_t *reply = NEM_msg_new_reply(msg, 0, 0);
+	NEM_msg_set_header(reply, &hdr);
+	NEM_chan_send(&this->chan, reply, NULL);
+}
+
 static void
 NEM_txnmgr_on_req(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 {
@@ -465,19 +614,12 @@ NEM_txnmgr_on_req(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 
 	// NB: Find an existing txnin if we've got one. The cached service/command
 	// ids override anything in the message if there's a matching seq.
-	NEM_txnin_t dummy = {
-		.base = {
-			.seq = msg->packed.seq,
-		},
-	};
-	NEM_txnin_t *txnin = SPLAY_FIND(
-		NEM_txnin_tree_t,
+	NEM_txnin_t *txnin = (NEM_txnin_t*) NEM_txntab_find(
 		&this->txns_in,
-		&dummy
+		msg->packed.seq
 	);
 	if (NULL != txnin) {
 		if (txnin->base.cancelled) {
-			// XXX: We might consider notifying the remote gratitously.
 			// NB: The message is still owned and freed by NEM_chan_t.
 			return;
 		}
@@ -486,6 +628,20 @@ NEM_txnmgr_on_req(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 		msg->packed.command_id = txnin->command_id;
 	}
 
+	// NB: A cancel for a transaction we don't have (most likely because
+	// it's already been answered) has nothing left to cancel. Either way
+	// it doesn't go anywhere near the handlers.
+	if ((msg->packed.flags & NEM_PMSGFLAG_CANCEL)) {
+		if (NULL != txnin) {
+			NEM_txn_cancel_internal(
+				&txnin->base,
+				msg,
+				NEM_err_static("remote cancelled transaction")
+			);
+		}
+		return;
+	}
+
 	// NB: Handlers can be removed at runtime; there isn't much that can be
 	// done about this since the thunks are owned by the svcmux. So whenever
 	// a message comes in, we need to re-resolve the handler against the mux
@@ -496,26 +652,27 @@ NEM_txnmgr_on_req(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 		msg->packed.command_id
 	);
 	if (NULL == handler) {
-		// XXX: This shouldn't be using a generic error.
-		NEM_msghdr_err_t err = {
-			.code   = 1,
-			.reason = "no handler",
-		};
-		NEM_msghdr_t hdr = {
-			.err = &err,
-		};
-		NEM_msg_t *reply = NEM_msg_new_reply(msg, 0, 0);
-		NEM_msg_set_header(reply, &hdr);
-		NEM_chan_send(&this->chan, reply, NULL);
+		NEM_txnmgr_reply_err(this, msg, "no handler");
 		return;
 	}
 
 	if (NULL == txnin) {
-		// NB: If this is a cancel request for a transaction we don't have
-		// a record for ... just ... ignore it.
-		if (msg->packed.flags & NEM_PMSGFLAG_CANCEL) {
-			return;
+		// NB: Only the first message of a request carries its deadline. One
+		// that's already run out gets turned away before it costs anything;
+		// the sender has given up on it (or is about to).
+		int timeout_ms = -1;
+		NEM_msghdr_t *hdr = NEM_msg_header(msg);
+		if (NULL != hdr && NULL != hdr->time) {
+			if (0 == hdr->time->timeout_ms) {
+				NEM_msghdr_free(hdr);
+				NEM_txnmgr_reply_err(this, msg, "deadline exceeded");
+				return;
+			}
+			if (INT32_MAX > hdr->time->timeout_ms) {
+				timeout_ms = hdr->time->timeout_ms;
+			}
 		}
+		NEM_msghdr_free(hdr);
 
 		txnin = NEM_malloc(sizeof(NEM_txnin_t));
 		txnin->base.seq = msg->packed.seq;
@@ -524,11 +681,9 @@ NEM_txnmgr_on_req(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 		txnin->command_id = msg->packed.command_id;
 		NEM_txnmgr_add_txn(this, &txnin->base);
 
-		NEM_msghdr_t *hdr = NEM_msg_header(msg);
-		if (NULL != hdr && NULL != hdr->time) {
-			NEM_txnin_set_timeout(txnin, hdr->time->timeout_ms);
+		if (-1 != timeout_ms) {
+			NEM_txnin_set_timeout(txnin, timeout_ms);
 		}
-		NEM_msghdr_free(hdr);
 	}
 
 	bool done = 0 == (msg->packed.flags & NEM_PMSGFLAG_CONTINUE);
@@ -536,13 +691,6 @@ NEM_txnmgr_on_req(NEM_txnmgr_t *this, NEM_chan_ca *chan_ca)
 
 	// XXX: Maybe claim the message here?
 
-	if ((msg->packed.flags & NEM_PMSGFLAG_CANCEL)) {
-		// They're cancelling their request.
-		err = NEM_err_static("remote cancelled transaction");
-		NEM_txn_cancel_internal(&txnin->base, msg, err);
-		return;
-	}
-
 	NEM_txn_ca ca = {
 		.err   = err,
 		.txnin = txnin,
@@ -588,25 +736,17 @@ NEM_txnmgr_on_chan_close(NEM_thunk1_t *thunk, void *varg)
 }
 
 static void
-NEM_txnmgr_on_timer(NEM_thunk_t *thunk, void *varg)
+NEM_txn_on_timeout(NEM_timer1_t *timer)
 {
-	NEM_txnmgr_t *this = NEM_thunk_ptr(thunk);
-
-	struct timeval now;
-	gettimeofday(&now, NULL);
-
-	NEM_txn_t *txn = NULL;
-	NEM_err_t err = NEM_err_static("transaction timeout");
+	NEM_txn_t *txn = (NEM_txn_t*) timer;
 
-	while (NULL != (txn = SPLAY_MIN(NEM_txn_tree_t, &this->timeouts))) {
-		if (time_is_less(txn->timeout, now)) {
-			NEM_txn_cancel_internal(txn, NULL, err);
-			SPLAY_REMOVE(NEM_txn_tree_t, &this->timeouts, txn);
-		}
-	}
-
-	if (NULL != txn) {
-		NEM_timer_set_abs(&this->timer, txn->timeout);
+	// NB: An outgoing transaction is finished once its thunk has been told
+	// it's done. An incoming one sticks around until the handler replies,
+	// which it may well do from its thunk, so don't touch it afterwards.
+	bool out = NEM_TXN_OUT == txn->type;
+	NEM_txn_cancel_internal(txn, NULL, NEM_err_static("transaction timeout"));
+	if (out) {
+		NEM_txn_free(txn);
 	}
 }
 
@@ -614,12 +754,9 @@ void
 NEM_txnmgr_init(NEM_txnmgr_t *this, NEM_stream_t stream, NEM_kq_t *kq)
 {
 	NEM_chan_init(&this->chan, stream);
-	NEM_timer_init(&this->timer, kq, NEM_thunk_new_ptr(
-		&NEM_txnmgr_on_timer,
-		this
-	));
-	SPLAY_INIT(&this->txns_in);
-	SPLAY_INIT(&this->txns_out);
+	this->kq = kq;
+	bzero(&this->txns_in, sizeof(this->txns_in));
+	bzero(&this->txns_out, sizeof(this->txns_out));
 	this->mux = NULL;
 	this->seq = 1;
 	this->err = NEM_err_none;
@@ -633,15 +770,13 @@ static void
 NEM_txnmgr_remove_txn(NEM_txnmgr_t *this, NEM_txn_t *txn)
 {
 	if (NEM_TXN_IN == txn->type) {
-		SPLAY_REMOVE(NEM_txnin_tree_t, &this->txns_in, (NEM_txnin_t*) txn);
+		NEM_txntab_remove(&this->txns_in, txn);
 	}
 	else {
-		SPLAY_REMOVE(NEM_txnout_tree_t, &this->txns_out, (NEM_txnout_t*) txn);
+		NEM_txntab_remove(&this->txns_out, txn);
 	}
 
-	if (!time_is_zero(txn->timeout)) {
-		SPLAY_REMOVE(NEM_txn_tree_t, &this->timeouts, txn);
-	}
+	NEM_kq_timer1_cancel(this->kq, &txn->timeout);
 }
 
 static void
@@ -649,37 +784,27 @@ NEM_txnmgr_add_txn(NEM_txnmgr_t *this, NEM_txn_t *txn)
 {
 	txn->mgr = this;
 
-	if (NEM_TXN_IN == txn->type) {
-		SPLAY_INSERT(NEM_txnin_tree_t, &this->txns_in, (NEM_txnin_t*) txn);
-	}
-	else {
-		SPLAY_INSERT(NEM_txnout_tree_t, &this->txns_out, (NEM_txnout_t*) txn);
+	// NB: Incoming requests are looked up by seq before they're added and
+	// outgoing ones get a fresh seq, so a duplicate means the tables are
+	// corrupt. Dropping it would leave the txn dangling.
+	NEM_txntab_t *tab = (NEM_TXN_IN == txn->type)
+		? &this->txns_in
+		: &this->txns_out;
+	if (!NEM_txntab_insert(tab, txn)) {
+		NEM_panicf("NEM_txnmgr_add_txn: duplicate seq %" PRIu64, txn->seq);
 	}
 
-	if (!time_is_zero(txn->timeout)) {
-		SPLAY_INSERT(NEM_txn_tree_t, &this->timeouts, txn);
-		if (txn == SPLAY_MIN(NEM_txn_tree_t, &this->timeouts)) {
-			NEM_timer_set_abs(&this->timer, txn->timeout);
-		}
-	}
+	NEM_timer1_init(&txn->timeout, &NEM_txn_on_timeout);
 }
 
 static void
-NEM_txnmgr_set_timeout(NEM_txnmgr_t *this, NEM_txn_t *txn, struct timeval t)
+NEM_txnmgr_set_timeout(NEM_txnmgr_t *this, NEM_txn_t *txn, uint64_t at)
 {
-	if (!time_is_zero(txn->timeout)) {
-		SPLAY_REMOVE(NEM_txn_tree_t, &this->timeouts, txn);
-	}
-
-	txn->timeout = t;
-
-	if (!time_is_zero(txn->timeout)) {
-		SPLAY_INSERT(NEM_txn_tree_t, &this->timeouts, txn);
+	if (0 == at) {
+		NEM_kq_timer1_cancel(this->kq, &txn->timeout);
 	}
-
-	NEM_txn_t *min = SPLAY_MIN(NEM_txn_tree_t, &this->timeouts);
-	if (NULL != min) {
-		NEM_timer_set_abs(&this->timer, min->timeout);
+	else {
+		NEM_kq_timer1_set(this->kq, &txn->timeout, at);
 	}
 }
 
@@ -696,16 +821,11 @@ NEM_txnmgr_free(NEM_txnmgr_t *this)
 
 	// NB: At this point, we're ensured that nothing is hanging on to txn
 	// pointers, so go through and remove any remaining transactions.
-	NEM_txnin_t *txnin = NULL;
-	NEM_txnout_t *txnout = NULL;
-
-	// NB: NEM_txn_free removes the bits from the tree.
-	while (NULL != (txnin = SPLAY_MIN(NEM_txnin_tree_t, &this->txns_in))) {
-		NEM_txn_free(&txnin->base);
-	}
-	while (NULL != (txnout = SPLAY_MIN(NEM_txnout_tree_t, &this->txns_out))) {
-		NEM_txn_free(&txnout->base);
-	}
+	// NB: NEM_txn_free removes the bits from the table.
+	NEM_txntab_walk(&this->txns_in, &NEM_txnmgr_free_txn, this);
+	NEM_txntab_walk(&this->txns_out, &NEM_txnmgr_free_txn, this);
+	NEM_txntab_free(&this->txns_in);
+	NEM_txntab_free(&this->txns_out);
 }
 
 void
@@ -761,14 +881,29 @@ NEM_txnmgr_req(NEM_txnmgr_t *this, NEM_txnin_t *parent, NEM_thunk_t *thunk)
 	txnout->base.type = NEM_TXN_OUT;
 	txnout->base.seq = ++this->seq;
 	txnout->base.thunk = thunk;
-	if (NULL != parent) {
-		txnout->base.timeout = parent->base.timeout;
-	}
 	NEM_txnmgr_add_txn(this, &txnout->base);
 
 	if (NULL == parent) {
 		NEM_txnout_set_timeout(txnout, NEM_TXN_DEFAULT_TIMEOUT_MS);
 	}
+	else {
+		txnout->base.parent = &parent->base;
+		NEM_txn_add_child(&parent->base, &txnout->base);
+
+		// NB: A child only gets whatever's left of its parent's deadline,
+		// which then goes out with the request. A parent without one
+		// doesn't make the child immortal.
+		if (NEM_timer1_active(&parent->base.timeout)) {
+			NEM_txnmgr_set_timeout(
+				this,
+				&txnout->base,
+				parent->base.timeout.at
+			);
+		}
+		else {
+			NEM_txnout_set_timeout(txnout, NEM_TXN_DEFAULT_TIMEOUT_MS);
+		}
+	}
 
 	return txnout;
 }
@@ -0,0 +1,402 @@
+#include "nem.h"
+
+typedef enum {
+	NEM_TXNPOOL_DOWN,
+	NEM_TXNPOOL_DIALING,
+	NEM_TXNPOOL_UP,
+}
+NEM_txnpool_state_t;
+
+// NB: Members are allocated separately so that one with a dial in flight
+// can outlive the pool (see orphaned).
+struct NEM_txnpool_member_t {
+	// NB: retry is set while the member is waiting out its backoff. It
+	// must remain the first member.
+	NEM_timer1_t        retry;
+
+	NEM_txnpool_t      *pool;
+	size_t              endpoint;
+	NEM_txnpool_state_t state;
+	int                 failures;
+
+	// NB: mgr is only valid while has_mgr is set. A member that drops keeps
+	// its closed mgr around until the retry fires, since the close is
+	// reported from inside the mgr's own callbacks.
+	NEM_txnmgr_t        mgr;
+	bool                has_mgr;
+
+	// NB: orphaned is set if the pool is freed while this member is
+	// dialing. The dial's completion frees the member (and the stream).
+	bool                orphaned;
+};
+
+static void NEM_txnpool_member_dial(NEM_txnpool_member_t *this);
+
+static uint64_t
+NEM_txnpool_rand(NEM_txnpool_t *this)
+{
+	// NB: xorshift64*. This only has to keep the picks from lining up, so
+	// it isn't worth a syscall or a lock.
+	uint64_t x = this->rand;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	this->rand = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+NEM_txnpool_member_free(NEM_txnpool_member_t *this)
+{
+	NEM_kq_timer1_cancel(this->pool->kq, &this->retry);
+
+	if (NEM_TXNPOOL_DIALING == this->state) {
+		this->orphaned = true;
+		this->pool = NULL;
+		return;
+	}
+	if (this->has_mgr) {
+		NEM_txnmgr_free(&this->mgr);
+	}
+
+	free(this);
+}
+
+static void
+NEM_txnpool_member_on_retry(NEM_timer1_t *timer)
+{
+	NEM_txnpool_member_t *this = (NEM_txnpool_member_t*) timer;
+
+	if (this->has_mgr) {
+		NEM_txnmgr_free(&this->mgr);
+		this->has_mgr = false;
+	}
+
+	NEM_txnpool_member_dial(this);
+}
+
+static void
+NEM_txnpool_member_fail(NEM_txnpool_member_t *this)
+{
+	NEM_txnpool_t *pool = this->pool;
+	this->state = NEM_TXNPOOL_DOWN;
+	this->failures += 1;
+	pool->failures += 1;
+
+	// NB: Back off exponentially, but with half the wait picked at random
+	// so that members which dropped together don't all redial together.
+	uint64_t wait = pool->backoff_max_ms;
+	if (this->failures < 20) {
+		wait = (uint64_t)pool->backoff_min_ms << (this->failures - 1);
+	}
+	if (wait > (uint64_t)pool->backoff_max_ms) {
+		wait = pool->backoff_max_ms;
+	}
+	wait = wait / 2 + NEM_txnpool_rand(pool) % (wait / 2 + 1);
+
+	NEM_kq_timer1_set(
+		pool->kq,
+		&this->retry,
+		NEM_kq_now(pool->kq) + wait * NEM_KQ_NSEC_PER_MSEC
+	);
+}
+
+static void
+NEM_txnpool_member_on_close(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_txnpool_member_t *this = NEM_thunk1_ptr(thunk);
+
+	// NB: Freeing the pool closes every member; there's nothing to retry.
+	if (this->pool->freeing) {
+		return;
+	}
+
+	// NB: NEM_txnpool_pick may already have taken it out of the running.
+	if (NEM_TXNPOOL_UP == this->state) {
+		this->pool->up -= 1;
+	}
+	NEM_txnpool_member_fail(this);
+}
+
+static void
+NEM_txnpool_member_on_dial(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_txnpool_member_t *this = NEM_thunk1_ptr(thunk);
+	NEM_dial_ca *ca = varg;
+
+	if (this->orphaned) {
+		if (NEM_err_ok(ca->err)) {
+			NEM_stream_close(ca->stream);
+		}
+		free(this);
+		return;
+	}
+	if (!NEM_err_ok(ca->err)) {
+		NEM_txnpool_member_fail(this);
+		return;
+	}
+
+	NEM_txnpool_t *pool = this->pool;
+	bzero(&this->mgr, sizeof(this->mgr));
+	NEM_txnmgr_init(&this->mgr, ca->stream, pool->kq);
+	NEM_txnmgr_set_mux(&this->mgr, pool->mux);
+	NEM_txnmgr_on_close(&this->mgr, NEM_thunk1_new_ptr(
+		&NEM_txnpool_member_on_close,
+		this
+	));
+	this->has_mgr = true;
+	this->state = NEM_TXNPOOL_UP;
+	this->failures = 0;
+	pool->up += 1;
+
+	if (NULL != pool->on_ready) {
+		NEM_txn_ca ready_ca = {
+			.mgr = &this->mgr,
+		};
+		NEM_thunk1_invoke(&pool->on_ready, &ready_ca);
+	}
+}
+
+static void
+NEM_txnpool_member_dial(NEM_txnpool_member_t *this)
+{
+	NEM_txnpool_t *pool = this->pool;
+	this->state = NEM_TXNPOOL_DIALING;
+	pool->dials += 1;
+
+	// NB: The dial can complete (or fail) before this returns.
+	NEM_txnpool_dial_ca ca = {
+		.pool      = pool,
+		.endpoint  = this->endpoint,
+		.on_stream = NEM_thunk1_new_ptr(&NEM_txnpool_member_on_dial, this),
+	};
+	NEM_thunk_invoke(pool->dial, &ca);
+}
+
+void
+NEM_txnpool_init(
+	NEM_txnpool_t            *this,
+	NEM_kq_t                 *kq,
+	const NEM_txnpool_opts_t *opts,
+	NEM_thunk_t              *dial
+) {
+	if (NULL == dial) {
+		NEM_panic("NEM_txnpool_init: cannot have a NULL dial thunk");
+	}
+	if (NULL == opts || 0 == opts->endpoints) {
+		NEM_panic("NEM_txnpool_init: need at least one endpoint");
+	}
+
+	bzero(this, sizeof(*this));
+	this->kq = kq;
+	this->dial = dial;
+	this->policy = opts->policy;
+	this->backoff_min_ms = opts->backoff_min_ms;
+	this->backoff_max_ms = opts->backoff_max_ms;
+	if (0 >= this->backoff_min_ms) {
+		this->backoff_min_ms = NEM_TXNPOOL_BACKOFF_MIN_MS;
+	}
+	if (0 >= this->backoff_max_ms) {
+		this->backoff_max_ms = NEM_TXNPOOL_BACKOFF_MAX_MS;
+	}
+	if (this->backoff_max_ms < this->backoff_min_ms) {
+		this->backoff_max_ms = this->backoff_min_ms;
+	}
+
+	// NB: The seed only needs to differ between pools.
+	this->rand = (NEM_kq_now(kq) ^ (uintptr_t)this) | 1;
+
+	if (NULL != opts->mux) {
+		this->mux = NEM_svcmux_ref(opts->mux);
+	}
+	else {
+		NEM_svcmux_init(&this->mux_empty);
+		this->mux = &this->mux_empty;
+	}
+
+	size_t conns = (0 < opts->conns) ? opts->conns : 1;
+	this->members_len = opts->endpoints * conns;
+	this->members = NEM_malloc(
+		this->members_len * sizeof(NEM_txnpool_member_t*)
+	);
+
+	// NB: Lay the members out round-robin across the endpoints, so that
+	// ties in NEM_txnpool_pick spread over endpoints rather than piling
+	// onto the first one.
+	for (size_t i = 0; i < this->members_len; i += 1) {
+		NEM_txnpool_member_t *member =
+			NEM_malloc(sizeof(NEM_txnpool_member_t));
+		member->pool = this;
+		member->endpoint = i % opts->endpoints;
+		member->state = NEM_TXNPOOL_DOWN;
+		NEM_timer1_init(&member->retry, &NEM_txnpool_member_on_retry);
+		this->members[i] = member;
+	}
+
+	// NB: Warm everything up now rather than on the first request.
+	for (size_t i = 0; i < this->members_len; i += 1) {
+		NEM_txnpool_member_dial(this->members[i]);
+	}
+}
+
+void
+NEM_txnpool_free(NEM_txnpool_t *this)
+{
+	this->freeing = true;
+
+	for (size_t i = 0; i < this->members_len; i += 1) {
+		NEM_txnpool_member_free(this->members[i]);
+	}
+	free(this->members);
+	this->members = NULL;
+	this->members_len = 0;
+	this->up = 0;
+
+	NEM_thunk_free(this->dial);
+	if (NULL != this->on_ready) {
+		NEM_thunk1_discard(&this->on_ready);
+	}
+
+	NEM_svcmux_unref(this->mux);
+}
+
+void
+NEM_txnpool_on_ready(NEM_txnpool_t *this, NEM_thunk1_t *thunk)
+{
+	if (NULL != this->on_ready) {
+		NEM_panic("NEM_txnpool_on_ready: callback already assigned");
+	}
+
+	NEM_txnmgr_t *mgr = NEM_txnpool_pick(this);
+	if (NULL != mgr) {
+		NEM_txn_ca ca = {
+			.mgr = mgr,
+		};
+		NEM_thunk1_invoke(&thunk, &ca);
+		return;
+	}
+
+	this->on_ready = thunk;
+}
+
+// NB: A mgr that's shutting down cancels its transactions before on_close
+// reports it, and a request retried from one of those cancellations must
+// not land back on it. Take such members out of the running before picking;
+// on_close still schedules the redial.
+static void
+NEM_txnpool_sweep(NEM_txnpool_t *this)
+{
+	for (size_t i = 0; i < this->members_len; i += 1) {
+		NEM_txnpool_member_t *member = this->members[i];
+		if (NEM_TXNPOOL_UP == member->state && !NEM_err_ok(member->mgr.err)) {
+			member->state = NEM_TXNPOOL_DOWN;
+			this->up -= 1;
+		}
+	}
+}
+
+static NEM_txnpool_member_t*
+NEM_txnpool_nth_up(NEM_txnpool_t *this, size_t n)
+{
+	for (size_t i = 0; i < this->members_len; i += 1) {
+		NEM_txnpool_member_t *member = this->members[i];
+		if (NEM_TXNPOOL_UP != member->state) {
+			continue;
+		}
+		if (0 == n) {
+			return member;
+		}
+		n -= 1;
+	}
+
+	NEM_panic("NEM_txnpool_nth_up: not enough members up");
+}
+
+NEM_txnmgr_t*
+NEM_txnpool_pick(NEM_txnpool_t *this)
+{
+	NEM_txnpool_member_t *best = NULL;
+
+	// NB: Freeing a member cancels its transactions, and whatever those
+	// retry lands back here while the rest of the members are half torn
+	// down. Treat the pool as having nothing up from then on.
+	if (this->freeing) {
+		return NULL;
+	}
+
+	NEM_txnpool_sweep(this);
+	if (0 == this->up) {
+		return NULL;
+	}
+	else if (1 == this->up) {
+		best = NEM_txnpool_nth_up(this, 0);
+	}
+	else if (NEM_TXNPOOL_P2C == this->policy) {
+		size_t i = NEM_txnpool_rand(this) % this->up;
+		size_t j = NEM_txnpool_rand(this) % (this->up - 1);
+		if (j >= i) {
+			j += 1;
+		}
+
+		NEM_txnpool_member_t *a = NEM_txnpool_nth_up(this, i);
+		NEM_txnpool_member_t *b = NEM_txnpool_nth_up(this, j);
+		best = (b->mgr.txns_out.len < a->mgr.txns_out.len) ? b : a;
+	}
+	else {
+		// NB: Start the scan where the last one left off so that idle
+		// members take turns instead of the first one getting everything.
+		for (size_t k = 0; k < this->members_len; k += 1) {
+			size_t i = (this->next + k) % this->members_len;
+			NEM_txnpool_member_t *member = this->members[i];
+			if (NEM_TXNPOOL_UP != member->state) {
+				continue;
+			}
+			if (
+				NULL == best
+				|| member->mgr.txns_out.len < best->mgr.txns_out.len
+			) {
+				best = member;
+			}
+		}
+		this->next = (this->next + 1) % this->members_len;
+	}
+
+	return &best->mgr;
+}
+
+NEM_txnout_t*
+NEM_txnpool_req(NEM_txnpool_t *this, NEM_txnin_t *parent, NEM_thunk_t *thunk)
+{
+	if (NULL == thunk) {
+		NEM_panic("NEM_txnpool_req: cannot have a NULL thunk");
+	}
+
+	NEM_txnmgr_t *mgr = NEM_txnpool_pick(this);
+	if (NULL == mgr) {
+		NEM_txn_ca ca = {
+			.err  = NEM_err_static("NEM_txnpool_req: no connections up"),
+			.done = true,
+		};
+		NEM_thunk_invoke(thunk, &ca);
+		NEM_thunk_free(thunk);
+		return NULL;
+	}
+
+	return NEM_txnmgr_req(mgr, parent, thunk);
+}
+
+void
+NEM_txnpool_req1(
+	NEM_txnpool_t *this,
+	NEM_txnin_t   *parent,
+	NEM_msg_t     *msg,
+	NEM_thunk_t   *thunk
+) {
+	NEM_txnout_t *txnout = NEM_txnpool_req(this, parent, thunk);
+	if (NULL == txnout) {
+		NEM_msg_free(msg);
+		return;
+	}
+
+	NEM_txnout_req(txnout, msg);
+}
@@ -0,0 +1,857 @@
+#include "nem.h"
+
+#if defined(__linux__)
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// NB: Submissions are flushed at least once per harvested batch, so the SQ
+// never needs to be very deep. The CQ is sized for the number of in-flight
+// operations (two per NEM_fd_t); anything past that is held by the kernel
+// until the next harvest (IORING_FEAT_NODROP).
+static const unsigned NEM_URING_SQ_ENTRIES = 256;
+static const unsigned NEM_URING_CQ_ENTRIES = 4096;
+
+// NB: Reads of up to NEM_URING_BUF_SIZE go through a registered buffer,
+// which saves the kernel from pinning the destination on every call. The
+// bulk of the chan read path is small fixed-size headers.
+#define NEM_URING_BUFS 64
+static const size_t NEM_URING_BUF_SIZE = 4096;
+
+static const uint32_t NEM_URING_NONE = UINT32_MAX;
+
+// NB: How many times NEM_uring_submit reaps the CQ and retries before
+// giving up on a backed-up kernel.
+static const int NEM_URING_SUBMIT_TRIES = 4;
+
+typedef struct {
+	NEM_uring_fn fn;
+	void        *arg;
+	void        *dst;
+	uint32_t     gen;
+	uint32_t     next;
+	int          buf;
+	bool         busy;
+}
+NEM_uring_op_t;
+
+struct NEM_uring_t {
+	int          kq;
+	int          fd;
+	NEM_thunk_t *on_kevent;
+	bool         harvesting;
+	bool         kicked;
+
+	void    *sq_ptr;
+	size_t   sq_len;
+	void    *cq_ptr;
+	size_t   cq_len;
+	void    *sqes_ptr;
+	size_t   sqes_len;
+
+	_Atomic uint32_t *sq_head;
+	_Atomic uint32_t *sq_tail;
+	_Atomic uint32_t *sq_flags;
+	uint32_t          sq_mask;
+	uint32_t          sq_entries;
+	uint32_t          sq_pending;
+	struct io_uring_sqe *sqes;
+
+	_Atomic uint32_t    *cq_head;
+	_Atomic uint32_t    *cq_tail;
+	uint32_t             cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// NB: Completions reaped to make room for submissions wait here for
+	// the next harvest, since callbacks can't be invoked from the middle
+	// of a submission.
+	struct io_uring_cqe *backlog;
+	size_t               backlog_len;
+	size_t               backlog_cap;
+
+	// NB: Operations are identified to the kernel by their index in ops
+	// and a generation, so completions for cancelled operations can
+	// arrive after whatever submitted them is gone.
+	NEM_uring_op_t *ops;
+	uint32_t        ops_cap;
+	uint32_t        ops_free;
+
+	char *bufs;
+	int   bufs_free[NEM_URING_BUFS];
+	int   bufs_free_len;
+};
+
+static pthread_mutex_t NEM_urings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static NEM_uring_t   **NEM_urings = NULL;
+static size_t          NEM_urings_cap = 0;
+
+static pthread_once_t NEM_uring_probe_once = PTHREAD_ONCE_INIT;
+static bool           NEM_uring_probe_ok = false;
+
+static int
+NEM_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+NEM_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int
+NEM_uring_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+	return (int) syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+static int
+NEM_uring_sync_cancel(int fd, uint64_t op)
+{
+	struct io_uring_sync_cancel_reg reg = {
+		.addr    = op,
+		.fd      = -1,
+		.timeout = { .tv_sec = -1, .tv_nsec = -1 },
+	};
+
+	return NEM_uring_register(fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+}
+
+static void
+NEM_uring_probe()
+{
+	struct io_uring_params params = {0};
+	int fd = NEM_uring_setup(2, &params);
+	if (-1 == fd) {
+		return;
+	}
+
+	uint32_t want = IORING_FEAT_SINGLE_MMAP
+		| IORING_FEAT_NODROP
+		| IORING_FEAT_RW_CUR_POS;
+
+	// NB: Synchronous cancellation (6.0+) is what makes it safe to tear
+	// down a NEM_fd_t with operations in flight. Cancelling something that
+	// doesn't exist is ENOENT if it's supported and EINVAL if it isn't.
+	NEM_uring_probe_ok = (want == (params.features & want))
+		&& -1 == NEM_uring_sync_cancel(fd, 1)
+		&& ENOENT == errno;
+
+	close(fd);
+}
+
+bool
+NEM_uring_supported()
+{
+	pthread_once(&NEM_uring_probe_once, &NEM_uring_probe);
+	return NEM_uring_probe_ok;
+}
+
+static uint32_t
+NEM_uring_op_idx(uint64_t op)
+{
+	return (uint32_t)(op & 0xFFFFFFFF);
+}
+
+static uint32_t
+NEM_uring_op_gen(uint64_t op)
+{
+	return (uint32_t)(op >> 32);
+}
+
+static uint64_t
+NEM_uring_op_alloc(NEM_uring_t *this, NEM_uring_fn fn, void *arg)
+{
+	if (NEM_URING_NONE == this->ops_free) {
+		uint32_t cap = (0 == this->ops_cap) ? 64 : 2 * this->ops_cap;
+		this->ops = NEM_panic_if_null(realloc(
+			this->ops,
+			sizeof(NEM_uring_op_t) * cap
+		));
+		for (uint32_t i = this->ops_cap; i < cap; i += 1) {
+			bzero(&this->ops[i], sizeof(NEM_uring_op_t));
+			this->ops[i].gen = 1;
+			this->ops[i].next = (i + 1 < cap) ? i + 1 : NEM_URING_NONE;
+		}
+		this->ops_free = this->ops_cap;
+		this->ops_cap = cap;
+	}
+
+	uint32_t idx = this->ops_free;
+	NEM_uring_op_t *op = &this->ops[idx];
+	this->ops_free = op->next;
+
+	op->fn = fn;
+	op->arg = arg;
+	op->dst = NULL;
+	op->buf = -1;
+	op->busy = true;
+
+	return ((uint64_t) op->gen << 32) | idx;
+}
+
+static void
+NEM_uring_op_free(NEM_uring_t *this, uint32_t idx)
+{
+	NEM_uring_op_t *op = &this->ops[idx];
+	if (-1 != op->buf) {
+		this->bufs_free[this->bufs_free_len] = op->buf;
+		this->bufs_free_len += 1;
+	}
+
+	op->busy = false;
+	op->fn = NULL;
+	op->arg = NULL;
+	op->gen += 1;
+	if (0 == op->gen) {
+		op->gen = 1;
+	}
+	op->next = this->ops_free;
+	this->ops_free = idx;
+}
+
+static NEM_uring_op_t*
+NEM_uring_op_get(NEM_uring_t *this, uint64_t handle)
+{
+	uint32_t idx = NEM_uring_op_idx(handle);
+	if (idx >= this->ops_cap) {
+		return NULL;
+	}
+
+	NEM_uring_op_t *op = &this->ops[idx];
+	if (!op->busy || op->gen != NEM_uring_op_gen(handle)) {
+		return NULL;
+	}
+
+	return op;
+}
+
+static void
+NEM_uring_flush(NEM_uring_t *this)
+{
+	while (0 < this->sq_pending) {
+		int ret = NEM_uring_enter(this->fd, this->sq_pending, 0, 0);
+		if (-1 == ret) {
+			if (EINTR == errno) {
+				continue;
+			}
+			// NB: EAGAIN/EBUSY mean the kernel is backed up (usually on
+			// completions); leave the rest for the next flush.
+			if (EAGAIN == errno || EBUSY == errno) {
+				return;
+			}
+			NEM_panicf_errno("NEM_uring_flush: io_uring_enter");
+		}
+
+		this->sq_pending -= (uint32_t) ret;
+	}
+}
+
+static void
+NEM_uring_kick(NEM_uring_t *this)
+{
+	if (this->kicked) {
+		return;
+	}
+
+	struct kevent ev;
+	EV_SET(&ev, this->fd, EVFILT_USER, 0, NOTE_TRIGGER, 0, this->on_kevent);
+	if (-1 == kevent(this->kq, &ev, 1, NULL, 0, NULL)) {
+		NEM_panicf_errno("NEM_uring_kick: kevent");
+	}
+	this->kicked = true;
+}
+
+static void
+NEM_uring_reap(NEM_uring_t *this)
+{
+	uint32_t head = atomic_load_explicit(this->cq_head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(this->cq_tail, memory_order_acquire);
+	if (head == tail) {
+		return;
+	}
+
+	size_t want = this->backlog_len + (tail - head);
+	if (want > this->backlog_cap) {
+		size_t cap = (0 == this->backlog_cap) ? 64 : 2 * this->backlog_cap;
+		while (cap < want) {
+			cap *= 2;
+		}
+		this->backlog = NEM_panic_if_null(realloc(
+			this->backlog,
+			sizeof(struct io_uring_cqe) * cap
+		));
+		this->backlog_cap = cap;
+	}
+
+	while (head != tail) {
+		this->backlog[this->backlog_len] = this->cqes[head & this->cq_mask];
+		this->backlog_len += 1;
+		head += 1;
+	}
+	atomic_store_explicit(this->cq_head, head, memory_order_release);
+
+	// NB: The ring's fd only polls readable while there's something in
+	// the CQ, so make sure the backlog gets harvested.
+	NEM_uring_kick(this);
+}
+
+// NEM_uring_submit flushes pending submissions. If the kernel refuses them
+// because it's backed up on completions, the CQ is reaped into the backlog
+// and the kernel is asked to flush its overflow before trying again.
+static NEM_err_t
+NEM_uring_submit(NEM_uring_t *this)
+{
+	for (int i = 0; i < NEM_URING_SUBMIT_TRIES; i += 1) {
+		NEM_uring_flush(this);
+		if (0 == this->sq_pending) {
+			return NEM_err_none;
+		}
+
+		NEM_uring_reap(this);
+		if (-1 == NEM_uring_enter(this->fd, 0, 0, IORING_ENTER_GETEVENTS)) {
+			if (EINTR != errno && EAGAIN != errno && EBUSY != errno) {
+				NEM_panicf_errno("NEM_uring_submit: io_uring_enter");
+			}
+		}
+	}
+
+	return NEM_err_static("NEM_uring_submit: kernel backed up");
+}
+
+static NEM_err_t
+NEM_uring_sqe(NEM_uring_t *this, struct io_uring_sqe **out)
+{
+	uint32_t tail = atomic_load_explicit(this->sq_tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(this->sq_head, memory_order_acquire);
+	if (tail - head >= this->sq_entries) {
+		NEM_err_t err = NEM_uring_submit(this);
+		if (!NEM_err_ok(err)) {
+			return err;
+		}
+	}
+
+	struct io_uring_sqe *sqe = &this->sqes[tail & this->sq_mask];
+	bzero(sqe, sizeof(*sqe));
+	*out = sqe;
+	return NEM_err_none;
+}
+
+static void
+NEM_uring_push(NEM_uring_t *this)
+{
+	uint32_t tail = atomic_load_explicit(this->sq_tail, memory_order_relaxed);
+	atomic_store_explicit(this->sq_tail, tail + 1, memory_order_release);
+	this->sq_pending += 1;
+
+	// NB: Submissions made from completion callbacks are batched up and
+	// flushed at the end of the harvest. If the kernel won't take this
+	// one yet, it stays in the SQ and the next harvest retries it.
+	if (!this->harvesting && !NEM_err_ok(NEM_uring_submit(this))) {
+		NEM_uring_kick(this);
+	}
+}
+
+static void
+NEM_uring_dispatch(NEM_uring_t *this, struct io_uring_cqe cqe)
+{
+	NEM_uring_op_t *op = NEM_uring_op_get(this, cqe.user_data);
+	if (NULL == op) {
+		return;
+	}
+
+	if (0 < cqe.res && -1 != op->buf && NULL != op->fn) {
+		memcpy(
+			op->dst,
+			this->bufs + NEM_URING_BUF_SIZE * op->buf,
+			(size_t) cqe.res
+		);
+	}
+
+	NEM_uring_fn fn = op->fn;
+	void *arg = op->arg;
+	NEM_uring_op_free(this, NEM_uring_op_idx(cqe.user_data));
+
+	// NB: A NULL fn means the operation was cancelled.
+	if (NULL != fn) {
+		fn(arg, cqe.res);
+	}
+}
+
+static void
+NEM_uring_harvest(NEM_uring_t *this)
+{
+	// NB: Anything in the backlog completed before what's in the CQ now.
+	// The callbacks can reap more onto the end of it.
+	for (size_t i = 0; i < this->backlog_len; i += 1) {
+		NEM_uring_dispatch(this, this->backlog[i]);
+	}
+	this->backlog_len = 0;
+
+	uint32_t head = atomic_load_explicit(this->cq_head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(this->cq_tail, memory_order_acquire);
+
+	while (head != tail) {
+		struct io_uring_cqe cqe = this->cqes[head & this->cq_mask];
+		head += 1;
+
+		// NB: Hand the slot back before dispatching, so the kernel can
+		// reuse it for whatever the callback submits.
+		atomic_store_explicit(this->cq_head, head, memory_order_release);
+		NEM_uring_dispatch(this, cqe);
+
+		// NB: The callback might have reaped the rest into the backlog.
+		head = atomic_load_explicit(this->cq_head, memory_order_relaxed);
+		tail = atomic_load_explicit(this->cq_tail, memory_order_acquire);
+	}
+}
+
+static void
+NEM_uring_on_kevent(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_uring_t *this = NEM_thunk_ptr(thunk);
+
+	// NB: This is also the EVFILT_USER handler for NEM_uring_kick.
+	this->kicked = false;
+	this->harvesting = true;
+	do {
+		NEM_uring_harvest(this);
+
+		// NB: If the CQ overflowed, the kernel is holding on to completions
+		// that need to be flushed back into the ring.
+		uint32_t flags = atomic_load_explicit(this->sq_flags, memory_order_acquire);
+		if (!(flags & IORING_SQ_CQ_OVERFLOW)) {
+			break;
+		}
+		if (-1 == NEM_uring_enter(this->fd, 0, 0, IORING_ENTER_GETEVENTS)) {
+			if (EINTR != errno) {
+				NEM_panicf_errno("NEM_uring_on_kevent: io_uring_enter");
+			}
+		}
+	}
+	while (true);
+	this->harvesting = false;
+
+	if (!NEM_err_ok(NEM_uring_submit(this))) {
+		NEM_uring_kick(this);
+	}
+}
+
+static void
+NEM_uring_free(NEM_uring_t *this)
+{
+	if (NULL != this->on_kevent) {
+		struct kevent ev;
+		EV_SET(&ev, this->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		kevent(this->kq, &ev, 1, NULL, 0, NULL);
+		EV_SET(&ev, this->fd, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+		kevent(this->kq, &ev, 1, NULL, 0, NULL);
+		NEM_kq_forget(this->on_kevent);
+		NEM_thunk_free(this->on_kevent);
+	}
+
+	// NB: Closing the ring cancels anything still in flight.
+	if (NULL != this->sqes_ptr) {
+		munmap(this->sqes_ptr, this->sqes_len);
+	}
+	if (NULL != this->cq_ptr && this->cq_ptr != this->sq_ptr) {
+		munmap(this->cq_ptr, this->cq_len);
+	}
+	if (NULL != this->sq_ptr) {
+		munmap(this->sq_ptr, this->sq_len);
+	}
+	if (-1 != this->fd) {
+		close(this->fd);
+	}
+
+	if (NULL != this->bufs) {
+		munmap(this->bufs, NEM_URING_BUFS * NEM_URING_BUF_SIZE);
+	}
+
+	free(this->backlog);
+	free(this->ops);
+	free(this);
+}
+
+static void
+NEM_uring_init_bufs(NEM_uring_t *this)
+{
+	size_t len = NEM_URING_BUFS * NEM_URING_BUF_SIZE;
+	void *bufs = mmap(
+		NULL,
+		len,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANON,
+		-1,
+		0
+	);
+	if (MAP_FAILED == bufs) {
+		return;
+	}
+
+	struct iovec iovs[NEM_URING_BUFS];
+	for (int i = 0; i < NEM_URING_BUFS; i += 1) {
+		iovs[i].iov_base = (char*) bufs + NEM_URING_BUF_SIZE * i;
+		iovs[i].iov_len = NEM_URING_BUF_SIZE;
+	}
+
+	// NB: Registration counts against RLIMIT_MEMLOCK on older kernels;
+	// everything still works without the registered buffers.
+	if (-1 == NEM_uring_register(
+		this->fd,
+		IORING_REGISTER_BUFFERS,
+		iovs,
+		NEM_URING_BUFS
+	)) {
+		munmap(bufs, len);
+		return;
+	}
+
+	this->bufs = bufs;
+	for (int i = 0; i < NEM_URING_BUFS; i += 1) {
+		this->bufs_free[i] = NEM_URING_BUFS - 1 - i;
+	}
+	this->bufs_free_len = NEM_URING_BUFS;
+}
+
+static NEM_err_t
+NEM_uring_new(int kq, NEM_uring_t **out)
+{
+	NEM_uring_t *this = NEM_malloc(sizeof(NEM_uring_t));
+	this->kq = kq;
+	this->ops_free = NEM_URING_NONE;
+
+	struct io_uring_params params = {
+		.flags      = IORING_SETUP_CQSIZE,
+		.cq_entries = NEM_URING_CQ_ENTRIES,
+	};
+	this->fd = NEM_uring_setup(NEM_URING_SQ_ENTRIES, &params);
+	if (-1 == this->fd) {
+		NEM_err_t err = NEM_err_errno();
+		free(this);
+		return err;
+	}
+
+	// NB: NEM_uring_supported checked for IORING_FEAT_SINGLE_MMAP, so the
+	// SQ and CQ rings share a mapping.
+	this->sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	this->cq_len = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	if (this->cq_len > this->sq_len) {
+		this->sq_len = this->cq_len;
+	}
+	this->cq_len = this->sq_len;
+
+	this->sq_ptr = mmap(
+		NULL,
+		this->sq_len,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		this->fd,
+		IORING_OFF_SQ_RING
+	);
+	if (MAP_FAILED == this->sq_ptr) {
+		this->sq_ptr = NULL;
+		goto fail;
+	}
+	this->cq_ptr = this->sq_ptr;
+
+	this->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	this->sqes_ptr = mmap(
+		NULL,
+		this->sqes_len,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		this->fd,
+		IORING_OFF_SQES
+	);
+	if (MAP_FAILED == this->sqes_ptr) {
+		this->sqes_ptr = NULL;
+		goto fail;
+	}
+
+	char *sq = this->sq_ptr;
+	this->sq_head = (_Atomic uint32_t*)(sq + params.sq_off.head);
+	this->sq_tail = (_Atomic uint32_t*)(sq + params.sq_off.tail);
+	this->sq_flags = (_Atomic uint32_t*)(sq + params.sq_off.flags);
+	this->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+	this->sq_entries = params.sq_entries;
+	this->sqes = this->sqes_ptr;
+
+	// NB: The SQ index array is never reordered, so map it 1:1 up front.
+	uint32_t *array = (uint32_t*)(sq + params.sq_off.array);
+	for (uint32_t i = 0; i < params.sq_entries; i += 1) {
+		array[i] = i;
+	}
+
+	char *cq = this->cq_ptr;
+	this->cq_head = (_Atomic uint32_t*)(cq + params.cq_off.head);
+	this->cq_tail = (_Atomic uint32_t*)(cq + params.cq_off.tail);
+	this->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+	this->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	NEM_uring_init_bufs(this);
+
+	this->on_kevent = NEM_thunk_new_ptr(&NEM_uring_on_kevent, this);
+	struct kevent ev;
+	EV_SET(&ev, this->fd, EVFILT_READ, EV_ADD, 0, 0, this->on_kevent);
+	if (-1 == kevent(kq, &ev, 1, NULL, 0, NULL)) {
+		NEM_thunk_free(this->on_kevent);
+		this->on_kevent = NULL;
+		goto fail;
+	}
+	EV_SET(
+		&ev,
+		this->fd,
+		EVFILT_USER,
+		EV_ADD | EV_CLEAR,
+		0,
+		0,
+		this->on_kevent
+	);
+	if (-1 == kevent(kq, &ev, 1, NULL, 0, NULL)) {
+		goto fail;
+	}
+
+	*out = this;
+	return NEM_err_none;
+
+fail:
+	{
+		NEM_err_t err = NEM_err_errno();
+		NEM_uring_free(this);
+		return err;
+	}
+}
+
+NEM_err_t
+NEM_uring_get(int kq, NEM_uring_t **out)
+{
+	if (0 > kq) {
+		return NEM_err_static("NEM_uring_get: invalid kq");
+	}
+
+	NEM_err_t err = NEM_err_none;
+	pthread_mutex_lock(&NEM_urings_mtx);
+
+	if ((size_t) kq >= NEM_urings_cap) {
+		size_t cap = NEM_urings_cap ? NEM_urings_cap : 16;
+		while (cap <= (size_t) kq) {
+			cap *= 2;
+		}
+		NEM_urings = NEM_panic_if_null(realloc(
+			NEM_urings,
+			sizeof(NEM_uring_t*) * cap
+		));
+		bzero(
+			&NEM_urings[NEM_urings_cap],
+			sizeof(NEM_uring_t*) * (cap - NEM_urings_cap)
+		);
+		NEM_urings_cap = cap;
+	}
+
+	if (NULL == NEM_urings[kq]) {
+		err = NEM_uring_new(kq, &NEM_urings[kq]);
+	}
+
+	*out = NEM_urings[kq];
+	pthread_mutex_unlock(&NEM_urings_mtx);
+	return err;
+}
+
+void
+NEM_uring_release(int kq)
+{
+	NEM_uring_t *this = NULL;
+
+	pthread_mutex_lock(&NEM_urings_mtx);
+	if (0 <= kq && (size_t) kq < NEM_urings_cap) {
+		this = NEM_urings[kq];
+		NEM_urings[kq] = NULL;
+	}
+	pthread_mutex_unlock(&NEM_urings_mtx);
+
+	if (NULL != this) {
+		NEM_uring_free(this);
+	}
+}
+
+NEM_err_t
+NEM_uring_read(
+	NEM_uring_t *this,
+	int          fd,
+	void        *buf,
+	size_t       len,
+	NEM_uring_fn fn,
+	void        *arg,
+	uint64_t    *out
+) {
+	struct io_uring_sqe *sqe;
+	NEM_err_t err = NEM_uring_sqe(this, &sqe);
+	if (!NEM_err_ok(err)) {
+		return err;
+	}
+
+	uint64_t handle = NEM_uring_op_alloc(this, fn, arg);
+	NEM_uring_op_t *op = &this->ops[NEM_uring_op_idx(handle)];
+
+	sqe->fd = fd;
+	sqe->off = (uint64_t) -1;
+	sqe->user_data = handle;
+
+	if (len <= NEM_URING_BUF_SIZE && 0 < this->bufs_free_len) {
+		this->bufs_free_len -= 1;
+		op->buf = this->bufs_free[this->bufs_free_len];
+		op->dst = buf;
+
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uint64_t)(uintptr_t)(this->bufs + NEM_URING_BUF_SIZE * op->buf);
+		sqe->len = (uint32_t) len;
+		sqe->buf_index = (uint16_t) op->buf;
+	}
+	else {
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr = (uint64_t)(uintptr_t) buf;
+		sqe->len = (uint32_t)(len > UINT32_MAX ? UINT32_MAX : len);
+	}
+
+	NEM_uring_push(this);
+	*out = handle;
+	return NEM_err_none;
+}
+
+NEM_err_t
+NEM_uring_write(
+	NEM_uring_t *this,
+	int          fd,
+	const void  *buf,
+	size_t       len,
+	bool         sock,
+	NEM_uring_fn fn,
+	void        *arg,
+	uint64_t    *out
+) {
+	struct io_uring_sqe *sqe;
+	NEM_err_t err = NEM_uring_sqe(this, &sqe);
+	if (!NEM_err_ok(err)) {
+		return err;
+	}
+
+	uint64_t handle = NEM_uring_op_alloc(this, fn, arg);
+
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t) buf;
+	sqe->len = (uint32_t)(len > UINT32_MAX ? UINT32_MAX : len);
+	sqe->user_data = handle;
+
+	if (sock) {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	else {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->off = (uint64_t) -1;
+	}
+
+	NEM_uring_push(this);
+	*out = handle;
+	return NEM_err_none;
+}
+
+NEM_err_t
+NEM_uring_writev(
+	NEM_uring_t        *this,
+	int                 fd,
+	const struct iovec *iov,
+	size_t              iovcnt,
+	NEM_uring_fn        fn,
+	void               *arg,
+	uint64_t           *out
+) {
+	struct io_uring_sqe *sqe;
+	NEM_err_t err = NEM_uring_sqe(this, &sqe);
+	if (!NEM_err_ok(err)) {
+		return err;
+	}
+
+	uint64_t handle = NEM_uring_op_alloc(this, fn, arg);
+
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t) iov;
+	sqe->len = (uint32_t) iovcnt;
+	sqe->off = (uint64_t) -1;
+	sqe->user_data = handle;
+
+	NEM_uring_push(this);
+	*out = handle;
+	return NEM_err_none;
+}
+
+NEM_err_t
+NEM_uring_sendmsg(
+	NEM_uring_t         *this,
+	int                  fd,
+	const struct msghdr *msg,
+	NEM_uring_fn         fn,
+	void                *arg,
+	uint64_t            *out
+) {
+	struct io_uring_sqe *sqe;
+	NEM_err_t err = NEM_uring_sqe(this, &sqe);
+	if (!NEM_err_ok(err)) {
+		return err;
+	}
+
+	uint64_t handle = NEM_uring_op_alloc(this, fn, arg);
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t) msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = handle;
+
+	NEM_uring_push(this);
+	*out = handle;
+	return NEM_err_none;
+}
+
+void
+NEM_uring_cancel(NEM_uring_t *this, uint64_t handle)
+{
+	NEM_uring_op_t *op = NEM_uring_op_get(this, handle);
+	if (NULL == op) {
+		return;
+	}
+
+	// NB: Orphan the operation first; its completion is still posted (and
+	// reclaims the slot), but nothing gets invoked.
+	op->fn = NULL;
+	op->arg = NULL;
+
+	// NB: The kernel can only cancel what it's seen. If the operation is
+	// still stuck in the SQ it'd be submitted later, pointing at a buffer
+	// the caller thinks it's done with, so turn it into a no-op instead.
+	uint32_t tail = atomic_load_explicit(this->sq_tail, memory_order_relaxed);
+	for (uint32_t i = tail - this->sq_pending; i != tail; i += 1) {
+		struct io_uring_sqe *sqe = &this->sqes[i & this->sq_mask];
+		if (handle == sqe->user_data) {
+			bzero(sqe, sizeof(*sqe));
+			sqe->opcode = IORING_OP_NOP;
+			sqe->user_data = handle;
+			return;
+		}
+	}
+
+	if (0 > NEM_uring_sync_cancel(this->fd, handle)) {
+		// NB: ENOENT means it already completed and the CQE is waiting to
+		// be harvested.
+		if (ENOENT != errno) {
+			NEM_panicf_errno("NEM_uring_cancel: IORING_REGISTER_SYNC_CANCEL");
+		}
+	}
+}
+
+#endif
@@ -14,15 +14,25 @@ extern Suite
 	*suite_child(),
 	*suite_msghdr(),
 	*suite_msg(),
+	*suite_poller(),
 	*suite_kq(),
+	*suite_pool(),
+	*suite_loopback(),
+	*suite_shmring(),
 	*suite_file(),
 	*suite_fd(),
+	*suite_fd_uring(),
 	*suite_stream(),
 	*suite_list(),
 	*suite_dial(),
 	*suite_chan(),
+	*suite_chan_uring(),
+	*suite_chan_buffered(),
+	*suite_chan_loopback(),
+	*suite_chan_shmring(),
 	*suite_svcmux(),
 	*suite_txnmgr(),
+	*suite_txnpool(),
 	*suite_app();
 
 static suite_def suites[] = {
@@ -37,15 +47,25 @@ static suite_def suites[] = {
 	&suite_marshal_yaml,
 	&suite_msghdr,
 	&suite_msg,
+	&suite_poller,
 	&suite_kq,
+	&suite_pool,
 	&suite_file,
 	&suite_fd,
+	&suite_fd_uring,
 	&suite_stream,
+	&suite_loopback,
+	&suite_shmring,
 	&suite_list,
 	&suite_dial,
 	&suite_chan,
+	&suite_chan_uring,
+	&suite_chan_buffered,
+	&suite_chan_loopback,
+	&suite_chan_shmring,
 	&suite_svcmux,
 	&suite_txnmgr,
+	&suite_txnpool,
 	&suite_app,
 };
 
@@ -1,5 +1,7 @@
 #include "test.h"
 
+#include <stdatomic.h>
+
 typedef struct {
 	NEM_app_t app;
 	int ctr1, ctr2;
@@ -106,12 +108,61 @@ START_TEST(setup_teardown_order)
 }
 END_TEST
 
+static atomic_int workers_setup;
+static atomic_int workers_teardown;
+
+static NEM_err_t
+workers_setup_loop(NEM_app_t *app, NEM_kq_t *kq)
+{
+	// NB: Everything but the main loop runs on its own thread.
+	ck_assert_int_eq(kq == &app->kq, pthread_equal(
+		pthread_self(),
+		*(pthread_t*) app->data
+	));
+	atomic_fetch_add(&workers_setup, 1);
+	return NEM_err_none;
+}
+
+static void
+workers_teardown_loop(NEM_app_t *app, NEM_kq_t *kq)
+{
+	atomic_fetch_add(&workers_teardown, 1);
+}
+
+static NEM_app_comp_t workers_comp = {
+	.name          = "workers-comp",
+	.setup_loop    = &workers_setup_loop,
+	.teardown_loop = &workers_teardown_loop,
+};
+
+START_TEST(workers)
+{
+	NEM_app_t app;
+	pthread_t main_thread = pthread_self();
+	NEM_app_init_root(&app);
+	app.data = &main_thread;
+
+	const NEM_app_comp_t *comps[] = {
+		&workers_comp,
+		&shutdown_comp,
+	};
+	NEM_app_add_comps(&app, comps, NEM_ARRSIZE(comps));
+	NEM_app_set_workers(&app, 3);
+	ck_err(NEM_app_main(&app, 0, NULL));
+
+	// NB: Once for the main loop plus once per worker.
+	ck_assert_int_eq(4, atomic_load(&workers_setup));
+	ck_assert_int_eq(4, atomic_load(&workers_teardown));
+}
+END_TEST
+
 Suite*
 suite_app()
 {
 	tcase_t tests[] = {
 		{ "init_shutdown",        &init_shutdown        },
 		{ "setup_teardown_order", &setup_teardown_order },
+		{ "workers",              &workers              },
 	};
 
 	return tcase_build_suite("app", tests, sizeof(tests));
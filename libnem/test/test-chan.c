@@ -5,6 +5,7 @@ typedef struct {
 	NEM_chan_t c_1, c_2;
 	int freed[2];
 	int ctr;
+	int sent;
 }
 work_t;
 
@@ -24,16 +25,99 @@ work_close_fd(NEM_thunk1_t *thunk, void *varg)
 	free(fd);
 }
 
+static void
+work_close_shmring(NEM_thunk1_t *thunk, void *varg)
+{
+	free(NEM_thunk1_ptr(thunk));
+}
+
+static void
+work_close_loopback(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_loopback_t *lb = NEM_thunk1_ptr(thunk);
+	NEM_loopback_free(lb);
+	free(lb);
+}
+
+// NB: Read buffer size for each NEM_fd_t work_init makes; zero leaves
+// reads unbuffered.
+static size_t work_read_buffer = 0;
+
+// NB: Ring size for a NEM_loopback_t pair to use instead of a unix socket;
+// zero uses the socket.
+static size_t work_loopback = 0;
+
+// NB: Whether to use a NEM_shmring_t pair over the unix socket rather than
+// the socket itself.
+static bool work_shmring = false;
+
 static void
 work_init(work_t *work)
 {
 	bzero(work, sizeof(*work));
 	ck_err(NEM_kq_init_root(&work->kq));
 
+	if (0 != work_loopback) {
+		NEM_loopback_t *lb1 = NEM_malloc(sizeof(NEM_loopback_t));
+		NEM_loopback_t *lb2 = NEM_malloc(sizeof(NEM_loopback_t));
+		NEM_loopback_init(lb1, lb2, &work->kq, work_loopback);
+
+		NEM_loopback_on_close(lb1, NEM_thunk1_new_ptr(
+			&work_close_loopback,
+			lb1
+		));
+		NEM_loopback_on_close(lb2, NEM_thunk1_new_ptr(
+			&work_close_loopback,
+			lb2
+		));
+
+		NEM_chan_init(&work->c_1, NEM_loopback_as_stream(lb1));
+		NEM_chan_init(&work->c_2, NEM_loopback_as_stream(lb2));
+
+		NEM_kq_after(&work->kq, 3000, NEM_thunk1_new_ptr(
+			&work_stop_cb,
+			work
+		));
+		return;
+	}
+
+	if (work_shmring) {
+		int fds[2];
+		ck_assert_int_eq(0, socketpair(PF_LOCAL, SOCK_STREAM, 0, fds));
+
+		NEM_shmring_t *ring1 = NEM_malloc(sizeof(NEM_shmring_t));
+		NEM_shmring_t *ring2 = NEM_malloc(sizeof(NEM_shmring_t));
+		ck_err(NEM_shmring_init_parent(ring1, work->kq.kq, fds[0]));
+		ck_err(NEM_shmring_init_child(ring2, work->kq.kq, fds[1]));
+
+		NEM_shmring_on_close(ring1, NEM_thunk1_new_ptr(
+			&work_close_shmring,
+			ring1
+		));
+		NEM_shmring_on_close(ring2, NEM_thunk1_new_ptr(
+			&work_close_shmring,
+			ring2
+		));
+
+		NEM_chan_init(&work->c_1, NEM_shmring_as_stream(ring1));
+		NEM_chan_init(&work->c_2, NEM_shmring_as_stream(ring2));
+
+		NEM_kq_after(&work->kq, 3000, NEM_thunk1_new_ptr(
+			&work_stop_cb,
+			work
+		));
+		return;
+	}
+
 	NEM_fd_t *fd1 = NEM_malloc(sizeof(NEM_fd_t));
 	NEM_fd_t *fd2 = NEM_malloc(sizeof(NEM_fd_t));
 	ck_err(NEM_fd_init_unix(fd1, fd2, work->kq.kq));
 
+	if (0 != work_read_buffer) {
+		ck_err(NEM_fd_set_read_buffer(fd1, work_read_buffer));
+		ck_err(NEM_fd_set_read_buffer(fd2, work_read_buffer));
+	}
+
 	NEM_fd_on_close(fd1, NEM_thunk1_new_ptr(
 		&work_close_fd,
 		fd1
@@ -613,29 +697,632 @@ START_TEST(send_ordering)
 }
 END_TEST
 
+// NB: The stack address of the first send_backlog message dispatched.
+static uintptr_t send_backlog_sp = 0;
+
+static void
+send_backlog_on_msg(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_chan_ca *ca = varg;
+	ck_err(ca->err);
+
+	// NB: Messages that were already buffered get dispatched without going
+	// back to the kq, but that mustn't cost a stack frame apiece.
+	uintptr_t sp = (uintptr_t)&sp;
+	if (0 == work->ctr) {
+		send_backlog_sp = sp;
+	}
+	uintptr_t depth = (sp < send_backlog_sp)
+		? send_backlog_sp - sp
+		: sp - send_backlog_sp;
+	ck_assert_msg(depth < 64 * 1024, "recursing per message");
+
+	int *body = (int*) ca->msg->body;
+	ck_assert_int_eq(*body, work->ctr);
+	work->ctr += 1;
+
+	if (work->ctr == 5000) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+START_TEST(send_backlog)
+{
+	work_t work;
+	work_init(&work);
+
+	NEM_chan_on_msg(&work.c_1, NEM_thunk_new_ptr(
+		&send_backlog_on_msg,
+		&work
+	));
+
+	for (int i = 0; i < 5000; i += 1) {
+		NEM_msg_t *msg = NEM_msg_new(0, sizeof(int));
+		memcpy(msg->body, &i, sizeof(int));
+		NEM_chan_send(&work.c_2, msg, NULL);
+	}
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(5000, work.ctr);
+	work_free(&work);
+}
+END_TEST
+
+static void
+send_batch_on_msg(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_chan_ca *ca = varg;
+	ck_err(ca->err);
+
+	int *body = (int*) ca->msg->body;
+	ck_assert_int_eq(*body, work->ctr);
+	work->ctr += 1;
+
+	if (work->ctr == 64) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static void
+send_batch_on_send(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_chan_ca *ca = varg;
+	ck_err(ca->err);
+
+	// NB: Completions come back in the order the messages were sent, even
+	// though most of them share a write.
+	int *body = (int*) ca->msg->body;
+	ck_assert_int_eq(*body, work->sent);
+	work->sent += 1;
+}
+
+START_TEST(send_batch)
+{
+	work_t work;
+	work_init(&work);
+
+	NEM_chan_on_msg(&work.c_1, NEM_thunk_new_ptr(
+		&send_batch_on_msg,
+		&work
+	));
+
+	for (int i = 0; i < 64; i += 1) {
+		// NB: One big body in the middle, to overflow the write budget.
+		size_t len = (i == 20) ? 100 * 1024 : sizeof(int);
+		int *body = NEM_malloc(len);
+		*body = i;
+
+		NEM_msg_t *msg = NEM_msg_new(0, 0);
+		ck_err(NEM_msg_set_body(msg, body, len));
+		NEM_chan_send(&work.c_2, msg, NEM_thunk1_new_ptr(
+			&send_batch_on_send,
+			&work
+		));
+	}
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(64, work.ctr);
+	ck_assert_int_eq(64, work.sent);
+	work_free(&work);
+}
+END_TEST
+
+static void
+send_ool_on_msg(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_chan_ca *ca = varg;
+	ck_err(ca->err);
+
+	NEM_msg_t *msg = ca->msg;
+	ck_assert_int_eq(0, msg->packed.flags & (NEM_PMSGFLAG_FD | NEM_PMSGFLAG_OOL));
+	ck_assert_int_eq(0, msg->flags & NEM_MSGFLAG_HAS_FD);
+
+	if (0 == work->ctr) {
+		// NB: The big one comes back as a mapping, even though it's too
+		// big to have been sent inline.
+		ck_assert(msg->flags & NEM_MSGFLAG_BODY_MAPPED);
+		ck_assert_int_eq(2 * NEM_PMSG_BODYMAX, msg->packed.body_len);
+		ck_assert_int_eq(2, msg->packed.header_len);
+		ck_assert_str_eq("h", msg->header);
+
+		const unsigned char *body = msg->body;
+		for (size_t i = 0; i < msg->packed.body_len; i += 1) {
+			ck_assert_int_eq((unsigned char) i, body[i]);
+		}
+	}
+	else {
+		ck_assert(!(msg->flags & NEM_MSGFLAG_BODY_MAPPED));
+		ck_assert_int_eq(4, msg->packed.body_len);
+		ck_assert_str_eq("abc", msg->body);
+	}
+
+	work->ctr += 1;
+	if (work->ctr == 2) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+START_TEST(send_ool)
+{
+	work_t work;
+	work_init(&work);
+	NEM_chan_set_ool_threshold(&work.c_2, 16);
+
+	NEM_chan_on_msg(&work.c_1, NEM_thunk_new_ptr(
+		&send_ool_on_msg,
+		&work
+	));
+
+	size_t len = 2 * NEM_PMSG_BODYMAX;
+	unsigned char *body = NEM_malloc(len);
+	for (size_t i = 0; i < len; i += 1) {
+		body[i] = (unsigned char) i;
+	}
+
+	NEM_msg_t *msg = NEM_msg_new(2, 0);
+	memcpy(msg->header, "h", 2);
+	ck_err(NEM_msg_set_body(msg, body, len));
+	NEM_chan_send(&work.c_2, msg, NULL);
+
+	msg = NEM_msg_new(0, 4);
+	memcpy(msg->body, "abc", 4);
+	NEM_chan_send(&work.c_2, msg, NULL);
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(2, work.ctr);
+	work_free(&work);
+}
+END_TEST
+
+static void
+send_ool_off_on_msg(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_chan_ca *ca = varg;
+	ck_err(ca->err);
+
+	ck_assert(!(ca->msg->flags & NEM_MSGFLAG_BODY_MAPPED));
+	ck_assert_int_eq(256 * 1024, ca->msg->packed.body_len);
+
+	work->ctr += 1;
+	NEM_kq_stop(&work->kq);
+}
+
+START_TEST(send_ool_off)
+{
+	work_t work;
+	work_init(&work);
+	NEM_chan_set_ool_threshold(&work.c_2, 16);
+	NEM_chan_set_ool_threshold(&work.c_2, NEM_CHAN_OOL_OFF);
+
+	NEM_chan_on_msg(&work.c_1, NEM_thunk_new_ptr(
+		&send_ool_off_on_msg,
+		&work
+	));
+
+	size_t len = 256 * 1024;
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	ck_err(NEM_msg_set_body(msg, NEM_malloc(len), len));
+	NEM_chan_send(&work.c_2, msg, NULL);
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(1, work.ctr);
+	work_free(&work);
+}
+END_TEST
+
+static void
+err_send_ool_too_long_on_send(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_chan_ca *ca = varg;
+	ck_assert(!NEM_err_ok(ca->err));
+	work->ctr += 1;
+}
+
+START_TEST(err_send_ool_too_long)
+{
+	work_t work;
+	work_init(&work);
+
+	// NB: Without out-of-line bodies there's no way to send it, but the
+	// channel's still fine for everything else.
+	size_t len = NEM_PMSG_BODYMAX + 1;
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	ck_err(NEM_msg_set_body(msg, NEM_malloc(len), len));
+	NEM_chan_send(&work.c_2, msg, NEM_thunk1_new_ptr(
+		&err_send_ool_too_long_on_send,
+		&work
+	));
+	ck_assert_int_eq(1, work.ctr);
+	ck_err(work.c_2.err);
+
+	work_free(&work);
+}
+END_TEST
+
+static void
+send_fd_ordering_on_msg(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_chan_ca *ca = varg;
+	ck_err(ca->err);
+
+	int *body = (int*) ca->msg->body;
+	ck_assert_int_eq(*body, work->ctr);
+	ck_assert_int_ne(0, ca->msg->fd);
+
+	// NB: Each fd is the read end of a pipe the body's index was written
+	// into, so checking the index catches fds getting matched up with the
+	// wrong message.
+	int idx = -1;
+	ck_assert_int_eq(sizeof(idx), read(ca->msg->fd, &idx, sizeof(idx)));
+	ck_assert_int_eq(idx, work->ctr);
+	close(ca->msg->fd);
+
+	work->ctr += 1;
+	if (work->ctr == 4) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+START_TEST(send_fd_ordering)
+{
+	work_t work;
+	work_init(&work);
+
+	NEM_chan_on_msg(&work.c_1, NEM_thunk_new_ptr(
+		&send_fd_ordering_on_msg,
+		&work
+	));
+
+	int rfds[4];
+	for (int i = 0; i < 4; i += 1) {
+		int fds[2];
+		ck_assert_int_eq(0, pipe(fds));
+		rfds[i] = fds[0];
+		ck_assert_int_eq(sizeof(i), write(fds[1], &i, sizeof(i)));
+		close(fds[1]);
+
+		NEM_msg_t *msg = NEM_msg_new(0, sizeof(int));
+		memcpy(msg->body, &i, sizeof(int));
+		ck_err(NEM_msg_set_fd(msg, fds[0]));
+		NEM_chan_send(&work.c_2, msg, NULL);
+	}
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(4, work.ctr);
+	for (int i = 0; i < 4; i += 1) {
+		close(rfds[i]);
+	}
+	work_free(&work);
+}
+END_TEST
+
+static void
+send_fds_on_msg(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_chan_ca *ca = varg;
+	ck_err(ca->err);
+
+	NEM_msg_t *msg = ca->msg;
+	if (0 == work->ctr) {
+		ck_assert(msg->flags & NEM_MSGFLAG_HAS_FDS);
+		ck_assert(!(msg->flags & NEM_MSGFLAG_HAS_FD));
+		ck_assert_int_eq(5, msg->fds_len);
+
+		// NB: Each one is a pipe with its index written into it, so they
+		// have to come back in order.
+		for (size_t i = 0; i < msg->fds_len; i += 1) {
+			int idx = -1;
+			ck_assert_int_eq(sizeof(idx), read(msg->fds[i], &idx, sizeof(idx)));
+			ck_assert_int_eq(idx, i);
+			close(msg->fds[i]);
+		}
+	}
+	else {
+		// NB: A plain fd right after a batch still works.
+		ck_assert(msg->flags & NEM_MSGFLAG_HAS_FD);
+		ck_assert(!(msg->flags & NEM_MSGFLAG_HAS_FDS));
+		close(msg->fd);
+	}
+
+	work->ctr += 1;
+	if (work->ctr == 2) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+START_TEST(send_fds)
+{
+	work_t work;
+	work_init(&work);
+
+	NEM_chan_on_msg(&work.c_1, NEM_thunk_new_ptr(
+		&send_fds_on_msg,
+		&work
+	));
+
+	int rfds[5];
+	for (int i = 0; i < 5; i += 1) {
+		int fds[2];
+		ck_assert_int_eq(0, pipe(fds));
+		ck_assert_int_eq(sizeof(i), write(fds[1], &i, sizeof(i)));
+		close(fds[1]);
+		rfds[i] = fds[0];
+	}
+
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	ck_err(NEM_msg_set_fds(msg, rfds, NEM_ARRSIZE(rfds)));
+	ck_assert(!NEM_err_ok(NEM_msg_set_fd(msg, rfds[0])));
+	NEM_chan_send(&work.c_2, msg, NULL);
+
+	msg = NEM_msg_new(0, 0);
+	ck_err(NEM_msg_set_fd(msg, rfds[0]));
+	NEM_chan_send(&work.c_2, msg, NULL);
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(2, work.ctr);
+	for (int i = 0; i < 5; i += 1) {
+		close(rfds[i]);
+	}
+	work_free(&work);
+}
+END_TEST
+
+static void
+uring_setup()
+{
+	NEM_fd_set_default_mode(NEM_FD_URING);
+}
+
+static void
+uring_teardown()
+{
+	NEM_fd_set_default_mode(NEM_FD_READY);
+}
+
+// NB: Small enough that most messages span several fills and bodies get
+// read straight into the message.
+static void
+buffered_setup()
+{
+	work_read_buffer = 64;
+}
+
+static void
+buffered_teardown()
+{
+	work_read_buffer = 0;
+}
+
+static void
+loopback_setup()
+{
+	// NB: Small enough that the bigger messages wrap around the ring.
+	work_loopback = 1024;
+}
+
+static void
+loopback_teardown()
+{
+	work_loopback = 0;
+}
+
+static void
+shmring_setup()
+{
+	work_shmring = true;
+}
+
+static void
+shmring_teardown()
+{
+	work_shmring = false;
+}
+
 Suite*
 suite_chan()
 {
 	tcase_t tests[] = {
-		{ "init_free",           &init_free           },
-		{ "send_empty_msg",      &send_empty_msg      },
-		{ "send_hdr_inline",     &send_hdr_inline     },
-		{ "send_hdr",            &send_hdr            },
-		{ "send_body_inline",    &send_body_inline    },
-		{ "send_body",           &send_body           },
-		{ "send_hdrbody_inline", &send_hdrbody_inline },
-		{ "send_hdrbody_ihdr",   &send_hdrbody_ihdr   },
-		{ "send_hdrbody_ibody",  &send_hdrbody_ibody  },
-		{ "send_hdrbody",        &send_hdrbody        },
-		{ "send_fd",             &send_fd             },
-		{ "send_fd_hdr",         &send_fd_hdr         },
-		{ "send_fd_hdr_inline",  &send_fd_hdr_inline  },
-		{ "send_fd_body",        &send_fd_body        },
-		{ "send_fd_body_inline", &send_fd_body_inline },
-		{ "send_callback",       &send_callback       },
-		{ "err_send_callback",   &err_send_callback   },
-		{ "send_ordering",       &send_ordering       },
+		{ "init_free",             &init_free             },
+		{ "send_empty_msg",        &send_empty_msg        },
+		{ "send_hdr_inline",       &send_hdr_inline       },
+		{ "send_hdr",              &send_hdr              },
+		{ "send_body_inline",      &send_body_inline      },
+		{ "send_body",             &send_body             },
+		{ "send_hdrbody_inline",   &send_hdrbody_inline   },
+		{ "send_hdrbody_ihdr",     &send_hdrbody_ihdr     },
+		{ "send_hdrbody_ibody",    &send_hdrbody_ibody    },
+		{ "send_hdrbody",          &send_hdrbody          },
+		{ "send_fd",               &send_fd               },
+		{ "send_fd_hdr",           &send_fd_hdr           },
+		{ "send_fd_hdr_inline",    &send_fd_hdr_inline    },
+		{ "send_fd_body",          &send_fd_body          },
+		{ "send_fd_body_inline",   &send_fd_body_inline   },
+		{ "send_callback",         &send_callback         },
+		{ "err_send_callback",     &err_send_callback     },
+		{ "send_ordering",         &send_ordering         },
+		{ "send_batch",            &send_batch            },
+		{ "send_ool",              &send_ool              },
+		{ "send_ool_off",          &send_ool_off          },
+		{ "err_send_ool_too_long", &err_send_ool_too_long },
+		{ "send_fd_ordering",      &send_fd_ordering      },
+		{ "send_backlog",          &send_backlog          },
+		{ "send_fds",              &send_fds              },
 	};
 
 	return tcase_build_suite("chan", tests, sizeof(tests));
 }
+
+// NB: suite_chan_uring reruns the same tests with every NEM_fd_t in
+// NEM_FD_URING mode (which is the same as NEM_FD_READY off Linux).
+Suite*
+suite_chan_uring()
+{
+	tcase_t tests[] = {
+		{ "init_free",             &init_free             },
+		{ "send_empty_msg",        &send_empty_msg        },
+		{ "send_hdr_inline",       &send_hdr_inline       },
+		{ "send_hdr",              &send_hdr              },
+		{ "send_body_inline",      &send_body_inline      },
+		{ "send_body",             &send_body             },
+		{ "send_hdrbody_inline",   &send_hdrbody_inline   },
+		{ "send_hdrbody_ihdr",     &send_hdrbody_ihdr     },
+		{ "send_hdrbody_ibody",    &send_hdrbody_ibody    },
+		{ "send_hdrbody",          &send_hdrbody          },
+		{ "send_fd",               &send_fd               },
+		{ "send_fd_hdr",           &send_fd_hdr           },
+		{ "send_fd_hdr_inline",    &send_fd_hdr_inline    },
+		{ "send_fd_body",          &send_fd_body          },
+		{ "send_fd_body_inline",   &send_fd_body_inline   },
+		{ "send_callback",         &send_callback         },
+		{ "err_send_callback",     &err_send_callback     },
+		{ "send_ordering",         &send_ordering         },
+		{ "send_batch",            &send_batch            },
+		{ "send_ool",              &send_ool              },
+		{ "send_ool_off",          &send_ool_off          },
+		{ "err_send_ool_too_long", &err_send_ool_too_long },
+		{ "send_fd_ordering",      &send_fd_ordering      },
+		{ "send_backlog",          &send_backlog          },
+		{ "send_fds",              &send_fds              },
+	};
+
+	return tcase_build_suite_with_fixtures(
+		"chan-uring",
+		&uring_setup,
+		&uring_teardown,
+		tests,
+		sizeof(tests)
+	);
+}
+
+// NB: suite_chan_buffered reruns the same tests with a read buffer on both
+// ends of the channel.
+Suite*
+suite_chan_buffered()
+{
+	tcase_t tests[] = {
+		{ "init_free",             &init_free             },
+		{ "send_empty_msg",        &send_empty_msg        },
+		{ "send_hdr_inline",       &send_hdr_inline       },
+		{ "send_hdr",              &send_hdr              },
+		{ "send_body_inline",      &send_body_inline      },
+		{ "send_body",             &send_body             },
+		{ "send_hdrbody_inline",   &send_hdrbody_inline   },
+		{ "send_hdrbody_ihdr",     &send_hdrbody_ihdr     },
+		{ "send_hdrbody_ibody",    &send_hdrbody_ibody    },
+		{ "send_hdrbody",          &send_hdrbody          },
+		{ "send_fd",               &send_fd               },
+		{ "send_fd_hdr",           &send_fd_hdr           },
+		{ "send_fd_hdr_inline",    &send_fd_hdr_inline    },
+		{ "send_fd_body",          &send_fd_body          },
+		{ "send_fd_body_inline",   &send_fd_body_inline   },
+		{ "send_callback",         &send_callback         },
+		{ "err_send_callback",     &err_send_callback     },
+		{ "send_ordering",         &send_ordering         },
+		{ "send_batch",            &send_batch            },
+		{ "send_ool",              &send_ool              },
+		{ "send_ool_off",          &send_ool_off          },
+		{ "err_send_ool_too_long", &err_send_ool_too_long },
+		{ "send_fd_ordering",      &send_fd_ordering      },
+		{ "send_backlog",          &send_backlog          },
+		{ "send_fds",              &send_fds              },
+	};
+
+	return tcase_build_suite_with_fixtures(
+		"chan-buffered",
+		&buffered_setup,
+		&buffered_teardown,
+		tests,
+		sizeof(tests)
+	);
+}
+
+// NB: suite_chan_loopback reruns the same tests over a NEM_loopback_t pair
+// rather than a unix socket.
+Suite*
+suite_chan_loopback()
+{
+	tcase_t tests[] = {
+		{ "init_free",             &init_free             },
+		{ "send_empty_msg",        &send_empty_msg        },
+		{ "send_hdr_inline",       &send_hdr_inline       },
+		{ "send_hdr",              &send_hdr              },
+		{ "send_body_inline",      &send_body_inline      },
+		{ "send_body",             &send_body             },
+		{ "send_hdrbody_inline",   &send_hdrbody_inline   },
+		{ "send_hdrbody_ihdr",     &send_hdrbody_ihdr     },
+		{ "send_hdrbody_ibody",    &send_hdrbody_ibody    },
+		{ "send_hdrbody",          &send_hdrbody          },
+		{ "send_fd",               &send_fd               },
+		{ "send_fd_hdr",           &send_fd_hdr           },
+		{ "send_fd_hdr_inline",    &send_fd_hdr_inline    },
+		{ "send_fd_body",          &send_fd_body          },
+		{ "send_fd_body_inline",   &send_fd_body_inline   },
+		{ "send_callback",         &send_callback         },
+		{ "err_send_callback",     &err_send_callback     },
+		{ "send_ordering",         &send_ordering         },
+		{ "send_batch",            &send_batch            },
+		{ "send_ool",              &send_ool              },
+		{ "send_ool_off",          &send_ool_off          },
+		{ "err_send_ool_too_long", &err_send_ool_too_long },
+		{ "send_fd_ordering",      &send_fd_ordering      },
+		{ "send_fds",              &send_fds              },
+	};
+
+	return tcase_build_suite_with_fixtures(
+		"chan-loopback",
+		&loopback_setup,
+		&loopback_teardown,
+		tests,
+		sizeof(tests)
+	);
+}
+
+// NB: suite_chan_shmring reruns the same tests over a NEM_shmring_t pair,
+// which moves the bytes through shared memory and the descriptors over the
+// socket.
+Suite*
+suite_chan_shmring()
+{
+	tcase_t tests[] = {
+		{ "init_free",             &init_free             },
+		{ "send_empty_msg",        &send_empty_msg        },
+		{ "send_hdr_inline",       &send_hdr_inline       },
+		{ "send_hdr",              &send_hdr              },
+		{ "send_body_inline",      &send_body_inline      },
+		{ "send_body",             &send_body             },
+		{ "send_hdrbody_inline",   &send_hdrbody_inline   },
+		{ "send_hdrbody_ihdr",     &send_hdrbody_ihdr     },
+		{ "send_hdrbody_ibody",    &send_hdrbody_ibody    },
+		{ "send_hdrbody",          &send_hdrbody          },
+		{ "send_fd",               &send_fd               },
+		{ "send_fd_hdr",           &send_fd_hdr           },
+		{ "send_fd_hdr_inline",    &send_fd_hdr_inline    },
+		{ "send_fd_body",          &send_fd_body          },
+		{ "send_fd_body_inline",   &send_fd_body_inline   },
+		{ "send_callback",         &send_callback         },
+		{ "err_send_callback",     &err_send_callback     },
+		{ "send_ordering",         &send_ordering         },
+		{ "send_batch",            &send_batch            },
+		{ "send_ool",              &send_ool              },
+		{ "send_ool_off",          &send_ool_off          },
+		{ "err_send_ool_too_long", &err_send_ool_too_long },
+		{ "send_fd_ordering",      &send_fd_ordering      },
+		{ "send_fds",              &send_fds              },
+	};
+
+	return tcase_build_suite_with_fixtures(
+		"chan-shmring",
+		&shmring_setup,
+		&shmring_teardown,
+		tests,
+		sizeof(tests)
+	);
+}
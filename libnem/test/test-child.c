@@ -93,13 +93,14 @@ work_kq_cb(NEM_thunk_t *thunk, void *varg)
 	work_t *this = NEM_thunk_ptr(thunk);
 	struct kevent *kev = varg;
 	this->out = NEM_panic_if_null(realloc(
-		this->out, this->out_len + kev->data
+		this->out, this->out_len + kev->data + 1
 	));
 	ck_assert_int_eq(
 		kev->data,
 		read(this->fds[0], this->out + this->out_len, kev->data)
 	);
 	this->out_len += kev->data;
+	this->out[this->out_len] = 0;
 }
 
 static void
@@ -80,7 +80,7 @@ START_TEST(listen_dial_unix)
 	));
 
 	NEM_dial_unix(
-		work.kq.kq,
+		&work.kq,
 		unix_path,
 		NEM_thunk1_new_ptr(
 			&listen_dial_cb,
@@ -113,7 +113,7 @@ START_TEST(listen_dial_tcp)
 	));
 
 	NEM_dial_tcp(
-		work.kq.kq,
+		&work.kq,
 		12894,
 		"127.0.0.1",
 		NEM_thunk1_new_ptr(
@@ -130,12 +130,192 @@ START_TEST(listen_dial_tcp)
 }
 END_TEST
 
+typedef struct {
+	NEM_kq_t    kq;
+	NEM_dial_ca ca;
+	bool        done;
+}
+dial_work_t;
+
+static void
+dial_work_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	dial_work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_dial_ca *ca = varg;
+
+	work->ca = *ca;
+	work->done = true;
+	if (NEM_err_ok(ca->err)) {
+		NEM_stream_close(ca->stream);
+	}
+	NEM_kq_stop(&work->kq);
+}
+
+static void
+dial_work_run(dial_work_t *work)
+{
+	if (!work->done) {
+		ck_err(NEM_kq_run(&work->kq));
+	}
+	ck_assert(work->done);
+}
+
+START_TEST(dial_tcp_refused)
+{
+	dial_work_t work = {0};
+	ck_err(NEM_kq_init_root(&work.kq));
+
+	NEM_dial_tcp(
+		&work.kq,
+		12895,
+		"127.0.0.1",
+		NEM_thunk1_new_ptr(&dial_work_cb, &work)
+	);
+	dial_work_run(&work);
+
+	ck_assert(!NEM_err_ok(work.ca.err));
+	ck_assert_int_eq(NEM_ERR_SOURCE_POSIX, work.ca.err.source);
+	ck_assert_int_eq(ECONNREFUSED, work.ca.err.code);
+	ck_assert_int_eq(1, work.ca.attempts);
+
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+START_TEST(dial_tcp_timeout)
+{
+	dial_work_t work = {0};
+	ck_err(NEM_kq_init_root(&work.kq));
+
+	// NB: A listener that never accepts, with its queue already full, drops
+	// any more SYNs on the floor.
+	int list = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	ck_assert_int_ne(-1, list);
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(12896);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int on = 1;
+	ck_assert_int_eq(0, setsockopt(
+		list,
+		SOL_SOCKET,
+		SO_REUSEADDR,
+		&on,
+		sizeof(on)
+	));
+	ck_assert_int_eq(0, bind(list, (struct sockaddr*) &addr, sizeof(addr)));
+	ck_assert_int_eq(0, listen(list, 0));
+
+	int fill[4];
+	for (size_t i = 0; i < NEM_ARRSIZE(fill); i += 1) {
+		fill[i] = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		connect(fill[i], (struct sockaddr*) &addr, sizeof(addr));
+	}
+	usleep(10 * 1000);
+
+	NEM_dial_opts_t opts = {
+		.timeout_ms = 100,
+	};
+	NEM_dial_tcp_host(
+		&work.kq,
+		12896,
+		"127.0.0.1",
+		&opts,
+		NEM_thunk1_new_ptr(&dial_work_cb, &work)
+	);
+	dial_work_run(&work);
+
+	ck_assert(!NEM_err_ok(work.ca.err));
+	ck_assert_int_eq(ETIMEDOUT, work.ca.err.code);
+	ck_assert(work.ca.connect_ns >= 100 * 1000 * 1000);
+	ck_assert(0 == work.ca.resolve_ns);
+
+	for (size_t i = 0; i < NEM_ARRSIZE(fill); i += 1) {
+		close(fill[i]);
+	}
+	close(list);
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+static void
+dial_host_conn(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_list_ca *ca = varg;
+	ck_err(ca->err);
+	NEM_stream_close(ca->stream);
+}
+
+START_TEST(dial_tcp_host)
+{
+	dial_work_t work = {0};
+	ck_err(NEM_kq_init_root(&work.kq));
+
+	NEM_pool_t pool;
+	ck_err(NEM_pool_init(&pool, 1, 0));
+
+	NEM_list_t list;
+	ck_err(NEM_list_init_tcp(
+		&list,
+		work.kq.kq,
+		12897,
+		"127.0.0.1",
+		NEM_thunk_new_ptr(&dial_host_conn, &work)
+	));
+
+	// NB: localhost may well resolve to ::1 first, which is refused since
+	// the listener's IPv4-only; the dial should move on to 127.0.0.1.
+	NEM_dial_opts_t opts = {
+		.pool = &pool,
+	};
+	NEM_dial_tcp_host(
+		&work.kq,
+		12897,
+		"localhost",
+		&opts,
+		NEM_thunk1_new_ptr(&dial_work_cb, &work)
+	);
+	dial_work_run(&work);
+
+	ck_err(work.ca.err);
+	ck_assert(0 < work.ca.resolve_ns);
+	ck_assert_int_ge(work.ca.attempts, 1);
+
+	NEM_list_close(list);
+	NEM_pool_free(&pool);
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+START_TEST(err_dial_tcp_host_no_pool)
+{
+	dial_work_t work = {0};
+	ck_err(NEM_kq_init_root(&work.kq));
+
+	NEM_dial_tcp_host(
+		&work.kq,
+		12898,
+		"localhost",
+		NULL,
+		NEM_thunk1_new_ptr(&dial_work_cb, &work)
+	);
+	dial_work_run(&work);
+	ck_assert(!NEM_err_ok(work.ca.err));
+
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
 Suite*
 suite_dial()
 {
 	tcase_t tests[] = {
-		{ "listen_dial_unix", &listen_dial_unix },
-		{ "listen_dial_tcp",  &listen_dial_tcp  },
+		{ "listen_dial_unix",          &listen_dial_unix          },
+		{ "listen_dial_tcp",           &listen_dial_tcp           },
+		{ "dial_tcp_refused",          &dial_tcp_refused          },
+		{ "dial_tcp_timeout",          &dial_tcp_timeout          },
+		{ "dial_tcp_host",             &dial_tcp_host             },
+		{ "err_dial_tcp_host_no_pool", &err_dial_tcp_host_no_pool },
 	};
 
 	return tcase_build_suite("dial", tests, sizeof(tests));
@@ -209,6 +209,67 @@ START_TEST(read_1)
 }
 END_TEST
 
+typedef struct {
+	work_t   work;
+	NEM_fd_t fd;
+	bool     closed;
+}
+read_close_t;
+
+static void
+read_close_2_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_stream_ca *ca = varg;
+	ck_assert(!NEM_err_ok(ca->err));
+
+	read_close_t *rc = NEM_thunk1_ptr(thunk);
+	rc->closed = true;
+	NEM_kq_stop(&rc->work.kq);
+}
+
+static void
+read_close_1_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_stream_ca *ca = varg;
+	ck_err(ca->err);
+
+	// NB: With io_uring, the second read is still sitting in the SQ when
+	// the close cancels it.
+	read_close_t *rc = NEM_thunk1_ptr(thunk);
+	ck_err(NEM_fd_read(&rc->fd, rc->work.buf, 6, NEM_thunk1_new_ptr(
+		&read_close_2_cb,
+		rc
+	)));
+	NEM_fd_close(&rc->fd);
+}
+
+START_TEST(read_close_in_cb)
+{
+	read_close_t rc = {0};
+	work_init(&rc.work);
+
+	NEM_kq_init_root(&rc.work.kq);
+
+	ck_err(NEM_fd_init(&rc.fd, rc.work.kq.kq, rc.work.fds[0]));
+	rc.work.fds_freed[0] = true;
+
+	ck_assert_int_eq(6, write(rc.work.fds[1], "hello", 6));
+	rc.work.buf = alloca(6);
+
+	ck_err(NEM_fd_read(&rc.fd, rc.work.buf, 6, NEM_thunk1_new_ptr(
+		&read_close_1_cb,
+		&rc
+	)));
+
+	NEM_kq_run(&rc.work.kq);
+	ck_assert(rc.closed);
+
+	NEM_fd_free(&rc.fd);
+	NEM_kq_free(&rc.work.kq);
+	work_free(&rc.work);
+}
+END_TEST
+
 static void
 err_fail_cb(NEM_thunk1_t *thunk, void *varg)
 {
@@ -316,6 +377,18 @@ START_TEST(err_read_then_close)
 }
 END_TEST
 
+static void
+uring_setup()
+{
+	NEM_fd_set_default_mode(NEM_FD_URING);
+}
+
+static void
+uring_teardown()
+{
+	NEM_fd_set_default_mode(NEM_FD_READY);
+}
+
 Suite*
 suite_fd()
 {
@@ -330,6 +403,7 @@ suite_fd()
 		{ "err_init2_invalid_fd1", &err_init2_invalid_fd1 },
 		{ "err_init2_invalid_fd2", &err_init2_invalid_fd2 },
 		{ "read_1",                &read_1                },
+		{ "read_close_in_cb",      &read_close_in_cb      },
 		{ "err_read_interleaved",  &err_read_interleaved  },
 		{ "err_read_closed",       &err_read_closed       },
 		{ "err_read_then_close",   &err_read_then_close   },
@@ -337,3 +411,34 @@ suite_fd()
 
 	return tcase_build_suite("fd", tests, sizeof(tests));
 }
+
+// NB: suite_fd_uring reruns the same tests with every NEM_fd_t in
+// NEM_FD_URING mode (which is the same as NEM_FD_READY off Linux).
+Suite*
+suite_fd_uring()
+{
+	tcase_t tests[] = {
+		{ "init_free",             &init_free             },
+		{ "init_close_free",       &init_close_free       },
+		{ "err_init_invalid_kq",   &err_init_invalid_kq   },
+		{ "err_init_invalid_fd",   &err_init_invalid_fd   },
+		{ "init2_free",            &init2_free            },
+		{ "init2_close_free",      &init2_close_free      },
+		{ "err_init2_invalid_kq",  &err_init2_invalid_kq  },
+		{ "err_init2_invalid_fd1", &err_init2_invalid_fd1 },
+		{ "err_init2_invalid_fd2", &err_init2_invalid_fd2 },
+		{ "read_1",                &read_1                },
+		{ "read_close_in_cb",      &read_close_in_cb      },
+		{ "err_read_interleaved",  &err_read_interleaved  },
+		{ "err_read_closed",       &err_read_closed       },
+		{ "err_read_then_close",   &err_read_then_close   },
+	};
+
+	return tcase_build_suite_with_fixtures(
+		"fd-uring",
+		&uring_setup,
+		&uring_teardown,
+		tests,
+		sizeof(tests)
+	);
+}
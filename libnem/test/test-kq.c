@@ -125,6 +125,45 @@ START_TEST(defer_chain)
 }
 END_TEST
 
+typedef struct {
+	work_t *work;
+	int     n;
+}
+defer_fifo_t;
+
+static void
+defer_fifo_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	defer_fifo_t *df = NEM_thunk1_inlineptr(thunk);
+	ck_assert_int_eq(df->n, df->work->ctr);
+	df->work->ctr += 1;
+}
+
+START_TEST(defer_fifo)
+{
+	work_t work;
+	work_init(&work);
+
+	// NB: Enough to make the queue grow a few times.
+	for (int i = 0; i < 100; i += 1) {
+		NEM_thunk1_t *thunk = NEM_thunk1_new(
+			&defer_fifo_cb,
+			sizeof(defer_fifo_t)
+		);
+		defer_fifo_t *df = NEM_thunk1_inlineptr(thunk);
+		df->work = &work;
+		df->n = i;
+		NEM_kq_defer(&work.kq, thunk);
+	}
+
+	NEM_kq_stop(&work.kq);
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.ctr, 100);
+
+	work_free(&work);
+}
+END_TEST
+
 static void
 defer_timer_timer_cb(NEM_thunk1_t *thunk, void *varg)
 {
@@ -336,6 +375,393 @@ START_TEST(timer_cancel)
 }
 END_TEST
 
+static void
+timer_same_deadline_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	work->ctr += 1;
+
+	if (100 == work->ctr) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+START_TEST(timer_same_deadline)
+{
+	work_t work;
+	work_init(&work);
+
+	for (size_t i = 0; i < 100; i += 1) {
+		NEM_kq_after(&work.kq, 5, NEM_thunk1_new_ptr(
+			&timer_same_deadline_cb,
+			&work
+		));
+	}
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.ctr, 100);
+
+	work_free(&work);
+}
+END_TEST
+
+typedef struct {
+	NEM_timer1_t base;
+	work_t      *work;
+	int          n;
+	bool         stop;
+}
+timer1_node_t;
+
+static void
+timer1_node_fire(NEM_timer1_t *timer)
+{
+	timer1_node_t *node = (timer1_node_t*) timer;
+	ck_assert_int_eq(node->n, node->work->ctr);
+	node->work->ctr += 1;
+
+	if (node->stop) {
+		NEM_kq_stop(&node->work->kq);
+	}
+}
+
+START_TEST(timer1_cascade)
+{
+	work_t work;
+	work_init(&work);
+
+	// NB: These land on different levels of the wheel and have to cascade
+	// down before firing.
+	timer1_node_t nodes[] = {
+		{ .work = &work, .n = 2, .stop = true },
+		{ .work = &work, .n = 1 },
+		{ .work = &work, .n = 0 },
+		{ .work = &work, .n = -1 },
+	};
+	uint64_t after[] = { 200, 70, 3, 100 };
+
+	uint64_t now = NEM_kq_now(&work.kq);
+	for (size_t i = 0; i < NEM_ARRSIZE(nodes); i += 1) {
+		uint64_t at = now + after[i] * NEM_KQ_NSEC_PER_MSEC;
+		NEM_timer1_init(&nodes[i].base, &timer1_node_fire);
+		NEM_kq_timer1_set(&work.kq, &nodes[i].base, at);
+		ck_assert(NEM_timer1_active(&nodes[i].base));
+	}
+
+	NEM_kq_timer1_cancel(&work.kq, &nodes[3].base);
+	ck_assert(!NEM_timer1_active(&nodes[3].base));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.ctr, 3);
+	ck_assert_int_le(now + 200 * NEM_KQ_NSEC_PER_MSEC, NEM_kq_now(&work.kq));
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(timer1_kq_free)
+{
+	work_t work;
+	work_init(&work);
+
+	// NB: A node embedded in something else that's still scheduled when the
+	// kq goes away is just unlinked; it's not the kq's to free.
+	timer1_node_t *node = NEM_malloc(sizeof(timer1_node_t));
+	NEM_timer1_init(&node->base, &timer1_node_fire);
+	NEM_kq_timer1_set(
+		&work.kq,
+		&node->base,
+		NEM_kq_now(&work.kq) + 100 * NEM_KQ_NSEC_PER_MSEC
+	);
+	NEM_kq_after(&work.kq, 100, NEM_thunk1_new_ptr(&work_stop, &work));
+
+	work_free(&work);
+	ck_assert(!NEM_timer1_active(&node->base));
+	ck_assert_int_eq(work.ctr, 0);
+	free(node);
+}
+END_TEST
+
+START_TEST(now_coarse)
+{
+	work_t work;
+	work_init(&work);
+
+	// NB: The clock only moves between iterations of the eventloop.
+	uint64_t before = NEM_kq_now(&work.kq);
+	usleep(5 * 1000);
+	ck_assert_uint_eq(before, NEM_kq_now(&work.kq));
+
+	NEM_kq_set_coarse(&work.kq, true);
+	NEM_kq_after(&work.kq, 20, NEM_thunk1_new_ptr(&work_stop, &work));
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_le(before + 20 * NEM_KQ_NSEC_PER_MSEC, NEM_kq_now(&work.kq));
+
+	// NB: Flipping between the clocks mustn't make it go backwards, even
+	// though the coarse one trails the precise one.
+	for (int i = 0; i < 100; i += 1) {
+		before = NEM_kq_now(&work.kq);
+		NEM_kq_set_coarse(&work.kq, 0 == i % 2);
+		ck_assert_int_le(before, NEM_kq_now(&work.kq));
+	}
+
+	work_free(&work);
+}
+END_TEST
+
+typedef struct forget_t {
+	work_t          *work;
+	struct forget_t *peer;
+	NEM_thunk_t     *thunk;
+	bool             freed;
+	int              fds[2];
+}
+forget_t;
+
+static void
+forget_cb(NEM_thunk_t *thunk, void *varg)
+{
+	forget_t *f = NEM_thunk_ptr(thunk);
+	f->work->ctr += 1;
+
+	// NB: Both pipes are readable, so the peer's event is in the same batch.
+	NEM_kq_forget(f->peer->thunk);
+	NEM_thunk_free(f->peer->thunk);
+	f->peer->freed = true;
+	NEM_kq_stop(&f->work->kq);
+}
+
+START_TEST(batch_forget)
+{
+	work_t work;
+	work_init(&work);
+
+	forget_t fs[2] = {
+		{ .work = &work, .peer = &fs[1] },
+		{ .work = &work, .peer = &fs[0] },
+	};
+
+	for (size_t i = 0; i < 2; i += 1) {
+		ck_assert_int_eq(0, pipe2(fs[i].fds, O_CLOEXEC));
+		fs[i].thunk = NEM_thunk_new_ptr(&forget_cb, &fs[i]);
+
+		struct kevent kev;
+		EV_SET(
+			&kev,
+			fs[i].fds[0],
+			EVFILT_READ,
+			EV_ADD|EV_CLEAR,
+			0,
+			0,
+			fs[i].thunk
+		);
+		ck_assert_int_eq(0, kevent(work.kq.kq, &kev, 1, NULL, 0, NULL));
+		ck_assert_int_eq(1, write(fs[i].fds[1], "x", 1));
+	}
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(1, work.ctr);
+
+	for (size_t i = 0; i < 2; i += 1) {
+		close(fs[i].fds[0]);
+		close(fs[i].fds[1]);
+		if (!fs[i].freed) {
+			NEM_thunk_free(fs[i].thunk);
+		}
+	}
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(batch_one)
+{
+	work_t work;
+	work_init(&work);
+	NEM_kq_set_batch(&work.kq, 1);
+
+	NEM_kq_after(&work.kq, 10, NEM_thunk1_new_ptr(
+		&defer_timer_timer_cb,
+		&work
+	));
+	NEM_kq_defer(&work.kq, NEM_thunk1_new_ptr(
+		&defer_timer_defer_cb,
+		&work
+	));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.ctr, 2);
+
+	work_free(&work);
+}
+END_TEST
+
+#define POST_THREADS 4
+#define POST_PER_THREAD 1000
+
+typedef struct {
+	work_t *work;
+	int     seen[POST_THREADS];
+}
+post_state_t;
+
+typedef struct {
+	post_state_t *st;
+	int           thread;
+	int           n;
+}
+post_msg_t;
+
+typedef struct {
+	post_state_t *st;
+	int           thread;
+}
+post_thread_t;
+
+static void
+post_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	post_msg_t *msg = NEM_thunk1_inlineptr(thunk);
+	post_state_t *st = msg->st;
+
+	// NB: Posts from a single thread are delivered in order.
+	ck_assert_int_eq(msg->n, st->seen[msg->thread]);
+	st->seen[msg->thread] += 1;
+	st->work->ctr += 1;
+
+	if (POST_THREADS * POST_PER_THREAD == st->work->ctr) {
+		NEM_kq_stop(&st->work->kq);
+	}
+}
+
+static void*
+post_thread(void *varg)
+{
+	post_thread_t *pt = varg;
+
+	for (int i = 0; i < POST_PER_THREAD; i += 1) {
+		NEM_thunk1_t *thunk = NEM_thunk1_new(&post_cb, sizeof(post_msg_t));
+		post_msg_t *msg = NEM_thunk1_inlineptr(thunk);
+		msg->st = pt->st;
+		msg->thread = pt->thread;
+		msg->n = i;
+		NEM_kq_post(&pt->st->work->kq, thunk);
+	}
+
+	return NULL;
+}
+
+START_TEST(post_threads)
+{
+	work_t work;
+	work_init(&work);
+
+	post_state_t st = { .work = &work };
+	post_thread_t pts[POST_THREADS];
+	pthread_t threads[POST_THREADS];
+
+	for (int i = 0; i < POST_THREADS; i += 1) {
+		pts[i].st = &st;
+		pts[i].thread = i;
+		ck_assert_int_eq(
+			0,
+			pthread_create(&threads[i], NULL, &post_thread, &pts[i])
+		);
+	}
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.ctr, POST_THREADS * POST_PER_THREAD);
+
+	for (int i = 0; i < POST_THREADS; i += 1) {
+		ck_assert_int_eq(0, pthread_join(threads[i], NULL));
+	}
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(post_discard)
+{
+	work_t work;
+	work_init(&work);
+
+	// NB: Posts that are never run are discarded when the kq is freed.
+	NEM_kq_post(&work.kq, NEM_thunk1_new_ptr(&work_stop, &work));
+	work_free(&work);
+}
+END_TEST
+
+static void
+stats_defer_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	work->ctr += 1;
+}
+
+static void
+stats_slow_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	usleep(5 * 1000);
+	NEM_kq_stop(&work->kq);
+}
+
+START_TEST(stats)
+{
+	work_t work;
+	work_init(&work);
+
+	NEM_kq_stats_t snap;
+	ck_assert(!NEM_kq_stats_snapshot(&work.kq, &snap));
+
+	NEM_kq_set_stats(&work.kq, true);
+	NEM_kq_set_slow(&work.kq, 1);
+
+	for (int i = 0; i < 10; i += 1) {
+		NEM_kq_defer(&work.kq, NEM_thunk1_new_ptr(&stats_defer_cb, &work));
+	}
+	NEM_kq_after(&work.kq, 1, NEM_thunk1_new_ptr(&stats_slow_cb, &work));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.ctr, 10);
+	ck_assert(NEM_kq_stats_snapshot(&work.kq, &snap));
+
+	ck_assert_int_ge(snap.iterations, 2);
+	ck_assert_int_ge(snap.defers, 11);
+	ck_assert_int_ge(snap.events[-EVFILT_TIMER], 1);
+	ck_assert_int_eq(snap.slow, 1);
+
+	uint64_t iterations = 0;
+	for (size_t i = 0; i < NEM_KQ_STATS_BUCKETS; i += 1) {
+		iterations += snap.latency[i];
+	}
+	ck_assert_int_eq(iterations, snap.iterations);
+
+	// NB: The timer's callback is dispatched through the kq's own timer
+	// thunk, which should account for the most time.
+	ck_assert_int_ge(snap.fns_len, 2);
+	ck_assert_int_ge(snap.fns[0].total_ns, 5 * NEM_KQ_NSEC_PER_MSEC);
+	bool found = false;
+	for (size_t i = 0; i < snap.fns_len; i += 1) {
+		if (i > 0) {
+			ck_assert_int_ge(snap.fns[i - 1].total_ns, snap.fns[i].total_ns);
+		}
+		if (snap.fns[i].fn == (void*) &stats_defer_cb) {
+			ck_assert_int_eq(snap.fns[i].calls, 10);
+			found = true;
+		}
+	}
+	ck_assert(found);
+
+	char *name = NEM_kq_fn_name(snap.fns[0].fn);
+	ck_assert_ptr_ne(name, NULL);
+	free(name);
+
+	NEM_kq_stats_free(&snap);
+	work_free(&work);
+}
+END_TEST
+
 Suite*
 suite_kq()
 {
@@ -345,6 +771,7 @@ suite_kq()
 		{ "stop_run_free",       &stop_run_free       },
 		{ "defer_parallel",      &defer_parallel      },
 		{ "defer_chain",         &defer_chain         },
+		{ "defer_fifo",          &defer_fifo          },
 		{ "defer_timer",         &defer_timer         },
 		{ "timer_ordering",      &timer_ordering      },
 		{ "timer_init_free",     &timer_init_free     },
@@ -352,6 +779,15 @@ suite_kq()
 		{ "timer_set",           &timer_set           },
 		{ "timer_reset",         &timer_reset         },
 		{ "timer_cancel",        &timer_cancel        },
+		{ "timer_same_deadline", &timer_same_deadline },
+		{ "timer1_cascade",      &timer1_cascade      },
+		{ "timer1_kq_free",      &timer1_kq_free      },
+		{ "now_coarse",          &now_coarse          },
+		{ "batch_forget",        &batch_forget        },
+		{ "batch_one",           &batch_one           },
+		{ "post_threads",        &post_threads        },
+		{ "post_discard",        &post_discard        },
+		{ "stats",               &stats               },
 	};
 
 	return tcase_build_suite("kq", tests, sizeof(tests));
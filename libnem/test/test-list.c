@@ -1,4 +1,5 @@
 #include "test.h"
+#include <sys/resource.h>
 
 static void
 err_dont_call(NEM_thunk_t *thunk, void *varg)
@@ -82,14 +83,276 @@ START_TEST(err_tcp_bad_addr)
 }
 END_TEST
 
+START_TEST(tcp_shared)
+{
+	int kq = kqueue();
+	ck_assert_int_ne(-1, kq);
+
+	// NB: Shared listeners can bind the same port; a plain one can't join
+	// them.
+	NEM_list_t list1, list2, list3;
+	ck_err(NEM_list_init_tcp_shared(&list1, kq, 1936, NULL, NEM_thunk_new(
+		&err_dont_call,
+		0
+	)));
+	ck_err(NEM_list_init_tcp_shared(&list2, kq, 1936, NULL, NEM_thunk_new(
+		&err_dont_call,
+		0
+	)));
+
+	NEM_err_t err = NEM_list_init_tcp(&list3, kq, 1936, NULL, NEM_thunk_new(
+		&err_dont_call,
+		0
+	));
+	ck_assert(!NEM_err_ok(err));
+
+	NEM_list_close(list1);
+	NEM_list_close(list2);
+	close(kq);
+}
+END_TEST
+
+typedef struct {
+	NEM_kq_t   kq;
+	NEM_list_t list;
+	int        want;
+	int        nconns;
+	bool       nonblock;
+}
+accept_work_t;
+
+static void
+accept_stop_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	accept_work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_kq_stop(&work->kq);
+}
+
+static void
+accept_on_conn(NEM_thunk_t *thunk, void *varg)
+{
+	accept_work_t *work = NEM_thunk_ptr(thunk);
+	NEM_list_ca *ca = varg;
+	ck_err(ca->err);
+
+	NEM_fd_t *fd = ca->stream.this;
+	work->nonblock = 0 != (O_NONBLOCK & fcntl(fd->fd_in, F_GETFL));
+	NEM_stream_close(ca->stream);
+
+	work->nconns += 1;
+	if (work->want == work->nconns) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+// NB: connect_tcp connects to a local listener without accepting; the
+// kernel finishes the handshake on its own.
+static int
+connect_tcp(int port)
+{
+	int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	ck_assert_int_ne(-1, fd);
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ck_assert_int_eq(0, connect(fd, (struct sockaddr*) &addr, sizeof(addr)));
+
+	return fd;
+}
+
+START_TEST(tcp_accept_batch)
+{
+	accept_work_t work = {0};
+	ck_err(NEM_kq_init_root(&work.kq));
+	ck_err(NEM_list_init_tcp(
+		&work.list,
+		work.kq.kq,
+		1937,
+		NULL,
+		NEM_thunk_new_ptr(&accept_on_conn, &work)
+	));
+	ck_err(NEM_list_set_backlog(work.list, 256));
+
+	int fds[NEM_LIST_ACCEPT_MAX + 10];
+	for (size_t i = 0; i < NEM_ARRSIZE(fds); i += 1) {
+		fds[i] = connect_tcp(1937);
+	}
+
+	work.want = NEM_ARRSIZE(fds);
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert(work.nonblock);
+
+	// NB: Everything was waiting by the time the loop started, so it should
+	// have taken two goes.
+	NEM_list_stats_t stats;
+	NEM_list_stats(work.list, &stats);
+	ck_assert_int_eq(stats.accepted, NEM_ARRSIZE(fds));
+	ck_assert_int_eq(stats.wakeups, 2);
+	ck_assert_int_eq(stats.saturated, 1);
+	ck_assert_int_eq(stats.shed, 0);
+
+	for (size_t i = 0; i < NEM_ARRSIZE(fds); i += 1) {
+		close(fds[i]);
+	}
+	NEM_list_close(work.list);
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+START_TEST(tcp_accept_emfile)
+{
+	accept_work_t work = {0};
+	ck_err(NEM_kq_init_root(&work.kq));
+	ck_err(NEM_list_init_tcp(
+		&work.list,
+		work.kq.kq,
+		1938,
+		NULL,
+		NEM_thunk_new_ptr(&accept_on_conn, &work)
+	));
+
+	// NB: Get the kq's timer armed while there are still descriptors to
+	// arm it with; the second stop is still pending once the first's run.
+	NEM_kq_after(&work.kq, 1, NEM_thunk1_new_ptr(&accept_stop_cb, &work));
+	NEM_kq_after(&work.kq, 300, NEM_thunk1_new_ptr(&accept_stop_cb, &work));
+	ck_err(NEM_kq_run(&work.kq));
+
+	int conn = connect_tcp(1938);
+
+	// NB: Use up every descriptor the process is allowed.
+	struct rlimit lim;
+	ck_assert_int_eq(0, getrlimit(RLIMIT_NOFILE, &lim));
+	lim.rlim_cur = conn + 16;
+	ck_assert_int_eq(0, setrlimit(RLIMIT_NOFILE, &lim));
+
+	int fill[32];
+	size_t nfill = 0;
+	while (nfill < NEM_ARRSIZE(fill)) {
+		int fd = dup(conn);
+		if (-1 == fd) {
+			ck_assert_int_eq(EMFILE, errno);
+			break;
+		}
+		fill[nfill] = fd;
+		nfill += 1;
+	}
+	ck_assert_int_lt(nfill, NEM_ARRSIZE(fill));
+
+	// NB: The connection can't be accepted, so it's dropped instead.
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.nconns, 0);
+
+	NEM_list_stats_t stats;
+	NEM_list_stats(work.list, &stats);
+	ck_assert_int_eq(stats.shed, 1);
+	ck_assert_int_eq(stats.accepted, 0);
+
+	char c;
+	ck_assert_int_eq(0, read(conn, &c, 1));
+
+	for (size_t i = 0; i < nfill; i += 1) {
+		close(fill[i]);
+	}
+	close(conn);
+	NEM_list_close(work.list);
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+START_TEST(tcp_accept_stuck)
+{
+	accept_work_t work = {0};
+	ck_err(NEM_kq_init_root(&work.kq));
+
+	NEM_kq_after(&work.kq, 1, NEM_thunk1_new_ptr(&accept_stop_cb, &work));
+	NEM_kq_after(&work.kq, 5000, NEM_thunk1_new_ptr(&accept_stop_cb, &work));
+	ck_err(NEM_kq_run(&work.kq));
+
+	// NB: Leave exactly one descriptor for the listening socket, so that
+	// there's none for its reserve.
+	int fill[32];
+	size_t nfill = 0;
+	fill[nfill] = dup(0);
+	ck_assert_int_ne(-1, fill[nfill]);
+	nfill += 1;
+
+	struct rlimit lim;
+	ck_assert_int_eq(0, getrlimit(RLIMIT_NOFILE, &lim));
+	lim.rlim_cur = fill[0] + 16;
+	ck_assert_int_eq(0, setrlimit(RLIMIT_NOFILE, &lim));
+
+	while (nfill < NEM_ARRSIZE(fill)) {
+		int fd = dup(fill[0]);
+		if (-1 == fd) {
+			ck_assert_int_eq(EMFILE, errno);
+			break;
+		}
+		fill[nfill] = fd;
+		nfill += 1;
+	}
+	ck_assert_int_lt(nfill, NEM_ARRSIZE(fill));
+	nfill -= 1;
+	close(fill[nfill]);
+
+	ck_err(NEM_list_init_tcp(
+		&work.list,
+		work.kq.kq,
+		1939,
+		NULL,
+		NEM_thunk_new_ptr(&accept_on_conn, &work)
+	));
+
+	// NB: Then just enough room for the client end of the connection.
+	lim.rlim_cur += 1;
+	ck_assert_int_eq(0, setrlimit(RLIMIT_NOFILE, &lim));
+	int conn = connect_tcp(1939);
+
+	// NB: The connection can neither be accepted nor shed, so the listener
+	// should back off rather than spin.
+	NEM_kq_after(&work.kq, 200, NEM_thunk1_new_ptr(&accept_stop_cb, &work));
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.nconns, 0);
+
+	NEM_list_stats_t stats;
+	NEM_list_stats(work.list, &stats);
+	ck_assert_int_eq(stats.accepted, 0);
+	ck_assert_int_eq(stats.shed, 0);
+	ck_assert_int_ge(stats.paused, 1);
+	ck_assert_int_le(stats.wakeups, 200 / NEM_LIST_PAUSE_MS + 1);
+	ck_assert_int_eq(stats.paused, stats.wakeups);
+
+	// NB: Once there's room for both the reserve and the connection it
+	// picks the connection up again.
+	nfill -= 2;
+	close(fill[nfill]);
+	close(fill[nfill + 1]);
+	work.want = 1;
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.nconns, 1);
+
+	for (size_t i = 0; i < nfill; i += 1) {
+		close(fill[i]);
+	}
+	close(conn);
+	NEM_list_close(work.list);
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
 Suite*
 suite_list()
 {
 	tcase_t tests[] = {
-		{ "unix_init_free",   &unix_init_free   },
-		{ "tcp_init_free",    &tcp_init_free    },
-		{ "err_tcp_bad_port", &err_tcp_bad_port },
-		{ "err_tcp_bad_addr", &err_tcp_bad_addr },
+		{ "unix_init_free",    &unix_init_free    },
+		{ "tcp_init_free",     &tcp_init_free     },
+		{ "tcp_shared",        &tcp_shared        },
+		{ "err_tcp_bad_port",  &err_tcp_bad_port  },
+		{ "err_tcp_bad_addr",  &err_tcp_bad_addr  },
+		{ "tcp_accept_batch",  &tcp_accept_batch  },
+		{ "tcp_accept_emfile", &tcp_accept_emfile },
+		{ "tcp_accept_stuck",  &tcp_accept_stuck  },
 	};
 
 	return tcase_build_suite("list", tests, sizeof(tests));
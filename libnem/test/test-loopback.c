@@ -0,0 +1,281 @@
+#include "test.h"
+
+typedef struct {
+	NEM_kq_t       kq;
+	NEM_loopback_t lb1;
+	NEM_loopback_t lb2;
+	char          *wbuf;
+	char          *rbuf;
+	size_t         len;
+	int            done;
+	int            want;
+	int            closed;
+	bool           failed;
+}
+work_t;
+
+static void
+work_stop_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_kq_stop(&work->kq);
+	ck_assert_msg(false, "too long");
+}
+
+static void
+work_init(work_t *work, size_t cap, size_t len)
+{
+	bzero(work, sizeof(*work));
+	ck_err(NEM_kq_init_root(&work->kq));
+	NEM_loopback_init(&work->lb1, &work->lb2, &work->kq, cap);
+
+	work->len = len;
+	work->want = 2;
+	work->wbuf = NEM_malloc(len + 1);
+	work->rbuf = NEM_malloc(len + 1);
+	for (size_t i = 0; i < len; i += 1) {
+		work->wbuf[i] = (char) i * 7;
+	}
+
+	NEM_kq_after(&work->kq, 3000, NEM_thunk1_new_ptr(
+		&work_stop_cb,
+		work
+	));
+}
+
+static void
+work_free(work_t *work)
+{
+	NEM_loopback_free(&work->lb1);
+	NEM_loopback_free(&work->lb2);
+	NEM_kq_free(&work->kq);
+	free(work->wbuf);
+	free(work->rbuf);
+}
+
+static void
+work_on_done(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_stream_ca *ca = varg;
+
+	if (!NEM_err_ok(ca->err)) {
+		work->failed = true;
+	}
+
+	work->done += 1;
+	if (work->want == work->done) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static void
+work_on_close(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	work->closed += 1;
+}
+
+START_TEST(init_free)
+{
+	work_t work;
+	work_init(&work, 0, 0);
+	work_free(&work);
+}
+END_TEST
+
+static void
+transfer(size_t cap, size_t len, bool read_first)
+{
+	work_t work;
+	work_init(&work, cap, len);
+	NEM_stream_t s1 = NEM_loopback_as_stream(&work.lb1);
+	NEM_stream_t s2 = NEM_loopback_as_stream(&work.lb2);
+
+	if (read_first) {
+		ck_err(NEM_stream_read(
+			s2,
+			work.rbuf,
+			len,
+			NEM_thunk1_new_ptr(&work_on_done, &work)
+		));
+	}
+	ck_err(NEM_stream_write(
+		s1,
+		work.wbuf,
+		len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	if (!read_first) {
+		ck_err(NEM_stream_read(
+			s2,
+			work.rbuf,
+			len,
+			NEM_thunk1_new_ptr(&work_on_done, &work)
+		));
+	}
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.done, 2);
+	ck_assert(!work.failed);
+	ck_assert(0 == memcmp(work.wbuf, work.rbuf, len));
+
+	work_free(&work);
+}
+
+START_TEST(write_read)
+{
+	transfer(0, 1000, false);
+}
+END_TEST
+
+START_TEST(read_write)
+{
+	transfer(0, 1000, true);
+}
+END_TEST
+
+START_TEST(write_read_wrap)
+{
+	// NB: Much larger than the ring, so the writer has to wait for the
+	// reader to make room (and the data wraps around the ring).
+	transfer(100, 100 * 1000 + 7, false);
+}
+END_TEST
+
+START_TEST(read_write_wrap)
+{
+	transfer(100, 100 * 1000 + 7, true);
+}
+END_TEST
+
+START_TEST(peek)
+{
+	work_t work;
+	work_init(&work, 0, 10);
+	NEM_stream_t s1 = NEM_loopback_as_stream(&work.lb1);
+	NEM_stream_t s2 = NEM_loopback_as_stream(&work.lb2);
+
+	const void *out;
+	ck_assert_int_eq(0, NEM_stream_peek(s2, &out));
+
+	ck_err(NEM_stream_write(
+		s1,
+		work.wbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	ck_assert_int_eq(work.len, NEM_stream_peek(s2, &out));
+	ck_assert(0 == memcmp(out, work.wbuf, work.len));
+
+	ck_err(NEM_stream_read(
+		s2,
+		work.rbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	ck_assert_int_eq(0, NEM_stream_peek(s2, &out));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.done, 2);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(close_peer)
+{
+	work_t work;
+	work_init(&work, 0, 10);
+	NEM_stream_t s1 = NEM_loopback_as_stream(&work.lb1);
+	NEM_stream_t s2 = NEM_loopback_as_stream(&work.lb2);
+
+	NEM_stream_on_close(s2, NEM_thunk1_new_ptr(&work_on_close, &work));
+	work.want = 3;
+
+	// NB: What's already been written can still be read after the writer
+	// goes away; the read after that fails.
+	ck_err(NEM_stream_write(
+		s1,
+		work.wbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	NEM_loopback_close(&work.lb1);
+
+	ck_err(NEM_stream_read(
+		s2,
+		work.rbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	ck_assert(!work.failed);
+	ck_assert_int_eq(work.done, 2);
+
+	ck_err(NEM_stream_read(
+		s2,
+		work.rbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	ck_assert(!NEM_err_ok(NEM_stream_read(
+		s1,
+		work.rbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	)));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert(work.failed);
+	ck_assert_int_eq(work.done, 3);
+	ck_assert_int_eq(work.closed, 1);
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(send_fds)
+{
+	work_t work;
+	work_init(&work, 0, 0);
+
+	int fds[2];
+	ck_assert_int_eq(0, pipe(fds));
+
+	int got[4];
+	size_t len = NEM_ARRSIZE(got);
+	ck_assert(!NEM_err_ok(NEM_loopback_read_fds(&work.lb2, got, &len)));
+
+	ck_err(NEM_loopback_write_fds(&work.lb1, fds, 2));
+	close(fds[0]);
+	close(fds[1]);
+
+	ck_err(NEM_loopback_read_fds(&work.lb2, got, &len));
+	ck_assert_int_eq(len, 2);
+
+	ck_assert_int_eq(1, write(got[1], "x", 1));
+	char c = 0;
+	ck_assert_int_eq(1, read(got[0], &c, 1));
+	ck_assert_int_eq(c, 'x');
+
+	close(got[0]);
+	close(got[1]);
+	work_free(&work);
+}
+END_TEST
+
+Suite*
+suite_loopback()
+{
+	tcase_t tests[] = {
+		{ "init_free",       &init_free       },
+		{ "write_read",      &write_read      },
+		{ "read_write",      &read_write      },
+		{ "write_read_wrap", &write_read_wrap },
+		{ "read_write_wrap", &read_write_wrap },
+		{ "peek",            &peek            },
+		{ "close_peer",      &close_peer      },
+		{ "send_fds",        &send_fds        },
+	};
+
+	return tcase_build_suite("loopback", tests, sizeof(tests));
+}
@@ -0,0 +1,243 @@
+#include "test.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static const struct timespec poller_wait = {
+	.tv_sec = 1,
+};
+
+START_TEST(open_close)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+START_TEST(timer_oneshot)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+
+	struct kevent kev;
+	EV_SET(&kev, 1, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_MSECONDS, 10, &kev);
+	ck_assert_int_eq(0, kevent(kq, &kev, 1, NULL, 0, NULL));
+
+	struct kevent out;
+	ck_assert_int_eq(1, kevent(kq, NULL, 0, &out, 1, &poller_wait));
+	ck_assert_int_eq(EVFILT_TIMER, out.filter);
+	ck_assert_int_eq(1, out.ident);
+	ck_assert_ptr_eq(&kev, out.udata);
+
+	// NB: One-shot timers don't fire again.
+	struct timespec brief = { .tv_nsec = 50 * 1000 * 1000 };
+	ck_assert_int_eq(0, kevent(kq, NULL, 0, &out, 1, &brief));
+
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+START_TEST(timer_zero)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+
+	struct kevent kev;
+	EV_SET(&kev, 1, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_MSECONDS, 0, NULL);
+	ck_assert_int_eq(0, kevent(kq, &kev, 1, NULL, 0, NULL));
+
+	struct kevent out;
+	ck_assert_int_eq(1, kevent(kq, NULL, 0, &out, 1, &poller_wait));
+	ck_assert_int_eq(EVFILT_TIMER, out.filter);
+
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+START_TEST(read_avail)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+
+	int fds[2];
+	ck_assert_int_eq(0, pipe2(fds, O_CLOEXEC));
+
+	struct kevent kev;
+	EV_SET(&kev, fds[0], EVFILT_READ, EV_ADD|EV_CLEAR, 0, 0, NULL);
+	ck_assert_int_eq(0, kevent(kq, &kev, 1, NULL, 0, NULL));
+	ck_assert_int_eq(5, write(fds[1], "hello", 5));
+
+	struct kevent out;
+	ck_assert_int_eq(1, kevent(kq, NULL, 0, &out, 1, &poller_wait));
+	ck_assert_int_eq(EVFILT_READ, out.filter);
+	ck_assert_int_eq(fds[0], out.ident);
+	ck_assert_int_eq(5, out.data);
+	ck_assert_int_eq(0, out.flags & EV_EOF);
+
+	close(fds[1]);
+	ck_assert_int_eq(1, kevent(kq, NULL, 0, &out, 1, &poller_wait));
+	ck_assert_int_eq(EVFILT_READ, out.filter);
+	ck_assert_int_eq(EV_EOF, out.flags & EV_EOF);
+
+	close(fds[0]);
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+START_TEST(delete_drops_events)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+
+	int fds[2];
+	ck_assert_int_eq(0, socketpair(PF_LOCAL, SOCK_STREAM, 0, fds));
+
+	struct kevent kevs[2];
+	EV_SET(&kevs[0], fds[0], EVFILT_READ, EV_ADD|EV_CLEAR, 0, 0, NULL);
+	EV_SET(&kevs[1], fds[0], EVFILT_WRITE, EV_ADD|EV_CLEAR, 0, 0, NULL);
+	ck_assert_int_eq(0, kevent(kq, kevs, 2, NULL, 0, NULL));
+	ck_assert_int_eq(5, write(fds[1], "hello", 5));
+
+	// NB: Both filters are ready; take one and then delete the other. The
+	// deleted filter's event must not be delivered.
+	struct kevent out;
+	ck_assert_int_eq(1, kevent(kq, NULL, 0, &out, 1, &poller_wait));
+
+	short other = (EVFILT_READ == out.filter) ? EVFILT_WRITE : EVFILT_READ;
+	EV_SET(&kevs[0], fds[0], other, EV_DELETE, 0, 0, NULL);
+	ck_assert_int_eq(0, kevent(kq, kevs, 1, NULL, 0, NULL));
+
+	struct timespec brief = { .tv_nsec = 50 * 1000 * 1000 };
+	while (0 < kevent(kq, NULL, 0, &out, 1, &brief)) {
+		ck_assert_int_ne(other, out.filter);
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+START_TEST(err_delete_unknown)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+
+	int fds[2];
+	ck_assert_int_eq(0, pipe2(fds, O_CLOEXEC));
+
+	struct kevent kev;
+	EV_SET(&kev, fds[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	ck_assert_int_eq(-1, kevent(kq, &kev, 1, NULL, 0, NULL));
+	ck_assert_int_eq(ENOENT, errno);
+
+	struct kevent out;
+	ck_assert_int_eq(1, kevent(kq, &kev, 1, &out, 1, NULL));
+	ck_assert_int_eq(EV_ERROR, out.flags & EV_ERROR);
+	ck_assert_int_eq(ENOENT, out.data);
+
+	close(fds[0]);
+	close(fds[1]);
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+START_TEST(signal_ignored)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+
+	signal(SIGUSR1, SIG_IGN);
+
+	struct kevent kev;
+	EV_SET(&kev, SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+	ck_assert_int_eq(0, kevent(kq, &kev, 1, NULL, 0, NULL));
+	ck_assert_int_eq(0, kill(getpid(), SIGUSR1));
+
+	struct kevent out;
+	ck_assert_int_eq(1, kevent(kq, NULL, 0, &out, 1, &poller_wait));
+	ck_assert_int_eq(EVFILT_SIGNAL, out.filter);
+	ck_assert_int_eq(SIGUSR1, out.ident);
+
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+START_TEST(proc_exit)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+
+	pid_t pid = fork();
+	if (0 == pid) {
+		usleep(10 * 1000);
+		_exit(66);
+	}
+	ck_assert_int_lt(0, pid);
+
+	struct kevent kev;
+	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
+	ck_assert_int_eq(0, kevent(kq, &kev, 1, NULL, 0, NULL));
+
+	struct kevent out;
+	ck_assert_int_eq(1, kevent(kq, NULL, 0, &out, 1, &poller_wait));
+	ck_assert_int_eq(EVFILT_PROC, out.filter);
+	ck_assert_int_eq(pid, out.ident);
+	ck_assert_int_eq(66, out.data);
+
+	int status = 0;
+	ck_assert_int_eq(pid, waitpid(pid, &status, 0));
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+START_TEST(user_trigger)
+{
+	int kq = NEM_poller_open();
+	ck_assert_int_ne(-1, kq);
+
+	struct kevent kev;
+	EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	ck_assert_int_eq(0, kevent(kq, &kev, 1, NULL, 0, NULL));
+
+	struct kevent out;
+	struct timespec zero = {0};
+	ck_assert_int_eq(0, kevent(kq, NULL, 0, &out, 1, &zero));
+
+	// NB: Multiple triggers before a wait coalesce into one event.
+	EV_SET(&kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	ck_assert_int_eq(0, kevent(kq, &kev, 1, NULL, 0, NULL));
+	ck_assert_int_eq(0, kevent(kq, &kev, 1, NULL, 0, NULL));
+
+	ck_assert_int_eq(1, kevent(kq, NULL, 0, &out, 1, &poller_wait));
+	ck_assert_int_eq(EVFILT_USER, out.filter);
+	ck_assert_int_eq(1, out.ident);
+	ck_assert_int_eq(0, kevent(kq, NULL, 0, &out, 1, &zero));
+
+	EV_SET(&kev, 2, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	ck_assert_int_eq(-1, kevent(kq, &kev, 1, NULL, 0, NULL));
+	ck_assert_int_eq(ENOENT, errno);
+
+	ck_assert_int_eq(0, NEM_poller_close(kq));
+}
+END_TEST
+
+Suite*
+suite_poller()
+{
+	tcase_t tests[] = {
+		{ "open_close",          &open_close          },
+		{ "timer_oneshot",       &timer_oneshot       },
+		{ "timer_zero",          &timer_zero          },
+		{ "read_avail",          &read_avail          },
+		{ "delete_drops_events", &delete_drops_events },
+		{ "err_delete_unknown",  &err_delete_unknown  },
+		{ "signal_ignored",      &signal_ignored      },
+		{ "proc_exit",           &proc_exit           },
+		{ "user_trigger",        &user_trigger        },
+	};
+
+	return tcase_build_suite("poller", tests, sizeof(tests));
+}
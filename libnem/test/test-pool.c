@@ -0,0 +1,309 @@
+#include "test.h"
+
+typedef struct {
+	NEM_kq_t    kq;
+	NEM_pool_t  pool;
+	pthread_t   loop;
+	int         done;
+	int         cancelled;
+	int         rejected;
+	int         want;
+	atomic_bool gate;
+	atomic_int  started;
+}
+work_t;
+
+typedef struct {
+	work_t *work;
+	int     in;
+	int     out;
+}
+task_t;
+
+static void
+work_init(work_t *work, size_t threads, size_t cap)
+{
+	bzero(work, sizeof(*work));
+	ck_err(NEM_kq_init_root(&work->kq));
+	ck_err(NEM_pool_init(&work->pool, threads, cap));
+	work->loop = pthread_self();
+	atomic_init(&work->gate, false);
+	atomic_init(&work->started, 0);
+}
+
+static void
+work_free(work_t *work)
+{
+	NEM_pool_free(&work->pool);
+	NEM_kq_free(&work->kq);
+}
+
+static NEM_err_t
+square_fn(NEM_thunk1_t *done)
+{
+	task_t *task = NEM_thunk1_inlineptr(done);
+	task->out = task->in * task->in;
+	return NEM_err_none;
+}
+
+static NEM_err_t
+gate_fn(NEM_thunk1_t *done)
+{
+	task_t *task = NEM_thunk1_inlineptr(done);
+	atomic_fetch_add(&task->work->started, 1);
+
+	while (!atomic_load(&task->work->gate)) {
+		if (NEM_pool_cancelled()) {
+			return NEM_err_none;
+		}
+		usleep(100);
+	}
+
+	return NEM_err_none;
+}
+
+static void
+task_done(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_pool_ca *ca = varg;
+	task_t *task = NEM_thunk1_inlineptr(thunk);
+	work_t *work = task->work;
+
+	// NB: Completions always come back on the submitting loop.
+	ck_assert(pthread_equal(work->loop, pthread_self()));
+
+	if (ca->cancelled) {
+		ck_assert(!NEM_err_ok(ca->err));
+		work->cancelled += 1;
+	}
+	else if (!NEM_err_ok(ca->err)) {
+		work->rejected += 1;
+	}
+	else {
+		ck_assert_int_eq(task->out, task->in * task->in);
+	}
+
+	work->done += 1;
+	if (work->done == work->want) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static uint64_t
+submit(work_t *work, NEM_pool_fn fn, int in)
+{
+	NEM_thunk1_t *thunk = NEM_thunk1_new(&task_done, sizeof(task_t));
+	task_t *task = NEM_thunk1_inlineptr(thunk);
+	task->work = work;
+	task->in = in;
+
+	return NEM_pool_submit(&work->pool, fn, thunk, &work->kq);
+}
+
+static void
+wait_started(work_t *work, int n)
+{
+	while (atomic_load(&work->started) < n) {
+		usleep(100);
+	}
+}
+
+START_TEST(init_free)
+{
+	work_t work;
+	work_init(&work, 4, 0);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(submit_many)
+{
+	work_t work;
+	work_init(&work, 4, 0);
+	work.want = 500;
+
+	for (int i = 0; i < work.want; i += 1) {
+		ck_assert_int_ne(0, submit(&work, &square_fn, i));
+	}
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.done, 500);
+	ck_assert_int_eq(work.cancelled, 0);
+	ck_assert_int_eq(work.rejected, 0);
+
+	NEM_pool_stats_t stats;
+	NEM_pool_get_stats(&work.pool, &stats);
+	ck_assert_int_eq(stats.submitted, 500);
+	ck_assert_int_eq(stats.completed, 500);
+	ck_assert_int_eq(stats.queued, 0);
+	ck_assert_int_eq(stats.running, 0);
+	ck_assert_int_ge(stats.queued_max, 1);
+
+	uint64_t runs = 0;
+	for (size_t i = 0; i < NEM_POOL_STATS_BUCKETS; i += 1) {
+		runs += stats.run[i];
+	}
+	ck_assert_int_eq(runs, 500);
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(cancel_queued)
+{
+	work_t work;
+	work_init(&work, 1, 0);
+	work.want = 3;
+
+	submit(&work, &gate_fn, 0);
+	wait_started(&work, 1);
+
+	uint64_t id = submit(&work, &square_fn, 2);
+	submit(&work, &square_fn, 3);
+	ck_assert(NEM_pool_cancel(&work.pool, id));
+	atomic_store(&work.gate, true);
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.done, 3);
+	ck_assert_int_eq(work.cancelled, 1);
+
+	// NB: It's already completed, so there's nothing left to cancel.
+	ck_assert(!NEM_pool_cancel(&work.pool, id));
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(cancel_running)
+{
+	work_t work;
+	work_init(&work, 1, 0);
+	work.want = 1;
+
+	uint64_t id = submit(&work, &gate_fn, 0);
+	wait_started(&work, 1);
+	ck_assert(NEM_pool_cancel(&work.pool, id));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.cancelled, 1);
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(queue_full)
+{
+	work_t work;
+	work_init(&work, 1, 2);
+	work.want = 5;
+
+	submit(&work, &gate_fn, 0);
+	wait_started(&work, 1);
+	for (int i = 0; i < 4; i += 1) {
+		submit(&work, &square_fn, i);
+	}
+	atomic_store(&work.gate, true);
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.rejected, 2);
+
+	NEM_pool_stats_t stats;
+	NEM_pool_get_stats(&work.pool, &stats);
+	ck_assert_int_eq(stats.rejected, 2);
+	ck_assert_int_eq(stats.queued_max, 2);
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(free_queued)
+{
+	work_t work;
+	work_init(&work, 1, 0);
+	work.want = 3;
+
+	submit(&work, &gate_fn, 0);
+	wait_started(&work, 1);
+	submit(&work, &square_fn, 1);
+	submit(&work, &square_fn, 2);
+	atomic_store(&work.gate, true);
+
+	// NB: Freeing the pool cancels whatever hasn't started yet; the
+	// completions still run once the loop does. Whether the gated task's
+	// successors got a thread first is racy, so only the total is checked.
+	NEM_pool_free(&work.pool);
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.done, 3);
+
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+static void*
+open_gate_on_stop(void *varg)
+{
+	work_t *work = varg;
+
+	for (;;) {
+		pthread_mutex_lock(&work->pool.mtx);
+		bool stopping = work->pool.stopping;
+		pthread_mutex_unlock(&work->pool.mtx);
+		if (stopping) {
+			break;
+		}
+		usleep(100);
+	}
+
+	atomic_store(&work->gate, true);
+	return NULL;
+}
+
+START_TEST(free_queued_stats)
+{
+	work_t work;
+	work_init(&work, 1, 0);
+	work.want = 3;
+
+	submit(&work, &gate_fn, 0);
+	wait_started(&work, 1);
+	submit(&work, &square_fn, 1);
+	submit(&work, &square_fn, 2);
+
+	// NB: The gate only opens once NEM_pool_free has stopped the pool, so
+	// both of the queued tasks are the ones it cancels.
+	pthread_t opener;
+	ck_assert_int_eq(0, pthread_create(
+		&opener,
+		NULL,
+		&open_gate_on_stop,
+		&work
+	));
+	NEM_pool_free(&work.pool);
+	ck_assert_int_eq(0, pthread_join(opener, NULL));
+
+	// NB: The pool's mutex is gone, so read the stats directly.
+	ck_assert_int_eq(work.pool.stats.queued, 0);
+	ck_assert_int_eq(work.pool.stats.cancelled, 2);
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.done, 3);
+	ck_assert_int_eq(work.cancelled, 2);
+
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+Suite*
+suite_pool()
+{
+	tcase_t tests[] = {
+		{ "init_free",         &init_free         },
+		{ "submit_many",       &submit_many       },
+		{ "cancel_queued",     &cancel_queued     },
+		{ "cancel_running",    &cancel_running    },
+		{ "queue_full",        &queue_full        },
+		{ "free_queued",       &free_queued       },
+		{ "free_queued_stats", &free_queued_stats },
+	};
+
+	return tcase_build_suite("pool", tests, sizeof(tests));
+}
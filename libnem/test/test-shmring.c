@@ -0,0 +1,298 @@
+#include "test.h"
+
+typedef struct {
+	NEM_kq_t      kq;
+	NEM_shmring_t parent;
+	NEM_shmring_t child;
+	int           sock;
+	char         *wbuf;
+	char         *rbuf;
+	size_t        len;
+	int           done;
+	int           want;
+	int           closed;
+	bool          failed;
+}
+work_t;
+
+static void
+work_stop_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_kq_stop(&work->kq);
+	ck_assert_msg(false, "too long");
+}
+
+// NB: work_init sets up both ends in this process. With offer false the
+// parent end is left as a plain socket in sock, which never makes the child
+// an offer.
+static void
+work_init(work_t *work, size_t len, bool offer)
+{
+	bzero(work, sizeof(*work));
+	ck_err(NEM_kq_init_root(&work->kq));
+
+	work->sock = -1;
+
+	int fds[2];
+	ck_assert_int_eq(0, socketpair(PF_LOCAL, SOCK_STREAM, 0, fds));
+	if (offer) {
+		ck_err(NEM_shmring_init_parent(&work->parent, work->kq.kq, fds[0]));
+	}
+	else {
+		work->sock = fds[0];
+	}
+	ck_err(NEM_shmring_init_child(&work->child, work->kq.kq, fds[1]));
+
+	work->len = len;
+	work->want = 2;
+	work->wbuf = NEM_malloc(len + 1);
+	work->rbuf = NEM_malloc(len + 1);
+	for (size_t i = 0; i < len; i += 1) {
+		work->wbuf[i] = (char) i * 7;
+	}
+
+	NEM_kq_after(&work->kq, 3000, NEM_thunk1_new_ptr(
+		&work_stop_cb,
+		work
+	));
+}
+
+static void
+work_free(work_t *work)
+{
+	NEM_shmring_free(&work->parent);
+	NEM_shmring_free(&work->child);
+	if (-1 != work->sock) {
+		close(work->sock);
+	}
+	NEM_kq_free(&work->kq);
+	free(work->wbuf);
+	free(work->rbuf);
+}
+
+static void
+work_on_done(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_stream_ca *ca = varg;
+
+	if (!NEM_err_ok(ca->err)) {
+		work->failed = true;
+	}
+
+	work->done += 1;
+	if (work->want == work->done) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static void
+work_on_close(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	work->closed += 1;
+}
+
+START_TEST(init_free)
+{
+	work_t work;
+	work_init(&work, 0, true);
+	ck_assert_int_eq(work.child.mode, NEM_SHMRING_RING);
+	work_free(&work);
+}
+END_TEST
+
+static void
+transfer(size_t len, bool to_child)
+{
+	work_t work;
+	work_init(&work, len, true);
+	NEM_stream_t s1 = NEM_shmring_as_stream(&work.parent);
+	NEM_stream_t s2 = NEM_shmring_as_stream(&work.child);
+	if (!to_child) {
+		NEM_stream_t tmp = s1;
+		s1 = s2;
+		s2 = tmp;
+	}
+
+	ck_err(NEM_stream_write(
+		s1,
+		work.wbuf,
+		len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	ck_err(NEM_stream_read(
+		s2,
+		work.rbuf,
+		len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.done, 2);
+	ck_assert(!work.failed);
+	ck_assert_int_eq(work.parent.mode, NEM_SHMRING_RING);
+	ck_assert(0 == memcmp(work.wbuf, work.rbuf, len));
+
+	work_free(&work);
+}
+
+START_TEST(to_child)
+{
+	transfer(1000, true);
+}
+END_TEST
+
+START_TEST(to_parent)
+{
+	transfer(1000, false);
+}
+END_TEST
+
+START_TEST(to_child_wrap)
+{
+	// NB: Several times the size of the ring, so each side has to ring the
+	// other's doorbell to get going again.
+	transfer(5 * NEM_SHMRING_CAP + 7, true);
+}
+END_TEST
+
+START_TEST(to_parent_wrap)
+{
+	transfer(5 * NEM_SHMRING_CAP + 7, false);
+}
+END_TEST
+
+START_TEST(no_offer)
+{
+	work_t work;
+	work_init(&work, 10, false);
+	ck_assert_int_eq(work.child.mode, NEM_SHMRING_SOCKET);
+
+	NEM_stream_on_close(
+		NEM_shmring_as_stream(&work.child),
+		NEM_thunk1_new_ptr(&work_on_close, &work)
+	);
+	work.want = 1;
+
+	ck_assert_int_eq(work.len, write(work.sock, work.wbuf, work.len));
+	ck_err(NEM_stream_read(
+		NEM_shmring_as_stream(&work.child),
+		work.rbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert(!work.failed);
+	ck_assert(0 == memcmp(work.wbuf, work.rbuf, work.len));
+
+	close(work.sock);
+	work.sock = -1;
+	work.want = 2;
+	ck_err(NEM_stream_read(
+		NEM_shmring_as_stream(&work.child),
+		work.rbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert(work.failed);
+	ck_assert_int_eq(work.closed, 1);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(close_peer)
+{
+	work_t work;
+	work_init(&work, 10, true);
+	NEM_stream_t s1 = NEM_shmring_as_stream(&work.parent);
+	NEM_stream_t s2 = NEM_shmring_as_stream(&work.child);
+
+	NEM_stream_on_close(s2, NEM_thunk1_new_ptr(&work_on_close, &work));
+
+	ck_err(NEM_stream_write(
+		s1,
+		work.wbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	ck_err(NEM_stream_read(
+		s2,
+		work.rbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert(!work.failed);
+	ck_assert_int_eq(work.done, 2);
+
+	// NB: The parent going away fails the child's pending read.
+	work.want = 3;
+	ck_err(NEM_stream_read(
+		s2,
+		work.rbuf,
+		work.len,
+		NEM_thunk1_new_ptr(&work_on_done, &work)
+	));
+	NEM_shmring_close(&work.parent);
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert(work.failed);
+	ck_assert_int_eq(work.done, 3);
+	ck_assert_int_eq(work.closed, 1);
+	ck_assert(0 == memcmp(work.wbuf, work.rbuf, work.len));
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(send_fds)
+{
+	work_t work;
+	work_init(&work, 0, true);
+
+	int fds[2];
+	ck_assert_int_eq(0, pipe(fds));
+
+	NEM_stream_t s1 = NEM_shmring_as_stream(&work.parent);
+	NEM_stream_t s2 = NEM_shmring_as_stream(&work.child);
+	ck_err(NEM_stream_write_fds(s1, fds, 2));
+	close(fds[0]);
+	close(fds[1]);
+
+	int got[4];
+	size_t len = NEM_ARRSIZE(got);
+	ck_err(NEM_stream_read_fds(s2, got, &len));
+	ck_assert_int_eq(len, 2);
+
+	ck_assert_int_eq(1, write(got[1], "x", 1));
+	char c = 0;
+	ck_assert_int_eq(1, read(got[0], &c, 1));
+	ck_assert_int_eq(c, 'x');
+
+	close(got[0]);
+	close(got[1]);
+	work_free(&work);
+}
+END_TEST
+
+Suite*
+suite_shmring()
+{
+	tcase_t tests[] = {
+		{ "init_free",      &init_free      },
+		{ "to_child",       &to_child       },
+		{ "to_parent",      &to_parent      },
+		{ "to_child_wrap",  &to_child_wrap  },
+		{ "to_parent_wrap", &to_parent_wrap },
+		{ "no_offer",       &no_offer       },
+		{ "close_peer",     &close_peer     },
+		{ "send_fds",       &send_fds       },
+	};
+
+	return tcase_build_suite("shmring", tests, sizeof(tests));
+}
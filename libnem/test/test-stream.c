@@ -305,6 +305,285 @@ dangerous_reuse(fd_init_fn fn)
 }
 DEFINE_TESTS(dangerous_reuse);
 
+static void
+cont_reuse_rcb(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	ck_err(ca->err);
+	work_t *work = cont->ctx;
+
+	// NB: Keep reading a byte at a time with the same continuation.
+	work->state[0] += 1;
+	if (work->state[0] < 6) {
+		ck_err(NEM_stream_read_cont(
+			work->s_1,
+			work->bufs[0] + work->state[0],
+			1,
+			cont
+		));
+		return;
+	}
+
+	NEM_kq_stop(&work->kq);
+}
+
+static void
+cont_reuse_wcb(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	ck_err(ca->err);
+	work_t *work = cont->ctx;
+	work->state[1] += 1;
+}
+
+static void
+cont_reuse(fd_init_fn fn)
+{
+	work_t work;
+	work_init(&work, fn);
+	work.bufs[0] = alloca(6);
+
+	NEM_stream_cont_t rcont, wcont;
+	NEM_stream_cont_init(&rcont, &cont_reuse_rcb, &work);
+	NEM_stream_cont_init(&wcont, &cont_reuse_wcb, &work);
+
+	ck_err(NEM_stream_read_cont(work.s_1, work.bufs[0], 1, &rcont));
+	ck_assert(!NEM_err_ok(NEM_stream_read_cont(work.s_1, work.bufs[0], 1, &rcont)));
+	ck_err(NEM_stream_write_cont(work.s_2, "hello", 6, &wcont));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_str_eq("hello", work.bufs[0]);
+	ck_assert_int_eq(6, work.state[0]);
+	ck_assert_int_eq(1, work.state[1]);
+
+	work_free(&work);
+}
+DEFINE_TESTS(cont_reuse);
+
+static void
+write_vec_cb(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	ck_err(ca->err);
+	work_t *work = cont->ctx;
+	work->state[0] += 1;
+	if (2 == work->state[0]) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static void
+write_vec_common(fd_init_fn fn, bool fallback)
+{
+	work_t work;
+	work_init(&work, fn);
+	work.bufs[0] = alloca(12);
+
+	// NB: A vt without writev_cont gets one write_cont per buffer.
+	NEM_stream_vt vt = NEM_fd_stream_vt;
+	if (fallback) {
+		vt.writev_cont = NULL;
+		work.s_2.vt = &vt;
+	}
+
+	struct iovec iov[] = {
+		{ .iov_base = "hel",    .iov_len = 3 },
+		{ .iov_base = "",       .iov_len = 0 },
+		{ .iov_base = "lo",     .iov_len = 2 },
+		{ .iov_base = " world", .iov_len = 7 },
+	};
+
+	NEM_stream_cont_t rcont, wcont;
+	NEM_stream_cont_init(&rcont, &write_vec_cb, &work);
+	NEM_stream_cont_init(&wcont, &write_vec_cb, &work);
+
+	ck_err(NEM_stream_read_cont(work.s_1, work.bufs[0], 12, &rcont));
+	ck_err(NEM_stream_writev_cont(work.s_2, iov, NEM_ARRSIZE(iov), &wcont));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_str_eq("hello world", work.bufs[0]);
+
+	work_free(&work);
+}
+
+static void
+write_vec(fd_init_fn fn)
+{
+	write_vec_common(fn, false);
+}
+DEFINE_TESTS(write_vec);
+
+static void
+write_vec_fallback(fd_init_fn fn)
+{
+	write_vec_common(fn, true);
+}
+DEFINE_TESTS(write_vec_fallback);
+
+static void
+send_file_rcb(NEM_stream_cont_t *cont, NEM_stream_ca *ca)
+{
+	ck_err(ca->err);
+	work_t *work = cont->ctx;
+	work->state[0] += 1;
+	if (1 == work->state[1]) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static void
+send_file_wcb(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_stream_ca *ca = varg;
+	ck_err(ca->err);
+	work_t *work = NEM_thunk1_ptr(thunk);
+	work->state[1] += 1;
+	if (1 == work->state[0]) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static void
+send_file_common(fd_init_fn fn, bool fallback)
+{
+	work_t work;
+	work_init(&work, fn);
+
+	// NB: Big enough that it takes a few rounds to get through the pipe.
+	const size_t file_len = 300 * 1024;
+	const off_t off = 1000;
+	const size_t len = 200 * 1024;
+
+	FILE *file = tmpfile();
+	ck_assert_ptr_ne(NULL, file);
+	int fd = fileno(file);
+	unsigned char *data = NEM_malloc(file_len);
+	for (size_t i = 0; i < file_len; i += 1) {
+		data[i] = (unsigned char)(i * 7);
+	}
+	ck_assert_int_eq(file_len, write(fd, data, file_len));
+
+	NEM_stream_vt vt = NEM_fd_stream_vt;
+	if (fallback) {
+		vt.sendfile_cont = NULL;
+		work.s_2.vt = &vt;
+	}
+
+	work.bufs[0] = NEM_malloc(len);
+	NEM_stream_cont_t rcont;
+	NEM_stream_cont_init(&rcont, &send_file_rcb, &work);
+
+	ck_err(NEM_stream_read_cont(work.s_1, work.bufs[0], len, &rcont));
+	ck_err(NEM_stream_sendfile(work.s_2, fd, off, len, NEM_thunk1_new_ptr(
+		&send_file_wcb,
+		&work
+	)));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(1, work.state[0]);
+	ck_assert_int_eq(1, work.state[1]);
+	ck_assert(0 == memcmp(work.bufs[0], data + off, len));
+
+	// NB: The file's own offset is left alone.
+	ck_assert_int_eq(file_len, lseek(fd, 0, SEEK_CUR));
+
+	free(work.bufs[0]);
+	free(data);
+	fclose(file);
+	work_free(&work);
+}
+
+static void
+send_file(fd_init_fn fn)
+{
+	send_file_common(fn, false);
+}
+DEFINE_TESTS(send_file);
+
+static void
+send_file_fallback(fd_init_fn fn)
+{
+	send_file_common(fn, true);
+}
+DEFINE_TESTS(send_file_fallback);
+
+static void
+err_send_file_short_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_stream_ca *ca = varg;
+	work_t *work = NEM_thunk1_ptr(thunk);
+	ck_assert(!NEM_err_ok(ca->err));
+	work->state[1] += 1;
+	NEM_kq_stop(&work->kq);
+}
+
+static void
+err_send_file_short(fd_init_fn fn)
+{
+	work_t work;
+	work_init(&work, fn);
+
+	FILE *file = tmpfile();
+	ck_assert_ptr_ne(NULL, file);
+	ck_assert_int_eq(5, write(fileno(file), "hello", 5));
+
+	ck_err(NEM_stream_sendfile(work.s_2, fileno(file), 0, 10, NEM_thunk1_new_ptr(
+		&err_send_file_short_cb,
+		&work
+	)));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(1, work.state[1]);
+
+	fclose(file);
+	work_free(&work);
+}
+DEFINE_TESTS(err_send_file_short);
+
+static void
+send_file_close_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	NEM_stream_ca *ca = varg;
+	ck_err(ca->err);
+	work_t *work = NEM_thunk1_ptr(thunk);
+	work->state[1] += 1;
+
+	// NB: The fd's on the heap so that anything touching it after this
+	// trips ASan.
+	NEM_fd_t *fd = ca->stream.this;
+	NEM_fd_free(fd);
+	free(fd);
+	NEM_kq_stop(&work->kq);
+}
+
+static void
+send_file_close(fd_init_fn fn)
+{
+	work_t work;
+	bzero(&work, sizeof(work));
+	ck_err(NEM_kq_init_root(&work.kq));
+
+	NEM_fd_t *out = NEM_malloc(sizeof(NEM_fd_t));
+	ck_err(fn(&work.fd_1, out, work.kq.kq));
+
+	FILE *file = tmpfile();
+	ck_assert_ptr_ne(NULL, file);
+	ck_assert_int_eq(5, write(fileno(file), "hello", 5));
+
+	ck_err(NEM_stream_sendfile(
+		NEM_fd_as_stream(out),
+		fileno(file),
+		0,
+		5,
+		NEM_thunk1_new_ptr(&send_file_close_cb, &work)
+	));
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(1, work.state[1]);
+
+	fclose(file);
+	NEM_fd_free(&work.fd_1);
+	NEM_kq_free(&work.kq);
+}
+DEFINE_TESTS(send_file_close);
+
 Suite*
 suite_stream()
 {
@@ -316,6 +595,13 @@ suite_stream()
 		USE_TESTS(err_read_preclosed),
 		USE_TESTS(err_write_preclosed),
 		USE_TESTS(dangerous_reuse),
+		USE_TESTS(cont_reuse),
+		USE_TESTS(write_vec),
+		USE_TESTS(write_vec_fallback),
+		USE_TESTS(send_file),
+		USE_TESTS(send_file_fallback),
+		USE_TESTS(send_file_close),
+		USE_TESTS(err_send_file_short),
 	};
 
 	return tcase_build_suite("stream", tests, sizeof(tests));
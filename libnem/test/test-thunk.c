@@ -101,6 +101,69 @@ START_TEST(ptr)
 }
 END_TEST
 
+START_TEST(recycle)
+{
+	NEM_thunk1_t *a = NEM_thunk1_new(&checkstr, 20);
+	memset(NEM_thunk1_inlineptr(a), 'x', 20);
+	NEM_thunk1_t *tmp = a;
+	NEM_thunk1_discard(&a);
+
+	// NB: Same size class, so the block comes straight back off the
+	// free list -- zeroed.
+	NEM_thunk1_t *b = NEM_thunk1_new(&checkstr, 24);
+	ck_assert_ptr_eq(b, tmp);
+	for (size_t i = 0; i < 24; i += 1) {
+		ck_assert_int_eq(((char*) NEM_thunk1_inlineptr(b))[i], 0);
+	}
+	NEM_thunk1_discard(&b);
+
+	NEM_thunk1_t *big = NEM_thunk1_new(&checkstr, 4096);
+	memset(NEM_thunk1_inlineptr(big), 'x', 4096);
+	NEM_thunk1_discard(&big);
+}
+END_TEST
+
+static void*
+new_on_thread(void *varg)
+{
+	return NEM_thunk1_new_ptr(&add1, varg);
+}
+
+START_TEST(cross_thread)
+{
+	int i = 1;
+	pthread_t thread;
+	ck_assert_int_eq(0, pthread_create(&thread, NULL, &new_on_thread, &i));
+
+	NEM_thunk1_t *thunk = NULL;
+	ck_assert_int_eq(0, pthread_join(thread, (void**) &thunk));
+	NEM_thunk1_invoke(&thunk, NULL);
+	ck_assert_int_eq(i, 2);
+
+	NEM_thunk_cache_flush();
+}
+END_TEST
+
+START_TEST(debug_live)
+{
+	NEM_thunk_set_debug(true);
+	size_t base = NEM_thunk_live();
+
+	int i = 0;
+	NEM_thunk1_t *a = NEM_thunk1_new_ptr(&add1, &i);
+	NEM_thunk1_t *b = NEM_thunk1_new(&checkstr, 1024);
+	NEM_thunk_t *c = NEM_thunk_new(NULL, 64);
+	ck_assert_int_eq(NEM_thunk_live(), base + 3);
+
+	NEM_thunk1_invoke(&a, NULL);
+	NEM_thunk1_discard(&b);
+	NEM_thunk_free(c);
+	ck_assert_int_eq(NEM_thunk_live(), base);
+
+	NEM_thunk_set_debug(false);
+}
+END_TEST
+
 Suite*
 suite_thunk()
 {
@@ -111,6 +174,9 @@ suite_thunk()
 		{ "invoke_chunk", &invoke_chunk },
 		{ "new_ptr",      &new_ptr      },
 		{ "ptr",          &ptr          },
+		{ "recycle",      &recycle      },
+		{ "cross_thread", &cross_thread },
+		{ "debug_live",   &debug_live   },
 	};
 
 	return tcase_build_suite("thunk", tests, sizeof(tests));
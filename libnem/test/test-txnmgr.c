@@ -7,8 +7,11 @@ typedef struct {
 	NEM_svcmux_t svc_1, svc_2;
 	NEM_txnout_t *txnout;
 	NEM_txnin_t *txnin;
-	int ctr, ctr2;
+	NEM_txnin_t **held;
+	size_t held_len, hold;
+	int ctr, ctr2, cancels;
 	int flags;
+	uint64_t deadlines[2];
 }
 work_t;
 
@@ -76,6 +79,14 @@ work_svc_1_3(NEM_thunk_t *thunk, void *varg)
 	work->ctr += 1000;
 	ck_err(ca->err);
 
+	// NB: Only the first message carries the client's deadline.
+	if (1000 == work->ctr) {
+		ck_assert_int_ne(0, ca->msg->packed.header_len);
+	}
+	else {
+		ck_assert_int_eq(0, ca->msg->packed.header_len);
+	}
+
 	if (ca->done) {
 		NEM_msg_t *msg = NEM_msg_new(0, 5);
 		memcpy(msg->body, "done", 5);
@@ -119,6 +130,92 @@ work_svc_1_4(NEM_thunk_t *thunk, void *varg)
 	));
 }
 
+static void
+work_svc_1_5(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_txn_ca *ca = varg;
+	work_t *work = NEM_thunk_ptr(thunk);
+	work->ctr += 1;
+	ck_err(ca->err);
+
+	// NB: Hold on to everything until it's all arrived, then reply in the
+	// reverse order.
+	work->held[work->held_len] = ca->txnin;
+	work->held_len += 1;
+	if (work->held_len < work->hold) {
+		return;
+	}
+
+	while (0 < work->held_len) {
+		work->held_len -= 1;
+		NEM_txnin_reply(work->held[work->held_len], NEM_msg_new(0, 0));
+	}
+}
+
+static void
+work_on_cancel(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_txn_ca *ca = varg;
+	work_t *work = NEM_thunk_ptr(thunk);
+	work->cancels += 1;
+
+	ck_assert(!NEM_err_ok(ca->err));
+	ck_assert(ca->done);
+	ck_assert_ptr_ne(NULL, ca->txnin);
+	ck_assert(NEM_txnin_cancelled(ca->txnin));
+
+	// NB: The handler still has to finish up, but the reply goes nowhere.
+	NEM_txnin_reply(ca->txnin, NEM_msg_new(0, 0));
+}
+
+static void
+work_svc_hold(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_txn_ca *ca = varg;
+	work_t *work = NEM_thunk_ptr(thunk);
+	work->ctr += 1;
+	ck_err(ca->err);
+	ck_assert(!NEM_txnin_cancelled(ca->txnin));
+
+	if (
+		work->ctr <= NEM_ARRSIZE(work->deadlines)
+		&& NEM_timer1_active(&ca->txnin->base.timeout)
+	) {
+		work->deadlines[work->ctr - 1] = ca->txnin->base.timeout.at;
+	}
+
+	// NB: Never replies unless it's cancelled.
+	ca->txnin->base.thunk = NEM_thunk_new_ptr(&work_on_cancel, work);
+}
+
+static void
+work_svc_child_cb(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_txn_ca *ca = varg;
+	work_t *work = NEM_thunk_ptr(thunk);
+
+	ck_assert(!NEM_err_ok(ca->err));
+	ck_assert(ca->done);
+	work->ctr2 += 100;
+}
+
+static void
+work_svc_1_7(NEM_thunk_t *thunk, void *varg)
+{
+	NEM_txn_ca *ca = varg;
+	work_t *work = NEM_thunk_ptr(thunk);
+	work_svc_hold(thunk, varg);
+
+	// NB: Pass the request on to the other side, on behalf of this one.
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	msg->packed.service_id = 2;
+	msg->packed.command_id = 1;
+	NEM_txnmgr_req1(ca->mgr, ca->txnin, msg, NEM_thunk_new_ptr(
+		&work_svc_child_cb,
+		work
+	));
+}
+
 static void
 work_init(work_t *work)
 {
@@ -140,8 +237,12 @@ work_init(work_t *work)
 		{ 1, 2, NEM_thunk_new_ptr(&work_svc_1_2, work) },
 		{ 1, 3, NEM_thunk_new_ptr(&work_svc_1_3, work) },
 		{ 1, 4, NEM_thunk_new_ptr(&work_svc_1_4, work) },
+		{ 1, 5, NEM_thunk_new_ptr(&work_svc_1_5, work) },
+		{ 1, 6, NEM_thunk_new_ptr(&work_svc_hold, work) },
+		{ 1, 7, NEM_thunk_new_ptr(&work_svc_1_7, work) },
 	};
 	NEM_svcmux_entry_t svcs_2[] = {
+		{ 2, 1, NEM_thunk_new_ptr(&work_svc_hold, work) },
 	};
 
 	NEM_svcmux_init(&work->svc_1);
@@ -164,6 +265,7 @@ work_free(work_t *work)
 	NEM_fd_free(&work->fd_1);
 	NEM_fd_free(&work->fd_2);
 	NEM_kq_free(&work->kq);
+	free(work->held);
 }
 
 START_TEST(scaffolding)
@@ -609,23 +711,310 @@ START_TEST(on_close)
 }
 END_TEST
 
+static void
+many_inflight_cb(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_txn_ca *ca = varg;
+
+	if (NEM_err_ok(ca->err)) {
+		work->ctr2 += 1;
+	}
+	else {
+		work->flags += 1;
+	}
+	if (work->ctr2 + work->flags == work->hold) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static void
+many_inflight_send(work_t *work, size_t n)
+{
+	work->hold = n;
+	work->held = NEM_malloc(sizeof(NEM_txnin_t*) * n);
+
+	for (size_t i = 0; i < n; i += 1) {
+		NEM_msg_t *msg = NEM_msg_new(0, 0);
+		msg->packed.service_id = 1;
+		msg->packed.command_id = 5;
+		NEM_txnmgr_req1(&work->t_2, NULL, msg, NEM_thunk_new_ptr(
+			&many_inflight_cb,
+			work
+		));
+	}
+	ck_assert_int_eq(work->t_2.txns_out.len, n);
+}
+
+START_TEST(many_inflight)
+{
+	work_t work;
+	work_init(&work);
+	many_inflight_send(&work, 5000);
+
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.ctr, 5000);
+	ck_assert_int_eq(work.ctr2, 5000);
+	ck_assert_int_eq(work.flags, 0);
+	ck_assert_int_eq(work.t_1.txns_in.len, 0);
+	ck_assert_int_eq(work.t_2.txns_out.len, 0);
+
+	// NB: The table shrinks back down as new transactions come in.
+	size_t cap = work.t_2.txns_out.cap;
+	ck_assert(cap >= 5000 * 4 / 3);
+	NEM_txnout_cancel(NEM_txnmgr_req(&work.t_2, NULL, NEM_thunk_new_ptr(
+		&many_inflight_cb,
+		&work
+	)));
+	ck_assert_int_eq(work.t_2.txns_out.cap, cap / 2);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(many_inflight_close)
+{
+	work_t work;
+	work_init(&work);
+	many_inflight_send(&work, 5000);
+
+	// NB: Everything in flight is cancelled when the connection goes.
+	NEM_txnmgr_close(&work.t_2);
+	ck_assert_int_eq(work.ctr2, 0);
+	ck_assert_int_eq(work.flags, 5000);
+	work_free(&work);
+}
+END_TEST
+
+static void
+cancel_remote_cb(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_txn_ca *ca = varg;
+
+	ck_assert(!NEM_err_ok(ca->err));
+	ck_assert(ca->done);
+	work->ctr2 += 1;
+}
+
+static void
+cancel_remote_cancel(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_txnout_cancel(work->txnout);
+}
+
+static void
+cancel_remote_scaffold(work_t *work, uint16_t cmd, int timeout)
+{
+	work_init(work);
+
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	msg->packed.service_id = 1;
+	msg->packed.command_id = cmd;
+
+	work->txnout = NEM_txnmgr_req(&work->t_2, NULL, NEM_thunk_new_ptr(
+		&cancel_remote_cb,
+		work
+	));
+	if (0 < timeout) {
+		NEM_txnout_set_timeout(work->txnout, timeout);
+	}
+	NEM_txnout_req(work->txnout, msg);
+
+	if (0 == timeout) {
+		NEM_kq_after(&work->kq, 20, NEM_thunk1_new_ptr(
+			&cancel_remote_cancel,
+			work
+		));
+	}
+	NEM_kq_after(&work->kq, 150, NEM_thunk1_new_ptr(
+		&work_stop_clean,
+		work
+	));
+
+	ck_err(NEM_kq_run(&work->kq));
+}
+
+START_TEST(cancel_remote)
+{
+	work_t work;
+	cancel_remote_scaffold(&work, 6, 0);
+
+	// NB: The server heard about the cancel and everything's cleaned up.
+	ck_assert_int_eq(work.ctr, 1);
+	ck_assert_int_eq(work.ctr2, 1);
+	ck_assert_int_eq(work.cancels, 1);
+	ck_assert_int_eq(work.t_1.txns_in.len, 0);
+	ck_assert_int_eq(work.t_2.txns_out.len, 0);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(cancel_remote_timeout)
+{
+	work_t work;
+	cancel_remote_scaffold(&work, 6, 20);
+
+	ck_assert_int_eq(work.ctr, 1);
+	ck_assert_int_eq(work.ctr2, 1);
+	ck_assert_int_eq(work.cancels, 1);
+	ck_assert_int_eq(work.t_1.txns_in.len, 0);
+	ck_assert_int_eq(work.t_2.txns_out.len, 0);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(cancel_remote_children)
+{
+	work_t work;
+	cancel_remote_scaffold(&work, 7, 0);
+
+	// NB: Cancelling the request cancels the one the server made on its
+	// behalf, which in turn gets cancelled on this side.
+	ck_assert_int_eq(work.ctr, 2);
+	ck_assert_int_eq(work.ctr2, 101);
+	ck_assert_int_eq(work.cancels, 2);
+	ck_assert_int_eq(work.t_1.txns_in.len, 0);
+	ck_assert_int_eq(work.t_1.txns_out.len, 0);
+	ck_assert_int_eq(work.t_2.txns_in.len, 0);
+	ck_assert_int_eq(work.t_2.txns_out.len, 0);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(deadline_inherit)
+{
+	work_t work;
+	cancel_remote_scaffold(&work, 7, 50);
+
+	// NB: The server's txnin picked up the client's deadline (rather than
+	// the default, which would still be well off), and the request it made
+	// on its behalf only got what was left of it. Each hop restarts the
+	// clock from when the request arrived, so allow for the trip over.
+	ck_assert(0 != work.deadlines[0]);
+	ck_assert(0 != work.deadlines[1]);
+	ck_assert(work.deadlines[0] <= NEM_kq_now(&work.kq));
+	ck_assert(
+		work.deadlines[1] <= work.deadlines[0] + 10 * NEM_KQ_NSEC_PER_MSEC
+	);
+
+	ck_assert_int_eq(work.ctr, 2);
+	ck_assert_int_eq(work.ctr2, 101);
+	ck_assert_int_eq(work.cancels, 2);
+	ck_assert_int_eq(work.t_1.txns_in.len, 0);
+	ck_assert_int_eq(work.t_1.txns_out.len, 0);
+	ck_assert_int_eq(work.t_2.txns_in.len, 0);
+	ck_assert_int_eq(work.t_2.txns_out.len, 0);
+	work_free(&work);
+}
+END_TEST
+
+static void
+deadline_scaffold(work_t *work, uint16_t cmd, int64_t timeout_ms)
+{
+	work_init(work);
+
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	msg->packed.service_id = 1;
+	msg->packed.command_id = cmd;
+
+	// NB: The client side doesn't time out on its own here; whatever
+	// deadline there is only exists in the header.
+	if (0 <= timeout_ms) {
+		NEM_msghdr_time_t timehdr = {
+			.timeout_ms = timeout_ms,
+		};
+		NEM_msghdr_t hdr = {
+			.time = &timehdr,
+		};
+		ck_err(NEM_msg_set_header(msg, &hdr));
+	}
+
+	work->txnout = NEM_txnmgr_req(&work->t_2, NULL, NEM_thunk_new_ptr(
+		&cancel_remote_cb,
+		work
+	));
+	NEM_txnout_set_timeout(work->txnout, -1);
+	NEM_txnout_req(work->txnout, msg);
+
+	NEM_kq_after(&work->kq, 150, NEM_thunk1_new_ptr(
+		&work_stop_clean,
+		work
+	));
+
+	ck_err(NEM_kq_run(&work->kq));
+}
+
+START_TEST(deadline_header)
+{
+	work_t work;
+	deadline_scaffold(&work, 6, 20);
+
+	// NB: The server timed the request out by itself and told the client.
+	ck_assert_int_eq(work.ctr, 1);
+	ck_assert_int_eq(work.ctr2, 1);
+	ck_assert_int_eq(work.cancels, 1);
+	ck_assert(0 != work.deadlines[0]);
+	ck_assert_int_eq(work.t_1.txns_in.len, 0);
+	ck_assert_int_eq(work.t_2.txns_out.len, 0);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(deadline_expired)
+{
+	work_t work;
+	deadline_scaffold(&work, 6, 0);
+
+	// NB: The handler never saw the request.
+	ck_assert_int_eq(work.ctr, 0);
+	ck_assert_int_eq(work.ctr2, 1);
+	ck_assert_int_eq(work.cancels, 0);
+	ck_assert_int_eq(work.t_1.txns_in.len, 0);
+	ck_assert_int_eq(work.t_2.txns_out.len, 0);
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(deadline_default)
+{
+	work_t work;
+	deadline_scaffold(&work, 7, -1);
+
+	// NB: The parent has no deadline, but its child still gets one.
+	ck_assert_int_eq(work.ctr, 2);
+	ck_assert(0 == work.deadlines[0]);
+	ck_assert(0 != work.deadlines[1]);
+	work_free(&work);
+}
+END_TEST
+
 Suite*
 suite_txnmgr()
 {
 	tcase_t tests[] = {
-		{ "scaffolding",           &scaffolding           },
-		{ "set_mux",               &set_mux               },
-		{ "send_recv_1_1",         &send_recv_1_1         },
-		{ "send_recv_1_2",         &send_recv_1_2         },
-		{ "send_recv_1_3",         &send_recv_1_3         },
-		{ "send_recv_1_4",         &send_recv_1_4         },
-		{ "err_fd_closed_clisend", &err_fd_closed_clisend },
-		{ "err_fd_closed_srvsend", &err_fd_closed_srvsend },
-		{ "err_send_invalid_cmd",  &err_send_invalid_cmd  },
-		{ "err_timeout",           &err_timeout           },
-		{ "err_timeout_nodelay",   &err_timeout_nodelay   },
-		{ "cancel_cli",            &cancel_cli            },
-		{ "on_close",              &on_close              },
+		{ "scaffolding",            &scaffolding            },
+		{ "set_mux",                &set_mux                },
+		{ "send_recv_1_1",          &send_recv_1_1          },
+		{ "send_recv_1_2",          &send_recv_1_2          },
+		{ "send_recv_1_3",          &send_recv_1_3          },
+		{ "send_recv_1_4",          &send_recv_1_4          },
+		{ "err_fd_closed_clisend",  &err_fd_closed_clisend  },
+		{ "err_fd_closed_srvsend",  &err_fd_closed_srvsend  },
+		{ "err_send_invalid_cmd",   &err_send_invalid_cmd   },
+		{ "err_timeout",            &err_timeout            },
+		{ "err_timeout_nodelay",    &err_timeout_nodelay    },
+		{ "cancel_cli",             &cancel_cli             },
+		{ "on_close",               &on_close               },
+		{ "many_inflight",          &many_inflight          },
+		{ "many_inflight_close",    &many_inflight_close    },
+		{ "cancel_remote",          &cancel_remote          },
+		{ "cancel_remote_timeout",  &cancel_remote_timeout  },
+		{ "cancel_remote_children", &cancel_remote_children },
+		{ "deadline_inherit",       &deadline_inherit       },
+		{ "deadline_header",        &deadline_header        },
+		{ "deadline_expired",       &deadline_expired       },
+		{ "deadline_default",       &deadline_default       },
 	};
 
 	return tcase_build_suite("txnmgr", tests, sizeof(tests));
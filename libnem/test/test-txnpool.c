@@ -0,0 +1,513 @@
+#include "test.h"
+
+#define SERVERS_MAX 16
+
+typedef struct {
+	NEM_kq_t       kq;
+	NEM_txnpool_t  pool;
+	NEM_svcmux_t   mux;
+	NEM_fd_t       cfds[SERVERS_MAX];
+	NEM_fd_t       sfds[SERVERS_MAX];
+	NEM_txnmgr_t   servers[SERVERS_MAX];
+	size_t         endpoints[SERVERS_MAX];
+	int            hits[SERVERS_MAX];
+	size_t         servers_len;
+	int            fail_dials;
+	NEM_thunk1_t  *pending;
+	NEM_txnin_t   *held[64];
+	size_t         held_len;
+	size_t         hold;
+	int            replies;
+	int            want;
+	int            errors;
+	bool           ready;
+}
+work_t;
+
+static void
+work_stop_cb(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_kq_stop(&work->kq);
+	ck_assert_msg(false, "too long");
+}
+
+static void
+work_stop_clean(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_kq_stop(&work->kq);
+}
+
+static void
+work_svc(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_txn_ca *ca = varg;
+	ck_err(ca->err);
+
+	work->hits[ca->mgr - work->servers] += 1;
+
+	if (0 == work->hold) {
+		NEM_txnin_reply(ca->txnin, NEM_msg_new(0, 0));
+		return;
+	}
+
+	// NB: Sit on the requests until they've all arrived, so they're all in
+	// flight at once when the pool picks where each one goes.
+	work->held[work->held_len] = ca->txnin;
+	work->held_len += 1;
+	if (work->held_len == work->hold) {
+		for (size_t i = 0; i < work->held_len; i += 1) {
+			NEM_txnin_reply(work->held[i], NEM_msg_new(0, 0));
+		}
+		work->held_len = 0;
+	}
+}
+
+static void
+work_dial(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_txnpool_dial_ca *ca = varg;
+	NEM_dial_ca dial_ca = {0};
+
+	if (0 < work->fail_dials) {
+		work->fail_dials -= 1;
+		dial_ca.err = NEM_err_static("work_dial: failing on purpose");
+		NEM_thunk1_invoke(&ca->on_stream, &dial_ca);
+		return;
+	}
+	if (0 > work->fail_dials) {
+		// NB: Hang on to the dial without finishing it.
+		work->pending = ca->on_stream;
+		return;
+	}
+
+	size_t n = work->servers_len;
+	ck_assert(n < SERVERS_MAX);
+	work->servers_len += 1;
+	work->endpoints[n] = ca->endpoint;
+
+	ck_err(NEM_fd_init_unix(&work->cfds[n], &work->sfds[n], work->kq.kq));
+	NEM_txnmgr_init(
+		&work->servers[n],
+		NEM_fd_as_stream(&work->sfds[n]),
+		&work->kq
+	);
+	NEM_txnmgr_set_mux(&work->servers[n], &work->mux);
+
+	dial_ca.stream = NEM_fd_as_stream(&work->cfds[n]);
+	NEM_thunk1_invoke(&ca->on_stream, &dial_ca);
+}
+
+static void
+work_on_ready(NEM_thunk1_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk1_ptr(thunk);
+	NEM_txn_ca *ca = varg;
+	ck_assert_ptr_ne(NULL, ca->mgr);
+	work->ready = true;
+	NEM_kq_stop(&work->kq);
+}
+
+static void
+work_on_reply(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_txn_ca *ca = varg;
+
+	if (!NEM_err_ok(ca->err)) {
+		work->errors += 1;
+	}
+	if (ca->done) {
+		work->replies += 1;
+	}
+	if (work->replies == work->want) {
+		NEM_kq_stop(&work->kq);
+	}
+}
+
+static void
+work_init(work_t *work)
+{
+	bzero(work, sizeof(*work));
+	ck_err(NEM_kq_init_root(&work->kq));
+
+	NEM_svcmux_entry_t svcs[] = {
+		{ 1, 1, NEM_thunk_new_ptr(&work_svc, work) },
+	};
+	NEM_svcmux_init(&work->mux);
+	NEM_svcmux_add_handlers(&work->mux, svcs, NEM_ARRSIZE(svcs));
+
+	NEM_kq_after(&work->kq, 3000, NEM_thunk1_new_ptr(
+		&work_stop_cb,
+		work
+	));
+}
+
+static void
+work_start(work_t *work, const NEM_txnpool_opts_t *opts)
+{
+	NEM_txnpool_init(
+		&work->pool,
+		&work->kq,
+		opts,
+		NEM_thunk_new_ptr(&work_dial, work)
+	);
+}
+
+static void
+work_send(work_t *work, int n)
+{
+	work->want += n;
+	for (int i = 0; i < n; i += 1) {
+		NEM_msg_t *msg = NEM_msg_new(0, 0);
+		msg->packed.service_id = 1;
+		msg->packed.command_id = 1;
+		NEM_txnpool_req1(&work->pool, NULL, msg, NEM_thunk_new_ptr(
+			&work_on_reply,
+			work
+		));
+	}
+}
+
+static void
+work_free(work_t *work)
+{
+	NEM_txnpool_free(&work->pool);
+	for (size_t i = 0; i < work->servers_len; i += 1) {
+		NEM_txnmgr_free(&work->servers[i]);
+		NEM_fd_free(&work->cfds[i]);
+		NEM_fd_free(&work->sfds[i]);
+	}
+	NEM_svcmux_unref(&work->mux);
+	NEM_kq_free(&work->kq);
+}
+
+START_TEST(warm_up)
+{
+	work_t work;
+	work_init(&work);
+	NEM_txnpool_opts_t opts = {
+		.endpoints = 2,
+		.conns     = 2,
+	};
+	work_start(&work, &opts);
+
+	// NB: Every member is dialed up front, spread across the endpoints.
+	ck_assert_int_eq(work.pool.up, 4);
+	ck_assert_int_eq(work.pool.dials, 4);
+	ck_assert_int_eq(work.servers_len, 4);
+	ck_assert_int_eq(work.endpoints[0], 0);
+	ck_assert_int_eq(work.endpoints[1], 1);
+	ck_assert_int_eq(work.endpoints[2], 0);
+	ck_assert_int_eq(work.endpoints[3], 1);
+
+	NEM_txnpool_on_ready(&work.pool, NEM_thunk1_new_ptr(
+		&work_on_ready,
+		&work
+	));
+	ck_assert(work.ready);
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(least_loaded)
+{
+	work_t work;
+	work_init(&work);
+	NEM_txnpool_opts_t opts = {
+		.endpoints = 2,
+		.conns     = 2,
+		.policy    = NEM_TXNPOOL_LEAST_LOADED,
+	};
+	work_start(&work, &opts);
+
+	work.hold = 8;
+	work_send(&work, 8);
+	ck_err(NEM_kq_run(&work.kq));
+
+	ck_assert_int_eq(work.replies, 8);
+	ck_assert_int_eq(work.errors, 0);
+	for (size_t i = 0; i < work.servers_len; i += 1) {
+		ck_assert_int_eq(work.hits[i], 2);
+	}
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(p2c)
+{
+	work_t work;
+	work_init(&work);
+	NEM_txnpool_opts_t opts = {
+		.endpoints = 4,
+		.policy    = NEM_TXNPOOL_P2C,
+	};
+	work_start(&work, &opts);
+
+	// NB: Pin the seed, otherwise the spread is only usually within bounds.
+	work.pool.rand = 1;
+
+	work.hold = 40;
+	work_send(&work, 40);
+	ck_err(NEM_kq_run(&work.kq));
+
+	ck_assert_int_eq(work.replies, 40);
+	ck_assert_int_eq(work.errors, 0);
+
+	int min = work.hits[0];
+	int max = work.hits[0];
+	for (size_t i = 1; i < work.servers_len; i += 1) {
+		min = (work.hits[i] < min) ? work.hits[i] : min;
+		max = (work.hits[i] > max) ? work.hits[i] : max;
+	}
+	ck_assert(max - min <= 3);
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(reconnect)
+{
+	work_t work;
+	work_init(&work);
+	NEM_txnpool_opts_t opts = {
+		.endpoints      = 1,
+		.backoff_min_ms = 10,
+		.backoff_max_ms = 20,
+	};
+	work.fail_dials = 2;
+	work_start(&work, &opts);
+	ck_assert_int_eq(work.pool.up, 0);
+
+	NEM_txnpool_on_ready(&work.pool, NEM_thunk1_new_ptr(
+		&work_on_ready,
+		&work
+	));
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert(work.ready);
+	ck_assert_int_eq(work.pool.up, 1);
+	ck_assert_int_eq(work.pool.dials, 3);
+	ck_assert_int_eq(work.pool.failures, 2);
+
+	// NB: Dropping the connection from the other end gets it redialed.
+	NEM_txnmgr_close(&work.servers[0]);
+	NEM_kq_after(&work.kq, 200, NEM_thunk1_new_ptr(
+		&work_stop_clean,
+		&work
+	));
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.pool.up, 1);
+	ck_assert_int_eq(work.pool.dials, 4);
+	ck_assert_int_eq(work.pool.failures, 3);
+	ck_assert_int_eq(work.servers_len, 2);
+
+	work.hold = 0;
+	work_send(&work, 1);
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.errors, 0);
+	ck_assert_int_eq(work.hits[1], 1);
+
+	work_free(&work);
+}
+END_TEST
+
+static void
+retry_on_reply(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_txn_ca *ca = varg;
+	ck_assert(!NEM_err_ok(ca->err));
+
+	// NB: Only the first failure is retried; the rest come from tearing
+	// the pool down.
+	work->errors += 1;
+	if (1 != work->errors) {
+		return;
+	}
+
+	// NB: This is invoked while the member's mgr is still cancelling its
+	// transactions, so the retry has to go somewhere else.
+	work->want = 1;
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	msg->packed.service_id = 1;
+	msg->packed.command_id = 1;
+	NEM_txnpool_req1(&work->pool, NULL, msg, NEM_thunk_new_ptr(
+		&work_on_reply,
+		work
+	));
+	NEM_kq_stop(&work->kq);
+}
+
+START_TEST(retry_on_error)
+{
+	work_t work;
+	work_init(&work);
+	NEM_txnpool_opts_t opts = {
+		.endpoints      = 2,
+		.policy         = NEM_TXNPOOL_LEAST_LOADED,
+		.backoff_min_ms = 1000,
+		.backoff_max_ms = 1000,
+	};
+	work_start(&work, &opts);
+
+	// NB: Nothing gets replied to, so the member that's dropped ends up
+	// less loaded than the other one even once its request is cancelled.
+	work.hold = SERVERS_MAX;
+	for (int i = 0; i < 3; i += 1) {
+		NEM_msg_t *msg = NEM_msg_new(0, 0);
+		msg->packed.service_id = 1;
+		msg->packed.command_id = 1;
+		NEM_txnpool_req1(&work.pool, NULL, msg, NEM_thunk_new_ptr(
+			&retry_on_reply,
+			&work
+		));
+	}
+	NEM_kq_after(&work.kq, 50, NEM_thunk1_new_ptr(
+		&work_stop_clean,
+		&work
+	));
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.hits[0] + work.hits[1], 3);
+
+	size_t drop = (work.hits[0] < work.hits[1]) ? 0 : 1;
+	NEM_txnmgr_close(&work.servers[drop]);
+	ck_err(NEM_kq_run(&work.kq));
+	ck_assert_int_eq(work.errors, 1);
+	ck_assert_int_eq(work.pool.up, 1);
+
+	work_free(&work);
+}
+END_TEST
+
+static void
+retry_freeing_on_reply(NEM_thunk_t *thunk, void *varg)
+{
+	work_t *work = NEM_thunk_ptr(thunk);
+	NEM_txn_ca *ca = varg;
+	ck_assert(!NEM_err_ok(ca->err));
+	work->errors += 1;
+
+	// NB: The pool's being freed, so the retry fails straight away rather
+	// than landing on a member that's already gone.
+	NEM_msg_t *msg = NEM_msg_new(0, 0);
+	msg->packed.service_id = 1;
+	msg->packed.command_id = 1;
+	NEM_txnpool_req1(&work->pool, NULL, msg, NEM_thunk_new_ptr(
+		&work_on_reply,
+		work
+	));
+}
+
+START_TEST(retry_during_free)
+{
+	work_t work;
+	work_init(&work);
+	NEM_txnpool_opts_t opts = {
+		.endpoints = 2,
+		.conns     = 2,
+	};
+	work_start(&work, &opts);
+
+	work.hold = SERVERS_MAX;
+	for (int i = 0; i < 4; i += 1) {
+		NEM_msg_t *msg = NEM_msg_new(0, 0);
+		msg->packed.service_id = 1;
+		msg->packed.command_id = 1;
+		NEM_txnpool_req1(&work.pool, NULL, msg, NEM_thunk_new_ptr(
+			&retry_freeing_on_reply,
+			&work
+		));
+	}
+
+	// NB: Each retry is answered by the pool itself, so the errors come in
+	// pairs.
+	NEM_txnpool_free(&work.pool);
+	ck_assert_int_eq(work.errors, 8);
+	ck_assert_int_eq(work.replies, 4);
+	bzero(&work.pool, sizeof(work.pool));
+
+	for (size_t i = 0; i < work.servers_len; i += 1) {
+		NEM_txnmgr_free(&work.servers[i]);
+		NEM_fd_free(&work.cfds[i]);
+		NEM_fd_free(&work.sfds[i]);
+	}
+	NEM_svcmux_unref(&work.mux);
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+START_TEST(none_up)
+{
+	work_t work;
+	work_init(&work);
+	NEM_txnpool_opts_t opts = {
+		.endpoints = 1,
+	};
+	work.fail_dials = 1000;
+	work_start(&work, &opts);
+	ck_assert_ptr_eq(NULL, NEM_txnpool_pick(&work.pool));
+
+	work_send(&work, 1);
+	ck_assert_int_eq(work.replies, 1);
+	ck_assert_int_eq(work.errors, 1);
+
+	ck_assert_ptr_eq(NULL, NEM_txnpool_req(
+		&work.pool,
+		NULL,
+		NEM_thunk_new_ptr(&work_on_reply, &work)
+	));
+	ck_assert_int_eq(work.errors, 2);
+
+	work_free(&work);
+}
+END_TEST
+
+START_TEST(free_dialing)
+{
+	work_t work;
+	work_init(&work);
+	NEM_txnpool_opts_t opts = {
+		.endpoints = 1,
+	};
+	work.fail_dials = -1;
+	work_start(&work, &opts);
+	ck_assert_ptr_ne(NULL, work.pending);
+
+	// NB: The dial finishing after the pool's gone just closes the stream.
+	NEM_txnpool_free(&work.pool);
+
+	NEM_fd_t fd1, fd2;
+	ck_err(NEM_fd_init_unix(&fd1, &fd2, work.kq.kq));
+	NEM_dial_ca ca = {
+		.stream = NEM_fd_as_stream(&fd1),
+	};
+	NEM_thunk1_invoke(&work.pending, &ca);
+
+	NEM_fd_free(&fd1);
+	NEM_fd_free(&fd2);
+	NEM_svcmux_unref(&work.mux);
+	NEM_kq_free(&work.kq);
+}
+END_TEST
+
+Suite*
+suite_txnpool()
+{
+	tcase_t tests[] = {
+		{ "warm_up",           &warm_up           },
+		{ "least_loaded",      &least_loaded      },
+		{ "p2c",               &p2c               },
+		{ "reconnect",         &reconnect         },
+		{ "retry_on_error",    &retry_on_error    },
+		{ "retry_during_free", &retry_during_free },
+		{ "none_up",           &none_up           },
+		{ "free_dialing",      &free_dialing      },
+	};
+
+	return tcase_build_suite("txnpool", tests, sizeof(tests));
+}
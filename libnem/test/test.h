@@ -17,6 +17,13 @@ typedef struct {
 tcase_t;
 
 Suite* tcase_build_suite(const char *name, tcase_t *tests, size_t blen);
+Suite* tcase_build_suite_with_fixtures(
+	const char *name,
+	void(*setup)(),
+	void(*teardown)(),
+	tcase_t *tests,
+	size_t blen
+);
 
 #define ck_err(err) \
 	if (!NEM_err_ok(err)) { \
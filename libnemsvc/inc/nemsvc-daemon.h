@@ -5,3 +5,45 @@ static const uint16_t
 	NEM_cmdid_daemon_getcfg = 2,
 	NEM_cmdid_daemon_setcfg = 3,
 	NEM_cmdid_daemon_stop   = 4;
+
+// NEM_svc_daemon_info_filter_t is the number of events dispatched by the
+// daemon's event loop for a single kevent filter.
+typedef struct {
+	const char *name;
+	uint64_t    count;
+}
+NEM_svc_daemon_info_filter_t;
+extern const NEM_marshal_map_t NEM_svc_daemon_info_filter_m;
+
+// NEM_svc_daemon_info_fn_t is the time spent in a single callback function
+// of the daemon's event loop. name is the symbolized function pointer.
+typedef struct {
+	const char *name;
+	uint64_t    calls;
+	uint64_t    total_ns;
+	uint64_t    max_ns;
+}
+NEM_svc_daemon_info_fn_t;
+extern const NEM_marshal_map_t NEM_svc_daemon_info_fn_m;
+
+// NEM_svc_daemon_info_t is the response to NEM_cmdid_daemon_info. The
+// loop fields are only filled in if the daemon has its runloop stats
+// enabled (see NEM_kq_set_stats); latency is the log2 histogram of
+// iteration times in microseconds.
+typedef struct {
+	bool     stats;
+	uint64_t iterations;
+	uint64_t defers;
+	uint64_t slow;
+
+	NEM_svc_daemon_info_filter_t *events;
+	size_t                        events_len;
+
+	uint64_t *latency;
+	size_t    latency_len;
+
+	NEM_svc_daemon_info_fn_t *fns;
+	size_t                    fns_len;
+}
+NEM_svc_daemon_info_t;
+extern const NEM_marshal_map_t NEM_svc_daemon_info_m;
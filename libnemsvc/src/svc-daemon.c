@@ -0,0 +1,49 @@
+#include "nemsvc.h"
+#include "nem.h"
+#include "nem-marshal-macros.h"
+
+#define TYPE NEM_svc_daemon_info_filter_t
+static const NEM_marshal_field_t daemon_info_filter_fs[] = {
+	{ "name",  NEM_MARSHAL_STRING, O(name),  -1, NULL },
+	{ "count", NEM_MARSHAL_UINT64, O(count), -1, NULL },
+};
+MAP(NEM_svc_daemon_info_filter_m, daemon_info_filter_fs);
+#undef TYPE
+
+#define TYPE NEM_svc_daemon_info_fn_t
+static const NEM_marshal_field_t daemon_info_fn_fs[] = {
+	{ "name",     NEM_MARSHAL_STRING, O(name),     -1, NULL },
+	{ "calls",    NEM_MARSHAL_UINT64, O(calls),    -1, NULL },
+	{ "total_ns", NEM_MARSHAL_UINT64, O(total_ns), -1, NULL },
+	{ "max_ns",   NEM_MARSHAL_UINT64, O(max_ns),   -1, NULL },
+};
+MAP(NEM_svc_daemon_info_fn_m, daemon_info_fn_fs);
+#undef TYPE
+
+#define TYPE NEM_svc_daemon_info_t
+static const NEM_marshal_field_t daemon_info_fs[] = {
+	{ "stats",      NEM_MARSHAL_BOOL,   O(stats),      -1, NULL },
+	{ "iterations", NEM_MARSHAL_UINT64, O(iterations), -1, NULL },
+	{ "defers",     NEM_MARSHAL_UINT64, O(defers),     -1, NULL },
+	{ "slow",       NEM_MARSHAL_UINT64, O(slow),       -1, NULL },
+	{
+		"events",
+		NEM_MARSHAL_STRUCT|NEM_MARSHAL_ARRAY,
+		O(events), O(events_len),
+		&NEM_svc_daemon_info_filter_m
+	},
+	{
+		"latency",
+		NEM_MARSHAL_UINT64|NEM_MARSHAL_ARRAY,
+		O(latency), O(latency_len),
+		NULL
+	},
+	{
+		"fns",
+		NEM_MARSHAL_STRUCT|NEM_MARSHAL_ARRAY,
+		O(fns), O(fns_len),
+		&NEM_svc_daemon_info_fn_m
+	},
+};
+MAP(NEM_svc_daemon_info_m, daemon_info_fs);
+#undef TYPE
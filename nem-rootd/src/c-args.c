@@ -11,6 +11,8 @@ static bool is_init = false;
 static bool is_root = false;
 static int verbose = 0;
 static int reload = 0;
+static int stats = 0;
+static uint64_t slow_ms = 0;
 static char *rootd_path = NULL;
 static char *config_path = NULL;
 
@@ -18,11 +20,13 @@ enum {
 	OPT_VERBOSE,
 	OPT_CONFIG,
 	OPT_RELOAD,
+	OPT_STATS,
 };
 static struct option longopts[] = {
 	{ "verbose",   optional_argument, &verbose, 'v' },
 	{ "config",    required_argument, NULL,     'c' },
 	{ "reload",    optional_argument, &reload,  'r' },
+	{ "stats",     optional_argument, &stats,   's' },
 	{ 0 },
 };
 
@@ -35,7 +39,9 @@ usage()
 			"Usage: %s\n"
 			"  --verbose, -v:    be noisy\n"
 			"  --reload:         internal usage\n"
-			"  --config=path:    path to config.yaml\n",
+			"  --config=path:    path to config.yaml\n"
+			"  --stats[=ms]:     instrument the runloop, logging callbacks\n"
+			"                    slower than ms\n",
 			rootd_path
 		);
 	}
@@ -66,6 +72,8 @@ setup(NEM_app_t *app, int argc, char *argv[])
 	config_path = NULL;
 	verbose = 0;
 	reload = 0;
+	stats = 0;
+	slow_ms = 0;
 
 	// NB: Explicitly reset getopt state when re-initializing. This is
 	// mostly for the test suite which is re-entrant without forking.
@@ -96,6 +104,12 @@ setup(NEM_app_t *app, int argc, char *argv[])
 			case OPT_CONFIG:
 				config_path = dupe_arg(argc, argv);
 				break;
+			case OPT_STATS:
+				stats = 1;
+				if (NULL != optarg) {
+					slow_ms = strtoull(optarg, NULL, 10);
+				}
+				break;
 			default:
 				usage();
 				return NEM_err_static("parse_options: invalid option");
@@ -107,6 +121,11 @@ setup(NEM_app_t *app, int argc, char *argv[])
 	}
 
 	rootd_path = strdup(argv[0]);
+
+	// NB: The stats are reported by the daemon service's info command.
+	NEM_kq_set_stats(&app->kq, stats);
+	NEM_kq_set_slow(&app->kq, slow_ms);
+
 	return NEM_err_none;
 }
 
@@ -10,8 +10,62 @@ svc_daemon_info(NEM_thunk_t *thunk, void *varg)
 	}
 
 	NEM_txn_ca *ca = varg;
-	NEM_msg_t *msg = NEM_msg_new_reply(ca->msg, 0, 6);
-	snprintf(msg->body, 6, "hello");
+	NEM_svc_daemon_info_t info = {0};
+	NEM_svc_daemon_info_filter_t events[NEM_KQ_STATS_FILTERS];
+	NEM_kq_stats_t stats = {0};
+
+	if (NEM_kq_stats_snapshot(ca->mgr->kq, &stats)) {
+		info.stats = true;
+		info.iterations = stats.iterations;
+		info.defers = stats.defers;
+		info.slow = stats.slow;
+		info.latency = stats.latency;
+		info.latency_len = NEM_KQ_STATS_BUCKETS;
+		info.events = events;
+
+		for (size_t i = 0; i < NEM_KQ_STATS_FILTERS; i += 1) {
+			if (0 == stats.events[i]) {
+				continue;
+			}
+
+			events[info.events_len].name = NEM_kq_filter_name(-(int)i);
+			events[info.events_len].count = stats.events[i];
+			info.events_len += 1;
+		}
+
+		info.fns_len = stats.fns_len;
+		info.fns = NEM_malloc(sizeof(NEM_svc_daemon_info_fn_t) * stats.fns_len);
+		for (size_t i = 0; i < stats.fns_len; i += 1) {
+			info.fns[i].name = NEM_kq_fn_name(stats.fns[i].fn);
+			info.fns[i].calls = stats.fns[i].calls;
+			info.fns[i].total_ns = stats.fns[i].total_ns;
+			info.fns[i].max_ns = stats.fns[i].max_ns;
+		}
+	}
+
+	void *bs = NULL;
+	size_t bs_len = 0;
+	NEM_err_t err = NEM_marshal_bson(
+		&NEM_svc_daemon_info_m,
+		&bs,
+		&bs_len,
+		&info,
+		sizeof(info)
+	);
+
+	for (size_t i = 0; i < info.fns_len; i += 1) {
+		free((char*) info.fns[i].name);
+	}
+	free(info.fns);
+	NEM_kq_stats_free(&stats);
+
+	if (!NEM_err_ok(err)) {
+		NEM_txnin_reply_err(ca->txnin, err);
+		return;
+	}
+
+	NEM_msg_t *msg = NEM_msg_new_reply(ca->msg, 0, 0);
+	NEM_msg_set_body(msg, bs, bs_len);
 	NEM_txnin_reply(ca->txnin, msg);
 }
 
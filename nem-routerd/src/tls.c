@@ -332,15 +332,17 @@ typedef struct {
 	NEM_thunk1_t *on_close;
 	NEM_thunk1_t *on_handshake;
 
-	size_t        wcap;
-	size_t        wavail;
-	char         *wbuf;
-	NEM_thunk1_t *on_write;
-
-	size_t        rcap;
-	size_t        ravail;
-	char         *rbuf;
-	NEM_thunk1_t *on_read;
+	size_t             wcap;
+	size_t             wavail;
+	char              *wbuf;
+	NEM_stream_cont_t *on_write;
+	NEM_stream_cont_t  wthunk;
+
+	size_t             rcap;
+	size_t             ravail;
+	char              *rbuf;
+	NEM_stream_cont_t *on_read;
+	NEM_stream_cont_t  rthunk;
 }
 NEM_tls_conn_t;
 
@@ -361,6 +363,7 @@ NEM_tls_conn_shutdown(NEM_tls_conn_t *this, NEM_err_t err)
 	}
 
 	close(this->fd);
+	NEM_kq_forget(this->on_kevent);
 	NEM_thunk_free(this->on_kevent);
 
 	mbedtls_ssl_free(&this->ctx);
@@ -374,10 +377,10 @@ NEM_tls_conn_shutdown(NEM_tls_conn_t *this, NEM_err_t err)
 		NEM_thunk1_discard(&this->on_handshake);
 	}
 	if (NULL != this->on_write) {
-		NEM_thunk1_invoke(&this->on_write, &ca);
+		NEM_stream_cont_invoke(&this->on_write, &ca);
 	}
 	if (NULL != this->on_read) {
-		NEM_thunk1_invoke(&this->on_read, &ca);
+		NEM_stream_cont_invoke(&this->on_read, &ca);
 	}
 	// NB: Invoke on_close last.
 	if (NULL != this->on_close) {
@@ -450,7 +453,7 @@ NEM_tls_conn_try_read(NEM_tls_conn_t *this)
 			.err    = NEM_err_none,
 			.stream = NEM_tls_conn_as_stream(this),
 		};
-		NEM_thunk1_invoke(&this->on_read, &ca);
+		NEM_stream_cont_invoke(&this->on_read, &ca);
 	}
 }
 
@@ -479,7 +482,7 @@ NEM_tls_conn_try_write(NEM_tls_conn_t *this)
 			.err    = NEM_err_none,
 			.stream = NEM_tls_conn_as_stream(this),
 		};
-		NEM_thunk1_invoke(&this->on_write, &ca);
+		NEM_stream_cont_invoke(&this->on_write, &ca);
 	}
 }
 
@@ -575,28 +578,26 @@ NEM_tls_conn_init(
 }
 
 static NEM_err_t
-NEM_tls_conn_read(
-	void         *vthis,
-	void         *buf,
-	size_t        len,
-	NEM_thunk1_t *cb
+NEM_tls_conn_read_cont(
+	void              *vthis,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
 ) {
 	NEM_tls_conn_t *this = vthis;
 	if (this->in_handshake) {
 		NEM_panic("NEM_tls_conn_read: still doing handshake");
 	}
 	if (NULL != this->on_read) {
-		NEM_thunk1_discard(&cb);
 		return NEM_err_static("NEM_tls_conn_read: interleaved read");
 	}
 	if (!this->running) {
-		NEM_thunk1_discard(&cb);
 		return NEM_err_static("NEM_tls_conn_read: closed");
 	}
 
 	this->rcap = len;
 	this->rbuf = buf;
-	this->on_read = cb;
+	this->on_read = cont;
 
 	NEM_tls_conn_try_read(this);
 
@@ -604,34 +605,76 @@ NEM_tls_conn_read(
 }
 
 static NEM_err_t
-NEM_tls_conn_write(
-	void         *vthis,
-	void         *buf,
-	size_t        len,
-	NEM_thunk1_t *cb
+NEM_tls_conn_write_cont(
+	void              *vthis,
+	void              *buf,
+	size_t             len,
+	NEM_stream_cont_t *cont
 ) {
 	NEM_tls_conn_t *this = vthis;
 	if (this->in_handshake) {
 		NEM_panic("NEM_tls_conn_write: still doing handshake");
 	}
 	if (NULL != this->on_write) {
-		NEM_thunk1_discard(&cb);
 		return NEM_err_static("NEM_tls_conn_write: interleaved write");
 	}
 	if (!this->running) {
-		NEM_thunk1_discard(&cb);
 		return NEM_err_static("NEM_tls_conn_write: closed");
 	}
 
 	this->wcap = len;
 	this->wbuf = buf;
-	this->on_write = cb;
+	this->on_write = cont;
 
 	NEM_tls_conn_try_write(this);
 
 	return NEM_err_none;
 }
 
+static NEM_err_t
+NEM_tls_conn_read(
+	void         *vthis,
+	void         *buf,
+	size_t        len,
+	NEM_thunk1_t *cb
+) {
+	NEM_tls_conn_t *this = vthis;
+	if (NULL != this->on_read) {
+		NEM_thunk1_discard(&cb);
+		return NEM_err_static("NEM_tls_conn_read: interleaved read");
+	}
+
+	NEM_stream_cont_bind(&this->rthunk, cb);
+	NEM_err_t err = NEM_tls_conn_read_cont(this, buf, len, &this->rthunk);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_cont_unbind(&this->rthunk);
+	}
+
+	return err;
+}
+
+static NEM_err_t
+NEM_tls_conn_write(
+	void         *vthis,
+	void         *buf,
+	size_t        len,
+	NEM_thunk1_t *cb
+) {
+	NEM_tls_conn_t *this = vthis;
+	if (NULL != this->on_write) {
+		NEM_thunk1_discard(&cb);
+		return NEM_err_static("NEM_tls_conn_write: interleaved write");
+	}
+
+	NEM_stream_cont_bind(&this->wthunk, cb);
+	NEM_err_t err = NEM_tls_conn_write_cont(this, buf, len, &this->wthunk);
+	if (!NEM_err_ok(err)) {
+		NEM_stream_cont_unbind(&this->wthunk);
+	}
+
+	return err;
+}
+
 static NEM_err_t
 NEM_tls_conn_close(void *vthis)
 {
@@ -666,10 +709,12 @@ static NEM_stream_t
 NEM_tls_conn_as_stream(NEM_tls_conn_t *this)
 {
 	static const NEM_stream_vt vt = {
-		.read     = &NEM_tls_conn_read,
-		.write    = &NEM_tls_conn_write,
-		.close    = &NEM_tls_conn_close,
-		.on_close = &NEM_tls_conn_on_close,
+		.read       = &NEM_tls_conn_read,
+		.write      = &NEM_tls_conn_write,
+		.read_cont  = &NEM_tls_conn_read_cont,
+		.write_cont = &NEM_tls_conn_write_cont,
+		.close      = &NEM_tls_conn_close,
+		.on_close   = &NEM_tls_conn_on_close,
 	};
 
 	NEM_stream_t s = {
@@ -765,11 +810,27 @@ NEM_tls_list_close(void *vthis)
 	NEM_tls_list_free(this);
 }
 
+static NEM_err_t
+NEM_tls_list_set_backlog(void *vthis, int backlog)
+{
+	NEM_tls_list_t *this = vthis;
+	return NEM_list_set_backlog(this->listener, backlog);
+}
+
+static void
+NEM_tls_list_stats(void *vthis, NEM_list_stats_t *out)
+{
+	NEM_tls_list_t *this = vthis;
+	NEM_list_stats(this->listener, out);
+}
+
 static NEM_list_t
 NEM_tls_list_as_list(NEM_tls_list_t *this)
 {
 	static const NEM_list_vt vt = {
-		.close = &NEM_tls_list_close,
+		.close       = &NEM_tls_list_close,
+		.set_backlog = &NEM_tls_list_set_backlog,
+		.stats       = &NEM_tls_list_stats,
 	};
 
 	NEM_list_t list = {